@@ -0,0 +1,167 @@
+#ifndef dtALLOC_H_
+#define dtALLOC_H_
+
+/** @file dtAlloc.h
+    Allocators for buffer data.
+
+    dtBufferStream allocates segment data, insert blocks and read-ahead blocks via
+    a dtAlloc interface, see dtBufferStream::SetAllocator(). History payloads are
+    allocated by dtHistory from the babel heap.
+    The default dtAllocHeap uses the babel heap functions.
+
+    dtArena serves blocks up to dtARENA_SLABMAX bytes from size class slabs, carved
+    from large chunks, and larger blocks from the heap. Slab blocks have no header,
+    each chunk is divided into runs of dtARENA_RUNSIZE bytes, and the size class of
+    each run is kept in a chunk table outside the chunk. All blocks are freed
+    at once with dtArena::Release(), which dtBufferStream calls on close instead of
+    freeing segments one by one. Since it is released on close, an arena must not
+    be shared between buffers.
+
+    With dtArena::SetHugePages(), chunks and blocks of at least dtARENA_HUGEPAGE bytes
+    are mapped from regions aligned to dtARENA_HUGEPAGE, and the kernel is advised to
+    back them with transparent huge pages (MADV_HUGEPAGE, Linux only). Scans over many
+    cached segments then cause fewer TLB misses. Slabs are aligned to their size, so
+    blocks of 512 KB tile each huge page exactly. If huge pages are not available,
+    the regions are backed by normal pages, if mapping fails, the heap is used.
+*/
+
+#include "dtdefs.h"
+#include <mutex>
+
+/** Allocator interface.
+    Implementations must be thread-safe, blocks are allocated by read-ahead threads.
+*/
+class dtAlloc
+{
+public:
+    virtual ~dtAlloc();
+
+    /** Allocate block.
+        @param size Size in bytes, must be >0
+        @return Pointer to block, or NULL on failure
+    */
+    virtual void* Alloc(bbU32 const size) = 0;
+
+    /** Resize block, see bbMemRealloc().
+        @param size New size in bytes, 0 to free the block and set *ppBlock to NULL
+        @param ppBlock Pointer to block pointer, block pointer can be NULL to allocate a new block
+        @return bbEOK on success, or value of bbELAST on failure, block is unchanged in this case
+    */
+    virtual bbERR Realloc(bbU32 const size, void** const ppBlock) = 0;
+
+    /** Free block.
+        @param pBlock Pointer to block, can be NULL
+    */
+    virtual void Free(void* const pBlock) = 0;
+
+    /** Free all blocks at once.
+        @return !=0 if all blocks were freed, 0 if not supported
+    */
+    virtual int Release();
+};
+
+/** Allocator using the babel heap functions. Release() is not supported. */
+class dtAllocHeap : public dtAlloc
+{
+public:
+    virtual void* Alloc(bbU32 const size);
+    virtual bbERR Realloc(bbU32 const size, void** const ppBlock);
+    virtual void Free(void* const pBlock);
+
+    static dtAllocHeap mDefault; //!< Shared default allocator
+};
+
+/** Payload size of smallest dtArena size class. */
+#define dtARENA_SLABMIN 64
+
+/** Payload size of largest dtArena size class, larger blocks are allocated from the heap. */
+#define dtARENA_SLABMAX 0x100000
+
+/** Number of dtArena size classes, two per power of 2 from dtARENA_SLABMIN to dtARENA_SLABMAX. */
+#define dtARENA_CLASSES 29
+
+/** Size of dtArena chunks, slab blocks are carved from. */
+#define dtARENA_CHUNKSIZE 0x400000
+
+/** Size of dtArena runs, a slab spans one or more runs of a chunk. */
+#define dtARENA_RUNSIZE 0x10000
+
+/** Number of runs per dtArena chunk. */
+#define dtARENA_CHUNKRUNS (dtARENA_CHUNKSIZE / dtARENA_RUNSIZE)
+
+/** Size of header preceding each large dtArena block. */
+#define dtARENA_HDRSIZE 32
+
+/** Size and alignment of huge pages, see dtArena::SetHugePages(). */
+#define dtARENA_HUGEPAGE 0x200000
+
+/** Arena allocator with slab size classes, releasable at once. */
+class dtArena : public dtAlloc
+{
+private:
+    /** Header of large block. */
+    struct dtArenaBlock
+    {
+        dtArenaBlock* mpNext;   //!< Next block in large block list
+        dtArenaBlock* mpPrev;   //!< Previous block in large block list
+        bbU32         mSize;    //!< Payload size
+        bbU8          mMapped;  //!< !=0 if block is mapped via MapHuge()
+    };
+
+    /** Chunk descriptor. */
+    struct dtArenaChunk
+    {
+        bbU8* mpBase;   //!< Chunk start, page aligned
+        bbU8* mpHeap;   //!< Heap block containing the chunk, or NULL if mapped via MapHuge()
+        bbU8  mClass[dtARENA_CHUNKRUNS]; //!< Size class of slab per run, dtARENA_CLASSES if unused
+    };
+
+    std::mutex    mLock;
+    bbU8*         mpFree[dtARENA_CLASSES];    //!< Free list per size class, linked via first pointer of each block
+    bbU8*         mpSlabPos[dtARENA_CLASSES]; //!< Next unused block in current slab per size class
+    bbU8*         mpSlabEnd[dtARENA_CLASSES]; //!< End of current slab per size class
+    bbU8*         mpSpare[dtARENA_CLASSES];   //!< List of unused slabs per size class, linked via first pointer of each slab
+    dtArenaBlock* mpLarge;      //!< List of large blocks
+    dtArenaChunk* mpChunks;     //!< Chunk descriptors, sorted by chunk start
+    bbUINT        mChunkCount;  //!< Number of chunks
+    bbU8*         mpChunk;      //!< Current chunk, or NULL
+    bbUINT        mChunkRun;    //!< Next unused run in current chunk
+    int           mHugePages;   //!< !=0 to map chunks and large blocks as huge pages, see SetHugePages()
+
+    static bbUINT GetClass(bbU32 const size);
+    static bbU32 GetClassSize(bbUINT const cls);
+    static bbUINT GetClassRuns(bbUINT const cls);
+    static bbU8* MapHuge(bbU64 const size);
+    static void UnmapHuge(bbU8* const pRegion, bbU64 const size);
+    dtArenaChunk* FindChunk(const bbU8* const pBlock);
+    void* AllocSlab(bbUINT const cls);
+    void* AllocLarge(bbU32 const size);
+    void FreeBlock(bbU8* const pBlock);
+    void FreeLarge(dtArenaBlock* const pBlock);
+    bbU8* NewSlab(bbUINT const cls);
+    bbU8* MarkSlab(bbUINT const cls);
+    bbERR NewChunk();
+    void CarveChunk(bbUINT const end);
+
+public:
+    dtArena();
+    ~dtArena();
+
+    virtual void* Alloc(bbU32 const size);
+    virtual bbERR Realloc(bbU32 const size, void** const ppBlock);
+    virtual void Free(void* const pBlock);
+    virtual int Release();
+
+    /** Enable or disable huge pages for chunks and large blocks.
+        Takes effect for chunks and blocks allocated afterwards.
+        @param enable !=0 to enable, 0 to disable (default)
+    */
+    inline void SetHugePages(int const enable) { mHugePages = enable; }
+
+    /** Test if huge pages are enabled.
+        @return !=0 if enabled
+    */
+    inline int GetHugePages() const { return mHugePages; }
+};
+
+#endif /* dtALLOC_H_ */
@@ -48,8 +48,25 @@ struct dtBufferNotify
         @param type Type of information that changed
     */
     virtual void OnBufferMetaChange(dtBuffer* const pBuf, dtMETACHANGE const type);
+
+    /** Save progress.
+        Called during dtBuffer::Save() and dtBuffer::SaveBackground() every
+        dtBUFFER_SAVEPROGRESSSTEP bytes, and once all data is written.
+        For a background save, the call is made from the save thread.
+        The handler may call dtBuffer::SaveCancel(), but no other buffer methods.
+        The default implementation does nothing.
+        @param pBuf Pointer to buffer
+        @param written Number of bytes written
+        @param total Number of bytes to write
+    */
+    virtual void OnBufferSaveProgress(dtBuffer* const pBuf, bbU64 const written, bbU64 const total);
 };
 
+/** Number of bytes between dtBufferNotify::OnBufferSaveProgress() notifications. */
+#define dtBUFFER_SAVEPROGRESSSTEP 0x1000000
+
+struct dtSaveTask;
+
 /** Flag bits for dtBuffer::mOpt. */
 enum dtBUFFEROPT
 {
@@ -85,9 +102,7 @@ struct dtSection
 {
     bbU8*   mpData;         //!< Pointer to section of data
     bbU32   mSize;          //!< Size of section in bytes
-    bbU8    mType;          //!< dtSECTIONTYPE
-    bbU8    mIndex;         //!< Index of this struct in dtBuffer::mSections
-    bbU8    mNextFree;      //!< Index of next free entry in dtBuffer::mSections
+    bbU8    mType;          //!< dtSECTIONTYPE, dtSECTIONTYPE_NONE while unused
     bbU8    mOpt;           //!< dtBuffer implementation specifc option bits
     union {
     void*   mpContext;      //!< dtBuffer implementation specific context
@@ -95,15 +110,31 @@ struct dtSection
     dtPage* mpPage;
     };
     bbU64   mOffset;        //!< Buffer offset of mapped section
+    dtSection* mpNextFree;  //!< Next free descriptor, valid while unused
+    dtPage* mpOrgPage;      //!< dtBuffer implementation specific copy of original data, see dtMAP_WRITEDIFF
 };
 
-/** Maximum number of concurrently mapable dtBuffer sections. */
+/** Number of section descriptors embedded in dtBuffer.
+    If more sections are mapped concurrently, descriptors are allocated in blocks
+    of dtBUFFER_SECTIONBLOCK entries.
+*/
 #define dtBUFFER_MAXSECTIONS 9
 
+/** Number of section descriptors per dynamically allocated block. */
+#define dtBUFFER_SECTIONBLOCK 16
+
+/** Block of section descriptors, allocated once the embedded pool is exhausted. */
+struct dtSectionBlock
+{
+    dtSectionBlock* mpNext;                         //!< Next block in list
+    dtSection       mSections[dtBUFFER_SECTIONBLOCK];
+};
+
 enum dtMAP
 {
     dtMAP_READONLY = 0, //!< Hint for dtBuffer::MapSeq: access will be read-only
-    dtMAP_WRITE = 1     //!< Hint for dtBuffer::MapSeq: access will be read-write
+    dtMAP_WRITE = 1,    //!< Hint for dtBuffer::MapSeq: access will be read-write
+    dtMAP_WRITEDIFF = 2 //!< Hint for dtBuffer::MapSeq: access will be read-write, only bytes found changed on Commit() are recorded for undo
 };
 
 /** Interface to file buffer.
@@ -118,7 +149,6 @@ class dtBuffer
 protected:
     bbU64               mBufSize;       //!< Current buffer size, implementations must keep this updated
     bbU8                mOpt;           //!< Flag bitmask, see dtBUFFEROPT
-    bbU8                mSectionFree;   //!< Next free index in mSections[]
     bbU8                mState;         //!< Buffer state, see dtBUFFERSTATE
     bbU8                mUndoPoint;     //!< True if next change should be marked as undo point
     bbU8                mUndoActive;    //!< 1 if inside undo, 2 if inside redo call (internal use for preventing recursive history)
@@ -133,18 +163,25 @@ protected:
     dtHistory           mHistory;       //!< Change history
 
     dtArrPBufferNotify  mNotifyHandlers;//!< Notification handler registry
+    dtSaveTask*         mpSaveTask;     //!< State of running save, or NULL
 
     static bbUINT       mNewBufferCount;//!< Next new file number.
 
     /** Pool of buffer section map descriptors.
+        The pool consists of mSections[] and the blocks in mpSectionBlocks.
         Unused entries are organized in a single linked list,
-        dtBuffer::mSectionFree -> dtSection->mNextFree -> ..
+        dtBuffer::mpSectionFree -> dtSection->mpNextFree -> ..
+        Descriptors are never returned to the heap before the buffer is destroyed,
+        so mapping does not allocate once the pool has grown to the number of
+        concurrently mapped sections.
     */
-    dtSection mSections[dtBUFFER_MAXSECTIONS];
+    dtSection           mSections[dtBUFFER_MAXSECTIONS];
+    dtSection*          mpSectionFree;  //!< First free section descriptor, or NULL if pool is exhausted
+    dtSectionBlock*     mpSectionBlocks;//!< List of dynamically allocated descriptor blocks
+    bbUINT              mSectionCount;  //!< Total number of descriptors in pool
 
     /** Allocate a mapped section descriptor.
-        The function fails with error code bbEFULL, if dtBUFFER_MAXSECTIONS
-        sections have already been mapped.
+        If all descriptors are in use, the pool is grown by dtBUFFER_SECTIONBLOCK entries.
         @return Pointer to unitialized section descriptor, or NULL on failure.
     */
     dtSection* SectionAlloc();
@@ -156,11 +193,9 @@ protected:
     {
         if (pSection)
         {
-            #ifdef bbDEBUG
             pSection->mType = dtSECTIONTYPE_NONE;
-            #endif
-            pSection->mNextFree = mSectionFree;
-            mSectionFree = pSection->mIndex;
+            pSection->mpNextFree = mpSectionFree;
+            mpSectionFree = pSection;
         }
     }
 
@@ -182,6 +217,34 @@ protected:
     */
     void AttachName(bbCHAR* const pName);
 
+    /** Determine save type and path for Save() and SaveBackground().
+        @param pPath Path to new save location, or NULL
+        @param pTask Save state to init
+    */
+    bbERR SavePrepare(const bbCHAR* const pPath, dtSaveTask* const pTask);
+
+    /** Call OnSave(), executed on the save thread for a background save. */
+    void SaveRun(dtSaveTask* const pTask);
+
+    /** Update buffer name and state after OnSave() returned.
+        @return Result of OnSave()
+    */
+    bbERR SaveComplete(dtSaveTask* const pTask);
+
+    /** Report save progress, to be called by OnSave() implementations.
+        Notifies dtBufferNotify::OnBufferSaveProgress() handlers, and checks for cancellation.
+        Must be called from the thread that runs OnSave().
+        @param written Number of bytes written so far
+        @return bbEOK to continue, or bbELAST with error dtECANCELLED if the save should be aborted
+    */
+    bbERR SaveProgress(bbU64 const written);
+
+    /** Test if cancellation of the running save was requested.
+        Can be called from any thread.
+        @return !=0 if cancelled
+    */
+    int IsSaveCancelled() const;
+
 public:
     dtBuffer();
 
@@ -238,6 +301,12 @@ public:
     */
     inline int IsNew() const { return mOpt & dtBUFFEROPT_NEW; }
 
+    /** Test if buffer is read-only.
+        @retval !=0 Read-only
+        @retval 0 Writable
+    */
+    inline int IsReadOnly() const { return mOpt & dtBUFFEROPT_READONLY; }
+
     /** Open buffer for new or existing file.
 
         Parameter \a pPath is interpreted by the dtBuffer implementation, usually it points
@@ -271,6 +340,37 @@ public:
     */
     bbERR Save(const bbCHAR* const pNewPath);
 
+    /** Start saving buffer on a background thread.
+
+        Same as Save(), but returns after the save was started. Progress is reported via
+        dtBufferNotify::OnBufferSaveProgress() and IsSaving(). The save must be completed
+        with SaveWait(). Until then only IsSaving(), SaveCancel() and SaveWait() may be
+        called on the buffer.
+
+        @param pNewPath Path to new save location (Save As), or NULL to save to original location.
+        @return bbEOK if the save was started, or value of bbELAST on failure
+    */
+    bbERR SaveBackground(const bbCHAR* const pNewPath);
+
+    /** Wait for a background save to finish.
+        @return Result of the save, error dtECANCELLED if it was cancelled
+    */
+    bbERR SaveWait();
+
+    /** Request cancellation of the running save.
+        The save stops at the next progress check, written files are deleted,
+        and the buffer keeps its contents. Can be called from any thread.
+        If the data is already written, the save completes.
+    */
+    void SaveCancel();
+
+    /** Test if a save is in progress.
+        @param pWritten Returns number of bytes written, can be NULL
+        @param pTotal Returns number of bytes to write, can be NULL
+        @return !=0 if OnSave() is still running
+    */
+    int IsSaving(bbU64* const pWritten, bbU64* const pTotal) const;
+
     /** Get buffer name (filename, URL, etc).
         @return 0-terminated name string, memory managed by buffer instance.
                 Will be NULL if buffer is closed.
@@ -302,6 +402,48 @@ public:
 
     bbERR Write(bbU64 offset, bbU8* pData, bbU32 size, int overwrite, void* user);
 
+    /** Map a buffer range as a vector of sections, without copying.
+
+        The range is covered by consecutive sections from MapSeq(), each pointing
+        directly into buffer memory, the last one is trimmed to the range end.
+        Consumers that can process scattered data (hashing, writev(), scanners)
+        thus avoid the gather copy of Map() for ranges spanning several segments.
+
+        Mapping stops early, if \a maxcount sections are mapped. The caller then
+        processes the mapped part, releases it, and continues after it. At least one
+        section is mapped for a non-empty range.
+
+        The sections must be released with CommitVec() if \a accesshint was dtMAP_WRITE
+        or dtMAP_WRITEDIFF, or DiscardVec() if it was dtMAP_READONLY or the data is unchanged.
+        In between no other call must be called that modifies the buffer.
+
+        @param offset     Buffer offset of range
+        @param size       Size of range in bytes, offset + size must not exceed the buffer size
+        @param accesshint dtMAP_READONLY, dtMAP_WRITE or dtMAP_WRITEDIFF, see MapSeq()
+        @param ppSections Array to receive section pointers
+        @param maxcount   Number of entries in \a ppSections, must be >0
+        @param pCount     Returns number of mapped sections, the mapped size is the sum of their dtSection::mSize
+        @return bbEOK on success, or value of bbELAST on failure, no sections are mapped in this case
+    */
+    bbERR MapVec(bbU64 const offset, bbU64 const size, dtMAP const accesshint, dtSection** const ppSections, bbUINT const maxcount, bbUINT* const pCount);
+
+    /** Commit sections mapped writable by MapVec().
+        All sections are released, regardless of errors.
+        @param ppSections Sections as returned by MapVec()
+        @param count      Number of sections
+        @param user       User context, will be forwarded to OnChange() callback
+        @return bbEOK on success, or value of bbELAST if any commit failed
+    */
+    bbERR CommitVec(dtSection** const ppSections, bbUINT const count, void* const user);
+
+    /** Discard sections mapped by MapVec() without changes.
+        Sections are discarded in reverse order, so that undo records of writable
+        sections are dropped, see Discard().
+        @param ppSections Sections as returned by MapVec()
+        @param count      Number of sections
+    */
+    void DiscardVec(dtSection** const ppSections, bbUINT const count);
+
     //
     // - Interface
     //
@@ -325,11 +467,25 @@ protected:
     virtual void OnClose() = 0;
 
     /** Save buffer to datasource.
+        Implementations should report progress via SaveProgress() regularly, and
+        abort if it returns an error. A background save calls this from a separate thread.
         @param pPath Path to save location.
         @param savetype Hint for save operation
     */
     virtual bbERR OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype) = 0;
 
+    /** Undo a deletion recorded as a dtHistoryRun list.
+        Called by Undo() for changes pushed with dtHistory::PushRuns(). Implementations
+        must reinsert \a length bytes at \a offset and notify the change.
+        The default implementation fails with bbENOTSUP.
+        @param offset Buffer offset to insert at
+        @param pRuns Run list
+        @param length Total number of bytes described by \a pRuns
+        @param user User data, passed to Commit()
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    virtual bbERR InsertRuns(bbU64 const offset, const dtHistoryRun* pRuns, bbU64 const length, void* const user);
+
 public:
     virtual ~dtBuffer();
 
@@ -405,6 +561,12 @@ public:
         section is to be discarded later, the contained data must not be
         modified.
 
+        With dtMAP_WRITE the undo history records the whole section when it is
+        mapped. With dtMAP_WRITEDIFF the original data is kept aside, and Commit()
+        records only the ranges that differ from it, as separate changes. Use it for
+        sparse changes to large sections. dtMAP_WRITEDIFF is treated like dtMAP_WRITE
+        by implementations not supporting it.
+
         @param offset     Start offset of section from beginning of the file.
         @param minsize    Minimum requested size of buffer section, 0 for no restriction
         @param accesshint Used as hint for optimizations such as preventing recording undo
@@ -427,6 +589,8 @@ public:
     virtual bbERR Commit(dtSection* const pSection, void* const user) = 0;
 
     /** Discard a section mapped by dtBuffer::Map or dtBuffer::MapSeq without changes.
+        A section mapped writable must be unchanged, bookkeeping done for writing
+        such as recording undo is reverted, if possible.
         @param pSection Pointer to section as returned by dtBuffer::Map. Can be NULL.
     */
     virtual void Discard(dtSection* const pSection) = 0;
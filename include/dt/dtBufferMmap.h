@@ -0,0 +1,132 @@
+#ifndef dtBUFFERMMAP_H_
+#define dtBUFFERMMAP_H_
+
+/** @file dtBufferMmap.h
+    Read-only file buffer backed by memory mappings.
+
+    dtBufferMmap serves files that are opened for viewing only. It keeps no segment
+    index, Map() and MapSeq() return pointers into a read-only mapping of the file,
+    computed from the buffer offset without lookup or copy.
+
+    If the file size is within the address space budget (see dtBufferMmap::SetMapBudget()),
+    the whole file is mapped at once. Otherwise, or if mapping the whole file fails,
+    the file is mapped in windows of at least dtBUFFERMMAP_WINDOWSIZE bytes, aligned to
+    dtBUFFERMMAP_WINDOWSIZE. Windows referenced by mapped sections stay mapped, up to
+    dtBUFFERMMAP_WINDOWS unreferenced windows are kept as cache. Where memory mappings
+    are not available, windows are read into heap blocks.
+
+    The buffer is flagged with dtBUFFEROPT_READONLY, dtBUFFEROPT_FIXED and
+    dtBUFFEROPT_NOINSERT. Map() and MapSeq() with dtMAP_WRITE, Insert(), Delete() and
+    Commit() fail with bbENOTSUP. Saving to a new location copies the file.
+*/
+
+#include "dtBuffer.h"
+#include "dtStreamFile.h"
+
+/** Default address space budget for mapping a file at once, see dtBufferMmap::SetMapBudget(). */
+#define dtBUFFERMMAP_BUDGET ((sizeof(void*) > 4) ? (bbU64)0x10000000000ULL : (bbU64)0x20000000UL)
+
+/** Minimum size and alignment of windows. Must be power of 2, and multiple of the system page size. */
+#define dtBUFFERMMAP_WINDOWSIZE 0x4000000UL
+
+/** Number of unreferenced windows kept mapped. */
+#define dtBUFFERMMAP_WINDOWS 4
+
+/** Maximum size of sections returned by MapSeq(). */
+#define dtBUFFERMMAP_SEQSIZE 0x40000000UL
+
+/** Mapped range of the file. */
+struct dtMmapWindow
+{
+    bbU8*   mpData;     //!< Mapped data, or NULL if window is unused
+    bbU64   mOffset;    //!< File offset of mapped data
+    bbU64   mSize;      //!< Number of bytes mapped
+    bbU32   mRefCt;     //!< Number of sections referencing this window
+    bbU32   mLastUse;   //!< Value of dtBufferMmap::mUseCount at last reference
+    bbU8    mMapped;    //!< !=0 if mpData is a memory mapping, 0 if it is a heap block
+};
+
+/** Read-only memory-mapped file buffer. */
+class dtBufferMmap : public dtBuffer
+{
+private:
+    dtStreamFile    mFile;          //!< Underlying file
+    dtMmapWindow*   mpWindows;      //!< Heap block with mWindowCount windows
+    bbUINT          mWindowCount;   //!< Number of entries in mpWindows
+    bbUINT          mWindowLast;    //!< Index of last referenced window
+    bbU32           mUseCount;      //!< Counter for window LRU
+    bbU64           mMapBudget;     //!< Maximum file size to map at once, see SetMapBudget()
+    int             mMapAll;        //!< !=0 if whole file is mapped in window 0
+
+    /** Map window.
+        @param pWindow Unused window to set up
+        @param offset File offset, must be multiple of the system page size
+        @param size Number of bytes to map
+        @param fallback !=0 to read the range into a heap block, if it cannot be mapped
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR OpenWindow(dtMmapWindow* const pWindow, bbU64 const offset, bbU64 const size, int const fallback);
+
+    /** Unmap window and mark it unused.
+        @param pWindow Window, must not be referenced
+    */
+    void CloseWindow(dtMmapWindow* const pWindow);
+
+    /** Get window containing a file range, and reference it.
+        @param offset File offset
+        @param minsize Number of bytes from \a offset the window must contain, must be >0
+        @return Window index, or (bbUINT)-1 on failure
+    */
+    bbUINT GetWindow(bbU64 const offset, bbU64 const minsize);
+
+    /** Drop reference to window.
+        Unreferenced windows are unmapped in LRU order, if more than dtBUFFERMMAP_WINDOWS are unreferenced.
+        @param idx Window index
+    */
+    void ReleaseWindow(bbUINT const idx);
+
+    /** Allocate section descriptor pointing into a window.
+        @param offset Buffer offset
+        @param size Minimum section size in bytes, must be >0
+        @param maxsize Maximum section size in bytes
+        @return Section, or NULL on failure
+    */
+    dtSection* MapWindow(bbU64 const offset, bbU32 const size, bbU32 const maxsize);
+
+    bbERR OpenFile(const bbCHAR* const pPath);
+    void CloseFile();
+
+protected:
+    virtual bbERR OnOpen(const bbCHAR* const pPath, int isnew);
+    virtual void OnClose();
+    virtual bbERR OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype);
+
+public:
+    dtBufferMmap();
+    virtual ~dtBufferMmap();
+
+    virtual bbERR Delete(bbU64 const offset, bbU64 size, void* const user);
+    virtual dtSection* Insert(bbU64 const offset, bbU32 const size);
+    virtual dtSection* Map(bbU64 offset, bbU32 size, dtMAP const accesshint);
+    virtual dtSection* MapSeq(bbU64 const offset, bbUINT minsize, dtMAP const accesshint);
+    virtual bbERR Commit(dtSection* const pSection, void* const user);
+    virtual void Discard(dtSection* const pSection);
+
+    /** Set address space budget for mapping a file at once.
+        Files larger than the budget are mapped in windows. Takes effect on next Open().
+        @param budget Size in bytes, 0 to always use windows, default is dtBUFFERMMAP_BUDGET
+    */
+    inline void SetMapBudget(bbU64 const budget) { mMapBudget = budget; }
+
+    /** Get address space budget for mapping a file at once.
+        @return Size in bytes
+    */
+    inline bbU64 GetMapBudget() const { return mMapBudget; }
+
+    /** Test if the whole file is mapped at once.
+        @return !=0 if mapped at once, 0 if windows are used
+    */
+    inline int IsMappedAll() const { return mMapAll; }
+};
+
+#endif /* dtBUFFERMMAP_H_ */
@@ -22,17 +22,151 @@
       dtSegment::mpData are replacing dtSegment::mFileSize bytes from the file at the
       current buffer offset.
 
+    - dtSEGMENTTYPE_TEMP: changed segment swapped out to the temp file. dtSegment::mSize
+      bytes stored at temp file offset dtSegment::mFileOffset are replacing
+      dtSegment::mFileSize bytes from the file at the current buffer offset. Temp
+      segments are loaded back into Map segments, before they are accessed.
+
     Segments are indexed via 2 structures: double-linked list and a binary tree.
 
     Segments do not store their absolute buffer offset, to avoid structure updating
     after inserts or deletes. Instead the buffer offset of a segment can be calculated
     by walking the index tree (see below).
 
-    Segments of type dtSEGMENTTYPE_MAP do not store the file offset of the replaced
-    data, because this information is generally not needed. The only time, when the
-    file offset is needed is, when a buffer is saved back to disk. In this case
+    Changed segments of type dtSEGMENTTYPE_MAP do not store the file offset of the
+    replaced data, because this information is generally not needed. The only time, when
+    the file offset is needed is, when a buffer is saved back to disk. In this case
     segments will be processed sequentially and the file offset can be calculated by
-    adding up segment sizes.
+    adding up segment sizes. Unchanged Map segments keep dtSegment::mFileOffset, so
+    they can be turned back into Null segments.
+
+    <b>Segment cache</b>
+
+    Unchanged Map segments are a cache of file data. They are chained in LRU order via
+    dtSegment::mLRUPrev and dtSegment::mLRUNext, dtBufferStream::mLRUFirst is the most
+    recently used segment. If the cached size exceeds the limit set with
+    dtBufferStream::SetCacheLimit(), the least recently used segments are freed and
+    turned back into Null segments, which are merged with contiguous Null neighbours.
+
+    Changed Map segments are chained the same way starting at dtBufferStream::mDirtyFirst.
+    If their size exceeds the limit set with dtBufferStream::SetDirtyLimit(), the least
+    recently used segments are appended to the temp file and become Temp segments.
+    The temp file is created in dtBufferStream::spTempDir on first use, and deleted
+    when the buffer is closed. Space of reloaded Temp segments is not reused.
+
+    Segments referenced by mapped sections are never freed or swapped out.
+
+    <b>Gap buffer</b>
+
+    An insert into the middle of a Map segment opens a gap at the insert position,
+    instead of splitting the segment. At most one segment has an open gap, it is
+    described by dtBufferStream::mGapSegment, dtBufferStream::mGapOffset and
+    dtBufferStream::mGapSize, and is always a changed Map segment. Its heap block
+    holds dtSegment::mSize bytes of data with the gap in between, the gap takes up
+    all spare capacity of the block when opened or enlarged. Inserts at the
+    gap fill it, deletes adjacent to the gap enlarge it, and a delete in the middle
+    of a Map segment leaves a gap behind. Typing thus keeps the segment count constant.
+    Any other edit, saving, or swapping out the segment closes the gap first.
+    MapSeq() maps the data before and after the gap separately.
+    See dtBufferStream::SetGapSize().
+
+    <b>Compaction</b>
+
+    Inserts into the middle of Map segments split them, and deletes shrink them, so
+    editing leaves runs of small segments. dtBufferStream::Compact() walks the segment
+    list incrementally from a cursor, and merges adjacent Map segments holding heap data
+    up to dtBUFFERSTREAM_SEGMENTSIZE. Unchanged segments are merged only if contiguous on
+    file, merging with a changed segment makes the result changed. Contiguous Null
+    segments are merged too. Every dtBUFFERSTREAM_COMPACTDEBT edits
+    a compaction step runs automatically, starting at the lowest edited offset since
+    the last step. Segments referenced by mapped sections are not merged.
+
+    <b>Allocator</b>
+
+    Heap data of Map segments, insert blocks and read-ahead blocks are allocated via
+    the dtAlloc set with dtBufferStream::SetAllocator(). With a dtArena, the blocks come
+    from slab size classes, and closing the buffer releases the arena at once instead
+    of freeing segments one by one. Mapped pages and history data stay on the heap.
+    With dtArena::SetHugePages(), cached segments are backed by transparent huge pages.
+
+    <b>File mapping</b>
+
+    If enabled with dtBufferStream::SetFileMapping(), the underlying file is mapped
+    read-only into the address space on Open (MAP_PRIVATE, POSIX only). Unchanged Map
+    segments then point directly into the mapping instead of holding a heap copy, see
+    dtBufferStream::IsFileMapped(). A heap copy is made only, when a segment is about
+    to be written, resized or changed, see dtBufferStream::MakeSegmentWritable().
+    Changed Map segments always hold heap data. If the mapping cannot be created,
+    segments are read into heap memory as usual.
+
+    <b>Read-ahead</b>
+
+    Loads of Null segments are reported to a dtPrefetch object. If loads follow a
+    constant stride in file offset, e.g. during a forward or backward MapSeq walk, the
+    following segments are read on a worker thread, see dtBufferStream::SetPrefetch().
+
+    <b>Asynchronous I/O</b>
+
+    Read-ahead and OnSave() submit file I/O in batches via dtFileIO, which uses io_uring
+    on Linux if available. OnSave() reads up to dtBUFFERSTREAM_SAVEBUFFERS chunks of
+    Null and Temp segments at once, and queues writes of Map segments without copying.
+    See dtBufferStream::SetAsyncIO().
+
+    <b>Parallel save</b>
+
+    If more than one save thread is set with dtBufferStream::SetSaveThreads(), OnSave()
+    first computes the output offset of every segment, splitting Null and Temp segments
+    into dtBUFFERSTREAM_SAVECHUNK sized jobs. The jobs are then processed by a pool of
+    workers with positional reads and writes. Each worker copies through two buffers,
+    and queues the write of one chunk and the read of the next in one dtFileIO batch,
+    so with asynchronous I/O they overlap. Direct I/O always saves serially.
+
+    Null segments are copied by OnSave() within the kernel via dtFileIO::CopyFrom(),
+    which reflinks block-aligned ranges on file systems supporting it. If the kernel
+    refuses, e.g. for saves to a different file system, the remaining data is copied
+    through the copy buffers.
+
+    <b>Direct I/O</b>
+
+    If enabled with dtBufferStream::SetDirectIO(), the underlying file, the read-ahead
+    file and the save output are opened with O_DIRECT, so scans and saves of huge files
+    do not evict other data from the page cache. Sector-aligned parts of a transfer
+    bypass the page cache, see dtStreamFile::Open(). OnSave() uses sector-aligned copy
+    buffers. Direct I/O is synchronous and takes precedence over file mapping.
+
+    <b>Patch save</b>
+
+    If OnSave() saves back to the original file, and all Null and unchanged Map segments
+    are still at their original file offset with an unchanged buffer size, e.g. after
+    overwrite-only editing, only changed and Temp segments are written back to the
+    original file with positional writes, see dtBufferStream::SetPatchSave(). Unlike
+    the default save via temp file and rename, a failing patch save can leave the file
+    partially updated.
+
+    <b>Patch overlay</b>
+
+    Small overwrites of unloaded file data are not applied to a loaded segment. Instead,
+    Map() with write access returns a copy of the range, and Commit() stores the new bytes
+    as a dtPatch in an overlay sorted by file offset. Overlapping and adjacent patches
+    are merged. Scattered edits thus cost memory per changed byte instead of per segment,
+    see dtBufferStream::SetPatchLimit(). When a Null segment is loaded, the patches
+    within it are applied to the loaded data, which turns into a changed segment.
+    Deletions and undo copies of Null segments read the file with the overlay applied,
+    and OnSave() writes the overlay bytes after the data of each Null segment.
+    Patches of deleted file ranges are kept, since undo may reinsert the range as Null
+    segment. The overlay is cleared after a save.
+
+    <b>Rebase after save</b>
+
+    After a successful save the segment index is rebased onto the saved file instead of
+    being rebuilt: Temp segments and Map segments pointing into the old file mapping turn
+    into Null segments at their new file offset, Map segments with heap data are kept as
+    unchanged segments, and contiguous Null segments are merged. Loaded data thus stays
+    cached, and the dirty chain is moved to the front of the LRU chain.
+
+    Undo records of deletions reference unloaded data by file offset. Before the file
+    is replaced, the referenced ranges are appended to the temp file, which is then
+    kept open across the save, see dtBufferStream::SpillUndoRuns().
 
     <b>Double-linked list</b>
 
@@ -50,28 +184,104 @@
     parent (relative to 0 for root). This allows for insertion and deletion of data
     without the need to update too many offset fields.
 
+    The tree is kept balanced as AA-tree, dtSegment::mLevel stores the node level.
+    Rotations adjust the relative offsets of the rotated nodes only, so lookups,
+    inserts and deletes stay O(log n) for any edit pattern.
+
     Special restriction for 0-sized segments:
     - as an optimization measure, 0-sized Null-segments are not allowed, except for
       the empty-buffer case where exactly 1 0-size Null- or Map-segment exists
-    - a 0-sized Map-segment must exist only as a right child
+    - a 0-sized Map-segment shares its start offset with its right neighbour,
+      tree walks to such a segment are resolved via the linked list order
 */
 
 #include "dtBuffer.h"
 #include "dtSegmentTree.h"
-#include "babel/file.h"
+#include "dtStreamFile.h"
+#include "dtFileIO.h"
+
+class dtPrefetch;
+struct dtSaveContext;
+struct dtDeleteUndo;
 
 struct dtPage
 {
-    bbU8*   mpData;
-    bbU32   mSize;
-    bbU8    mNextFree;
-    bbU8    mIndex;
+    bbU8*   mpData;     //!< Heap block holding copy of mapped range, kept while unused for reuse
+    bbU32   mSize;      //!< Size of heap block
+    dtPage* mpNextFree; //!< Next free page, valid while unused
 };
 
-/** Optimum size for cached file segment. Must be power of 2. */
+/** Number of page descriptors per dynamically allocated block. */
+#define dtBUFFERSTREAM_PAGEBLOCK 16
+
+/** Bytes overwritten in unloaded file data, see dtBufferStream::SetPatchLimit(). */
+struct dtPatch
+{
+    bbU64   mFileOffset;    //!< Offset in underlying file
+    bbU8*   mpData;         //!< Heap block with mSize patched bytes
+    bbU32   mSize;          //!< Number of bytes
+};
+
+/** Block of page descriptors, allocated once dtBufferStream::mPagePool[] is exhausted. */
+struct dtPageBlock
+{
+    dtPageBlock* mpNext;                            //!< Next block in list
+    dtPage       mPages[dtBUFFERSTREAM_PAGEBLOCK];
+};
+
+/** Optimum size for cached file segment. Must be power of 2.
+    Default load granularity, and size limit for appending inserts to a Map segment.
+*/
 #define dtBUFFERSTREAM_SEGMENTSIZE 0x80000UL
+
+/** Minimum load granularity, see dtBufferStream::SetSegmentSize(). */
+#define dtBUFFERSTREAM_SEGMENTSIZE_MIN 0x4000UL
+
+/** Maximum load granularity, see dtBufferStream::SetSegmentSize(). */
+#define dtBUFFERSTREAM_SEGMENTSIZE_MAX 0x800000UL
+
+/** Number of page descriptors embedded in dtBufferStream, see dtBUFFERSTREAM_PAGEBLOCK. */
 #define dtBUFFERSTREAM_MAXPAGES dtBUFFER_MAXSECTIONS
 
+/** Default limit for unchanged segments cached in memory, see dtBufferStream::SetCacheLimit(). */
+#define dtBUFFERSTREAM_CACHELIMIT 0x4000000UL
+
+/** Default limit for changed segments kept in memory, see dtBufferStream::SetDirtyLimit(). */
+#define dtBUFFERSTREAM_DIRTYLIMIT 0x10000000UL
+
+/** Default number of segments to read ahead, see dtBufferStream::SetPrefetch(). */
+#define dtBUFFERSTREAM_PREFETCH 4
+
+/** Number of copy buffers used by dtBufferStream::OnSave() with asynchronous I/O. */
+#define dtBUFFERSTREAM_SAVEBUFFERS 8
+
+/** Default number of threads used by dtBufferStream::OnSave(), see dtBufferStream::SetSaveThreads(). */
+#define dtBUFFERSTREAM_SAVETHREADS 4
+
+/** Maximum number of threads used by dtBufferStream::OnSave(). */
+#define dtBUFFERSTREAM_MAXSAVETHREADS 16
+
+/** Size of work units unchanged data is split into for a parallel save. */
+#define dtBUFFERSTREAM_SAVECHUNK (dtBUFFERSTREAM_SEGMENTSIZE * 8)
+
+/** Default number of bytes reserved for a gap, see dtBufferStream::SetGapSize(). */
+#define dtBUFFERSTREAM_GAPSIZE 0x1000
+
+/** Number of edits after which a compaction step runs, see dtBufferStream::Compact(). */
+#define dtBUFFERSTREAM_COMPACTDEBT 64
+
+/** Number of segments visited by an automatic compaction step. */
+#define dtBUFFERSTREAM_COMPACTSTEP 256
+
+/** Maximum number of equal bytes between changed ranges recorded as one change, see dtMAP_WRITEDIFF. */
+#define dtBUFFERSTREAM_DIFFGAP 16
+
+/** Default memory limit for the patch overlay, see dtBufferStream::SetPatchLimit(). */
+#define dtBUFFERSTREAM_PATCHLIMIT 0x100000UL
+
+/** Maximum size of a patch. Writes which would grow a patch beyond load the segment instead. */
+#define dtBUFFERSTREAM_PATCHSIZE 0x1000
+
 /** Large file buffer implementation with changes caching.
 
     This buffer implementation allows to handle large files (64 bit).
@@ -81,17 +291,65 @@ struct dtPage
 class dtBufferStream : public dtBuffer, private dtSegmentTree
 {
 private:
-    bbUINT          mPageFree;          //!< Next free index in mPagePool[]
+    dtPage*         mpPageFree;         //!< First free page in mPagePool[] and mpPageBlocks, or NULL
+    dtPageBlock*    mpPageBlocks;       //!< List of dynamically allocated page blocks
+    bbU32*          mpLocked;           //!< Heap block for GetLockedSegments()
+    bbUINT          mLockedSize;        //!< Number of entries in mpLocked
 
     bbU32           mSegmentLastMapped; //!< Index of last and still mapped segment, or -1 if none
     bbU64           mSegmentLastOffset; //!< Startoffset of mSegmentLastMapped segment
 
     bbU64           mMappedSize;        //!< Number of bytes mapped to memory
-    bbU64           mFileSize;          //!< Number of bytes in underlying file
 
-    bbFILEH         mhFile;             //!< Handle to underlying file
-    bbFILEH         mhTempFile;         //!< Handle to temp file
+    bbU32           mLRUFirst;          //!< Most recently used unchanged Map segment, or -1 if none
+    bbU64           mCacheSize;         //!< Number of bytes in unchanged Map segments
+    bbU64           mCacheLimit;        //!< Limit for mCacheSize, see SetCacheLimit()
+    bbU32           mDirtyFirst;        //!< Most recently used changed Map segment, or -1 if none
+    bbU64           mDirtySize;         //!< Number of bytes in changed Map segments
+    bbU64           mDirtyLimit;        //!< Limit for mDirtySize, see SetDirtyLimit()
+    bbU64           mFileSize;          //!< Number of bytes in underlying file
 
+    dtStreamFile    mFile;              //!< Underlying file, read via positional I/O
+    dtStreamFile    mTempFile;          //!< Temp file, not opened until first swap-out
+    bbCHAR*         mpTempName;         //!< Path of temp file, or NULL
+    bbU64           mTempFileSize;      //!< Number of bytes written to temp file
+    bbU8            mTempUndo;          //!< !=0 if the change history references the temp file, see SpillUndoRuns()
+
+    bbU8*           mpFileMap;          //!< Read-only mapping of underlying file, or NULL
+    bbU64           mFileMapSize;       //!< Number of bytes mapped at mpFileMap
+    int             mUseFileMap;        //!< !=0 if file mapping is enabled, see SetFileMapping()
+
+    dtPrefetch*     mpPrefetch;         //!< Read-ahead for sequential segment loads, or NULL
+    bbUINT          mPrefetchDepth;     //!< Number of segments to read ahead, see SetPrefetch()
+    int             mAsyncIO;           //!< !=0 if asynchronous I/O is enabled, see SetAsyncIO()
+    int             mDirectIO;          //!< !=0 if direct I/O is enabled, see SetDirectIO()
+    int             mUsePatchSave;      //!< !=0 if in-place patch save is enabled, see SetPatchSave()
+    bbUINT          mSaveThreads;       //!< Number of threads for OnSave(), see SetSaveThreads()
+
+    bbU32           mSegmentSize;       //!< Load granularity, or 0 for adaptive, see SetSegmentSize()
+    bbU32           mLoadSize;          //!< Current load granularity in adaptive mode
+    bbU64           mLoadStart;         //!< File offset of last loaded Null segment, or -1
+    bbU64           mLoadEnd;           //!< File offset after last loaded Null segment, or -1
+
+    bbU32           mGapSegment;        //!< Map segment with open gap, or -1 if none
+    bbU64           mGapSegmentStart;   //!< Buffer offset of mGapSegment
+    bbU32           mGapOffset;         //!< Offset of gap in mGapSegment
+    bbU32           mGapSize;           //!< Size of gap in bytes
+    bbU32           mGapReserve;        //!< Bytes to reserve for a gap, 0 if disabled, see SetGapSize()
+
+    bbU64           mCompactOffset;     //!< Buffer offset to resume compaction at, see Compact()
+    bbUINT          mCompactDebt;       //!< Number of edits since last compaction step
+
+    dtPatch*        mpPatches;          //!< Heap block with patch overlay, sorted by file offset, or NULL
+    bbU32           mPatchCount;        //!< Number of patches in mpPatches
+    bbU32           mPatchCapacity;     //!< Number of entries allocated at mpPatches
+    bbU64           mPatchSize;         //!< Memory used by patches and their descriptors in bytes
+    bbU64           mPatchLimit;        //!< Limit for mPatchSize, see SetPatchLimit()
+
+    /** Pool of page descriptors for Map() copies.
+        Unused pages keep their heap block, and are organized in a single linked list,
+        dtBufferStream::mpPageFree -> dtPage->mpNextFree -> ..
+    */
     dtPage          mPagePool[dtBUFFERSTREAM_MAXPAGES];
 
 #ifdef bbDEBUG
@@ -107,25 +365,379 @@ public:
     bbU32 DebugCheck();                 //!< Test integrity, returns buffer CRC
     void DumpSegments(bbFILEH hFile = NULL);
     void DebugCheckMappedSize();
+    void DebugCheckCache();
 #endif
 
 private:
+    /** Allocate a page for a Map() copy.
+        The smallest free page holding at least \a size bytes is reused. If none fits,
+        the largest free page is resized, and if no page is free, the pool is grown by
+        dtBUFFERSTREAM_PAGEBLOCK entries.
+        @param size Minimum page size in bytes
+        @return Pointer to page, or NULL on failure
+    */
     dtPage* PageAlloc(bbU32 const size);
 
-    /** Free mapped section descriptor, previously allocated via SectionGet().
-        @param pSec Pointer to section descriptor
+    /** Free page, previously allocated via PageAlloc().
+        The heap block is kept for reuse.
+        @param pPage Pointer to page, can be NULL
     */
     inline void PageFree(dtPage* const pPage)
     {
         if (pPage)
         {
-            pPage->mNextFree = mPageFree;
-            mPageFree = pPage->mIndex;
+            pPage->mpNextFree = mpPageFree;
+            mpPageFree = pPage;
         }
     }
 
-    /** Clear segment index. */
-    void ClearSegments();
+    /** Clear segment index.
+        @param freedata !=0 to free heap data of Map segments,
+                        0 if it was already released via dtAlloc::Release()
+    */
+    void ClearSegments(int const freedata);
+
+    /** Open gap in a Map segment holding heap data.
+        No other gap must be open. The segment is marked as changed.
+        @param idx Segment index
+        @param segmentstart Buffer offset of segment
+        @param segmentoffset Segment-relative offset of gap
+        @param gapsize Minimum size of gap in bytes, spare block capacity is added
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR OpenGap(bbU32 const idx, bbU64 const segmentstart, bbU32 const segmentoffset, bbU32 const gapsize);
+
+    /** Enlarge open gap.
+        @param size Minimum gap size in bytes, mGapReserve is added
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR GrowGap(bbU32 const size);
+
+    /** Close open gap, if any, by moving the data behind it down.
+        The heap block is only shrunk if mostly unused, see dtSegmentTree::ReserveSegmentData().
+    */
+    void CloseGap();
+
+    /** Setup insert section to point to the open gap.
+        @param pSection Insert section
+        @return \a pSection
+    */
+    dtSection* InsertAtGap(dtSection* const pSection);
+
+    /** Link Map segment as most recently used into LRU chain.
+        The chain is selected by dtSegment::mChanged.
+        @param idx Segment index
+    */
+    void LRUAdd(bbU32 const idx);
+
+    /** Unlink Map segment from LRU chain.
+        Must be called before the segment is resized, changed or freed.
+        @param idx Segment index
+    */
+    void LRURemove(bbU32 const idx);
+
+    /** Get segments referenced by mapped sections.
+        @param ppLocked Returns pointer to array of segment indices, valid until the next call
+        @return Number of entries in array, or (bbUINT)-1 if an insert is pending or on failure
+    */
+    bbUINT GetLockedSegments(bbU32** const ppLocked);
+
+    /** Free cached data of an unchanged Map segment and turn it back into a Null segment.
+        The segment is merged with contiguous Null neighbours, and may be returned to the free pool.
+        @param idx Segment index
+    */
+    void EvictSegment(bbU32 const idx);
+
+    /** Evict least recently used segments until the cache limit is met.
+        Segments referenced by mapped sections are skipped.
+    */
+    void EvictSegments();
+
+    /** Write changed Map segment to temp file and turn it into a Temp segment.
+        The temp file is created on first use.
+        @param idx Segment index
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SwapOutSegment(bbU32 const idx);
+
+    /** Swap out least recently used changed segments until the dirty limit is met.
+        Segments referenced by mapped sections are skipped. Failures are ignored,
+        segments stay in memory in this case.
+    */
+    void SwapOutSegments();
+
+    /** Load Temp segment back into memory and turn it into a changed Map segment.
+        @param idx Segment index
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SwapInSegment(bbU32 const idx);
+
+    /** Get number of bytes to load for a Null segment access.
+        In adaptive mode the load size is updated from the access pattern.
+        @param pSegment Null segment to be loaded
+        @param segmentoffset Accessed offset relative to segment start
+        @param pBackward Returns !=0 if the access continues a backward walk
+        @return Load size, power of 2
+    */
+    bbU32 GetLoadSize(const dtSegment* const pSegment, bbU64 const segmentoffset, int* const pBackward);
+
+    /** Map underlying file read-only into memory.
+        Failure is not an error, mpFileMap stays NULL in this case.
+    */
+    void OpenFileMap();
+
+    /** Unmap underlying file. */
+    void CloseFileMap();
+
+    /** Test if segment data points into the file mapping.
+        @param pData Segment data
+        @return !=0 if \a pData is within mpFileMap
+    */
+    inline int IsFileMapped(const bbU8* const pData) const
+    {
+        return mpFileMap && (pData >= mpFileMap) && (pData < (mpFileMap + mFileMapSize));
+    }
+
+    /** Open underlying file, file mapping and read-ahead, and set mFileSize.
+        @param pPath Path of file
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR OpenFile(const bbCHAR* const pPath);
+
+    /** Close read-ahead, file mapping and underlying file.
+        Segments must not reference them anymore.
+    */
+    void CloseFile();
+
+    /** Create temp file in spTempDir, if not open yet.
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR OpenTempFile();
+
+    /** Close and delete temp file.
+        Neither segments nor the change history must reference it anymore.
+    */
+    void CloseTempFile();
+
+    /** Rebase segment index onto the just saved file.
+        Afterwards no segment references the old file, file mapping or temp file.
+        Sets mFileSize to the buffer size, and trims the cache to its limit.
+    */
+    void RebaseSegments();
+
+    /** Test if the buffer can be saved by patching the original file.
+        @return !=0 if all unchanged data is at its original file offset, and the size is unchanged
+    */
+    int IsOverwriteOnly();
+
+    /** Save by writing changed and Temp segments back to the original file.
+        The segment index is rebased on success.
+        @param pPath Path of original file
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SavePatch(const bbCHAR* const pPath);
+
+    /** Write buffer to a new file, one segment after the other.
+        Uses batched I/O via dtFileIO, see SetAsyncIO().
+        @param pPath Path of file to create or truncate
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SaveSerial(const bbCHAR* const pPath);
+
+    /** Write buffer to a new file, using mSaveThreads threads.
+        Falls back to SaveSerial() if positional I/O is not available.
+        @param pPath Path of file to create or truncate
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SaveParallel(const bbCHAR* const pPath);
+
+    /** Process jobs of a parallel save, see SaveParallel().
+        @param pCtx Shared worker state
+        @param report !=0 if this worker reports progress via SaveProgress(),
+                      must be set for the thread running OnSave() only
+    */
+    static void SaveWorker(dtSaveContext* const pCtx, int const report);
+
+    /** Account an edit for automatic compaction, see Compact().
+        @param offset Buffer offset of edit
+    */
+    inline void CompactNote(bbU64 const offset)
+    {
+        if (offset < mCompactOffset)
+            mCompactOffset = offset;
+
+        if (++mCompactDebt >= dtBUFFERSTREAM_COMPACTDEBT)
+            Compact(dtBUFFERSTREAM_COMPACTSTEP);
+    }
+
+    /** Get options for opening dtFileIO instances.
+        @return Bitmask of dtFILEIOOPT options
+    */
+    inline bbUINT GetIOOpt() const
+    {
+        return (mAsyncIO ? dtFILEIOOPT_ASYNC : 0) | (mDirectIO ? dtFILEIOOPT_DIRECT : 0);
+    }
+
+    /** Prepare segment data for modification.
+        Temp segments are loaded, Map segments pointing into the file mapping are
+        copied to heap. Null segments and Map segments with heap data are not touched.
+        @param idx Segment index
+        @param pSection Section pointing into the segment to rebase to the new data, or NULL
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR MakeSegmentWritable(bbU32 const idx, dtSection* const pSection);
+
+    /** Keep original data of a section mapped with dtMAP_WRITEDIFF.
+        Data of changed segments is copied to a page. Data of unchanged segments is
+        compared against the file mapping, if available, and not copied.
+        @param pSection Section pointing into a Map segment, dtSection::mpOrgPage is set
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SnapshotSection(dtSection* const pSection);
+
+    /** Drop the undo record pushed when mapping a section with dtMAP_WRITE.
+        Used when the section is discarded unchanged. The record is dropped only
+        if it is still the last change.
+        @param pSection Section mapped with dtMAP_WRITE
+    */
+    void DropMapUndo(const dtSection* const pSection);
+
+    /** Record changes of a range written via dtMAP_WRITEDIFF.
+        Ranges differing from the original data are pushed to the change history and
+        notified, and the segment is marked as changed. If a range cannot be recorded,
+        the remaining data is reverted to the original.
+        @param idx Index of Map segment holding the range
+        @param offset Buffer offset of range
+        @param pData New data in segment
+        @param pOrg Original data
+        @param size Size of range in bytes
+        @param user User data passed to change notification
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR CommitDiff(bbU32 const idx, bbU64 const offset, bbU8* const pData, const bbU8* const pOrg, bbU32 const size, void* const user);
+
+    /** Get size of the dtHistoryRun list recording a deletion.
+        Null segments and fully covered unchanged Map segments are recorded as references
+        to the underlying file, all other data is copied.
+        @param offset Buffer offset of deletion
+        @param size Number of bytes to delete, must be >0
+        @return Upper bound for the run list size in bytes, or 0 if the deletion covers
+                no Null segment and is recorded as plain copy
+    */
+    bbU64 GetDeleteRunsSize(bbU64 const offset, bbU64 const size);
+
+    /** Record the history payload of a deletion.
+        Must be called before any segment in the deletion area is modified. Segments
+        covered only partially must have been made writable.
+        @param pUndo Payload writer
+        @param offset Buffer offset of deletion
+        @param size Number of bytes to delete, must be >0
+        @return Error code, fails if Temp or file data cannot be read
+    */
+    bbERR RecordDelete(dtDeleteUndo* const pUndo, bbU64 const offset, bbU64 const size);
+
+    /** Insert Null or Temp segment referencing a range of the underlying file or temp file.
+        Used to undo deletions recorded as file references. No history is recorded.
+        @param offset Buffer offset to insert at
+        @param type dtSEGMENTTYPE_NULL or dtSEGMENTTYPE_TEMP
+        @param fileoffset Offset in underlying file, or temp file offset
+        @param size Number of bytes, must be >0, at most dtBUFFERSTREAM_SEGMENTSIZE for Temp segments
+        @param user User data passed to change notification
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR InsertRef(bbU64 const offset, dtSEGMENTTYPE const type, bbU64 const fileoffset, bbU64 const size, void* const user);
+
+    /** Copy data referenced by the change history from the underlying file to the temp file.
+        Must be called before the underlying file is changed or replaced. File references
+        are rewritten to temp file references, and mTempUndo is updated. On failure the
+        history stays valid for the unchanged file.
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SpillUndoRuns();
+
+    virtual bbERR InsertRuns(bbU64 const offset, const dtHistoryRun* pRuns, bbU64 const length, void* const user);
+
+    /** Find first patch ending after a file offset.
+        @param fileoffset Offset in underlying file
+        @return Index into mpPatches, or mPatchCount if none
+    */
+    bbU32 PatchFind(bbU64 const fileoffset) const;
+
+    /** Test if patches overlap a file range.
+        @param fileoffset Offset in underlying file
+        @param size Number of bytes
+        @return !=0 if at least one patched byte is in range
+    */
+    inline int PatchTest(bbU64 const fileoffset, bbU64 const size) const
+    {
+        bbU32 const i = PatchFind(fileoffset);
+        return (i < mPatchCount) && (mpPatches[i].mFileOffset < (fileoffset + size));
+    }
+
+    /** Get size of a patch after writing a file range.
+        @param fileoffset Offset in underlying file
+        @param size Number of bytes to write
+        @return Size of patch containing the range, after merging with overlapping and adjacent patches
+    */
+    bbU64 PatchMergeSize(bbU64 const fileoffset, bbU32 const size) const;
+
+    /** Store bytes in the patch overlay.
+        Overlapping and adjacent patches are merged.
+        @param fileoffset Offset in underlying file
+        @param pData Bytes to store
+        @param size Number of bytes, must be >0
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR PatchWrite(bbU64 const fileoffset, const bbU8* const pData, bbU32 const size);
+
+    /** Copy patched bytes of a file range.
+        @param fileoffset Offset in underlying file
+        @param pData Data of file range to update
+        @param size Number of bytes
+    */
+    void PatchApply(bbU64 const fileoffset, bbU8* const pData, bbU64 const size) const;
+
+    /** Remove patches lying entirely within a file range.
+        @param fileoffset Offset in underlying file
+        @param size Number of bytes
+    */
+    void PatchDrop(bbU64 const fileoffset, bbU64 const size);
+
+    /** Remove all patches. */
+    void PatchClear();
+
+    /** Read from underlying file with the patch overlay applied.
+        @param fileoffset Offset in underlying file
+        @param pData Buffer to receive data
+        @param size Number of bytes
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR ReadPatched(bbU64 const fileoffset, bbU8* const pData, bbU32 const size);
+
+    /** Map range of a Null segment for writing into the patch overlay.
+        @param offset Buffer offset
+        @param fileoffset Offset in underlying file
+        @param size Number of bytes
+        @param accesshint dtMAP_WRITE or dtMAP_WRITEDIFF
+        @return Section holding a copy of the range, or NULL on failure
+    */
+    dtSection* MapPatch(bbU64 const offset, bbU64 const fileoffset, bbU32 const size, dtMAP const accesshint);
+
+    /** Store data of a section returned by MapPatch() in the patch overlay.
+        Changes are recorded in the change history and notified.
+        @param pSection Section
+        @param fileoffset Offset in underlying file
+        @param user User data passed to change notification
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR CommitPatch(dtSection* const pSection, bbU64 const fileoffset, void* const user);
+
+    /** Write patches within Null segments to a saved file.
+        Must be called after the segment data was written.
+        @param out File the buffer was saved to, at the output offsets of the segments
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR SavePatches(dtStreamFile& out);
 
     inline void NodeSubstractOffset(bbU32 const idx, bbU64 const segmentstart, bbS64 const diff)
     {
@@ -157,6 +769,175 @@ public:
     virtual bbERR Commit(dtSection* const pSection, void* const user);
     virtual void Discard(dtSection* const pSection);
 
+    /** Set memory limit for unchanged file data cached in memory.
+        Changed segments are not affected by the limit. If the limit is exceeded,
+        the least recently used unchanged segments are freed.
+        @param limit Limit in bytes, default is dtBUFFERSTREAM_CACHELIMIT
+    */
+    void SetCacheLimit(bbU64 const limit);
+
+    /** Get memory limit for unchanged file data cached in memory.
+        @return Limit in bytes
+    */
+    inline bbU64 GetCacheLimit() const { return mCacheLimit; }
+
+    /** Set memory limit for changed data kept in memory.
+        If the limit is exceeded, the least recently used changed segments are
+        swapped out to a temp file in spTempDir.
+        @param limit Limit in bytes, default is dtBUFFERSTREAM_DIRTYLIMIT
+    */
+    void SetDirtyLimit(bbU64 const limit);
+
+    /** Get memory limit for changed data kept in memory.
+        @return Limit in bytes
+    */
+    inline bbU64 GetDirtyLimit() const { return mDirtyLimit; }
+
+    /** Set memory limit for the patch overlay.
+        Writes of up to dtBUFFERSTREAM_PATCHSIZE bytes into unloaded file data are
+        kept as patches, until the limit is reached. Further writes load the segment.
+        @param limit Limit in bytes including descriptors, 0 to disable the overlay,
+                     default is dtBUFFERSTREAM_PATCHLIMIT
+    */
+    inline void SetPatchLimit(bbU64 const limit) { mPatchLimit = limit; }
+
+    /** Get memory limit for the patch overlay.
+        @return Limit in bytes
+    */
+    inline bbU64 GetPatchLimit() const { return mPatchLimit; }
+
+    /** Get memory used by the patch overlay.
+        @return Size in bytes
+    */
+    inline bbU64 GetPatchSize() const { return mPatchSize; }
+
+    /** Enable or disable read-only mapping of the underlying file.
+        If enabled, reads of unchanged file data return pointers into a private
+        file mapping, instead of copying the data to heap. Takes effect on next Open().
+        @param enable !=0 to enable, 0 to disable (default)
+    */
+    inline void SetFileMapping(int const enable) { mUseFileMap = enable; }
+
+    /** Test if read-only mapping of the underlying file is enabled.
+        @return !=0 if enabled
+    */
+    inline int GetFileMapping() const { return mUseFileMap; }
+
+    /** Set number of segments to read ahead on sequential access.
+        Takes effect on next Open().
+        @param depth Number of segments, 0 to disable, default is dtBUFFERSTREAM_PREFETCH
+    */
+    inline void SetPrefetch(bbUINT const depth) { mPrefetchDepth = depth; }
+
+    /** Get number of segments to read ahead on sequential access.
+        @return Number of segments, 0 if disabled
+    */
+    inline bbUINT GetPrefetch() const { return mPrefetchDepth; }
+
+    /** Enable or disable batched asynchronous I/O for read-ahead and save.
+        If disabled, or if io_uring is not available, I/O is executed synchronously.
+        Read-ahead picks up the setting on next Open().
+        @param enable !=0 to enable (default), 0 to disable
+    */
+    inline void SetAsyncIO(int const enable) { mAsyncIO = enable; }
+
+    /** Test if batched asynchronous I/O is enabled.
+        @return !=0 if enabled
+    */
+    inline int GetAsyncIO() const { return mAsyncIO; }
+
+    /** Enable or disable direct I/O, bypassing the page cache.
+        Applies to loading unchanged file data, read-ahead and save.
+        If the file system does not support O_DIRECT, I/O stays buffered.
+        Takes effect on next Open().
+        @param enable !=0 to enable, 0 to disable (default)
+    */
+    inline void SetDirectIO(int const enable) { mDirectIO = enable; }
+
+    /** Test if direct I/O is enabled.
+        @return !=0 if enabled
+    */
+    inline int GetDirectIO() const { return mDirectIO; }
+
+    /** Enable or disable patch save for overwrite-only edits.
+        If enabled, saving back to the original file writes only the changed data in
+        place, if no data was moved. Otherwise the file is rewritten via a temp file.
+        @param enable !=0 to enable (default), 0 to disable
+    */
+    inline void SetPatchSave(int const enable) { mUsePatchSave = enable; }
+
+    /** Test if patch save for overwrite-only edits is enabled.
+        @return !=0 if enabled
+    */
+    inline int GetPatchSave() const { return mUsePatchSave; }
+
+    /** Set number of threads writing the file in OnSave().
+        @param count Number of threads, 1 to save serially, clamped to
+                     dtBUFFERSTREAM_MAXSAVETHREADS. Default is dtBUFFERSTREAM_SAVETHREADS.
+    */
+    void SetSaveThreads(bbUINT count);
+
+    /** Get number of threads writing the file in OnSave().
+        @return Number of threads
+    */
+    inline bbUINT GetSaveThreads() const { return mSaveThreads; }
+
+    /** Set number of bytes reserved for a gap in Map segments.
+        Inserts into the middle of a Map segment open a gap of this size plus the
+        insert size, subsequent inserts at the same position fill it.
+        @param size Size in bytes, 0 to split segments on inserts instead.
+                    Default is dtBUFFERSTREAM_GAPSIZE.
+    */
+    inline void SetGapSize(bbU32 const size) { mGapReserve = size; }
+
+    /** Get number of bytes reserved for a gap in Map segments.
+        @return Size in bytes, 0 if disabled
+    */
+    inline bbU32 GetGapSize() const { return mGapReserve; }
+
+    /** Set granularity for loading unchanged file data.
+        MapSeq() loads at most this number of bytes around the accessed offset.
+        In adaptive mode loads start at dtBUFFERSTREAM_SEGMENTSIZE_MIN, and double with
+        each load continuing a forward or backward walk up to dtBUFFERSTREAM_SEGMENTSIZE_MAX.
+        @param size Size in bytes, rounded down to a power of 2 and clamped to
+                    dtBUFFERSTREAM_SEGMENTSIZE_MIN..dtBUFFERSTREAM_SEGMENTSIZE_MAX,
+                    or 0 for adaptive mode. Default is dtBUFFERSTREAM_SEGMENTSIZE.
+    */
+    void SetSegmentSize(bbU32 size);
+
+    /** Get granularity for loading unchanged file data.
+        @return Size in bytes, or 0 for adaptive mode
+    */
+    inline bbU32 GetSegmentSize() const { return mSegmentSize; }
+
+    /** Merge adjacent small segments, incrementally.
+        Visits up to \a count segments, resuming where the previous step stopped,
+        and wrapping at buffer end. Call this on idle to defragment the segment index.
+        Nothing is merged while an insert is pending.
+        @param count Number of segments to visit
+        @return Number of merged segments
+    */
+    bbU32 Compact(bbU32 count);
+
+    /** Get number of segments in the segment index.
+        @return Number of segments
+    */
+    bbU32 GetSegmentCount() const;
+
+    /** Set allocator for heap data of segments, insert blocks and read-ahead blocks.
+        If the allocator supports dtAlloc::Release(), it is released on close.
+        The allocator must stay valid until the buffer is destroyed or another
+        allocator is set, and must not be shared with other buffers in this case.
+        @param pAlloc Allocator, or NULL for the babel heap (default)
+        @return bbEOK on success, or value of bbELAST on failure, fails if buffer is open
+    */
+    bbERR SetAllocator(dtAlloc* const pAlloc);
+
+    /** Get allocator for heap data of segments.
+        @return Allocator, never NULL
+    */
+    inline dtAlloc* GetAllocator() const { return mpAlloc; }
+
     friend class e7WinDbg;
 };
 
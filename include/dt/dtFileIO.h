@@ -0,0 +1,146 @@
+#ifndef dtFILEIO_H_
+#define dtFILEIO_H_
+
+/** @file dtFileIO.h
+    Batched file I/O.
+
+    dtFileIO queues positional reads and writes on a file, and executes them as a batch
+    on dtFileIO::Flush(). On Linux the batch is submitted at once via io_uring, so the
+    device can process the requests in parallel. If io_uring is not available, at compile
+    time or at runtime, requests are executed one after the other via
+    dtStreamFile::ReadAt() or dtStreamFile::WriteAt().
+
+    Buffers passed to dtFileIO::Read() and dtFileIO::Write() must stay valid until
+    the next dtFileIO::Flush(). Requests within a batch are executed in any order.
+    dtFileIO::ReadFrom() queues reads from another file into the same batch, so that
+    copying can read the next chunk while the current one is written.
+    Define dtFILEIO_NOURING to build without io_uring support.
+
+    With dtFILEIOOPT_DIRECT the file is opened for direct I/O, see dtStreamFile::Open().
+    Direct I/O is executed synchronously, since the unaligned parts of a request must be
+    split off and bounced.
+*/
+
+#include "dtStreamFile.h"
+
+/** Maximum number of requests per batch. */
+#define dtFILEIO_MAXBATCH 32
+
+/** Options for dtFileIO::Open(). */
+enum dtFILEIOOPT
+{
+    dtFILEIOOPT_ASYNC  = 1, //!< Use io_uring if available
+    dtFILEIOOPT_DIRECT = 2  //!< Bypass page cache with O_DIRECT if available
+};
+
+struct dtIORing;
+
+struct dtFileIOReq
+{
+    dtStreamFile* mpFile; //!< File to transfer from or to
+    bbU64   mOffset;    //!< File offset
+    bbU8*   mpBuf;      //!< Data buffer
+    bbU32   mSize;      //!< Number of bytes to transfer
+    bbU8    mWrite;     //!< !=0 for write, 0 for read
+};
+
+/** Batched file I/O engine with synchronous fallback. */
+class dtFileIO
+{
+private:
+    dtStreamFile mFile;     //!< Opened file
+    dtIORing*   mpRing;     //!< io_uring instance on mFile.mFd, or NULL for synchronous I/O
+    bbUINT      mCount;     //!< Number of queued requests
+
+    dtFileIOReq mReq[dtFILEIO_MAXBATCH];
+
+    bbERR Queue(dtStreamFile* const pFile, bbU64 const offset, bbU8* const pBuf, bbU32 const size, bbU8 const write);
+    bbERR FlushSync(bbUINT const first);
+    bbERR FlushRing();
+
+public:
+    dtFileIO();
+    ~dtFileIO();
+
+    /** Open file.
+        @param pPath Path of file
+        @param flags bbFILEOPEN_READ, bbFILEOPEN_READWRITE, and optionally bbFILEOPEN_TRUNC
+        @param opt Bitmask of dtFILEIOOPT options, 0 for synchronous buffered I/O
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR Open(const bbCHAR* const pPath, bbUINT const flags, bbUINT const opt);
+
+    /** Close file. Queued requests are dropped. */
+    void Close();
+
+    /** Test if file is opened.
+        @return !=0 if opened
+    */
+    inline int IsOpen() const { return mFile.mhFile != NULL; }
+
+    /** Get opened file, for positional I/O while no requests are queued.
+        @return File
+    */
+    inline dtStreamFile& GetFile() { return mFile; }
+
+    /** Test if requests are submitted via io_uring.
+        @return !=0 if asynchronous
+    */
+    inline int IsAsync() const { return mpRing != NULL; }
+
+    /** Queue a read. Flushes the batch if it is full.
+        @param offset File offset
+        @param pBuf Buffer to receive data
+        @param size Number of bytes to read
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    inline bbERR Read(bbU64 const offset, bbU8* const pBuf, bbU32 const size)
+    {
+        return Queue(&mFile, offset, pBuf, size, 0);
+    }
+
+    /** Queue a read from another file. Flushes the batch if it is full.
+        @param file Source file, must be opened with a file descriptor for positional
+                    I/O (dtStreamFile::mFd), and stay open until flushed
+        @param offset Offset in source file
+        @param pBuf Buffer to receive data
+        @param size Number of bytes to read
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    inline bbERR ReadFrom(dtStreamFile& file, bbU64 const offset, bbU8* const pBuf, bbU32 const size)
+    {
+        return Queue(&file, offset, pBuf, size, 0);
+    }
+
+    /** Queue a write. Flushes the batch if it is full.
+        @param offset File offset
+        @param pBuf Data to write
+        @param size Number of bytes to write
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    inline bbERR Write(bbU64 const offset, const bbU8* const pBuf, bbU32 const size)
+    {
+        return Queue(&mFile, offset, (bbU8*)pBuf, size, 1);
+    }
+
+    /** Copy a file range from another file within the kernel.
+        See dtStreamFile::CopyFrom(). Queued requests are not flushed, the range
+        must not overlap with them.
+        @param src Source file
+        @param srcoffset Offset in source file
+        @param offset Offset in this file
+        @param size Number of bytes to copy
+        @return Number of bytes copied from the start of the range
+    */
+    inline bbU64 CopyFrom(dtFileIO& src, bbU64 const srcoffset, bbU64 const offset, bbU64 const size)
+    {
+        return mFile.CopyFrom(src.mFile, srcoffset, offset, size);
+    }
+
+    /** Execute all queued requests and wait for completion.
+        @return bbEOK if all requests succeeded, or value of bbELAST on failure
+    */
+    bbERR Flush();
+};
+
+#endif /* dtFILEIO_H_ */
@@ -4,22 +4,52 @@
 #include "dtdefs.h"
 #include "babel/Arr.h"
 
+/** Maximum size of a heap payload in the history. */
+#define dtHISTORY_MAXPAYLOAD 0x4000000UL
+
+/** dtHistoryRun::mFileOffset value for runs holding data bytes. */
+#define dtHISTORYRUN_DATA ((bbU64)-1)
+
+/** dtHistoryRun::mFileOffset flag for runs referencing the buffer's temp file.
+    Also set in dtHISTORYRUN_DATA, so test for dtHISTORYRUN_DATA first.
+*/
+#define dtHISTORYRUN_TEMP ((bbU64)1 << 63)
+
+/** Size of data bytes following a dtHistoryRun, padded to keep the next run aligned. */
+#define dtHISTORYRUN_PAD(size) (((size) + 7) &~ (bbU64)7)
+
+/** Run of a run list payload, see dtHistory::PushRuns().
+    A run list describes the change data as a sequence of runs, which either
+    reference a range of the buffer's underlying file or temp file, or hold a copy
+    of the data.
+    The runs follow each other, until their sizes add up to the change length.
+*/
+struct dtHistoryRun
+{
+    bbU64 mFileOffset;  //!< Offset in underlying file, temp file offset with dtHISTORYRUN_TEMP set,
+                        //!< or dtHISTORYRUN_DATA if mSize data bytes follow the run
+    bbU64 mSize;        //!< Number of bytes, >0
+};
+
 class dtHistory
 {
     // Serialized changes history format (max 1+8+8+8+1=26 bytes)
     // 1 byte     : bit 0..1 dtCHANGE type
     //              bit 2    1 = Undo point
+    //              bit 3    1 = Payload is a dtHistoryRun list
     //              bit 4..5 offset byte length (0=>4, 1=>2, 2=>8)
     //              bit 6..7 length byte length (0=>1, 1=>4, 2=>8)
     // 1..8 bytes : offset
     // 1..8 bytes : length
-    // 0..8 bytes : if dtCHANGE_INSERT 0 bytes, else if length<=8: data bytes, else serialized pointer (native size)
+    // 0..8 bytes : if length<=8 and no run list: data bytes, else serialized pointer (native size)
     // 1 byte     : length of change, for reverse walk
 
     bbArrU8 mHist;     //!< Change history
     bbU32   mHistSize; //!< Next write position in change history
     bbU32   mHistPos;  //!< Next read position in change history
 
+    bbU8*  PushPayload(dtCHANGE const type, bbU64 const offset, bbU64 const length, bbU64 const payloadsize, int const runs, bool isUndoPoint);
+
 public:
     dtHistory();
     ~dtHistory();
@@ -27,12 +57,42 @@ public:
     void   Clear();
     void   Trunc();
     bbU8*  Push(dtCHANGE const type, bbU64 const offset, bbU64 const length, bool isUndoPoint);
+
+    /** Push change with a run list payload.
+        Unlike Push(), the payload size does not depend on the change length.
+        @param type Change type
+        @param offset Buffer offset of change
+        @param length Length of change in bytes
+        @param payloadsize Size of run list in bytes, must be >0
+        @param isUndoPoint true if the change is an undo point
+        @return Pointer to payload to receive the run list, or NULL on failure
+    */
+    dtHistoryRun* PushRuns(dtCHANGE const type, bbU64 const offset, bbU64 const length, bbU64 const payloadsize, bool isUndoPoint);
+
     void   PushRevert();
 
     static const bbU32 PEEKPREV = 0;
     static const bbU32 PEEKNEXT = (bbU32)-1;
 
-    bbUINT Peek(bbU32 const pos, dtBufferChange* const pChange) const;
+    /** Read change.
+        @param pos End position of change, PEEKPREV for the change before the read position,
+                   or PEEKNEXT for the change at the read position
+        @param pChange Returns change, dtBufferChange::user points to the payload
+        @param pRuns Returns !=0 if the payload is a dtHistoryRun list, can be NULL
+        @return Length of serialized change
+    */
+    bbUINT Peek(bbU32 const pos, dtBufferChange* const pChange, int* const pRuns) const;
+
+    /** Replace payload of a change, the old payload is not freed.
+        @param pos End position of change, as passed to Peek()
+        @param pPayload New heap block, must be in the same format
+    */
+    void   SetPayload(bbU32 const pos, void* const pPayload);
+
+    /** Get end position of last change, for walking all changes with Peek().
+        @return Position
+    */
+    inline bbU32 GetEnd() const { return mHistSize; }
 
     inline void Seek(int const size)
     {
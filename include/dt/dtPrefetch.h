@@ -0,0 +1,110 @@
+#ifndef dtPREFETCH_H_
+#define dtPREFETCH_H_
+
+/** @file dtPrefetch.h
+    Asynchronous read-ahead for dtBufferStream.
+
+    dtPrefetch watches the file offsets of segments loaded by dtBufferStream::MapSeq().
+    If two consecutive loads have the same distance (stride), the access is considered
+    sequential, and the next dtPrefetch::mDepth blocks in stride direction are read on
+    a worker thread. This covers forward and backward walks, and constant strides.
+
+    Blocks are read via a separate dtFileIO instance, all queued blocks are submitted
+    as one batch. Finished blocks are allocated via the dtAlloc passed to dtPrefetch::Open(),
+    and handed out via dtPrefetch::Take(). The caller takes ownership. At most mDepth blocks are
+    queued, in flight or waiting to be taken.
+
+    If the underlying file is mapped into memory, no worker thread is started,
+    instead the kernel is advised to read ahead the predicted blocks.
+*/
+
+#include "dtdefs.h"
+#include "dtFileIO.h"
+#include "dtAlloc.h"
+#include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/** Asynchronous block reader with sequential access detection. */
+class dtPrefetch
+{
+private:
+    enum dtPREFETCHSTATE
+    {
+        dtPREFETCHSTATE_QUEUED = 0, //!< Waiting for worker
+        dtPREFETCHSTATE_READING,    //!< Worker reads block
+        dtPREFETCHSTATE_DONE,       //!< Block read, waiting to be taken
+        dtPREFETCHSTATE_FAILED      //!< Read failed
+    };
+
+    struct dtPrefetchBlock
+    {
+        bbU64   mFileOffset;    //!< File offset of block
+        bbU32   mSize;          //!< Block size in bytes
+        bbU8    mState;         //!< Block state, see dtPREFETCHSTATE
+        bbU8    mCancel;        //!< !=0 if block was cancelled while being read
+        bbU8*   mpData;         //!< Block with data allocated via mpAlloc, valid for dtPREFETCHSTATE_DONE
+    };
+
+    std::list<dtPrefetchBlock> mBlocks; //!< Blocks in request order, protected by mLock
+    std::mutex                 mLock;
+    std::condition_variable    mWake;   //!< Signals new requests or quit to worker
+    std::condition_variable    mDone;   //!< Signals finished reads to Take()
+    std::thread                mThread;
+    int                        mRunning; //!< !=0 if mThread was started
+    int                        mQuit;    //!< !=0 to request worker exit
+
+    bbCHAR*     mpPath;         //!< Path of file to read, heap copy
+    bbU64       mFileSize;      //!< File size in bytes
+    const bbU8* mpFileMap;      //!< Memory mapping of file, or NULL
+    bbUINT      mDepth;         //!< Number of blocks to read ahead
+    bbUINT      mIOOpt;         //!< I/O options, see dtFileIO::Open()
+    dtAlloc*    mpAlloc;        //!< Allocator for blocks
+
+    bbU64       mLast;          //!< File offset of last load, or (bbU64)-1
+    bbS64       mStride;        //!< Distance between the last two loads
+
+    void Worker();
+    void Advise(bbU64 const fileoffset, bbU32 const size);
+    void Request(bbU64 const fileoffset, bbU32 const size);
+    void Cancel();
+    void Prune(bbU64 const fileoffset);
+
+public:
+    dtPrefetch();
+    ~dtPrefetch();
+
+    /** Prepare prefetching for a file.
+        The worker thread is started on first detected sequential access.
+        @param pPath Path of file, will be opened read-only by the worker
+        @param filesize File size in bytes
+        @param depth Number of blocks to read ahead
+        @param ioopt Bitmask of dtFILEIOOPT options for reading
+        @param pFileMap Memory mapping of the complete file, or NULL
+        @param pAlloc Allocator for blocks, must be thread-safe
+        @return bbEOK on success, or value of bbELAST on failure
+    */
+    bbERR Open(const bbCHAR* const pPath, bbU64 const filesize, bbUINT const depth, bbUINT const ioopt, const bbU8* const pFileMap, dtAlloc* const pAlloc);
+
+    /** Stop worker thread and free all prefetched blocks. */
+    void Close();
+
+    /** Notify about a block load, and request read-ahead if access is sequential.
+        Read-ahead blocks have the same size as the loaded block.
+        @param fileoffset File offset of loaded block
+        @param blocksize Size of loaded block
+    */
+    void OnLoad(bbU64 const fileoffset, bbU32 const blocksize);
+
+    /** Take prefetched block.
+        If the block is currently being read, the call waits for completion.
+        @param fileoffset File offset of block
+        @param size Number of bytes needed
+        @return Block with \a size bytes, to be freed by caller via the dtAlloc passed
+                to Open(), or NULL if not prefetched
+    */
+    bbU8* Take(bbU64 const fileoffset, bbU32 const size);
+};
+
+#endif /* dtPREFETCH_H_ */
@@ -2,6 +2,7 @@
 #define dtSegmentTree_H_
 
 #include "dtdefs.h"
+#include "dtAlloc.h"
 #include "babel/Arr.h"
 
 /** dtSegment::mType segment type */
@@ -9,6 +10,7 @@ enum dtSEGMENTTYPE
 {
     dtSEGMENTTYPE_NULL = 0, //!< Segment is an unmapped portion of the file
     dtSEGMENTTYPE_MAP,      //!< Segment is a memory mapped portion of the file
+    dtSEGMENTTYPE_TEMP,     //!< Segment is a changed portion of the file, swapped out to temp file
 };
 
 /** Descriptor for a cached file segment. */
@@ -18,20 +20,20 @@ struct dtSegment
     bbU32   mGE;        //!< index of node with offset greater or equal than this node, (bbU32)-1 is NIL
     bbU32   mPrev;      //!< Previous index, used, circular
     bbU32   mNext;      //!< Next index, used or free, circular
+    bbU32   mParent;    //!< index of parent node, (bbU32)-1 for root
+    bbU32   mLRUPrev;   //!< Previous (more recently used) index in LRU chain, circular, valid for dtSEGMENTTYPE_MAP
+    bbU32   mLRUNext;   //!< Next (less recently used) index in LRU chain, circular, valid for dtSEGMENTTYPE_MAP
+    bbU32   mCapacity;  //!< Size of heap block at \a mpData in bytes, valid for dtSEGMENTTYPE_MAP with heap data
     bbU64   mOffset;    //!< Buffer offset, relative to parent segment, root is absolute
     bbU64   mFileSize;  //!< Original size of segment on file
-    union {
-    bbU64   mFileOffset;//!< File offset of segment (not buffer offset), valid for dtSEGMENTTYPE_NULL
-    struct {
+    bbU64   mFileOffset;//!< File offset of segment (not buffer offset), valid for dtSEGMENTTYPE_NULL and unchanged dtSEGMENTTYPE_MAP,
+                        //!< temp file offset for dtSEGMENTTYPE_TEMP
     bbU8*   mpData;     //!< Pointer to heap block containing data, valid for dtSEGMENTTYPE_MAP
-    bbU32   mSize;      //!< Size of cached \a mpData block in bytes, valid for dtSEGMENTTYPE_MAP
-    };
-    };
+    bbU32   mSize;      //!< Size of cached \a mpData block in bytes, valid for dtSEGMENTTYPE_MAP and dtSEGMENTTYPE_TEMP
     bbU8    mType;      //!< Segment type, see dtSEGMENTTYPE
-    bbU8    mLevel;     //!< AA-tree node level
-    bbU8    mChanged;   //!< !=0 if segment is changed, valid for dtSEGMENTTYPE_MAP only
+    bbU8    mLevel;     //!< AA-tree node level, 1 for leafs
+    bbU8    mChanged;   //!< !=0 if segment is changed, valid for dtSEGMENTTYPE_MAP, always !=0 for dtSEGMENTTYPE_TEMP
     bbU8    mOpt;       //!< do not use
-    bbU32   mCapacity;  //!< do not use
 
     inline bbU64 GetSize() const
     {
@@ -42,13 +44,18 @@ struct dtSegment
 /** Number of entries to enlarge dtBufferStream::mSegments on each realloc. */
 #define dtSEGMENTTREE_IDXENLARGE 32
 
+/** Maximum depth of segment tree.
+    An AA-tree with n nodes has a maximum depth of 2*log2(n+1), which is 64 for 32 bit node indices.
+*/
+#define dtSEGMENTTREE_MAXDEPTH 66
+
 #if bbSIZEOF_UPTR==4
-bbDECLAREARR(dtSegment, dtArrSegment, 48);
+bbDECLAREARR(dtSegment, dtArrSegment, 68);
 #elif bbSIZEOF_UPTR==8
-bbDECLAREARR(dtSegment, dtArrSegment, 56);
+bbDECLAREARR(dtSegment, dtArrSegment, 72);
 #endif
 
-/** Tree of buffer segments. */
+/** Tree of buffer segments, balanced as AA-tree. */
 class dtSegmentTree
 {
 protected:
@@ -57,6 +64,7 @@ protected:
     bbU32        mSegmentUsedFirst;  //!< mSegments[] index of first node
     bbU32        mSegmentUsedLast;   //!< mSegments[] index of last node
     bbU32        mSegmentUsedRoot;   //!< mSegments[] index of tree root node
+    dtAlloc*     mpAlloc;            //!< Allocator for heap data of Map segments, never NULL
 
 #ifdef bbDEBUG
     virtual void CheckTree() = 0;
@@ -99,14 +107,105 @@ protected:
     */
     bbU32 FindSegment(bbU64 const offset, bbU64* const pSegmentStart, int const wrap);
 
-    /** Link new segment to its left neighbour.
-        The segment with mSegments[] index \a idx must be the right neighbour of \a pSubTree.
+    /** Get AA-tree level of node, 0 for NIL.
+        @param idx Node index into mSegments[], or (bbU32)-1
+    */
+    inline bbUINT NodeLevel(bbU32 const idx) const
+    {
+        return (idx == (bbU32)-1) ? 0 : mSegments[idx].mLevel;
+    }
+
+    /** Test if node \a idx precedes node \a walk in the linked list.
+        Used to resolve ambiguous tree descents, if both nodes start at the same buffer offset.
+        @param idx  Node index
+        @param walk Node index, must start at the same buffer offset as \a idx
+        @return !=0 if \a idx is left of \a walk
+    */
+    int NodeIsBefore(bbU32 const idx, bbU32 walk) const;
+
+    /** Get path of nodes from tree root to a node.
+        @param idx          Node index to find
+        @param segmentstart Absolute buffer offset of node \a idx
+        @param pPath        Array with dtSEGMENTTREE_MAXDEPTH entries to receive the path, pPath[0] is the root
+        @return Number of entries written to \a pPath, the last entry is \a idx
+    */
+    bbUINT NodePath(bbU32 const idx, bbU64 const segmentstart, bbU32* const pPath) const;
+
+    /** Get absolute buffer offset of a node.
+        Walks from the node up to the tree root, use this if the offset is not known from a tree descent.
+        @param idx Node index
+        @return Absolute buffer offset of node \a idx
+    */
+    bbU64 NodeStart(bbU32 idx) const;
+
+    /** Replace link to a child node in its parent node.
+        @param parent Parent node index, or (bbU32)-1 to replace the root
+        @param child  Old child node index
+        @param link   New child node index, or (bbU32)-1
+    */
+    inline void NodeRelink(bbU32 const parent, bbU32 const child, bbU32 const link)
+    {
+        if (parent == (bbU32)-1)
+            mSegmentUsedRoot = link;
+        else if (mSegments[parent].mLT == child)
+            mSegments[parent].mLT = link;
+        else
+            mSegments[parent].mGE = link;
+
+        if (link != (bbU32)-1)
+            mSegments[link].mParent = parent;
+    }
+
+    /** AA-tree skew operation, rotate right if node has a horizontal left link.
+        Relative offsets are adjusted, the offset of the returned subtree root stays relative
+        to the parent of \a idx.
+        @param idx Subtree root, or (bbU32)-1
+        @return New subtree root
+    */
+    bbU32 NodeSkew(bbU32 const idx);
+
+    /** AA-tree split operation, rotate left and increase level if node has two horizontal right links.
+        Relative offsets are adjusted, the offset of the returned subtree root stays relative
+        to the parent of \a idx.
+        @param idx Subtree root, or (bbU32)-1
+        @return New subtree root
+    */
+    bbU32 NodeSplit(bbU32 const idx);
+
+    /** Rebalance tree after a leaf has been linked.
+        @param pPath Path from root to the new leaf's parent
+        @param depth Number of entries in \a pPath
+    */
+    void NodeRebalanceInsert(const bbU32* const pPath, bbUINT depth);
+
+    /** Rebalance tree after a node has been unlinked.
+        @param pPath Path from root to the parent of the removed node
+        @param depth Number of entries in \a pPath
+    */
+    void NodeRebalanceDelete(const bbU32* const pPath, bbUINT depth);
+
+    /** Adjust relative tree offsets along a path after resizing the path's last node.
+        @param pPath Path from root to resized node
+        @param depth Number of entries in \a pPath
+        @param diff  Number of bytes the segment was reduced (positive number) or increased (negative number)
+    */
+    void NodePathSubstractOffset(const bbU32* const pPath, bbUINT const depth, bbS64 const diff);
+
+    /** Link new segment to its left neighbour and rebalance the tree.
+        The segment with mSegments[] index \a idx must be the right neighbour of \a left.
         Will not adjust any tree index offsets.
-        @param idx      Index of new segment to link
-        @param pSubTree Left neighbour of \a idx, this is the root of a subtree
-        @param offset   Buffer offset of \a idx relative to \a pSubTree
+        @param idx       Index of new segment to link
+        @param left      Left neighbour of \a idx, must be linked in tree
+        @param leftstart Absolute buffer offset of \a left
+    */
+    void NodeLinkRight(bbU32 const idx, bbU32 const left, bbU64 const leftstart);
+
+    /** Link new segment as first segment and rebalance the tree.
+        The new segment starts at buffer offset 0, the tree offsets of all other
+        segments must already include its size.
+        @param idx Index of new segment to link
     */
-    void NodeLinkRight(bbU32 const idx, dtSegment* pSubTree, bbS64 offset);
+    void NodeLinkFirst(bbU32 const idx);
 
     /** Link new segment into tree and adjust all tree offsets.
         The segment \a mSegments[idx] must have dtSegment::mPrev and dtSegment::mNext initialized
@@ -116,6 +215,16 @@ protected:
     */
     void NodeInsert(bbU32 const idx, bbU64 const segmentstart);
 
+    /** Link new segment into list and tree.
+        The segment \a mSegments[idx] must have dtSegment::mPrev and dtSegment::mNext initialized
+        to its neighbours, and dtSegment::GetSize() must return the segment's size. Updates
+        mSegmentUsedFirst and mSegmentUsedLast for segments inserted at buffer start or end.
+        The buffer must not be empty.
+        @param idx    Index of new segment to link
+        @param segmentstart Absolute offset of segment \a idx
+    */
+    void LinkSegment(bbU32 const idx, bbU64 const segmentstart);
+
     /** Adjust relative tree offsets after reducing or increasing a segment size.
         This function will do bookkeeping on the relative offsets in the
         index tree, after reducing a segment size. The implementation will not look at the
@@ -126,7 +235,7 @@ protected:
     */
     void NodeSubstractOffset(bbU32 const idx, bbU64 const segmentstart, bbS64 const diff);
 
-    /** Delete node from index tree.
+    /** Delete node from index tree and rebalance the tree.
         Will unlink node from index tree, and adjust relative offsets of remaining nodes.
         Will not update the linked list, nor return the node into free pool.
         @param idx Node to be deleted
@@ -134,6 +243,13 @@ protected:
     */
     void NodeDelete(bbU32 const idx, bbU64 const segmentstart);
 
+    /** Unlink right neighbour of a segment from tree and list, and return it to the free pool.
+        The size of \a idx is not changed, all following segments move left.
+        @param idx Index of segment, must not be the last segment
+        @param segmentstart Absolute buffer offset of segment \a idx
+    */
+    void UnlinkRightSegment(bbU32 const idx, bbU64 const segmentstart);
+
     /** Split Null segment into two Null segments.
 
         \a segmentoffset must not be 0, and smaller or equal than \a idx segment's size.
@@ -146,10 +262,11 @@ protected:
         reallocate the mSegments[] array.
 
         @param idx Index of segment to split, must be Null segment
+        @param segmentstart Absolute buffer offset of segment \a idx
         @param segmentoffset Segment-relative offset to split at
         @return Index of inserted right Null segment, or -1 on failure
     */
-    bbU32 SplitNullSegment(bbU32 const idx, bbU64 segmentoffset);
+    bbU32 SplitNullSegment(bbU32 const idx, bbU64 const segmentstart, bbU64 segmentoffset);
 
     /** Split Map segment into two Map segments.
 
@@ -163,11 +280,51 @@ protected:
         reallocate the mSegments[] array.
 
         @param idx Index of segment to split, must be Map segment
+        @param segmentstart Absolute buffer offset of segment \a idx
         @param segmentoffset Segment-relative offset to split at. This is a 32 bit offset,
                              because a mapped segment is always smaller than 4 GB.
         @return Index of inserted right Null segment, or -1 on failure
     */
-    bbU32 SplitMapSegment(bbU32 const idx, bbU32 const segmentoffset);
+    bbU32 SplitMapSegment(bbU32 const idx, bbU64 const segmentstart, bbU32 const segmentoffset);
+
+    /** Resize heap block of a Map segment.
+
+        The block grows geometrically and shrinks only if it gets less than a quarter
+        used, so repeated appends and deletes on a segment are amortized O(1).
+        dtSegment::mCapacity is updated, dtSegment::mSize is not touched. For size 0
+        the block is freed.
+
+        @param pSegment Map segment holding heap data
+        @param size Minimum block size in bytes
+        @return bbEOK on success, or value of bbELAST on failure, block is unchanged in this case
+    */
+    bbERR ReserveSegmentData(dtSegment* const pSegment, bbU32 const size);
+
+    /** Merge Null segment with its right neighbour.
+
+        The segments are merged only, if the right neighbour is a Null segment too,
+        and both segments are contiguous on file. The right neighbour is
+        unlinked and returned into the free pool.
+
+        @param idx Index of segment to merge, must be Null segment
+        @param segmentstart Absolute buffer offset of segment \a idx
+        @return !=0 if segments were merged
+    */
+    int MergeNullSegment(bbU32 const idx, bbU64 const segmentstart);
+
+    /** Merge Map segment with its right neighbour.
+
+        The right neighbour must be a Map segment. Both segments must hold heap data,
+        the data of \a idx is reallocated to hold both. The merged segment is changed,
+        if any of both was changed. If both are unchanged, the caller must ensure they
+        are contiguous on file. The right neighbour is unlinked and returned into the
+        free pool.
+
+        @param idx Index of segment to merge, must be Map segment
+        @param segmentstart Absolute buffer offset of segment \a idx
+        @return bbEOK on success, or value of bbELAST on failure, segments are unchanged in this case
+    */
+    bbERR MergeMapSegment(bbU32 const idx, bbU64 const segmentstart);
 };
 
 #endif /* dtSegmentTree_H_ */
@@ -55,6 +55,40 @@ struct dtStream
         @param size Number of bytes to write
     */
     virtual bbERR Write(bbU8* pBuf, bbU32 size) = 0;
+
+    /** Read block from buffer offset, without using the current read/write position.
+        The default implementation seeks, reads, and restores the read/write position.
+        Implementations may override this with positional I/O, which is safe to call
+        from multiple threads.
+        @param offset Byte offset relative to buffer start
+        @param pBuf Pointer to buffer to receive data
+        @param size Number of bytes to read
+    */
+    virtual bbERR ReadAt(bbU64 offset, bbU8* pBuf, bbU32 size)
+    {
+        bbU64 const pos = mOffs;
+        bbERR err = Seek(offset);
+        if (err == bbEOK)
+            err = Read(pBuf, size);
+        Seek(pos);
+        return err;
+    }
+
+    /** Write block to buffer offset, without using the current read/write position.
+        See ReadAt().
+        @param offset Byte offset relative to buffer start
+        @param pBuf Pointer to buffer to holding data to write
+        @param size Number of bytes to write
+    */
+    virtual bbERR WriteAt(bbU64 offset, bbU8* pBuf, bbU32 size)
+    {
+        bbU64 const pos = mOffs;
+        bbERR err = Seek(offset);
+        if (err == bbEOK)
+            err = Write(pBuf, size);
+        Seek(pos);
+        return err;
+    }
 };
 
 #endif /* dtSTREAM_H_ */
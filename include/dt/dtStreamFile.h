@@ -4,21 +4,34 @@
 #include "dtStream.h"
 #include <babel/file.h>
 
+/** Alignment of file offset, size and memory for direct I/O, covers 512 and 4096 byte sectors. */
+#define dtSTREAMFILE_DIRECTALIGN 4096
+
+/** Size of bounce buffer for direct I/O on unaligned memory. */
+#define dtSTREAMFILE_DIRECTBUFSIZE 0x100000
+
 struct dtStreamFile : dtStream
 {
     bbFILEH mhFile;
+    int     mFd;        //!< POSIX file descriptor for positional I/O, or -1 if not available
+    int     mFdDirect;  //!< POSIX file descriptor opened with O_DIRECT, or -1 if not used
+    bbU8*   mpBounce;   //!< Heap block holding aligned bounce buffer for direct I/O, or NULL
 
     dtStreamFile()
     {
+        mOffs = 0;
         mhFile = NULL;
+        mFd = mFdDirect = -1;
+        mpBounce = NULL;
     }
 
     ~dtStreamFile()
     {
-        bbFileClose(mhFile);
+        Close();
     }
 
     /** Attach opened file to buffer.
+        Positional I/O falls back to seek and read/write for attached files.
         @param hFile Handle to file open for reading
     */
     void Attach(bbFILEH hFile)
@@ -28,24 +41,49 @@ struct dtStreamFile : dtStream
 
     /** Open file and attach to buffer.
         See bbFileOpen for parameter description.
+        On POSIX systems a second descriptor is opened for positional I/O.
+
+        If direct I/O is requested, a third descriptor is opened with O_DIRECT.
+        ReadAt() and WriteAt() then transfer the sector-aligned part of each request
+        bypassing the page cache, and only the unaligned head and tail through it.
+        Data in unaligned memory is transferred via a bounce buffer.
+        If O_DIRECT is not supported by the file system, I/O silently stays buffered.
+
+        @param pFilename Path of file
+        @param flags bbFILEOPEN_* flags
+        @param direct !=0 to use direct I/O
     */
-    inline bbFILEH Open(const bbCHAR* pFilename, const bbUINT flags)
-    {
-        return mhFile = bbFileOpen(pFilename, flags);
-    }
+    bbFILEH Open(const bbCHAR* pFilename, const bbUINT flags, const int direct);
 
-    inline void Close()
-    {
-        bbFileClose(mhFile);
-        mhFile = NULL;
-    }
+    void Close();
+
+    /** Test if direct I/O is in use.
+        @return !=0 if aligned transfers bypass the page cache
+    */
+    inline int IsDirect() const { return mFdDirect >= 0; }
+
+    /** Copy a file range from another file within the kernel.
+        Block-aligned parts are cloned with FICLONERANGE if the file system supports
+        reflinks, the rest is copied with copy_file_range(). Linux only.
+        @param src Source file
+        @param srcoffset Offset in source file
+        @param offset Offset in this file
+        @param size Number of bytes to copy
+        @return Number of bytes copied from the start of the range. If less than
+                \a size, the caller must copy the remainder.
+    */
+    bbU64 CopyFrom(dtStreamFile& src, bbU64 const srcoffset, bbU64 const offset, bbU64 const size);
 
     virtual bbU64 GetSize();
     virtual bbERR Seek(bbU64 offset);
     virtual bbERR Skip(bbS64 offset);
     virtual bbERR Read(bbU8* pBuf, bbU32 size);
     virtual bbERR Write(bbU8* pBuf, bbU32 size);
+    virtual bbERR ReadAt(bbU64 offset, bbU8* pBuf, bbU32 size);
+    virtual bbERR WriteAt(bbU64 offset, bbU8* pBuf, bbU32 size);
+
+private:
+    int TransferDirect(bbU64 offset, bbU8* pBuf, bbU32 size, int const write);
 };
 
 #endif /* dtSTREAMFILE_H_ */
-
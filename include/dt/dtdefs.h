@@ -17,6 +17,7 @@ bbDECLAREARRPTR(dtBuffer*, dtArrPBuffer);
 enum dtERR
 {
     dtENOCMD = bbEBASE_DT,  /**< Error code, no more commands in undo history */
+    dtECANCELLED,           /**< Error code, operation was cancelled */
 };
 
 /** Change IDs for dtBufferNotify::OnBufferChange */
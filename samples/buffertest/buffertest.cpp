@@ -1,5 +1,7 @@
 #include <babel/babel.h>
 #include <dt/dtBufferStream.h>
+#include <dt/dtAlloc.h>
+#include <dt/dtBufferMmap.h>
 #include <time.h>
 
 void syntax()
@@ -184,6 +186,1683 @@ bbERR test3(Param* pParams, dtBuffer& buffer)
     return bbELAST;
 }
 
+bbERR test4(Param* pParams, dtBuffer& buffer)
+{
+    bbU32 i;
+    bbERR err;
+    bbU8 c = 'x';
+
+    printf("test4: sequential small inserts and deletes\n");
+
+    if ((err = buffer.Open(pParams->pFile)) != bbEOK)
+    {
+        printf("Error %d on buffer open for new file\n", err);
+        goto test4_err;
+    }
+
+    for (i=0; i<5000; i++)
+    {
+        bbU64 offset = ((bbU64)i * 61) % (buffer.GetSize() + 1);
+
+        if (buffer.Write(offset, &c, 1, 0, NULL) != bbEOK)
+            goto test4_err;
+
+        if ((i & 3) == 0)
+        {
+            offset = (offset + 30) % buffer.GetSize();
+            if (buffer.Delete(offset, 1, NULL) != bbEOK)
+                goto test4_err;
+        }
+    }
+
+    if (pParams->pBufferClass && !strcmp(pParams->pBufferClass, "dtBufferStream"))
+    {
+        dtBufferStream* pStreamBuf = static_cast<dtBufferStream*>(&buffer);
+        #ifdef bbDEBUG
+        pStreamBuf->DebugCheck();
+        #endif
+    }
+
+    buffer.Close();
+    return bbEOK;
+
+    test4_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    return bbELAST;
+}
+
+/** Scratch files written by tests, in the working directory. */
+static const bbCHAR* const spScratch  = bbT("buffertest.tmp");
+static const bbCHAR* const spScratch2 = bbT("buffertest2.tmp");
+static const bbCHAR* const spScratch3 = bbT("buffertest3.tmp");
+
+/** Size of scratch file used by tests. */
+#define SCRATCHSIZE 0x800000UL
+
+/** Get test pattern byte.
+    @param offset Offset in scratch file
+*/
+static bbU8 Pattern(bbU64 const offset)
+{
+    return (bbU8)((offset * 0x9E3779B1UL) >> 11);
+}
+
+/** Create scratch file filled with Pattern().
+    @param pPath Path of file
+    @param size Size in bytes
+*/
+bbERR CreateScratch(const bbCHAR* const pPath, bbU64 const size)
+{
+    dtBufferStream buffer;
+    dtSection* pSection;
+    bbU64 offset = 0;
+
+    if (buffer.Open(NULL) != bbEOK)
+        return bbELAST;
+
+    while (offset < size)
+    {
+        bbU32 const chunk = (size - offset) > 0x10000 ? 0x10000 : (bbU32)(size - offset);
+
+        if (!(pSection = buffer.Insert(offset, chunk)))
+            goto CreateScratch_err;
+
+        for (bbU32 i=0; i<chunk; i++)
+            pSection->mpData[i] = Pattern(offset + i);
+
+        if (buffer.Commit(pSection, NULL) != bbEOK)
+            goto CreateScratch_err;
+
+        offset += chunk;
+    }
+
+    if (buffer.Save(pPath) != bbEOK)
+        goto CreateScratch_err;
+
+    buffer.Close();
+    return bbEOK;
+
+    CreateScratch_err:
+    printf("Error %d creating scratch file\n", bbErrGet());
+    buffer.Close();
+    return bbELAST;
+}
+
+/** Test if a buffer range holds Pattern().
+    @param buffer Buffer
+    @param offset Buffer offset
+    @param size Number of bytes to check
+    @param fileoffset Offset in scratch file of byte at \a offset
+*/
+bbERR CheckPattern(dtBuffer& buffer, bbU64 offset, bbU64 size, bbU64 fileoffset)
+{
+    while (size)
+    {
+        dtSection* const pSection = buffer.MapSeq(offset, 0, dtMAP_READONLY);
+        if (!pSection)
+            return bbELAST;
+
+        bbU32 const len = (pSection->mSize > size) ? (bbU32)size : pSection->mSize;
+
+        for (bbU32 i=0; i<len; i++)
+        {
+            if (pSection->mpData[i] != Pattern(fileoffset + i))
+            {
+                printf("Pattern mismatch at offset %" bbI64 "u\n", offset + i);
+                buffer.Discard(pSection);
+                return bbErrSet(bbEUK);
+            }
+        }
+
+        buffer.Discard(pSection);
+        offset += len;
+        fileoffset += len;
+        size -= len;
+    }
+
+    return bbEOK;
+}
+
+/** Compare buffer contents to a file.
+    @param buffer Buffer
+    @param pPath Path of file
+*/
+bbERR CompareFile(dtBuffer& buffer, const bbCHAR* const pPath)
+{
+    dtBufferStream file;
+    dtSection* pSection = NULL;
+    dtSection* pFileSection = NULL;
+    bbU64 offset = 0;
+
+    if (file.Open(pPath) != bbEOK)
+        return bbELAST;
+
+    if (file.GetSize() != buffer.GetSize())
+    {
+        printf("Size mismatch, buffer %" bbI64 "u, file %" bbI64 "u\n", buffer.GetSize(), file.GetSize());
+        bbErrSet(bbEUK);
+        goto CompareFile_err;
+    }
+
+    while (offset < buffer.GetSize())
+    {
+        if (!(pSection = buffer.MapSeq(offset, 0, dtMAP_READONLY)) ||
+            !(pFileSection = file.MapSeq(offset, 0, dtMAP_READONLY)))
+            goto CompareFile_err;
+
+        bbU32 const len = (pSection->mSize < pFileSection->mSize) ? pSection->mSize : pFileSection->mSize;
+
+        if (memcmp(pSection->mpData, pFileSection->mpData, len))
+        {
+            printf("Content mismatch in %" bbI64 "u..%" bbI64 "u\n", offset, offset + len);
+            bbErrSet(bbEUK);
+            goto CompareFile_err;
+        }
+
+        buffer.Discard(pSection);
+        file.Discard(pFileSection);
+        pSection = pFileSection = NULL;
+        offset += len;
+    }
+
+    file.Close();
+    return bbEOK;
+
+    CompareFile_err:
+    buffer.Discard(pSection);
+    file.Discard(pFileSection);
+    file.Close();
+    return bbELAST;
+}
+
+/** Apply a fixed set of edits to the opened scratch file.
+    Inserts, deletes, appends, and overwrites bytes spread over 2 MB, so that
+    several segments are changed.
+*/
+bbERR EditScratch(dtBuffer& buffer)
+{
+    bbU8 data[100];
+    bbU64 offset;
+
+    for (bbUINT i=0; i<sizeof(data); i++)
+        data[i] = (bbU8)i;
+
+    if ((buffer.Write(1000, data, sizeof(data), 0, NULL) != bbEOK) ||
+        (buffer.Delete(0x300000, 0x123456, NULL) != bbEOK) ||
+        (buffer.Write(buffer.GetSize(), data, sizeof(data), 0, NULL) != bbEOK))
+        return bbELAST;
+
+    for (offset = 0x100000; offset < 0x300000; offset += 0x1000)
+    {
+        if (buffer.Write(offset, data, 7, 1, NULL) != bbEOK)
+            return bbELAST;
+    }
+
+    return bbEOK;
+}
+
+/** Get tested buffer as dtBufferStream.
+    @return Pointer to buffer, or NULL if another class is tested
+*/
+dtBufferStream* GetStreamBuffer(Param* pParams, dtBuffer& buffer)
+{
+    if (pParams->pBufferClass && !strcmp(pParams->pBufferClass, "dtBufferStream"))
+        return static_cast<dtBufferStream*>(&buffer);
+
+    printf("skipped, needs dtBufferStream\n");
+    return NULL;
+}
+
+bbERR test5(Param* pParams, dtBuffer& buffer)
+{
+    bbU64 offset;
+    bbU8 c = 'x';
+
+    printf("test5: read-ahead on sequential MapSeq\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        goto test5_err;
+
+    // small cache and adaptive loads, so both walks load from file
+    pStreamBuf->SetPrefetch(dtBUFFERSTREAM_PREFETCH);
+    pStreamBuf->SetSegmentSize(0);
+    pStreamBuf->SetCacheLimit(0x100000);
+
+    if (buffer.Open(spScratch) != bbEOK)
+        goto test5_err;
+
+    printf("Forward...\n");
+    if (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK)
+        goto test5_err;
+
+    printf("Backward...\n");
+    for (offset = SCRATCHSIZE; offset; offset -= dtBUFFERSTREAM_SEGMENTSIZE_MIN)
+    {
+        if (CheckPattern(buffer, offset - dtBUFFERSTREAM_SEGMENTSIZE_MIN, 1, offset - dtBUFFERSTREAM_SEGMENTSIZE_MIN) != bbEOK)
+            goto test5_err;
+    }
+
+    for (offset = 0; offset < SCRATCHSIZE; offset += 0x100001)
+    {
+        if (buffer.Write(offset, &c, 1, 1, NULL) != bbEOK)
+            goto test5_err;
+    }
+
+    if ((buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test5_err;
+
+    #ifdef bbDEBUG
+    pStreamBuf->DebugCheck();
+    #endif
+
+    buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    pStreamBuf->SetCacheLimit(dtBUFFERSTREAM_CACHELIMIT);
+    pStreamBuf->SetPrefetch(dtBUFFERSTREAM_PREFETCH);
+    return bbEOK;
+
+    test5_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    pStreamBuf->SetCacheLimit(dtBUFFERSTREAM_CACHELIMIT);
+    pStreamBuf->SetPrefetch(dtBUFFERSTREAM_PREFETCH);
+    return bbELAST;
+}
+
+bbERR test6(Param* pParams, dtBuffer& buffer)
+{
+    printf("test6: batched I/O on save\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        goto test6_err;
+
+    // swap out changed segments, so that the save reads the temp file
+    pStreamBuf->SetDirtyLimit(0x100000);
+    pStreamBuf->SetSaveThreads(1);
+
+    for (int async=1; async>=0; async--)
+    {
+        printf("Async I/O %d...\n", async);
+        pStreamBuf->SetAsyncIO(async);
+
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (EditScratch(buffer) != bbEOK) ||
+            (buffer.Save(spScratch2) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK))
+            goto test6_err;
+
+        buffer.Close();
+    }
+
+    pStreamBuf->SetAsyncIO(1);
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbEOK;
+
+    test6_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetAsyncIO(1);
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbELAST;
+}
+
+bbERR test7(Param* pParams, dtBuffer& buffer)
+{
+    printf("test7: direct I/O\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        goto test7_err;
+
+    pStreamBuf->SetDirectIO(1);
+
+    // unaligned load offsets and sizes go through bounce buffers
+    if ((buffer.Open(spScratch) != bbEOK) ||
+        (CheckPattern(buffer, 12345, 0x234567, 12345) != bbEOK) ||
+        (EditScratch(buffer) != bbEOK) ||
+        (buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test7_err;
+
+    buffer.Close();
+
+    if ((buffer.Open(spScratch2) != bbEOK) ||
+        (EditScratch(buffer) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test7_err;
+
+    buffer.Close();
+    pStreamBuf->SetDirectIO(0);
+    return bbEOK;
+
+    test7_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetDirectIO(0);
+    return bbELAST;
+}
+
+bbERR test8(Param* pParams, dtBuffer& buffer)
+{
+    bbU8 c = 'x';
+
+    printf("test8: kernel copy of unchanged data on save\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        goto test8_err;
+
+    for (bbUINT threads=1; threads<=dtBUFFERSTREAM_SAVETHREADS; threads+=dtBUFFERSTREAM_SAVETHREADS-1)
+    {
+        printf("Save threads %u...\n", threads);
+        pStreamBuf->SetSaveThreads(threads);
+
+        // unchanged data shifted by 1 byte, not block aligned in the saved file
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (buffer.Write(0, &c, 1, 0, NULL) != bbEOK) ||
+            (buffer.Save(spScratch2) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK) ||
+            (CheckPattern(buffer, 1, SCRATCHSIZE, 0) != bbEOK))
+            goto test8_err;
+
+        buffer.Close();
+
+        // unchanged data shifted by 1 page, may be reflinked
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (buffer.Delete(0, 0x1000, NULL) != bbEOK) ||
+            (buffer.Save(spScratch2) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK) ||
+            (CheckPattern(buffer, 0, SCRATCHSIZE - 0x1000, 0x1000) != bbEOK))
+            goto test8_err;
+
+        buffer.Close();
+    }
+
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    return bbEOK;
+
+    test8_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    return bbELAST;
+}
+
+bbERR test9(Param* pParams, dtBuffer& buffer)
+{
+    bbU8 data[7] = { 1, 2, 3, 4, 5, 6, 7 };
+    bbU64 offset;
+
+    printf("test9: in-place patch save\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if ((CreateScratch(spScratch2, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch2) != bbEOK))
+        goto test9_err;
+
+    // overwrites only, in loaded segments, swapped out segments and patches
+    pStreamBuf->SetDirtyLimit(0x100000);
+
+    for (bbUINT patchsave=1; patchsave<=2; patchsave++)
+    {
+        printf("Patch save %u...\n", patchsave & 1);
+        pStreamBuf->SetPatchSave(patchsave & 1);
+
+        for (offset = 0; offset < 0x300000; offset += 0x1000)
+        {
+            if (buffer.Write(offset, data, sizeof(data), 1, NULL) != bbEOK)
+                goto test9_err;
+        }
+
+        for (offset = 0x400000; offset < SCRATCHSIZE; offset += 0x12345)
+        {
+            if (buffer.Write(offset, data, 1, 1, NULL) != bbEOK)
+                goto test9_err;
+        }
+
+        data[0]++;
+
+        if ((buffer.Save(NULL) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK))
+            goto test9_err;
+    }
+
+    // size change, saved via temp file
+    if ((buffer.Write(10, data, sizeof(data), 0, NULL) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test9_err;
+
+    buffer.Close();
+    pStreamBuf->SetPatchSave(1);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbEOK;
+
+    test9_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetPatchSave(1);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbELAST;
+}
+
+bbERR test10(Param* pParams, dtBuffer& buffer)
+{
+    printf("test10: parallel save\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        goto test10_err;
+
+    // mix of loaded, swapped out and unloaded segments
+    pStreamBuf->SetDirtyLimit(0x100000);
+
+    for (bbUINT threads=2; threads<=dtBUFFERSTREAM_MAXSAVETHREADS; threads<<=1)
+    {
+        printf("Save threads %u...\n", threads);
+        pStreamBuf->SetSaveThreads(threads);
+
+        // data after the deletion of EditScratch() moves by 0x123456 - 100 bytes
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (CheckPattern(buffer, 0x600000, 0x100000, 0x600000) != bbEOK) ||
+            (EditScratch(buffer) != bbEOK) ||
+            (CheckPattern(buffer, 0x500000, 0x100000, 0x500000 + 0x123456 - 100) != bbEOK) ||
+            (buffer.Save(spScratch2) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK))
+            goto test10_err;
+
+        buffer.Close();
+    }
+
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbEOK;
+
+    test10_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSaveThreads(dtBUFFERSTREAM_SAVETHREADS);
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbELAST;
+}
+
+/** Notification handler recording save progress. */
+struct SaveNotify : public dtBufferNotify
+{
+    bbU64  mWritten;    //!< Number of bytes written at last call
+    bbU64  mTotal;      //!< Number of bytes to write at last call
+    bbUINT mCalls;      //!< Number of calls
+    int    mCancel;     //!< !=0 to cancel the save on first call
+
+    SaveNotify()
+    {
+        mWritten = mTotal = 0;
+        mCalls = 0;
+        mCancel = 0;
+    }
+
+    virtual void OnBufferSaveProgress(dtBuffer* const pBuf, bbU64 const written, bbU64 const total)
+    {
+        mWritten = written;
+        mTotal = total;
+        if ((mCalls++ == 0) && mCancel)
+            pBuf->SaveCancel();
+    }
+};
+
+bbERR test11(Param* pParams, dtBuffer& buffer)
+{
+    SaveNotify notify;
+    bbFILESTAT stat;
+    bbU8 c = 'x';
+
+    // larger than one progress step, so that a save can be cancelled
+    bbU64 const size = dtBUFFER_SAVEPROGRESSSTEP * 2 + 12345;
+
+    printf("test11: background save, progress and cancellation\n");
+
+    if ((CreateScratch(spScratch, size) != bbEOK) ||
+        (buffer.AddNotifyHandler(&notify) != bbEOK))
+        return bbELAST;
+
+    if ((buffer.Open(spScratch) != bbEOK) ||
+        (buffer.Write(0, &c, 1, 0, NULL) != bbEOK))
+        goto test11_err;
+
+    printf("Background save...\n");
+    if ((buffer.SaveBackground(spScratch2) != bbEOK) ||
+        (buffer.SaveWait() != bbEOK))
+        goto test11_err;
+
+    if ((notify.mCalls < 2) || (notify.mWritten != size + 1) || (notify.mTotal != size + 1))
+    {
+        printf("Unexpected progress, %u calls, %" bbI64 "u of %" bbI64 "u bytes\n", notify.mCalls, notify.mWritten, notify.mTotal);
+        bbErrSet(bbEUK);
+        goto test11_err;
+    }
+
+    if (CompareFile(buffer, spScratch2) != bbEOK)
+        goto test11_err;
+
+    // cancelled saves leave no file behind, and keep the buffer contents
+    for (int background=0; background<2; background++)
+    {
+        printf("Cancelled save, background %d...\n", background);
+        notify.mCalls = 0;
+        notify.mCancel = 1;
+
+        bbERR const err = background ? ((buffer.SaveBackground(spScratch3) == bbEOK) ? buffer.SaveWait() : bbELAST)
+                                     : buffer.Save(spScratch3);
+
+        if ((err == bbEOK) || (bbErrGet() != dtECANCELLED) ||
+            (bbFileStat(spScratch3, &stat) == bbEOK))
+        {
+            printf("Save was not cancelled cleanly\n");
+            bbErrSet(bbEUK);
+            goto test11_err;
+        }
+
+        if ((bbStrCmp(buffer.GetName(), spScratch2) != 0) ||
+            (CheckPattern(buffer, 1, size, 0) != bbEOK))
+            goto test11_err;
+    }
+
+    buffer.Close();
+    buffer.RemoveNotifyHandler(&notify);
+    return bbEOK;
+
+    test11_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    buffer.RemoveNotifyHandler(&notify);
+    return bbELAST;
+}
+
+bbERR test12(Param* pParams, dtBuffer& buffer)
+{
+    printf("test12: segment cache kept across save\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // loaded, changed and swapped out segments are rebased onto the saved file
+    pStreamBuf->SetDirtyLimit(0x100000);
+
+    if ((CreateScratch(spScratch2, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch2) != bbEOK) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+        goto test12_err;
+
+    for (int i=0; i<3; i++)
+    {
+        printf("Save %d...\n", i);
+
+        buffer.SetUndo();
+        if ((EditScratch(buffer) != bbEOK) ||
+            (buffer.Save(NULL) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK))
+            goto test12_err;
+
+        #ifdef bbDEBUG
+        pStreamBuf->DebugCheck();
+        #endif
+    }
+
+    // undo beyond the saves restores the original data
+    while (buffer.CanUndo())
+    {
+        if (buffer.Undo(NULL) != bbEOK)
+            goto test12_err;
+    }
+
+    if ((buffer.GetSize() != SCRATCHSIZE) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test12_err;
+
+    buffer.Close();
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbEOK;
+
+    test12_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetDirtyLimit(dtBUFFERSTREAM_DIRTYLIMIT);
+    return bbELAST;
+}
+
+bbERR test13(Param* pParams, dtBuffer& buffer)
+{
+    dtSection* pSection[2] = { NULL, NULL };
+    bbU64 offset;
+    bbU32 merged;
+    bbU8 c = 'x';
+
+    printf("test13: compaction with mapped sections\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // load file in small unchanged segments
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE_MIN);
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch) != bbEOK) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+        goto test13_err;
+
+    // segments referenced by sections must not be merged
+    if (!(pSection[0] = buffer.MapSeq(0x100000, 0, dtMAP_READONLY)) ||
+        !(pSection[1] = buffer.MapSeq(0x100000 + dtBUFFERSTREAM_SEGMENTSIZE_MIN, 0, dtMAP_READONLY)))
+        goto test13_err;
+
+    merged = pStreamBuf->Compact(0x10000);
+    printf("Merged %u segments\n", merged);
+
+    for (int i=0; i<2; i++)
+    {
+        for (bbU32 j=0; j<pSection[i]->mSize; j++)
+        {
+            if (pSection[i]->mpData[j] != Pattern(0x100000 + i * dtBUFFERSTREAM_SEGMENTSIZE_MIN + j))
+            {
+                printf("Mapped section %d changed by compaction\n", i);
+                bbErrSet(bbEUK);
+                goto test13_err;
+            }
+        }
+        buffer.Discard(pSection[i]);
+        pSection[i] = NULL;
+    }
+
+    if (!merged || (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+        goto test13_err;
+
+    #ifdef bbDEBUG
+    pStreamBuf->DebugCheck();
+    #endif
+
+    // inserts split segments without gap, compaction merges changed segments
+    pStreamBuf->SetGapSize(0);
+
+    for (offset = 1; offset < SCRATCHSIZE; offset += 0x1001)
+    {
+        if (buffer.Write(offset, &c, 1, 0, NULL) != bbEOK)
+            goto test13_err;
+    }
+
+    printf("Merged %u segments\n", pStreamBuf->Compact(0x10000));
+
+    if ((buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test13_err;
+
+    buffer.Close();
+    pStreamBuf->SetGapSize(dtBUFFERSTREAM_GAPSIZE);
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbEOK;
+
+    test13_err:
+    buffer.Discard(pSection[1]);
+    buffer.Discard(pSection[0]);
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetGapSize(dtBUFFERSTREAM_GAPSIZE);
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbELAST;
+}
+
+bbERR test14(Param* pParams, dtBuffer& buffer)
+{
+    dtSection* pSection = NULL;
+    bbU64 const pos = 0x200123;     // typing position within a loaded segment
+    bbU64 const other = 0x400000;   // second typing position
+    bbU32 i, segments;
+    bbU8 c;
+
+    printf("test14: gap runs\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch) != bbEOK) ||
+        (CheckPattern(buffer, 0x200000, 0x80000, 0x200000) != bbEOK))
+        goto test14_err;
+
+    segments = pStreamBuf->GetSegmentCount();
+
+    // type 5000 characters, backspace 1000, delete 500 file bytes forward
+    for (i=0; i<5000; i++)
+    {
+        c = (bbU8)('a' + i % 26);
+        if (buffer.Write(pos + i, &c, 1, 0, NULL) != bbEOK)
+            goto test14_err;
+    }
+
+    for (i=0; i<1000; i++)
+    {
+        if (buffer.Delete(pos + 4999 - i, 1, NULL) != bbEOK)
+            goto test14_err;
+    }
+
+    for (i=0; i<500; i++)
+    {
+        if (buffer.Delete(pos + 4000, 1, NULL) != bbEOK)
+            goto test14_err;
+    }
+
+    // typing runs through the gap instead of splitting a segment per byte
+    printf("Segments %u before typing, %u after\n", segments, pStreamBuf->GetSegmentCount());
+    if (pStreamBuf->GetSegmentCount() > segments + 4)
+    {
+        bbErrSet(bbEUK);
+        goto test14_err;
+    }
+
+    // type elsewhere, then map across the left behind gap
+    c = 'X';
+    for (i=0; i<100; i++)
+    {
+        if (buffer.Write(other + i, &c, 1, 0, NULL) != bbEOK)
+            goto test14_err;
+    }
+
+    printf("Segments %u after typing elsewhere\n", pStreamBuf->GetSegmentCount());
+    if (pStreamBuf->GetSegmentCount() > segments + 8)
+    {
+        bbErrSet(bbEUK);
+        goto test14_err;
+    }
+
+    if (!(pSection = buffer.Map(pos, 4000, dtMAP_READONLY)))
+        goto test14_err;
+
+    for (i=0; i<4000; i++)
+    {
+        if (pSection->mpData[i] != (bbU8)('a' + i % 26))
+        {
+            printf("Typed data mismatch at offset %" bbI64 "u\n", pos + i);
+            bbErrSet(bbEUK);
+            goto test14_err;
+        }
+    }
+
+    buffer.Discard(pSection);
+    pSection = NULL;
+
+    if ((CheckPattern(buffer, 0, pos, 0) != bbEOK) ||
+        (CheckPattern(buffer, pos + 4000, other - pos - 4000, pos + 500) != bbEOK) ||
+        (CheckPattern(buffer, other + 100, buffer.GetSize() - other - 100, other - 3500) != bbEOK))
+        goto test14_err;
+
+    if ((buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test14_err;
+
+    while (buffer.CanUndo())
+    {
+        if (buffer.Undo(NULL) != bbEOK)
+            goto test14_err;
+    }
+
+    if ((buffer.GetSize() != SCRATCHSIZE) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+        goto test14_err;
+
+    buffer.Close();
+    return bbEOK;
+
+    test14_err:
+    buffer.Discard(pSection);
+    if (buffer.IsOpen())
+        buffer.Close();
+    return bbELAST;
+}
+
+bbERR test15(Param* pParams, dtBuffer& buffer)
+{
+    bbU8 data[301];
+    bbU64 offset;
+    bbU32 size;
+
+    printf("test15: segment capacity growth and shrink\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // appends enlarge the last segment, no gap
+    pStreamBuf->SetGapSize(0);
+
+    if (buffer.Open(NULL) != bbEOK)
+        goto test15_err;
+
+    for (int round=0; round<2; round++)
+    {
+        printf("Grow...\n");
+        for (size=1; buffer.GetSize() < dtBUFFERSTREAM_SEGMENTSIZE * 3 / 2; size = size % sizeof(data) + 1)
+        {
+            offset = buffer.GetSize();
+            for (bbU32 i=0; i<size; i++)
+                data[i] = Pattern(offset + i);
+
+            if (buffer.Write(offset, data, size, 0, NULL) != bbEOK)
+                goto test15_err;
+        }
+
+        if (CheckPattern(buffer, 0, buffer.GetSize(), 0) != bbEOK)
+            goto test15_err;
+
+        printf("Shrink...\n");
+        for (size=1; buffer.GetSize() > 1000; size = size % 4096 + 1)
+        {
+            if (buffer.Delete(buffer.GetSize() - size, size, NULL) != bbEOK)
+                goto test15_err;
+        }
+
+        if (CheckPattern(buffer, 0, buffer.GetSize(), 0) != bbEOK)
+            goto test15_err;
+
+        #ifdef bbDEBUG
+        pStreamBuf->DebugCheck();
+        #endif
+    }
+
+    if ((buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test15_err;
+
+    buffer.Close();
+    pStreamBuf->SetGapSize(dtBUFFERSTREAM_GAPSIZE);
+    return bbEOK;
+
+    test15_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetGapSize(dtBUFFERSTREAM_GAPSIZE);
+    return bbELAST;
+}
+
+/** Test arena blocks of all size classes and large blocks.
+    Blocks are allocated, partly freed, resized and checked, then released at once.
+*/
+bbERR TestArena(dtArena& arena)
+{
+    void* pBlocks[64];
+    bbU32 sizes[64];
+    bbUINT i;
+
+    for (i=0; i<64; i++)
+    {
+        sizes[i] = ((bbU32)dtARENA_SLABMIN << (i % 16)) + i * 7;
+        if (!(pBlocks[i] = arena.Alloc(sizes[i])))
+            return bbELAST;
+        memset(pBlocks[i], (int)i, sizes[i]);
+    }
+
+    for (i=1; i<64; i+=2)
+    {
+        arena.Free(pBlocks[i]);
+        pBlocks[i] = NULL;
+    }
+
+    // grow, then shrink, the first bytes must be kept
+    for (i=0; i<64; i+=2)
+    {
+        if (arena.Realloc(sizes[i] * 3 / 2 + 1, &pBlocks[i]) != bbEOK)
+            return bbELAST;
+        memset((bbU8*)pBlocks[i] + sizes[i], (int)i, sizes[i] / 2 + 1);
+
+        sizes[i] = sizes[i] / 3 + 1;
+        if (arena.Realloc(sizes[i], &pBlocks[i]) != bbEOK)
+            return bbELAST;
+    }
+
+    for (i=0; i<64; i+=2)
+    {
+        for (bbU32 j=0; j<sizes[i]; j++)
+        {
+            if (((bbU8*)pBlocks[i])[j] != (bbU8)i)
+            {
+                printf("Arena block %u corrupted\n", i);
+                return bbErrSet(bbEUK);
+            }
+        }
+    }
+
+    if (!arena.Release())
+    {
+        printf("Arena release failed\n");
+        return bbErrSet(bbEUK);
+    }
+
+    return bbEOK;
+}
+
+bbERR test16(Param* pParams, dtBuffer& buffer)
+{
+    dtArena arena;
+
+    printf("test16: arena allocator\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // released arena is reused
+    for (int i=0; i<2; i++)
+    {
+        if (TestArena(arena) != bbEOK)
+            goto test16_err;
+    }
+
+    // buffer releases the arena on close
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (pStreamBuf->SetAllocator(&arena) != bbEOK))
+        goto test16_err;
+
+    for (int i=0; i<2; i++)
+    {
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (EditScratch(buffer) != bbEOK) ||
+            (CheckPattern(buffer, 0x500000, 0x100000, 0x500000 + 0x123456 - 100) != bbEOK) ||
+            (buffer.Save(spScratch2) != bbEOK) ||
+            (CompareFile(buffer, spScratch2) != bbEOK))
+            goto test16_err;
+
+        buffer.Close();
+    }
+
+    pStreamBuf->SetAllocator(NULL);
+    return bbEOK;
+
+    test16_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetAllocator(NULL);
+    return bbELAST;
+}
+
+bbERR test17(Param* pParams, dtBuffer& buffer)
+{
+    dtArena arena;
+    void* pBlock;
+
+    printf("test17: huge page arena\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    arena.SetHugePages(1);
+
+    if (TestArena(arena) != bbEOK)
+        goto test17_err;
+
+    // alignment is best effort, the heap is used if mapping fails
+    if (!(pBlock = arena.Alloc(dtBUFFERSTREAM_SEGMENTSIZE)))
+        goto test17_err;
+    printf("Segment block aligned: %d\n", ((bbUPTR)pBlock & (dtBUFFERSTREAM_SEGMENTSIZE - 1)) == 0);
+    arena.Free(pBlock);
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (pStreamBuf->SetAllocator(&arena) != bbEOK))
+        goto test17_err;
+
+    if ((buffer.Open(spScratch) != bbEOK) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK) ||
+        (EditScratch(buffer) != bbEOK) ||
+        (buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test17_err;
+
+    buffer.Close();
+    pStreamBuf->SetAllocator(NULL);
+    return bbEOK;
+
+    test17_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetAllocator(NULL);
+    return bbELAST;
+}
+
+/** Walk buffer range with MapVec().
+    @param buffer Buffer
+    @param offset Buffer offset, equal to offset in scratch file
+    @param size Number of bytes
+    @param accesshint dtMAP_READONLY to check for Pattern() XOR \a value,
+                      dtMAP_WRITE or dtMAP_WRITEDIFF to XOR all bytes with \a value
+    @param value XOR value
+*/
+bbERR WalkVec(dtBuffer& buffer, bbU64 offset, bbU64 const size, dtMAP const accesshint, bbU8 const value)
+{
+    dtSection* pSections[8];
+    bbUINT count;
+    bbU64 const end = offset + size;
+
+    while (offset < end)
+    {
+        if (buffer.MapVec(offset, end - offset, accesshint, pSections, 8, &count) != bbEOK)
+            return bbELAST;
+
+        for (bbUINT i=0; i<count; i++)
+        {
+            for (bbU32 j=0; j<pSections[i]->mSize; j++)
+            {
+                if (accesshint != dtMAP_READONLY)
+                {
+                    pSections[i]->mpData[j] ^= value;
+                }
+                else if (pSections[i]->mpData[j] != (bbU8)(Pattern(offset + j) ^ value))
+                {
+                    printf("MapVec mismatch at offset %" bbI64 "u\n", offset + j);
+                    buffer.DiscardVec(pSections, count);
+                    return bbErrSet(bbEUK);
+                }
+            }
+            offset += pSections[i]->mSize;
+        }
+
+        if (accesshint == dtMAP_READONLY)
+            buffer.DiscardVec(pSections, count);
+        else if (buffer.CommitVec(pSections, count, NULL) != bbEOK)
+            return bbELAST;
+    }
+
+    return bbEOK;
+}
+
+bbERR test18(Param* pParams, dtBuffer& buffer)
+{
+    dtSection* pSections[8];
+    bbUINT count;
+
+    bbU64 const offset = 0x100005;
+    bbU64 const size = 0x123456;
+
+    printf("test18: vectored map\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // small segments, so that ranges span more sections than fit the vector
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE_MIN);
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch) != bbEOK) ||
+        (WalkVec(buffer, offset, size, dtMAP_READONLY, 0) != bbEOK))
+        goto test18_err;
+
+    buffer.SetUndo();
+    if ((WalkVec(buffer, offset, size, dtMAP_WRITE, 0xFF) != bbEOK) ||
+        (WalkVec(buffer, offset, size, dtMAP_READONLY, 0xFF) != bbEOK) ||
+        (CheckPattern(buffer, 0, offset, 0) != bbEOK) ||
+        (CheckPattern(buffer, offset + size, SCRATCHSIZE - offset - size, offset + size) != bbEOK))
+        goto test18_err;
+
+    // discarded writable sections leave no undo record behind
+    buffer.SetUndo();
+    if (buffer.MapVec(offset, size, dtMAP_WRITE, pSections, 8, &count) != bbEOK)
+        goto test18_err;
+    buffer.DiscardVec(pSections, count);
+
+    if ((buffer.Undo(NULL) != bbEOK) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK) ||
+        (buffer.Redo(NULL) != bbEOK) ||
+        (buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test18_err;
+
+    buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbEOK;
+
+    test18_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbELAST;
+}
+
+bbERR test19(Param* pParams, dtBuffer& buffer)
+{
+    dtSection* pSections[40];
+    bbUINT i, count = 0;
+
+    printf("test19: more concurrent sections than dtBUFFER_MAXSECTIONS\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // small segments, so that Map() calls cross segment boundaries and need pages
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE_MIN);
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch) != bbEOK))
+        goto test19_err;
+
+    for (bbUINT round = 0; round < 3; round++)
+    {
+        for (count = 0; count < 40; count++)
+        {
+            bbU64 const offset = (bbU64)count * 0x31000 + round * 0x1234;
+
+            pSections[count] = (count & 1) ? buffer.MapSeq(offset, 1, dtMAP_READONLY)
+                                           : buffer.Map(offset + dtBUFFERSTREAM_SEGMENTSIZE_MIN - 0x100, 0x5000, dtMAP_READONLY);
+            if (!pSections[count])
+                goto test19_err;
+        }
+
+        // earlier sections must stay valid while the pool grows
+        for (i = 0; i < count; i++)
+        {
+            for (bbU32 j = 0; j < pSections[i]->mSize; j++)
+            {
+                if (pSections[i]->mpData[j] != Pattern(pSections[i]->mOffset + j))
+                {
+                    printf("section %u mismatch at offset %" bbI64 "u\n", i, pSections[i]->mOffset + j);
+                    bbErrSet(bbEUK);
+                    goto test19_err;
+                }
+            }
+        }
+
+        for (i = 0; i < count; i++)
+            buffer.Discard(pSections[(i * 7) % count]);
+        count = 0;
+    }
+
+    buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbEOK;
+
+    test19_err:
+    for (i = 0; i < count; i++)
+        buffer.Discard(pSections[i]);
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbELAST;
+}
+
+bbERR test20(Param* pParams, dtBuffer& buffer)
+{
+    dtBufferMmap mmapbuf;
+    dtSection* pSection;
+
+    printf("test20: memory-mapped buffer\n");
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        return bbELAST;
+
+    for (int windowed = 0; windowed < 2; windowed++)
+    {
+        mmapbuf.SetMapBudget(windowed ? 0 : dtBUFFERMMAP_BUDGET);
+
+        if (mmapbuf.Open(spScratch) != bbEOK)
+            goto test20_err;
+
+        printf("Mapped all: %d\n", mmapbuf.IsMappedAll());
+        if (windowed && mmapbuf.IsMappedAll())
+        {
+            bbErrSet(bbEUK);
+            goto test20_err;
+        }
+
+        if ((CheckPattern(mmapbuf, 0, SCRATCHSIZE, 0) != bbEOK) ||
+            (CheckPattern(mmapbuf, SCRATCHSIZE - 0x12345, 0x12345, SCRATCHSIZE - 0x12345) != bbEOK))
+            goto test20_err;
+
+        if ((pSection = mmapbuf.Map(0x123457, 0x200000, dtMAP_READONLY)) == NULL)
+            goto test20_err;
+        for (bbU32 i=0; i<pSection->mSize; i++)
+        {
+            if (pSection->mpData[i] != Pattern(0x123457 + i))
+            {
+                printf("Pattern mismatch at offset %" bbI64 "u\n", (bbU64)0x123457 + i);
+                mmapbuf.Discard(pSection);
+                bbErrSet(bbEUK);
+                goto test20_err;
+            }
+        }
+        mmapbuf.Discard(pSection);
+
+        // buffer is read-only
+        if ((pSection = mmapbuf.MapSeq(0, 1, dtMAP_WRITE)) != NULL)
+        {
+            mmapbuf.Discard(pSection);
+            printf("MapSeq(dtMAP_WRITE) succeeded on read-only buffer\n");
+            bbErrSet(bbEUK);
+            goto test20_err;
+        }
+        if ((bbErrGet() != bbENOTSUP) ||
+            (mmapbuf.Delete(0, 1, NULL) == bbEOK) || (bbErrGet() != bbENOTSUP) ||
+            (mmapbuf.Insert(0, 1) != NULL) || (bbErrGet() != bbENOTSUP))
+        {
+            printf("Change of read-only buffer not rejected\n");
+            bbErrSet(bbEUK);
+            goto test20_err;
+        }
+
+        if ((mmapbuf.Save(spScratch2) != bbEOK) ||
+            (CompareFile(mmapbuf, spScratch2) != bbEOK))
+            goto test20_err;
+
+        mmapbuf.Close();
+    }
+
+    return bbEOK;
+
+    test20_err:
+    if (mmapbuf.IsOpen())
+        mmapbuf.Close();
+    return bbELAST;
+}
+
+/** Check buffer contents after the deletes done by test21().
+    @param buffer Buffer
+    @param count Number of deletes applied, 0 to 2
+*/
+bbERR CheckDeletes(dtBuffer& buffer, bbUINT const count)
+{
+    switch (count)
+    {
+    case 0:
+        if ((buffer.GetSize() != SCRATCHSIZE) ||
+            (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+            break;
+        return bbEOK;
+    case 1:
+        if ((buffer.GetSize() != SCRATCHSIZE - 0x400000) ||
+            (CheckPattern(buffer, 0, 0x100000, 0) != bbEOK) ||
+            (CheckPattern(buffer, 0x100000, SCRATCHSIZE - 0x500000, 0x500000) != bbEOK))
+            break;
+        return bbEOK;
+    default:
+        if ((buffer.GetSize() != SCRATCHSIZE - 0x440000) ||
+            (CheckPattern(buffer, 0, 0x80000, 0) != bbEOK) ||
+            (CheckPattern(buffer, 0x80000, 0x40000, 0xC0000) != bbEOK) ||
+            (CheckPattern(buffer, 0xC0000, SCRATCHSIZE - 0x500000, 0x500000) != bbEOK))
+            break;
+        return bbEOK;
+    }
+
+    printf("Buffer mismatch after %u deletes\n", count);
+    return bbErrSet(bbEUK);
+}
+
+bbERR test21(Param* pParams, dtBuffer& buffer)
+{
+    printf("test21: undo deletes of unloaded data across saves\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    // small segments, so that deleted data is mostly not loaded
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE_MIN);
+
+    if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+        (buffer.Open(spScratch) != bbEOK))
+        goto test21_err;
+
+    buffer.SetUndo();
+    if ((buffer.Delete(0x100000, 0x400000, NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 1) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 1) != bbEOK))
+        goto test21_err;
+
+    buffer.SetUndo();
+    if ((buffer.Delete(0x80000, 0x40000, NULL) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 2) != bbEOK))
+        goto test21_err;
+
+    // deleted data refers to file contents overwritten by the saves
+    if ((buffer.Undo(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 1) != bbEOK) ||
+        (buffer.Undo(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 0) != bbEOK) ||
+        (buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 0) != bbEOK))
+        goto test21_err;
+
+    if ((buffer.Redo(NULL) != bbEOK) ||
+        (buffer.Redo(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 2) != bbEOK) ||
+        (buffer.Save(NULL) != bbEOK) ||
+        (buffer.Save(spScratch3) != bbEOK) ||
+        (CompareFile(buffer, spScratch3) != bbEOK) ||
+        (buffer.Undo(NULL) != bbEOK) ||
+        (buffer.Undo(NULL) != bbEOK) ||
+        (CheckDeletes(buffer, 0) != bbEOK))
+        goto test21_err;
+
+    buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbEOK;
+
+    test21_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetSegmentSize(dtBUFFERSTREAM_SEGMENTSIZE);
+    return bbELAST;
+}
+
+/** Notification handler summing up overwrite notifications. */
+struct ChangeNotify : public dtBufferNotify
+{
+    bbU64  mOverwritten;    //!< Number of bytes reported overwritten, excluding undo and redo
+    bbUINT mCalls;          //!< Number of overwrite notifications, excluding undo and redo
+
+    ChangeNotify()
+    {
+        mOverwritten = 0;
+        mCalls = 0;
+    }
+
+    virtual void OnBufferChange(dtBuffer* const pBuf, dtBufferChange* const pChange)
+    {
+        if ((pChange->type == dtCHANGE_OVERWRITE) && !pChange->undo)
+        {
+            mOverwritten += pChange->length;
+            mCalls++;
+        }
+    }
+};
+
+bbERR test22(Param* pParams, dtBuffer& buffer)
+{
+    ChangeNotify notify;
+    dtSection* pSection;
+    bbU32 size;
+    bbU8 data[2];
+
+    printf("test22: write-mapping with diff undo capture\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        return bbELAST;
+
+    // once on loaded segments, once on the patch overlay
+    for (bbUINT patch = 0; patch < 2; patch++)
+    {
+        pStreamBuf->SetPatchLimit(patch ? dtBUFFERSTREAM_PATCHLIMIT : 0);
+
+        if ((buffer.Open(spScratch) != bbEOK) ||
+            (buffer.AddNotifyHandler(&notify) != bbEOK))
+            goto test22_err;
+
+        // dtMAP_WRITEDIFF records the 3 changed ranges only
+        notify.mOverwritten = 0;
+        notify.mCalls = 0;
+        buffer.SetUndo();
+        if ((pSection = buffer.MapSeq(0x200000, 64, dtMAP_WRITEDIFF)) == NULL)
+            goto test22_err;
+        size = pSection->mSize;
+        pSection->mpData[10] ^= 0xFF;
+        pSection->mpData[11] ^= 0xFF;
+        pSection->mpData[size / 2] ^= 0xFF;
+        pSection->mpData[size - 1] ^= 0xFF;
+        if (buffer.Commit(pSection, NULL) != bbEOK)
+            goto test22_err;
+
+        printf("Section size %u, recorded %" bbI64 "u bytes in %u ranges\n", size, notify.mOverwritten, notify.mCalls);
+        if ((notify.mCalls != 3) || (notify.mOverwritten != 4))
+        {
+            bbErrSet(bbEUK);
+            goto test22_err;
+        }
+
+        // dtMAP_WRITE records the whole section
+        notify.mOverwritten = 0;
+        notify.mCalls = 0;
+        buffer.SetUndo();
+        if ((pSection = buffer.MapSeq(0x400000, 64, dtMAP_WRITE)) == NULL)
+            goto test22_err;
+        size = pSection->mSize;
+        pSection->mpData[10] ^= 0xFF;
+        if (buffer.Commit(pSection, NULL) != bbEOK)
+            goto test22_err;
+
+        if (notify.mOverwritten != size)
+        {
+            printf("Recorded %" bbI64 "u bytes for section size %u\n", notify.mOverwritten, size);
+            bbErrSet(bbEUK);
+            goto test22_err;
+        }
+
+        if ((buffer.Read(data, 0x20000A, 1) != 0) ||
+            (buffer.Read(data + 1, 0x40000A, 1) != 0))
+            goto test22_err;
+
+        if ((data[0] != (bbU8)(Pattern(0x20000A) ^ 0xFF)) ||
+            (data[1] != (bbU8)(Pattern(0x40000A) ^ 0xFF)))
+        {
+            printf("Committed data mismatch\n");
+            bbErrSet(bbEUK);
+            goto test22_err;
+        }
+
+        if ((buffer.Undo(NULL) != bbEOK) ||
+            (buffer.Undo(NULL) != bbEOK) ||
+            (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+            goto test22_err;
+
+        buffer.RemoveNotifyHandler(&notify);
+        buffer.Close();
+    }
+
+    pStreamBuf->SetPatchLimit(dtBUFFERSTREAM_PATCHLIMIT);
+    return bbEOK;
+
+    test22_err:
+    buffer.RemoveNotifyHandler(&notify);
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetPatchLimit(dtBUFFERSTREAM_PATCHLIMIT);
+    return bbELAST;
+}
+
+#define PATCHCOUNT 64
+#define PATCHSTEP 0x20000UL
+#define PATCHSIZE 5
+
+/** Check buffer contents after the overwrites done by test23().
+    @param buffer Buffer
+    @param patched !=0 if overwrites are applied, 0 if buffer is expected unchanged
+*/
+bbERR CheckPatches(dtBuffer& buffer, int const patched)
+{
+    bbU8 data[PATCHSIZE];
+    bbU64 offset = 0;
+
+    for (bbUINT i=0; i<PATCHCOUNT; i++)
+    {
+        bbU64 const patch = (bbU64)i * PATCHSTEP + 0x777;
+
+        if ((CheckPattern(buffer, offset, patch - offset, offset) != bbEOK) ||
+            (buffer.Read(data, patch, PATCHSIZE) != 0))
+            return bbELAST;
+
+        for (bbUINT j=0; j<PATCHSIZE; j++)
+        {
+            if (data[j] != (bbU8)(Pattern(patch + j) ^ (patched ? 0xFF : 0)))
+            {
+                printf("Patch mismatch at offset %" bbI64 "u\n", patch + j);
+                return bbErrSet(bbEUK);
+            }
+        }
+
+        offset = patch + PATCHSIZE;
+    }
+
+    return CheckPattern(buffer, offset, SCRATCHSIZE - offset, offset);
+}
+
+bbERR test23(Param* pParams, dtBuffer& buffer)
+{
+    bbU8 data[PATCHSIZE];
+
+    printf("test23: patch overlay\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    for (bbUINT limit = 0; limit < 2; limit++)
+    {
+        pStreamBuf->SetPatchLimit(limit ? 0 : dtBUFFERSTREAM_PATCHLIMIT);
+
+        if ((CreateScratch(spScratch, SCRATCHSIZE) != bbEOK) ||
+            (buffer.Open(spScratch) != bbEOK))
+            goto test23_err;
+
+        buffer.SetUndo();
+        for (bbUINT i=0; i<PATCHCOUNT; i++)
+        {
+            bbU64 const patch = (bbU64)i * PATCHSTEP + 0x777;
+
+            for (bbUINT j=0; j<PATCHSIZE; j++)
+                data[j] = Pattern(patch + j) ^ 0xFF;
+
+            if (buffer.Write(patch, data, PATCHSIZE, 1, NULL) != bbEOK)
+                goto test23_err;
+        }
+
+        // scattered overwrites stay in the overlay, unless it is disabled
+        printf("Patch size %" bbI64 "u\n", pStreamBuf->GetPatchSize());
+        if (limit ? (pStreamBuf->GetPatchSize() != 0) : (pStreamBuf->GetPatchSize() < PATCHCOUNT * PATCHSIZE))
+        {
+            bbErrSet(bbEUK);
+            goto test23_err;
+        }
+
+        if ((CheckPatches(buffer, 1) != bbEOK) ||
+            (buffer.Undo(NULL) != bbEOK) ||
+            (CheckPatches(buffer, 0) != bbEOK) ||
+            (buffer.Redo(NULL) != bbEOK) ||
+            (CheckPatches(buffer, 1) != bbEOK))
+            goto test23_err;
+
+        if ((buffer.Save(NULL) != bbEOK) ||
+            (CompareFile(buffer, spScratch) != bbEOK) ||
+            (CheckPatches(buffer, 1) != bbEOK))
+            goto test23_err;
+
+        if (pStreamBuf->GetPatchSize() != 0)
+        {
+            printf("Patch size %" bbI64 "u after save\n", pStreamBuf->GetPatchSize());
+            bbErrSet(bbEUK);
+            goto test23_err;
+        }
+
+        if ((buffer.Undo(NULL) != bbEOK) ||
+            (CheckPatches(buffer, 0) != bbEOK) ||
+            (buffer.Save(NULL) != bbEOK) ||
+            (CompareFile(buffer, spScratch) != bbEOK) ||
+            (buffer.Redo(NULL) != bbEOK) ||
+            (CheckPatches(buffer, 1) != bbEOK))
+            goto test23_err;
+
+        buffer.Close();
+    }
+
+    pStreamBuf->SetPatchLimit(dtBUFFERSTREAM_PATCHLIMIT);
+    return bbEOK;
+
+    test23_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetPatchLimit(dtBUFFERSTREAM_PATCHLIMIT);
+    return bbELAST;
+}
+
+bbERR test24(Param* pParams, dtBuffer& buffer)
+{
+    printf("test24: segments loaded from file mapping\n");
+
+    dtBufferStream* const pStreamBuf = GetStreamBuffer(pParams, buffer);
+    if (!pStreamBuf)
+        return bbEOK;
+
+    if (CreateScratch(spScratch, SCRATCHSIZE) != bbEOK)
+        return bbELAST;
+
+    pStreamBuf->SetFileMapping(1);
+
+    // load all segments from the mapping, so that edits copy mapped segments on write
+    if ((buffer.Open(spScratch) != bbEOK) ||
+        (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK))
+        goto test24_err;
+
+    buffer.SetUndo();
+    if ((EditScratch(buffer) != bbEOK) ||
+        (CheckPattern(buffer, 0, 1000, 0) != bbEOK) ||
+        (CheckPattern(buffer, 0x300000 + 100, 0x100000, 0x300000 + 0x123456) != bbEOK) ||
+        (buffer.Save(spScratch2) != bbEOK) ||
+        (CompareFile(buffer, spScratch2) != bbEOK))
+        goto test24_err;
+
+    while (buffer.CanUndo())
+    {
+        if (buffer.Undo(NULL) != bbEOK)
+            goto test24_err;
+    }
+
+    if (CheckPattern(buffer, 0, SCRATCHSIZE, 0) != bbEOK)
+        goto test24_err;
+
+    buffer.Close();
+    pStreamBuf->SetFileMapping(0);
+    return bbEOK;
+
+    test24_err:
+    if (buffer.IsOpen())
+        buffer.Close();
+    pStreamBuf->SetFileMapping(0);
+    return bbELAST;
+}
+
 bbERR testLog(Param* pParams)
 {
     return bbEOK;
@@ -281,11 +1960,36 @@ int main(int argc, char** argv)
     {
         if ((bbEOK != test1(&params, *pBuffer)) ||
             (bbEOK != test2(&params, *pBuffer)) ||
-            (bbEOK != test3(&params, *pBuffer)))
+            (bbEOK != test3(&params, *pBuffer)) ||
+            (bbEOK != test4(&params, *pBuffer)) ||
+            (bbEOK != test5(&params, *pBuffer)) ||
+            (bbEOK != test6(&params, *pBuffer)) ||
+            (bbEOK != test7(&params, *pBuffer)) ||
+            (bbEOK != test8(&params, *pBuffer)) ||
+            (bbEOK != test9(&params, *pBuffer)) ||
+            (bbEOK != test10(&params, *pBuffer)) ||
+            (bbEOK != test11(&params, *pBuffer)) ||
+            (bbEOK != test12(&params, *pBuffer)) ||
+            (bbEOK != test13(&params, *pBuffer)) ||
+            (bbEOK != test14(&params, *pBuffer)) ||
+            (bbEOK != test15(&params, *pBuffer)) ||
+            (bbEOK != test16(&params, *pBuffer)) ||
+            (bbEOK != test17(&params, *pBuffer)) ||
+            (bbEOK != test18(&params, *pBuffer)) ||
+            (bbEOK != test19(&params, *pBuffer)) ||
+            (bbEOK != test20(&params, *pBuffer)) ||
+            (bbEOK != test21(&params, *pBuffer)) ||
+            (bbEOK != test22(&params, *pBuffer)) ||
+            (bbEOK != test23(&params, *pBuffer)) ||
+            (bbEOK != test24(&params, *pBuffer)))
         {
             err = bbErrGet();
             printf("buffertest failed with code %d\n", err);
         }
+
+        bbFileDelete(spScratch);
+        bbFileDelete(spScratch2);
+        bbFileDelete(spScratch3);
     }
 
     endtime = clock();
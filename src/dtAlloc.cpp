@@ -0,0 +1,499 @@
+#include "dtAlloc.h"
+#include <babel/mem.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/** Round size up to a multiple of dtARENA_HUGEPAGE. */
+static inline bbU64 dtArenaHugeSize(bbU64 const size)
+{
+    return (size + dtARENA_HUGEPAGE - 1) &~ (bbU64)(dtARENA_HUGEPAGE - 1);
+}
+
+/** Get system page size. */
+static bbUPTR dtArenaPageSize()
+{
+#ifndef _WIN32
+    static bbUPTR pagesize = 0;
+    if (!pagesize)
+    {
+        long const size = sysconf(_SC_PAGESIZE);
+        pagesize = (size > 0) ? (bbUPTR)size : 4096;
+    }
+    return pagesize;
+#else
+    return 4096;
+#endif
+}
+
+dtAllocHeap dtAllocHeap::mDefault;
+
+dtAlloc::~dtAlloc()
+{
+}
+
+int dtAlloc::Release()
+{
+    return 0;
+}
+
+void* dtAllocHeap::Alloc(bbU32 const size)
+{
+    return bbMemAlloc(size);
+}
+
+bbERR dtAllocHeap::Realloc(bbU32 const size, void** const ppBlock)
+{
+    return bbMemRealloc(size, ppBlock);
+}
+
+void dtAllocHeap::Free(void* const pBlock)
+{
+    bbMemFree(pBlock);
+}
+
+dtArena::dtArena()
+{
+    for (bbUINT i = 0; i < dtARENA_CLASSES; i++)
+        mpFree[i] = mpSlabPos[i] = mpSlabEnd[i] = mpSpare[i] = NULL;
+    mpLarge = NULL;
+    mpChunks = NULL;
+    mChunkCount = 0;
+    mpChunk = NULL;
+    mChunkRun = 0;
+    mHugePages = 0;
+}
+
+dtArena::~dtArena()
+{
+    Release();
+}
+
+bbUINT dtArena::GetClass(bbU32 const size)
+{
+    if (size <= dtARENA_SLABMIN)
+        return 0;
+    if (size > dtARENA_SLABMAX)
+        return dtARENA_CLASSES;
+
+    // 2^b < size <= 2^(b+1), classes are 1.5*2^b and 2^(b+1)
+    bbUINT b = 6;
+    while ((size - 1) >> (b + 1))
+        b++;
+
+    bbU32 const base = (bbU32)1 << b;
+    return 2 * (b - 6) + ((size <= (base + (base >> 1))) ? 1 : 2);
+}
+
+bbU32 dtArena::GetClassSize(bbUINT const cls)
+{
+    if (cls == 0)
+        return dtARENA_SLABMIN;
+
+    bbUINT const b = 6 + ((cls - 1) >> 1);
+    return (cls & 1) ? (((bbU32)1 << b) + ((bbU32)1 << (b - 1))) : ((bbU32)1 << (b + 1));
+}
+
+bbU8* dtArena::MapHuge(bbU64 const size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    //
+    // Map a region aligned to dtARENA_HUGEPAGE, with one normal page in front for a block header
+    //
+    bbUPTR const pagesize = dtArenaPageSize();
+    size_t const len = (size_t)dtArenaHugeSize(size);
+    size_t const total = len + dtARENA_HUGEPAGE + pagesize;
+
+    bbU8* const pMap = (bbU8*)mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (pMap == (bbU8*)MAP_FAILED)
+        return NULL;
+
+    bbU8* const pRegion = (bbU8*)(((bbUPTR)pMap + pagesize + dtARENA_HUGEPAGE - 1) &~ (bbUPTR)(dtARENA_HUGEPAGE - 1));
+    bbU8* const pStart = pRegion - pagesize;
+
+    if (pStart > pMap)
+        munmap(pMap, pStart - pMap);
+    if ((pRegion + len) < (pMap + total))
+        munmap(pRegion + len, (pMap + total) - (pRegion + len));
+
+    madvise(pRegion, len, MADV_HUGEPAGE); // fails if transparent huge pages are not supported, normal pages are used then
+
+    return pRegion;
+#else
+    return NULL;
+#endif
+}
+
+void dtArena::UnmapHuge(bbU8* const pRegion, bbU64 const size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    bbUPTR const pagesize = dtArenaPageSize();
+    munmap(pRegion - pagesize, (size_t)dtArenaHugeSize(size) + pagesize);
+#endif
+}
+
+bbUINT dtArena::GetClassRuns(bbUINT const cls)
+{
+    // smallest number of runs holding a whole number of blocks, size / gcd(size, dtARENA_RUNSIZE)
+    bbU32 const size = GetClassSize(cls);
+    bbU32 gcd = size & (0 - size);
+    if (gcd > dtARENA_RUNSIZE)
+        gcd = dtARENA_RUNSIZE;
+
+    return size / gcd;
+}
+
+dtArena::dtArenaChunk* dtArena::FindChunk(const bbU8* const pBlock)
+{
+    //
+    // Binary search for last chunk starting at or before pBlock
+    //
+    bbUINT lo = 0, hi = mChunkCount;
+
+    while (lo < hi)
+    {
+        bbUINT const mid = (lo + hi) >> 1;
+
+        if ((bbUPTR)mpChunks[mid].mpBase <= (bbUPTR)pBlock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo && ((bbUPTR)pBlock < ((bbUPTR)mpChunks[lo - 1].mpBase + dtARENA_CHUNKSIZE)))
+        return &mpChunks[lo - 1];
+
+    return NULL; // large block
+}
+
+bbERR dtArena::NewChunk()
+{
+    bbU8* pHeap = NULL;
+    bbU8* pBase = mHugePages ? MapHuge(dtARENA_CHUNKSIZE) : NULL;
+
+    if (!pBase)
+    {
+        // align runs to pages
+        bbUPTR const pagesize = dtArenaPageSize();
+
+        if ((pHeap = (bbU8*)bbMemAlloc(dtARENA_CHUNKSIZE + (bbU32)pagesize)) == NULL)
+            return bbELAST;
+
+        pBase = (bbU8*)(((bbUPTR)pHeap + pagesize - 1) &~ (pagesize - 1));
+    }
+
+    if (bbEOK != bbMemRealloc((mChunkCount + 1) * sizeof(dtArenaChunk), (void**)&mpChunks))
+    {
+        if (pHeap)
+            bbMemFree(pHeap);
+        else
+            UnmapHuge(pBase, dtARENA_CHUNKSIZE);
+        return bbELAST;
+    }
+
+    // insert descriptor sorted by chunk start
+    bbUINT i = mChunkCount++;
+    while (i && ((bbUPTR)mpChunks[i - 1].mpBase > (bbUPTR)pBase))
+    {
+        mpChunks[i] = mpChunks[i - 1];
+        i--;
+    }
+
+    dtArenaChunk* const pChunk = &mpChunks[i];
+    pChunk->mpBase = pBase;
+    pChunk->mpHeap = pHeap;
+    for (i = 0; i < dtARENA_CHUNKRUNS; i++)
+        pChunk->mClass[i] = dtARENA_CLASSES;
+
+    mpChunk = pBase;
+    mChunkRun = 0;
+
+    return bbEOK;
+}
+
+bbU8* dtArena::MarkSlab(bbUINT const cls)
+{
+    bbUINT const runs = GetClassRuns(cls);
+    dtArenaChunk* const pChunk = FindChunk(mpChunk);
+    bbASSERT(pChunk && ((mChunkRun + runs) <= dtARENA_CHUNKRUNS));
+
+    for (bbUINT i = 0; i < runs; i++)
+        pChunk->mClass[mChunkRun + i] = (bbU8)cls;
+
+    bbU8* const pSlab = mpChunk + mChunkRun * dtARENA_RUNSIZE;
+    mChunkRun += runs;
+
+    return pSlab;
+}
+
+void dtArena::CarveChunk(bbUINT const end)
+{
+    //
+    // Hand out runs of the current chunk up to run end as unused slabs of the largest fitting classes
+    //
+    while (mChunkRun < end)
+    {
+        bbUINT cls = dtARENA_CLASSES;
+
+        for(;;) // terminates at class 0, which spans 1 run
+        {
+            bbUINT const runs = GetClassRuns(--cls);
+
+            if (((mChunkRun + runs) <= end) && !(mChunkRun & ((runs & (0 - runs)) - 1)))
+                break;
+        }
+
+        bbU8* const pSlab = MarkSlab(cls);
+        *(bbU8**)pSlab = mpSpare[cls];
+        mpSpare[cls] = pSlab;
+    }
+}
+
+bbU8* dtArena::NewSlab(bbUINT const cls)
+{
+    bbU8* const pSlab = mpSpare[cls];
+
+    if (pSlab)
+    {
+        mpSpare[cls] = *(bbU8**)pSlab;
+        return pSlab;
+    }
+
+    //
+    // Align slab to the largest power of 2 dividing its size, so that e.g. blocks
+    // of 512 KB tile each huge page
+    //
+    bbUINT const runs = GetClassRuns(cls);
+    bbUINT const align = runs & (0 - runs);
+    bbUINT const start = (mChunkRun + align - 1) &~ (align - 1);
+
+    if (!mpChunk || ((start + runs) > dtARENA_CHUNKRUNS))
+    {
+        if (mpChunk)
+            CarveChunk(dtARENA_CHUNKRUNS);
+
+        if (NewChunk() != bbEOK)
+            return NULL;
+    }
+    else
+    {
+        CarveChunk(start);
+    }
+
+    return MarkSlab(cls);
+}
+
+void* dtArena::AllocSlab(bbUINT const cls)
+{
+    bbU8* pBlock = mpFree[cls];
+
+    if (pBlock)
+    {
+        mpFree[cls] = *(bbU8**)pBlock;
+        return pBlock;
+    }
+
+    if (mpSlabPos[cls] == mpSlabEnd[cls])
+    {
+        bbU8* const pSlab = NewSlab(cls);
+        if (!pSlab)
+            return NULL;
+
+        mpSlabPos[cls] = pSlab;
+        mpSlabEnd[cls] = pSlab + GetClassRuns(cls) * dtARENA_RUNSIZE;
+    }
+
+    pBlock = mpSlabPos[cls];
+    mpSlabPos[cls] += GetClassSize(cls);
+
+    return pBlock;
+}
+
+void* dtArena::AllocLarge(bbU32 const size)
+{
+    if (size > ((bbU32)-1 - dtARENA_HDRSIZE))
+    {
+        bbErrSet(bbENOMEM);
+        return NULL;
+    }
+
+    dtArenaBlock* pBlock = NULL;
+    bbU8* pRegion;
+
+    if (mHugePages && (size >= dtARENA_HUGEPAGE) && ((pRegion = MapHuge(size)) != NULL))
+    {
+        pBlock = (dtArenaBlock*)(pRegion - dtARENA_HDRSIZE);
+        pBlock->mMapped = 1;
+    }
+    else
+    {
+        if ((pBlock = (dtArenaBlock*)bbMemAlloc(dtARENA_HDRSIZE + size)) == NULL)
+            return NULL;
+        pBlock->mMapped = 0;
+    }
+
+    pBlock->mSize  = size;
+    pBlock->mpPrev = NULL;
+    if ((pBlock->mpNext = mpLarge) != NULL)
+        mpLarge->mpPrev = pBlock;
+    mpLarge = pBlock;
+
+    return (bbU8*)pBlock + dtARENA_HDRSIZE;
+}
+
+void dtArena::FreeLarge(dtArenaBlock* const pBlock)
+{
+    if (pBlock->mpPrev)
+        pBlock->mpPrev->mpNext = pBlock->mpNext;
+    else
+        mpLarge = pBlock->mpNext;
+    if (pBlock->mpNext)
+        pBlock->mpNext->mpPrev = pBlock->mpPrev;
+
+    if (pBlock->mMapped)
+        UnmapHuge((bbU8*)pBlock + dtARENA_HDRSIZE, pBlock->mSize);
+    else
+        bbMemFree(pBlock);
+}
+
+void dtArena::FreeBlock(bbU8* const pBlock)
+{
+    const dtArenaChunk* const pChunk = FindChunk(pBlock);
+
+    if (!pChunk)
+    {
+        FreeLarge((dtArenaBlock*)(pBlock - dtARENA_HDRSIZE));
+        return;
+    }
+
+    bbUINT const cls = pChunk->mClass[(bbUPTR)(pBlock - pChunk->mpBase) / dtARENA_RUNSIZE];
+    bbASSERT(cls < dtARENA_CLASSES);
+
+    *(bbU8**)pBlock = mpFree[cls];
+    mpFree[cls] = pBlock;
+}
+
+void* dtArena::Alloc(bbU32 const size)
+{
+    bbUINT const cls = GetClass(size);
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return (cls == dtARENA_CLASSES) ? AllocLarge(size) : AllocSlab(cls);
+}
+
+bbERR dtArena::Realloc(bbU32 const size, void** const ppBlock)
+{
+    if (!*ppBlock)
+    {
+        if (size && ((*ppBlock = Alloc(size)) == NULL))
+            return bbELAST;
+        return bbEOK;
+    }
+
+    if (!size)
+    {
+        Free(*ppBlock);
+        *ppBlock = NULL;
+        return bbEOK;
+    }
+
+    bbUINT const cls = GetClass(size);
+    bbU8* const pOld = (bbU8*)*ppBlock;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    const dtArenaChunk* const pChunk = FindChunk(pOld);
+    bbU32 oldsize;
+
+    if (pChunk)
+    {
+        bbUINT const oldcls = pChunk->mClass[(bbUPTR)(pOld - pChunk->mpBase) / dtARENA_RUNSIZE];
+
+        if (cls == oldcls)
+            return bbEOK; // same size class, block is large enough
+
+        oldsize = GetClassSize(oldcls);
+    }
+    else
+    {
+        dtArenaBlock* pBlock = (dtArenaBlock*)(pOld - dtARENA_HDRSIZE);
+        oldsize = pBlock->mSize;
+
+        if (cls == dtARENA_CLASSES)
+        {
+            if (pBlock->mMapped && (dtArenaHugeSize(size) == dtArenaHugeSize(pBlock->mSize)))
+            {
+                pBlock->mSize = size; // fits into mapped region
+                return bbEOK;
+            }
+
+            if (!pBlock->mMapped && (!mHugePages || (size < dtARENA_HUGEPAGE)))
+            {
+                //
+                // Resize large heap block in place, and relink it
+                //
+                if (bbEOK != bbMemRealloc(dtARENA_HDRSIZE + size, (void**)&pBlock))
+                    return bbELAST;
+
+                if (pBlock->mpPrev)
+                    pBlock->mpPrev->mpNext = pBlock;
+                else
+                    mpLarge = pBlock;
+                if (pBlock->mpNext)
+                    pBlock->mpNext->mpPrev = pBlock;
+
+                pBlock->mSize = size;
+                *ppBlock = (bbU8*)pBlock + dtARENA_HDRSIZE;
+                return bbEOK;
+            }
+        }
+    }
+
+    bbU8* const pNew = (bbU8*)((cls == dtARENA_CLASSES) ? AllocLarge(size) : AllocSlab(cls));
+    if (!pNew)
+        return bbELAST;
+
+    bbMemMove(pNew, pOld, (oldsize < size) ? oldsize : size);
+
+    FreeBlock(pOld);
+    *ppBlock = pNew;
+
+    return bbEOK;
+}
+
+void dtArena::Free(void* const pBlock)
+{
+    if (!pBlock)
+        return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    FreeBlock((bbU8*)pBlock);
+}
+
+int dtArena::Release()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    while (mpLarge)
+        FreeLarge(mpLarge);
+
+    for (bbUINT i = 0; i < mChunkCount; i++)
+    {
+        if (mpChunks[i].mpHeap)
+            bbMemFree(mpChunks[i].mpHeap);
+        else
+            UnmapHuge(mpChunks[i].mpBase, dtARENA_CHUNKSIZE);
+    }
+
+    bbMemFree(mpChunks);
+    mpChunks = NULL;
+    mChunkCount = 0;
+    mpChunk = NULL;
+    mChunkRun = 0;
+
+    for (bbUINT i = 0; i < dtARENA_CLASSES; i++)
+        mpFree[i] = mpSlabPos[i] = mpSlabEnd[i] = mpSpare[i] = NULL;
+
+    return 1;
+}
@@ -2,6 +2,32 @@
 #include <babel/str.h>
 #include <babel/file.h>
 #include "dtBuffer.h"
+#include <new>
+#include <atomic>
+#include <thread>
+
+/** State of a save, see dtBuffer::Save() and dtBuffer::SaveBackground(). */
+struct dtSaveTask
+{
+    std::thread         mThread;    //!< Thread running OnSave() for a background save
+    std::atomic<bbU64>  mWritten;   //!< Number of bytes written
+    std::atomic<int>    mCancel;    //!< !=0 if cancellation was requested
+    std::atomic<int>    mDone;      //!< !=0 if OnSave() returned
+    bbU64               mTotal;     //!< Number of bytes to write
+    bbU64               mReported;  //!< Value of mWritten at last notification
+    bbCHAR*             mpPathNew;  //!< Normalized path for new or saveas, heap block, or NULL
+    dtBUFFERSAVETYPE    mSaveType;
+    bbERR               mResult;    //!< Return value of OnSave()
+    bbERR               mErr;       //!< Error code set by failed OnSave()
+
+    dtSaveTask() : mWritten(0), mCancel(0), mDone(0)
+    {
+        mTotal = mReported = 0;
+        mpPathNew = NULL;
+        mSaveType = dtBUFFERSAVETYPE_NEW;
+        mResult = mErr = bbEOK;
+    }
+};
 
 bbUINT dtBuffer::mNewBufferCount = 0;
 
@@ -13,6 +39,10 @@ void dtBufferNotify::OnBufferMetaChange(dtBuffer* const, dtMETACHANGE const)
 {
 }
 
+void dtBufferNotify::OnBufferSaveProgress(dtBuffer* const, bbU64 const, bbU64 const)
+{
+}
+
 dtBuffer::dtBuffer()
 {
     mState = dtBUFFERSTATE_INIT;
@@ -21,23 +51,33 @@ dtBuffer::dtBuffer()
     mSyncPt = 0;
     mpName = NULL;
     mRefCt = 0;
+    mpSaveTask = NULL;
 
     //
     // - Init section index
     //
     bbMemClear(mSections, sizeof(mSections));
-    mSectionFree = 0;
-    for (bbUINT i=0; i<dtBUFFER_MAXSECTIONS; i++)
+    mpSectionFree = NULL;
+    for (bbUINT i=dtBUFFER_MAXSECTIONS; i>0; i--)
     {
-        mSections[i].mIndex = (bbU8)i;
-        mSections[i].mNextFree = (bbU8)(i+1);
+        mSections[i-1].mpNextFree = mpSectionFree;
+        mpSectionFree = mSections + i - 1;
     }
+    mpSectionBlocks = NULL;
+    mSectionCount = dtBUFFER_MAXSECTIONS;
 }
 
 dtBuffer::~dtBuffer()
 {
     bbASSERT(mRefCt == 0);
     bbASSERT(mState == dtBUFFERSTATE_INIT);
+
+    while (mpSectionBlocks)
+    {
+        dtSectionBlock* const pNext = mpSectionBlocks->mpNext;
+        bbMemFree(mpSectionBlocks);
+        mpSectionBlocks = pNext;
+    }
 }
 
 bbERR dtBuffer::AddNotifyHandler(dtBufferNotify* const pNotify)
@@ -142,7 +182,8 @@ bbERR dtBuffer::Undo(void* const user)
     syncdiff = 0;
     do
     {
-        int changeLength = mHistory.Peek(dtHistory::PEEKPREV, &change);
+        int runs;
+        int changeLength = mHistory.Peek(dtHistory::PEEKPREV, &change, &runs);
         change.undo = mUndoActive;
         mUndoPointRec = change.undopoint;
         err = bbEOK;
@@ -157,6 +198,12 @@ bbERR dtBuffer::Undo(void* const user)
             break;
 
         case dtCHANGE_DELETE:
+            if (runs)
+            {
+                err = InsertRuns(change.offset, (const dtHistoryRun*)change.user, change.length, user);
+                break;
+            }
+
             if ((pSection = Insert(change.offset, (bbU32)change.length)) == NULL)
             {
                 err = bbELAST;
@@ -215,7 +262,7 @@ bbERR dtBuffer::Redo(void* const user)
     mUndoActive = 2;
 
     bbUINT syncdiff = 0;
-    bbUINT changeLength = mHistory.Peek(dtHistory::PEEKNEXT, &changeNext);
+    bbUINT changeLength = mHistory.Peek(dtHistory::PEEKNEXT, &changeNext, NULL);
     changeNext.undo = mUndoActive;
     do
     {
@@ -224,7 +271,7 @@ bbERR dtBuffer::Redo(void* const user)
 
         if (mHistory.CanRedo())
         {
-            changeLength = mHistory.Peek(dtHistory::PEEKNEXT, &changeNext);
+            changeLength = mHistory.Peek(dtHistory::PEEKNEXT, &changeNext, NULL);
             changeNext.undo = mUndoActive;
             mUndoPointRec = changeNext.undopoint;
         }
@@ -280,6 +327,11 @@ bbERR dtBuffer::Redo(void* const user)
     return err;
 }
 
+bbERR dtBuffer::InsertRuns(bbU64 const, const dtHistoryRun*, bbU64 const, void* const)
+{
+    return bbErrSet(bbENOTSUP);
+}
+
 bbCHAR* dtBuffer::PathNorm(const bbCHAR* const pPath)
 {
     return bbPathNorm(pPath);
@@ -334,12 +386,15 @@ bbERR dtBuffer::Open(const bbCHAR* pPath)
     return bbELAST;
 }
 
-bbERR dtBuffer::Save(const bbCHAR* const pPath)
+bbERR dtBuffer::SavePrepare(const bbCHAR* const pPath, dtSaveTask* const pTask)
 {
     dtBUFFERSAVETYPE savetype;
     bbCHAR* pPathNew = NULL;
 
     bbASSERT(mState == dtBUFFERSTATE_OPEN);
+    bbASSERT(!mpSaveTask);
+    if (mpSaveTask)
+        return bbErrSet(bbEBADPARAM);
 
     if (pPath) // normalize path for new or saveas
     {
@@ -372,11 +427,34 @@ bbERR dtBuffer::Save(const bbCHAR* const pPath)
             return bbErrSet(bbEBADPARAM);
     }
 
-    if (OnSave((savetype == dtBUFFERSAVETYPE_INPLACE) ? mpName : pPathNew, savetype) != bbEOK)
-        goto dtBuffer_Save_err;
+    pTask->mpPathNew = pPathNew;
+    pTask->mSaveType = savetype;
+    pTask->mTotal    = mBufSize;
+    return bbEOK;
+
+    dtBuffer_Save_err:
+    bbMemFree(pPathNew);
+    return bbELAST;
+}
+
+void dtBuffer::SaveRun(dtSaveTask* const pTask)
+{
+    pTask->mResult = OnSave((pTask->mSaveType == dtBUFFERSAVETYPE_INPLACE) ? mpName : pTask->mpPathNew, pTask->mSaveType);
+    if (pTask->mResult != bbEOK)
+        pTask->mErr = bbErrGet();
+    pTask->mDone = 1;
+}
+
+bbERR dtBuffer::SaveComplete(dtSaveTask* const pTask)
+{
+    if (pTask->mResult != bbEOK)
+    {
+        bbMemFree(pTask->mpPathNew);
+        return bbErrSet(pTask->mErr);
+    }
 
-    if (savetype != dtBUFFERSAVETYPE_INPLACE)
-        AttachName((bbCHAR*)pPathNew);
+    if (pTask->mSaveType != dtBUFFERSAVETYPE_INPLACE)
+        AttachName(pTask->mpPathNew);
 
     mSyncPtNoMod = mSyncPt;
     mOpt = (bbU8)((bbUINT)mOpt &~ (dtBUFFEROPT_NEW|dtBUFFEROPT_MODIFIED));
@@ -384,14 +462,120 @@ bbERR dtBuffer::Save(const bbCHAR* const pPath)
     NotifyMetaChange(dtMETACHANGE_ISNEW);
 
     return bbEOK;
+}
 
-    dtBuffer_Save_err:
-    bbMemFree(pPathNew);
-    return bbELAST;
+bbERR dtBuffer::Save(const bbCHAR* const pPath)
+{
+    dtSaveTask task;
+
+    if (SavePrepare(pPath, &task) != bbEOK)
+        return bbELAST;
+
+    mpSaveTask = &task;
+    SaveRun(&task);
+    mpSaveTask = NULL;
+
+    return SaveComplete(&task);
+}
+
+bbERR dtBuffer::SaveBackground(const bbCHAR* const pPath)
+{
+    dtSaveTask* const pTask = new(std::nothrow) dtSaveTask;
+    if (!pTask)
+        return bbErrSet(bbENOMEM);
+
+    if (SavePrepare(pPath, pTask) != bbEOK)
+    {
+        delete pTask;
+        return bbELAST;
+    }
+
+    mpSaveTask = pTask;
+
+    try
+    {
+        pTask->mThread = std::thread(&dtBuffer::SaveRun, this, pTask);
+    }
+    catch (...)
+    {
+        mpSaveTask = NULL;
+        bbMemFree(pTask->mpPathNew);
+        delete pTask;
+        return bbErrSet(bbENOMEM);
+    }
+
+    return bbEOK;
+}
+
+bbERR dtBuffer::SaveWait()
+{
+    dtSaveTask* const pTask = mpSaveTask;
+
+    bbASSERT(pTask && pTask->mThread.joinable());
+    if (!pTask || !pTask->mThread.joinable())
+        return bbErrSet(bbEBADPARAM);
+
+    pTask->mThread.join();
+    mpSaveTask = NULL;
+
+    bbERR const err = SaveComplete(pTask);
+    delete pTask;
+    return err;
+}
+
+void dtBuffer::SaveCancel()
+{
+    if (mpSaveTask)
+        mpSaveTask->mCancel = 1;
+}
+
+int dtBuffer::IsSaving(bbU64* const pWritten, bbU64* const pTotal) const
+{
+    dtSaveTask* const pTask = mpSaveTask;
+
+    if (!pTask)
+        return 0;
+
+    if (pWritten)
+        *pWritten = pTask->mWritten;
+    if (pTotal)
+        *pTotal = pTask->mTotal;
+
+    return !pTask->mDone;
+}
+
+bbERR dtBuffer::SaveProgress(bbU64 const written)
+{
+    dtSaveTask* const pTask = mpSaveTask;
+
+    if (!pTask)
+        return bbEOK;
+
+    pTask->mWritten = written;
+
+    if (((written - pTask->mReported) >= dtBUFFER_SAVEPROGRESSSTEP) || (written == pTask->mTotal))
+    {
+        pTask->mReported = written;
+        bbUINT i = mNotifyHandlers.GetSize();
+        while (i) mNotifyHandlers[--i]->OnBufferSaveProgress(this, written, pTask->mTotal);
+    }
+
+    return pTask->mCancel ? bbErrSet(dtECANCELLED) : bbEOK;
+}
+
+int dtBuffer::IsSaveCancelled() const
+{
+    return mpSaveTask && mpSaveTask->mCancel;
 }
 
 void dtBuffer::Close()
 {
+    if (mpSaveTask)
+    {
+        SaveCancel();
+        SaveWait();
+    }
+
     if (mState != dtBUFFERSTATE_INIT)
     {
         OnClose();
@@ -405,16 +589,29 @@ void dtBuffer::Close()
 
 dtSection* dtBuffer::SectionAlloc()
 {
-    bbUINT const i = mSectionFree;
-
-    if (i >= dtBUFFER_MAXSECTIONS)
+    if (!mpSectionFree)
     {
-        bbErrSet(bbEFULL);
-        return NULL;
+        //
+        // Pool exhausted, add a block of descriptors
+        //
+        dtSectionBlock* const pBlock = (dtSectionBlock*)bbMemAlloc(sizeof(dtSectionBlock));
+        if (!pBlock)
+            return NULL;
+
+        bbMemClear(pBlock, sizeof(dtSectionBlock));
+        for (bbUINT i=dtBUFFER_SECTIONBLOCK; i>0; i--)
+        {
+            pBlock->mSections[i-1].mpNextFree = mpSectionFree;
+            mpSectionFree = pBlock->mSections + i - 1;
+        }
+
+        pBlock->mpNext = mpSectionBlocks;
+        mpSectionBlocks = pBlock;
+        mSectionCount += dtBUFFER_SECTIONBLOCK;
     }
 
-    dtSection* const pSec = mSections + i;
-    mSectionFree = pSec->mNextFree;
+    dtSection* const pSec = mpSectionFree;
+    mpSectionFree = pSec->mpNextFree;
 
     bbASSERT(pSec->mType == dtSECTIONTYPE_NONE);
     return pSec;
@@ -483,4 +680,55 @@ bbERR dtBuffer::Write(bbU64 offset, bbU8* pData, bbU32 size, int overwrite, void
     return bbELAST;
 }
 
+bbERR dtBuffer::MapVec(bbU64 const offset, bbU64 const size, dtMAP const accesshint, dtSection** const ppSections, bbUINT const maxcount, bbUINT* const pCount)
+{
+    bbU64 const end = offset + size;
+    bbU64 pos = offset;
+    bbUINT count = 0;
+
+    *pCount = 0;
+
+    if ((end > mBufSize) || (end < offset) || !maxcount)
+        return bbErrSet(bbEBADPARAM);
+
+    while ((pos < end) && (count < maxcount))
+    {
+        dtSection* const pSection = MapSeq(pos, 0, accesshint);
+        if (!pSection)
+            goto dtBuffer_MapVec_err;
+
+        if (pSection->mSize > (end - pos))
+            pSection->mSize = (bbU32)(end - pos);
+
+        pos += pSection->mSize;
+        ppSections[count++] = pSection;
+    }
+
+    *pCount = count;
+    return bbEOK;
+
+    dtBuffer_MapVec_err:
+    DiscardVec(ppSections, count); // data is unchanged
+    return bbELAST;
+}
+
+bbERR dtBuffer::CommitVec(dtSection** const ppSections, bbUINT const count, void* const user)
+{
+    bbERR err = bbEOK;
+
+    for (bbUINT i = 0; i < count; i++)
+    {
+        if (Commit(ppSections[i], user) != bbEOK)
+            err = bbELAST;
+    }
+
+    return err;
+}
+
+void dtBuffer::DiscardVec(dtSection** const ppSections, bbUINT const count)
+{
+    for (bbUINT i = count; i > 0; i--)
+        Discard(ppSections[i - 1]);
+}
+
 
@@ -0,0 +1,452 @@
+#include "dtBufferMmap.h"
+#include "dtFileIO.h"
+#include <babel/mem.h>
+#include <babel/file.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+dtBufferMmap::dtBufferMmap()
+{
+    mpWindows = NULL;
+    mWindowCount = 0;
+    mWindowLast = 0;
+    mUseCount = 0;
+    mMapBudget = dtBUFFERMMAP_BUDGET;
+    mMapAll = 0;
+}
+
+dtBufferMmap::~dtBufferMmap()
+{
+    Close();
+}
+
+bbERR dtBufferMmap::OpenWindow(dtMmapWindow* const pWindow, bbU64 const offset, bbU64 const size, int const fallback)
+{
+    bbASSERT(!pWindow->mpData && size);
+
+#ifndef _WIN32
+    // size_t and off_t must hold the range
+    if ((mFile.mFd >= 0) && (size == (bbU64)(size_t)size) && (offset == (bbU64)(off_t)offset))
+    {
+        void* const pMap = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, mFile.mFd, (off_t)offset);
+
+        if (pMap != MAP_FAILED)
+        {
+            pWindow->mpData  = (bbU8*)pMap;
+            pWindow->mMapped = 1;
+            goto dtBufferMmap_OpenWindow_ok;
+        }
+    }
+#endif
+
+    if (!fallback)
+        return bbErrSet(bbENOMEM);
+
+    //
+    // Mapping not available, read window into heap block
+    //
+    if (size != (bbU64)(bbU32)size)
+        return bbErrSet(bbENOMEM);
+
+    if ((pWindow->mpData = (bbU8*)bbMemAlloc((bbU32)size)) == NULL)
+        return bbELAST;
+
+    if (mFile.ReadAt(offset, pWindow->mpData, (bbU32)size) != bbEOK)
+    {
+        bbMemFreeNull((void**)&pWindow->mpData);
+        return bbELAST;
+    }
+
+    pWindow->mMapped = 0;
+
+    dtBufferMmap_OpenWindow_ok:
+    pWindow->mOffset  = offset;
+    pWindow->mSize    = size;
+    pWindow->mRefCt   = 0;
+    pWindow->mLastUse = mUseCount;
+    return bbEOK;
+}
+
+void dtBufferMmap::CloseWindow(dtMmapWindow* const pWindow)
+{
+    if (!pWindow->mpData)
+        return;
+
+#ifndef _WIN32
+    if (pWindow->mMapped)
+        munmap(pWindow->mpData, (size_t)pWindow->mSize);
+    else
+#endif
+        bbMemFree(pWindow->mpData);
+
+    pWindow->mpData = NULL;
+    pWindow->mSize = 0;
+}
+
+bbUINT dtBufferMmap::GetWindow(bbU64 const offset, bbU64 const minsize)
+{
+    dtMmapWindow* pWindow;
+    bbUINT idx;
+
+    bbASSERT(minsize && ((offset + minsize) <= mBufSize));
+
+    //
+    // - Shortcut: repeated access to the same window
+    //
+    pWindow = mpWindows + mWindowLast;
+
+    if ((mWindowLast < mWindowCount) && pWindow->mpData &&
+        (offset >= pWindow->mOffset) && ((offset + minsize) <= (pWindow->mOffset + pWindow->mSize)))
+    {
+        goto dtBufferMmap_GetWindow_hit;
+    }
+
+    for (idx = 0; idx < mWindowCount; idx++)
+    {
+        pWindow = mpWindows + idx;
+
+        if (pWindow->mpData &&
+            (offset >= pWindow->mOffset) && ((offset + minsize) <= (pWindow->mOffset + pWindow->mSize)))
+        {
+            mWindowLast = idx;
+            goto dtBufferMmap_GetWindow_hit;
+        }
+    }
+
+    {
+        //
+        // - Miss: map window aligned to dtBUFFERMMAP_WINDOWSIZE, covering the requested range
+        //
+        bbU64 const start = offset &~ (bbU64)(dtBUFFERMMAP_WINDOWSIZE - 1);
+        bbU64 end = (offset + minsize + dtBUFFERMMAP_WINDOWSIZE - 1) &~ (bbU64)(dtBUFFERMMAP_WINDOWSIZE - 1);
+        if (end > mBufSize)
+            end = mBufSize;
+
+        for (idx = 0; idx < mWindowCount; idx++)
+            if (!mpWindows[idx].mpData)
+                break;
+
+        if (idx == mWindowCount)
+        {
+            bbUINT const count = mWindowCount + dtBUFFERMMAP_WINDOWS;
+
+            if (bbEOK != bbMemRealloc(count * sizeof(dtMmapWindow), (void**)&mpWindows))
+                return (bbUINT)-1;
+
+            bbMemClear(mpWindows + mWindowCount, dtBUFFERMMAP_WINDOWS * sizeof(dtMmapWindow));
+            mWindowCount = count;
+        }
+
+        pWindow = mpWindows + idx;
+
+        if (OpenWindow(pWindow, start, end - start, 1) != bbEOK)
+        {
+            // address space may be exhausted, drop cached windows and retry
+            for (bbUINT i = 0; i < mWindowCount; i++)
+                if (!mpWindows[i].mRefCt)
+                    CloseWindow(mpWindows + i);
+
+            if (OpenWindow(pWindow, start, end - start, 1) != bbEOK)
+                return (bbUINT)-1;
+        }
+
+        mWindowLast = idx;
+    }
+
+    dtBufferMmap_GetWindow_hit:
+    pWindow->mRefCt++;
+    pWindow->mLastUse = ++mUseCount;
+    return mWindowLast;
+}
+
+void dtBufferMmap::ReleaseWindow(bbUINT const idx)
+{
+    bbASSERT((idx < mWindowCount) && mpWindows[idx].mRefCt);
+
+    if (--mpWindows[idx].mRefCt)
+        return;
+
+    //
+    // Unmap least recently used window, if too many are unreferenced
+    //
+    bbUINT unused = 0, lru = (bbUINT)-1;
+
+    for (bbUINT i = 0; i < mWindowCount; i++)
+    {
+        dtMmapWindow* const pWindow = mpWindows + i;
+
+        if (!pWindow->mpData || pWindow->mRefCt)
+            continue;
+
+        unused++;
+
+        if ((lru == (bbUINT)-1) || ((bbS32)(pWindow->mLastUse - mpWindows[lru].mLastUse) < 0))
+            lru = i;
+    }
+
+    if (unused > dtBUFFERMMAP_WINDOWS)
+        CloseWindow(mpWindows + lru);
+}
+
+dtSection* dtBufferMmap::MapWindow(bbU64 const offset, bbU32 const size, bbU32 const maxsize)
+{
+    dtSection* const pSection = SectionAlloc();
+    if (!pSection)
+        return NULL;
+
+    bbUINT const idx = GetWindow(offset, size);
+    if (idx == (bbUINT)-1)
+    {
+        SectionFree(pSection);
+        return NULL;
+    }
+
+    const dtMmapWindow* const pWindow = mpWindows + idx;
+    bbU64 const avail = pWindow->mOffset + pWindow->mSize - offset;
+
+    pSection->mpData   = pWindow->mpData + (bbUPTR)(offset - pWindow->mOffset);
+    pSection->mSize    = (avail < maxsize) ? (bbU32)avail : maxsize;
+    pSection->mOpt     = 0;
+    pSection->mSegment = idx;
+    pSection->mOffset  = offset;
+
+    return pSection;
+}
+
+bbERR dtBufferMmap::OpenFile(const bbCHAR* const pPath)
+{
+    bbASSERT(!mFile.mhFile && !mpWindows);
+
+    if (mFile.Open(pPath, bbFILEOPEN_READ, 0) == NULL)
+        return bbELAST;
+
+    if ((mBufSize = mFile.GetSize()) == (bbU64)-1)
+    {
+        mBufSize = 0;
+        return bbELAST;
+    }
+
+    //
+    // Map whole file into window 0, it stays referenced until closed
+    //
+    if (mBufSize && (mBufSize <= mMapBudget))
+    {
+        if ((mpWindows = (dtMmapWindow*)bbMemAlloc(sizeof(dtMmapWindow))) == NULL)
+            return bbELAST;
+
+        bbMemClear(mpWindows, sizeof(dtMmapWindow));
+        mWindowCount = 1;
+
+        // failure is not an error, windows are used then
+        if (OpenWindow(mpWindows, 0, mBufSize, 0) == bbEOK)
+        {
+            mpWindows->mRefCt = 1;
+            mMapAll = 1;
+        }
+    }
+
+    return bbEOK;
+}
+
+void dtBufferMmap::CloseFile()
+{
+    for (bbUINT idx = 0; idx < mWindowCount; idx++)
+    {
+        bbASSERT(!mpWindows[idx].mRefCt || (mMapAll && !idx && (mpWindows[idx].mRefCt == 1))); // assert all sections are released
+        CloseWindow(mpWindows + idx);
+    }
+
+    bbMemFreeNull((void**)&mpWindows);
+    mWindowCount = 0;
+    mWindowLast = 0;
+    mMapAll = 0;
+
+    mFile.Close();
+}
+
+bbERR dtBufferMmap::OnOpen(const bbCHAR* const pPath, int isnew)
+{
+    if (isnew)
+        return bbErrSet(bbENOTSUP);
+
+    if (OpenFile(pPath) != bbEOK)
+    {
+        CloseFile();
+        return bbELAST;
+    }
+
+    mOpt |= dtBUFFEROPT_READONLY | dtBUFFEROPT_FIXED | dtBUFFEROPT_NOINSERT;
+
+    return bbEOK;
+}
+
+void dtBufferMmap::OnClose()
+{
+    CloseFile();
+    mBufSize = 0;
+}
+
+bbERR dtBufferMmap::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
+{
+    dtFileIO out;
+    dtFileIO in;
+    dtSection* pSection = NULL;
+    bbU64 outoffset = 0;
+
+    // buffer cannot be changed, the original location is up to date
+    if (savetype == dtBUFFERSAVETYPE_INPLACE)
+        return bbEOK;
+
+    if (out.Open(pPath, bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC, 0) != bbEOK)
+        goto dtBufferMmap_OnSave_err;
+
+    //
+    // Copy file within the kernel, or reflink it
+    //
+    if (mBufSize && (in.Open(mpName, bbFILEOPEN_READ, 0) == bbEOK))
+    {
+        while (outoffset < mBufSize)
+        {
+            bbU64 const tocopy = ((mBufSize - outoffset) > dtBUFFER_SAVEPROGRESSSTEP) ? dtBUFFER_SAVEPROGRESSSTEP : (mBufSize - outoffset);
+            bbU64 const copied = out.CopyFrom(in, outoffset, outoffset, tocopy);
+            outoffset += copied;
+
+            if (SaveProgress(outoffset) != bbEOK)
+                goto dtBufferMmap_OnSave_err;
+
+            if (copied < tocopy)
+                break;
+        }
+        in.Close();
+    }
+
+    //
+    // Write the rest from mapped sections
+    //
+    while (outoffset < mBufSize)
+    {
+        if ((pSection = MapSeq(outoffset, 0, dtMAP_READONLY)) == NULL)
+            goto dtBufferMmap_OnSave_err;
+
+        for (bbU32 pos = 0; pos < pSection->mSize; )
+        {
+            bbU32 const towrite = ((pSection->mSize - pos) > dtBUFFER_SAVEPROGRESSSTEP) ? dtBUFFER_SAVEPROGRESSSTEP : (pSection->mSize - pos);
+
+            if ((out.Write(outoffset, pSection->mpData + pos, towrite) != bbEOK) ||
+                (out.Flush() != bbEOK))
+            {
+                goto dtBufferMmap_OnSave_err;
+            }
+
+            pos += towrite;
+            outoffset += towrite;
+
+            if (SaveProgress(outoffset) != bbEOK)
+                goto dtBufferMmap_OnSave_err;
+        }
+
+        Discard(pSection);
+        pSection = NULL;
+    }
+
+    out.Close();
+
+    //
+    // Switch to the saved file
+    //
+    CloseFile();
+
+    if ((OpenFile(pPath) != bbEOK) || (mBufSize != outoffset))
+    {
+        OnClose();
+        return bbELAST;
+    }
+
+    return bbEOK;
+
+    dtBufferMmap_OnSave_err:
+    {
+        bbERR const err = bbErrGet();
+        Discard(pSection);
+        out.Close();
+        // a failed or cancelled save leaves no partial file behind
+        bbFileDelete(pPath);
+        bbErrSet(err);
+    }
+    return bbELAST;
+}
+
+bbERR dtBufferMmap::Delete(bbU64 const, bbU64, void* const)
+{
+    return bbErrSet(bbENOTSUP);
+}
+
+dtSection* dtBufferMmap::Insert(bbU64 const, bbU32 const)
+{
+    bbErrSet(bbENOTSUP);
+    return NULL;
+}
+
+dtSection* dtBufferMmap::Map(bbU64 offset, bbU32 size, dtMAP const accesshint)
+{
+    if (accesshint != dtMAP_READONLY)
+    {
+        bbErrSet(bbENOTSUP);
+        return NULL;
+    }
+
+    if (((offset + size) > mBufSize) || (offset >= mBufSize))
+    {
+        bbErrSet(bbEBADPARAM);
+        return NULL;
+    }
+
+    dtSection* const pSection = MapWindow(offset, size ? size : 1, size);
+    if (pSection)
+        pSection->mType = dtSECTIONTYPE_MAP;
+
+    return pSection;
+}
+
+dtSection* dtBufferMmap::MapSeq(bbU64 const offset, bbUINT minsize, dtMAP const accesshint)
+{
+    if (accesshint != dtMAP_READONLY)
+    {
+        bbErrSet(bbENOTSUP);
+        return NULL;
+    }
+
+    if (offset >= mBufSize)
+    {
+        bbErrSet(bbEEOF);
+        return NULL;
+    }
+
+    if ((offset + minsize) > mBufSize)
+        minsize = (bbUINT)(mBufSize - offset);
+
+    dtSection* const pSection = MapWindow(offset, minsize ? minsize : 1, (minsize > dtBUFFERMMAP_SEQSIZE) ? minsize : dtBUFFERMMAP_SEQSIZE);
+    if (pSection)
+        pSection->mType = dtSECTIONTYPE_MAPSEQ;
+
+    return pSection;
+}
+
+bbERR dtBufferMmap::Commit(dtSection* const pSection, void* const)
+{
+    Discard(pSection);
+    return bbErrSet(bbENOTSUP);
+}
+
+void dtBufferMmap::Discard(dtSection* const pSection)
+{
+    if (!pSection)
+        return;
+
+    bbASSERT((pSection->mType == dtSECTIONTYPE_MAP) || (pSection->mType == dtSECTIONTYPE_MAPSEQ));
+
+    ReleaseWindow(pSection->mSegment);
+    SectionFree(pSection);
+}
@@ -1,24 +1,37 @@
 #include "dtBufferStream.h"
+#include "dtPrefetch.h"
+#include "dtFileIO.h"
 #include <babel/str.h>
 #include <babel/file.h>
 #include <babel/log.h>
 #include <babel/strbuf.h>
+#include <new>
+#include <atomic>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 enum
 {
     dtSECTIONOPT_MAP_SEQ = 0,
     dtSECTIONOPT_MAP_PAGE = 1,
-    dtSECTIONOPT_MAP_TYPEMASK = 1,
+    dtSECTIONOPT_MAP_PATCH = 2,
+    dtSECTIONOPT_MAP_TYPEMASK = 3,
     dtSECTIONOPT_MAP_WRITE = 4,
+    dtSECTIONOPT_MAP_DIFF = 8,
     dtSECTIONOPT_INSERT_ENLARGE = 0,
     dtSECTIONOPT_INSERT_CREATE = 1,
-    dtSECTIONOPT_INSERT_REPLACE = 2
+    dtSECTIONOPT_INSERT_REPLACE = 2,
+    dtSECTIONOPT_INSERT_GAP = 3
 };
 
 #ifdef bbDEBUG
 static int            gCheckTreeDisable = 0;
 static bbU64*         gpOffsets = NULL;
 static bbU64*         gpOffsetStack = NULL;
+static bbU32*         gpNodeStack = NULL;
 static bbU32          gOffsetSize = 0;
 static dtSegment*     gpSavedSegments = NULL;
 static bbU32          gSavedSegmentSize = 0;
@@ -41,9 +54,48 @@ dtBufferStream::dtBufferStream()
     mSegmentLastOffset =
     mMappedSize =
     mFileSize = 0;
-    bbMemClear(mPagePool, sizeof(mPagePool));
 
-    mhFile = mhTempFile = NULL;
+    mLRUFirst   = (bbU32)-1;
+    mCacheSize  = 0;
+    mCacheLimit = dtBUFFERSTREAM_CACHELIMIT;
+    mDirtyFirst = (bbU32)-1;
+    mDirtySize  = 0;
+    mDirtyLimit = dtBUFFERSTREAM_DIRTYLIMIT;
+
+    bbMemClear(mPagePool, sizeof(mPagePool));
+    mpPageFree = NULL;
+    for (bbUINT i = dtBUFFERSTREAM_MAXPAGES; i > 0; i--)
+        PageFree(mPagePool + i - 1);
+    mpPageBlocks = NULL;
+    mpLocked = NULL;
+    mLockedSize = 0;
+
+    mpTempName = NULL;
+    mTempFileSize = 0;
+    mTempUndo = 0;
+
+    mpFileMap = NULL;
+    mFileMapSize = 0;
+    mUseFileMap = 0;
+    mAsyncIO = 1;
+    mDirectIO = 0;
+    mUsePatchSave = 1;
+    mSaveThreads = dtBUFFERSTREAM_SAVETHREADS;
+    mSegmentSize = dtBUFFERSTREAM_SEGMENTSIZE;
+    mLoadSize = dtBUFFERSTREAM_SEGMENTSIZE_MIN;
+    mLoadStart = mLoadEnd = (bbU64)-1;
+    mpPrefetch = NULL;
+    mPrefetchDepth = dtBUFFERSTREAM_PREFETCH;
+    mCompactOffset = (bbU64)-1;
+    mCompactDebt = 0;
+    mGapSegment = (bbU32)-1;
+    mGapSegmentStart = 0;
+    mGapOffset = mGapSize = 0;
+    mGapReserve = dtBUFFERSTREAM_GAPSIZE;
+    mpPatches = NULL;
+    mPatchCount = mPatchCapacity = 0;
+    mPatchSize = 0;
+    mPatchLimit = dtBUFFERSTREAM_PATCHLIMIT;
 
     #ifdef bbDEBUG
     mHitCount=
@@ -54,12 +106,21 @@ dtBufferStream::dtBufferStream()
 dtBufferStream::~dtBufferStream()
 {
     Close();
-    ClearSegments();
+    ClearSegments(1);
+
+    while (mpPageBlocks)
+    {
+        dtPageBlock* const pNext = mpPageBlocks->mpNext;
+        bbMemFree(mpPageBlocks);
+        mpPageBlocks = pNext;
+    }
+    bbMemFreeNull((void**)&mpLocked);
 
 #ifdef bbDEBUG
     bbMemFreeNull((void**)&gpSavedSegments);
     bbMemFreeNull((void**)&gpOffsets);
     bbMemFreeNull((void**)&gpOffsetStack);
+    bbMemFreeNull((void**)&gpNodeStack);
     gSavedSegmentSize = 0;
     gOffsetSize = 0;
 #endif
@@ -76,7 +137,7 @@ bbERR dtBufferStream::OnOpen(const bbCHAR* const pPath, int isnew)
     if (isnew)
     {
         mBufSize = mFileSize = 0;
-        bbASSERT(mhFile == NULL);
+        bbASSERT(mFile.mhFile == NULL);
     }
     else
     {
@@ -89,12 +150,10 @@ bbERR dtBufferStream::OnOpen(const bbCHAR* const pPath, int isnew)
             }
         }
 
-        if ((mhFile = bbFileOpen(pPath, bbFILEOPEN_READ)) == NULL)
+        if (OpenFile(pPath) != bbEOK)
             goto dtBuffer_file_Open_err;
 
-        mBufSize = mFileSize = bbFileExt(mhFile);
-        if (mBufSize == (bbU64)-1)
-            goto dtBuffer_file_Open_err;
+        mBufSize = mFileSize;
     }
 
     //
@@ -106,25 +165,25 @@ bbERR dtBufferStream::OnOpen(const bbCHAR* const pPath, int isnew)
     pSeg = mSegments.GetPtr(idx);
     bbMemClear(pSeg, sizeof(dtSegment));
     pSeg->mType       = dtSEGMENTTYPE_NULL;
+    pSeg->mLevel      = 1;
     pSeg->mFileSize   = mBufSize;
     pSeg->mLT         =
-    pSeg->mGE         = (bbU32)-1;
+    pSeg->mGE         =
+    pSeg->mParent     = (bbU32)-1;
+
+    mSegmentUsedFirst =
+    mSegmentUsedLast  =
+    mSegmentUsedRoot  = idx;
 
     mSegmentLastMapped = (bbU32)-1;
 
     mMappedSize = 0;
 
-    //
-    // Init page index
-    //
-    for (idx = 0; idx<dtBUFFERSTREAM_MAXPAGES; idx++)
-    {
-        bbASSERT(!mPagePool[idx].mpData);
-        mPagePool[idx].mSize = 0;
-        mPagePool[idx].mIndex = (bbU8)idx;
-        mPagePool[idx].mNextFree = (bbU8)(idx + 1);
-    }
-    mPageFree = 0;
+    mLoadSize = dtBUFFERSTREAM_SEGMENTSIZE_MIN;
+    mLoadStart = mLoadEnd = (bbU64)-1;
+
+    mCompactOffset = (bbU64)-1;
+    mCompactDebt = 0;
 
     return bbEOK;
 
@@ -135,25 +194,198 @@ bbERR dtBufferStream::OnOpen(const bbCHAR* const pPath, int isnew)
 
 void dtBufferStream::OnClose()
 {
+    //
+    // Free page data, descriptors stay in the free list
+    //
     for (bbUINT idx = 0; idx<dtBUFFERSTREAM_MAXPAGES; idx++)
+    {
         bbMemFreeNull((void**)&mPagePool[idx].mpData);
+        mPagePool[idx].mSize = 0;
+    }
+    for (dtPageBlock* pBlock = mpPageBlocks; pBlock; pBlock = pBlock->mpNext)
+    {
+        for (bbUINT idx = 0; idx<dtBUFFERSTREAM_PAGEBLOCK; idx++)
+        {
+            bbMemFreeNull((void**)&pBlock->mPages[idx].mpData);
+            pBlock->mPages[idx].mSize = 0;
+        }
+    }
+
+    // read-ahead blocks come from the allocator too, stop it before releasing
+    delete mpPrefetch;
+    mpPrefetch = NULL;
+
+    ClearSegments(!mpAlloc->Release());
+    CloseFile();
+    CloseTempFile();
+}
+
+bbERR dtBufferStream::OpenFile(const bbCHAR* const pPath)
+{
+    bbASSERT(!mFile.mhFile && !mpFileMap && !mpPrefetch);
+
+    if (mFile.Open(pPath, bbFILEOPEN_READ, mDirectIO) == NULL)
+        return bbELAST;
+
+    mFileSize = mFile.GetSize();
+    if (mFileSize == (bbU64)-1)
+        return bbELAST;
+
+    if (mUseFileMap && !mFile.IsDirect())
+        OpenFileMap();
+
+    // read-ahead is optional, failure is not an error
+    if (mPrefetchDepth && mFileSize && ((mpPrefetch = new(std::nothrow) dtPrefetch) != NULL))
+    {
+        if (mpPrefetch->Open(pPath, mFileSize, mPrefetchDepth, GetIOOpt(), mpFileMap, mpAlloc) != bbEOK)
+        {
+            delete mpPrefetch;
+            mpPrefetch = NULL;
+        }
+    }
+
+    return bbEOK;
+}
+
+void dtBufferStream::CloseFile()
+{
+    delete mpPrefetch;
+    mpPrefetch = NULL;
+    CloseFileMap();
+
+    mFile.Close();
+}
+
+bbERR dtBufferStream::OpenTempFile()
+{
+    if (mTempFile.mhFile)
+        return bbEOK;
+
+    if ((mpTempName = bbPathTemp(spTempDir)) == NULL)
+        return bbELAST;
+
+    if (mTempFile.Open(mpTempName, bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC, 0) == NULL)
+    {
+        bbMemFreeNull((void**)&mpTempName);
+        return bbELAST;
+    }
+
+    mTempFileSize = 0;
+    return bbEOK;
+}
+
+void dtBufferStream::CloseTempFile()
+{
+    if (mTempFile.mhFile)
+    {
+        mTempFile.Close();
+        bbFileDelete(mpTempName);
+    }
+    bbMemFreeNull((void**)&mpTempName);
+    mTempFileSize = 0;
+    mTempUndo = 0;
+}
+
+void dtBufferStream::RebaseSegments()
+{
+    bbU64 offset = 0;
+    bbU32 idx;
 
-    ClearSegments();
+    //
+    // Changed data is now on file, move dirty chain to the front of the LRU chain,
+    // keeping its order
+    //
+    while (mDirtyFirst != (bbU32)-1)
+    {
+        idx = mSegments[mDirtyFirst].mLRUPrev;
+        LRURemove(idx);
+        mSegments[idx].mChanged = 0;
+        LRUAdd(idx);
+    }
+
+    //
+    // Assign new file offsets, drop references to old file mapping and temp file,
+    // patched bytes are on file now
+    //
+    mMappedSize = 0;
+    PatchClear();
+
+    idx = mSegmentUsedFirst;
+    do
+    {
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+
+        if (pSegment->mType != dtSEGMENTTYPE_NULL)
+        {
+            if ((pSegment->mType == dtSEGMENTTYPE_TEMP) || IsFileMapped(pSegment->mpData))
+            {
+                if (pSegment->mType == dtSEGMENTTYPE_MAP)
+                    LRURemove(idx);
+                pSegment->mType = dtSEGMENTTYPE_NULL;
+                pSegment->mpData = NULL;
+            }
+            else
+            {
+                mMappedSize += pSegment->mSize;
+            }
+
+            pSegment->mFileSize = pSegment->mSize;
+            pSegment->mChanged = 0;
+        }
+
+        pSegment->mFileOffset = offset;
+        offset += pSegment->GetSize();
+        idx = pSegment->mNext;
+
+    } while (idx != mSegmentUsedFirst);
+
+    bbASSERT(offset == mBufSize);
+    mFileSize = mBufSize;
+
+    //
+    // Merge contiguous Null segments, idx stays valid since only right neighbours are freed
+    //
+    offset = 0;
+    idx = mSegmentUsedFirst;
+    do
+    {
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
 
-    bbFileClose(mhFile);
-    mhFile = NULL;
+        if (pSegment->mType == dtSEGMENTTYPE_NULL)
+            while (MergeNullSegment(idx, offset));
+
+        offset += pSegment->GetSize();
+        idx = pSegment->mNext;
+
+    } while (idx != mSegmentUsedFirst);
+
+    mSegmentLastMapped = (bbU32)-1;
+    mLoadSize = dtBUFFERSTREAM_SEGMENTSIZE_MIN;
+    mLoadStart = mLoadEnd = (bbU64)-1;
+
+    EvictSegments();
+
+    #ifdef bbDEBUG
+    DebugCheckMappedSize();
+    DebugCheckCache();
+    #endif
 }
 
 bbERR dtBufferStream::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
 {
-    bbFILEH hFile = NULL;
     bbCHAR* pTmpName = NULL;
-    bbU8*   pCopyBuf = NULL;
-    bbU32   copysize = dtBUFFERSTREAM_SEGMENTSIZE;
-    bbU32   idx;
+    bbERR   err;
+
+    CloseGap();
+
+    if (SpillUndoRuns() != bbEOK)
+        return bbELAST;
+
+    if ((savetype == dtBUFFERSAVETYPE_INPLACE) && mUsePatchSave && IsOverwriteOnly())
+        return SavePatch(pPath);
 
     //
-    // Create tempfile in same directory as pPath and allocate a copy buffer
+    // Create tempfile in same directory as pPath
     //
     if (savetype == dtBUFFERSAVETYPE_INPLACE)
     {
@@ -166,13 +398,172 @@ bbERR dtBufferStream::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
             return bbELAST;
     }
 
-    if (savetype != dtBUFFERSAVETYPE_NEW)
+    //
+    // Save
+    //
+    if ((mSaveThreads > 1) && !mDirectIO)
+        err = SaveParallel((savetype==dtBUFFERSAVETYPE_INPLACE) ? pTmpName : pPath);
+    else
+        err = SaveSerial((savetype==dtBUFFERSAVETYPE_INPLACE) ? pTmpName : pPath);
+
+    if (err != bbEOK)
+    {
+        // a cancelled save leaves no partial file behind
+        if ((bbErrGet() == dtECANCELLED) && (savetype != dtBUFFERSAVETYPE_INPLACE))
+        {
+            bbFileDelete(pPath);
+            bbErrSet(dtECANCELLED);
+        }
+        goto err;
+    }
+
+    //
+    // Keep loaded segments, and switch to the saved file
+    //
+    RebaseSegments();
+    CloseFile();
+    if (!mTempUndo)
+        CloseTempFile();
+
+    if (savetype == dtBUFFERSAVETYPE_INPLACE)
+    {
+        if ((bbEOK != bbFileDelete(mpName)) ||
+            (bbEOK != bbFileRename(pTmpName, pPath)))
+        {
+            bbLog(bbErr, bbT("Save error, cannot rename %s to %s"), pTmpName, pPath);
+            OnClose();
+            goto err;
+        }
+
+        bbMemFree(pTmpName);
+    }
+
+    if ((bbEOK != OpenFile(pPath)) || (mFileSize != mBufSize))
+    {
+        OnClose();
+        return bbELAST;
+    }
+
+    return bbEOK;
+
+    err:
+    if (pTmpName)
+    {
+        err = bbErrGet();
+        bbFileDelete(pTmpName);
+        bbMemFree(pTmpName);
+        bbErrSet(err);
+    }
+    return bbELAST;
+}
+
+bbERR dtBufferStream::SpillUndoRuns()
+{
+    dtBufferChange change;
+    int runs;
+    bbU8* pCopyBuf = NULL;
+    bbU8 tempundo = 0;
+    bbU32 pos = mHistory.GetEnd();
+
+    while (pos)
+    {
+        bbUINT const len = mHistory.Peek(pos, &change, &runs);
+
+        if (runs)
+        {
+            dtHistoryRun* pRun = (dtHistoryRun*)change.user;
+            bbU64 done = 0;
+
+            while (done < change.length)
+            {
+                bbU64 const size = pRun->mSize;
+                done += size;
+
+                if (pRun->mFileOffset == dtHISTORYRUN_DATA)
+                {
+                    pRun = (dtHistoryRun*)((bbU8*)(pRun + 1) + dtHISTORYRUN_PAD(size));
+                    continue;
+                }
+
+                if (!(pRun->mFileOffset & dtHISTORYRUN_TEMP))
+                {
+                    //
+                    // Append file range to temp file, within the kernel if no patches apply
+                    //
+                    bbU64 const fileoffset = pRun->mFileOffset;
+                    bbU64 copied = 0;
+
+                    if (OpenTempFile() != bbEOK)
+                        goto err;
+
+                    if (!PatchTest(fileoffset, size))
+                        copied = mTempFile.CopyFrom(mFile, fileoffset, mTempFileSize, size);
+
+                    while (copied < size)
+                    {
+                        bbU32 const tocopy = (size - copied) > dtBUFFERSTREAM_SEGMENTSIZE ? dtBUFFERSTREAM_SEGMENTSIZE : (bbU32)(size - copied);
+
+                        if ((!pCopyBuf && ((pCopyBuf = (bbU8*)bbMemAlloc(dtBUFFERSTREAM_SEGMENTSIZE)) == NULL)) ||
+                            (ReadPatched(fileoffset + copied, pCopyBuf, tocopy) != bbEOK) ||
+                            (mTempFile.WriteAt(mTempFileSize + copied, pCopyBuf, tocopy) != bbEOK))
+                        {
+                            goto err;
+                        }
+                        copied += tocopy;
+                    }
+
+                    pRun->mFileOffset = mTempFileSize | dtHISTORYRUN_TEMP;
+                    mTempFileSize += size;
+                }
+
+                tempundo = 1;
+                pRun++;
+            }
+        }
+
+        pos -= len;
+    }
+
+    bbMemFree(pCopyBuf);
+    mTempUndo = tempundo;
+    return bbEOK;
+
+    err:
+    // runs spilled so far stay valid, the rest still references the unchanged file
+    bbMemFree(pCopyBuf);
+    mTempUndo |= tempundo;
+    return bbELAST;
+}
+
+bbERR dtBufferStream::SaveSerial(const bbCHAR* const pPath)
+{
+    dtFileIO out;
+    dtFileIO src[2];    // [0] underlying file for Null segments, [1] temp file for Temp segments
+    bbU8*   pCopyMem = NULL;
+    bbU8*   pCopyBuf = NULL;    // pCopyMem aligned for direct I/O
+    bbU32   copysize = dtBUFFERSTREAM_SEGMENTSIZE;
+    bbUINT  copycount = mAsyncIO ? dtBUFFERSTREAM_SAVEBUFFERS : 1;
+    bbU32   chunks[dtBUFFERSTREAM_SAVEBUFFERS];
+    bbU64   outoffset = 0;
+    bbU32   idx;
+    bbUINT  i;
+    int     kernelcopy = 1; // cleared once the kernel refuses to copy
+
+    //
+    // Allocate copy buffers
+    //
+    if (mFile.mhFile || mTempFile.mhFile)
     {
         for(;;)
         {
-            pCopyBuf = (bbU8*)bbMemAlloc(copysize);
-            if (!pCopyBuf)
+            pCopyMem = (bbU8*)bbMemAlloc(copysize * copycount + dtSTREAMFILE_DIRECTALIGN);
+            if (!pCopyMem)
             {
+                if (copycount > 1)
+                {
+                    copycount = copycount >> 1;
+                    continue;
+                }
                 copysize = copysize >> 1;
                 if (copysize >= 4096)
                     continue;
@@ -180,12 +571,13 @@ bbERR dtBufferStream::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
             }
             break;
         }
+        pCopyBuf = (bbU8*)(((bbUPTR)pCopyMem + dtSTREAMFILE_DIRECTALIGN - 1) &~ (bbUPTR)(dtSTREAMFILE_DIRECTALIGN - 1));
     }
 
     //
     // Get save file handle
     //
-    if ((hFile = bbFileOpen( (savetype==dtBUFFERSAVETYPE_INPLACE) ? pTmpName : pPath, bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC)) == NULL)
+    if (out.Open(pPath, bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC, GetIOOpt()) != bbEOK)
         goto err;
 
     //
@@ -198,28 +590,75 @@ bbERR dtBufferStream::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
 
         dtSegment* pSegment = mSegments.GetPtr(idx);
 
-        if (pSegment->mType == dtSEGMENTTYPE_NULL)
+        if (pSegment->mType != dtSEGMENTTYPE_MAP)
         {
-            if (bbU64 size = pSegment->mFileSize)
+            // copy Null segments from file, Temp segments from temp file
+            int const istemp = (pSegment->mType == dtSEGMENTTYPE_TEMP);
+            dtFileIO& in = src[istemp];
+            bbU64 srcoffset = pSegment->mFileOffset;
+            bbU64 size = pSegment->GetSize();
+
+            if (size && !in.IsOpen() &&
+                (in.Open(istemp ? mpTempName : mpName, bbFILEOPEN_READ, GetIOOpt()) != bbEOK))
+            {
+                goto err;
+            }
+
+            // copy unchanged file data within the kernel, or reflink it
+            while (!istemp && kernelcopy && size)
             {
-                if (bbFileSeek(mhFile, pSegment->mFileOffset, bbFILESEEK_SET) != bbEOK)
+                bbU64 const tocopy = size > dtBUFFER_SAVEPROGRESSSTEP ? dtBUFFER_SAVEPROGRESSSTEP : size;
+                bbU64 const copied = out.CopyFrom(in, srcoffset, outoffset, tocopy);
+                if (copied < tocopy)
+                    kernelcopy = 0;
+                srcoffset += copied;
+                outoffset += copied;
+                size -= copied;
+
+                if (SaveProgress(outoffset) != bbEOK)
                     goto err;
+            }
+
+            // read a batch of chunks, then write the batch
+            while (size)
+            {
+                bbUINT count = 0;
 
-                while(size)
+                while (size && (count < copycount))
                 {
-                    bbU32 tocopy = size > copysize ? copysize : (bbU32)size;
+                    bbU32 const tocopy = size > copysize ? copysize : (bbU32)size;
+                    if (in.Read(srcoffset, pCopyBuf + count * copysize, tocopy) != bbEOK)
+                        goto err;
+                    chunks[count++] = tocopy;
+                    srcoffset += tocopy;
                     size -= tocopy;
-                    if ((bbFileRead(mhFile, pCopyBuf, tocopy) != bbEOK) ||
-                        (bbFileWrite(hFile, pCopyBuf, tocopy) != bbEOK))
-                    {
+                }
+
+                if (in.Flush() != bbEOK)
+                    goto err;
+
+                for (i = 0; i < count; i++)
+                {
+                    if (out.Write(outoffset, pCopyBuf + i * copysize, chunks[i]) != bbEOK)
                         goto err;
-                    }
+                    outoffset += chunks[i];
                 }
+
+                if (out.Flush() != bbEOK) // copy buffers are reused
+                    goto err;
+
+                if (SaveProgress(outoffset) != bbEOK)
+                    goto err;
             }
         }
         else
         {
-            if (bbFileWrite(hFile, pSegment->mpData, pSegment->mSize) != bbEOK)
+            // segment data is not copied, it stays valid until flushed
+            if (out.Write(outoffset, pSegment->mpData, pSegment->mSize) != bbEOK)
+                goto err;
+            outoffset += pSegment->mSize;
+
+            if (SaveProgress(outoffset) != bbEOK)
                 goto err;
         }
 
@@ -227,1042 +666,3045 @@ bbERR dtBufferStream::OnSave(const bbCHAR* pPath, dtBUFFERSAVETYPE savetype)
 
     } while (idx != mSegmentUsedFirst);
 
-    bbFileClose(hFile);
-    hFile = NULL;
-
-    OnClose();
-
-    if (savetype == dtBUFFERSAVETYPE_INPLACE)
-    {
-        if ((bbEOK != bbFileDelete(mpName)) ||
-            (bbEOK != bbFileRename(pTmpName, pPath)))
-        {
-            bbLog(bbErr, bbT("Save error, cannot rename %s to %s"), pTmpName, pPath);
-            mhFile = bbFileOpen(pPath, bbFILEOPEN_READ); // try to recover
-            goto err;
-        }
-
-        bbMemFree(pCopyBuf);
-        bbMemFree(pTmpName);
-    }
-
-    if (bbEOK != OnOpen(pPath, 0))
+    if ((out.Flush() != bbEOK) || (SavePatches(out.GetFile()) != bbEOK))
         goto err;
 
+    bbMemFree(pCopyMem);
     return bbEOK;
 
     err:
-    bbFileClose(hFile);
-    if (pTmpName)
-    {
-        bbFileDelete(pTmpName);
-        bbMemFree(pTmpName);
-    }
-    bbMemFree(pCopyBuf);
+    bbMemFree(pCopyMem);
     return bbELAST;
 }
 
-void dtBufferStream::ClearSegments()
+/** Unit of work for dtBufferStream::SaveParallel(). */
+struct dtSaveJob
 {
-    mSegmentLastMapped = (bbU32)-1;
+    bbU64   mOffset;    //!< Output file offset
+    bbU64   mSrcOffset; //!< Source file offset for Null and Temp segments
+    bbU8*   mpData;     //!< Data of Map segment
+    bbU32   mSize;      //!< Number of bytes
+    bbU8    mType;      //!< Segment type, see dtSEGMENTTYPE
+};
 
-    if (mSegments.GetSize())
-    {
-        bbU32 walk = mSegmentUsedLast;
-        do
-        {
-            dtSegment* const pWalk = mSegments.GetPtr(walk);
+/** Shared state of dtBufferStream::SaveParallel() workers. */
+struct dtSaveContext
+{
+    dtBufferStream*     mpBuf;
+    const bbCHAR*       mpPath;         //!< Output file, opened by each worker
+    dtStreamFile*       mpSrc[2];       //!< [0] underlying file, [1] temp file
+    dtSaveJob*          mpJobs;
+    bbU32               mJobCount;
+    std::atomic<bbU32>  mNextJob;       //!< Index of next job to pick
+    std::atomic<int>    mErr;           //!< Error code of first failure, or bbEOK
+    std::atomic<int>    mKernelCopy;    //!< Cleared once the kernel refuses to copy
+    std::atomic<bbU64>  mWritten;       //!< Number of bytes of finished jobs
+};
 
-            if (pWalk->mType == dtSEGMENTTYPE_MAP)
-                bbMemFree(pWalk->mpData);
+void dtBufferStream::SaveWorker(dtSaveContext* const pCtx, int const report)
+{
+    dtFileIO out;
+    bbU8*   pCopyMem = NULL;
+    bbU8*   pCopyBuf[2] = { NULL, NULL }; // double buffer, reading one chunk while the other is written
+    bbERR   err = bbEOK;
 
-            walk = pWalk->mPrev;
+    // own handle, so that queued requests of this worker are flushed independently
+    if (out.Open(pCtx->mpPath, bbFILEOPEN_READWRITE, pCtx->mpBuf->GetIOOpt()) != bbEOK)
+        err = bbEFILEWRITE;
 
-        } while (walk != mSegmentUsedLast);
-    }
+    while (err == bbEOK)
+    {
+        bbU32 const job = pCtx->mNextJob.fetch_add(1);
+        if ((job >= pCtx->mJobCount) || (pCtx->mErr.load() != bbEOK))
+            break;
 
-    dtSegmentTree::ClearSegments();
+        dtSaveJob* const pJob = &pCtx->mpJobs[job];
+
+        if (pJob->mType == dtSEGMENTTYPE_MAP)
+        {
+            if ((out.Write(pJob->mOffset, pJob->mpData, pJob->mSize) != bbEOK) || (out.Flush() != bbEOK))
+            {
+                err = bbEFILEWRITE;
+                break;
+            }
+        }
+        else
+        {
+            dtStreamFile* const pSrc = pCtx->mpSrc[pJob->mType == dtSEGMENTTYPE_TEMP];
+            bbU64 srcoffset = pJob->mSrcOffset;
+            bbU64 offset = pJob->mOffset;
+            bbU32 size = pJob->mSize;
+            bbU32 ready = 0;    // bytes read into pCopyBuf[0], to be written at offset
+
+            if ((pJob->mType == dtSEGMENTTYPE_NULL) && pCtx->mKernelCopy.load())
+            {
+                bbU32 const copied = (bbU32)out.GetFile().CopyFrom(*pSrc, srcoffset, offset, size);
+                if (copied < size)
+                    pCtx->mKernelCopy = 0;
+                srcoffset += copied;
+                offset += copied;
+                size -= copied;
+            }
+
+            if (size && !pCopyMem)
+            {
+                if ((pCopyMem = (bbU8*)bbMemAlloc(dtBUFFERSTREAM_SEGMENTSIZE * 2 + dtSTREAMFILE_DIRECTALIGN)) == NULL)
+                {
+                    err = bbENOMEM;
+                    break;
+                }
+                pCopyBuf[0] = (bbU8*)(((bbUPTR)pCopyMem + dtSTREAMFILE_DIRECTALIGN - 1) &~ (bbUPTR)(dtSTREAMFILE_DIRECTALIGN - 1));
+                pCopyBuf[1] = pCopyBuf[0] + dtBUFFERSTREAM_SEGMENTSIZE;
+            }
+
+            //
+            // Write chunk N and read chunk N+1 in one batch
+            //
+            while (size || ready)
+            {
+                bbU32 const tocopy = size > dtBUFFERSTREAM_SEGMENTSIZE ? dtBUFFERSTREAM_SEGMENTSIZE : size;
+
+                if ((ready && (out.Write(offset, pCopyBuf[0], ready) != bbEOK)) ||
+                    (tocopy && (out.ReadFrom(*pSrc, srcoffset, pCopyBuf[1], tocopy) != bbEOK)) ||
+                    (out.Flush() != bbEOK))
+                {
+                    err = bbErrGet(); // error of this thread, passed to the caller via mErr
+                    break;
+                }
+
+                bbU8* const pTmp = pCopyBuf[0];
+                pCopyBuf[0] = pCopyBuf[1];
+                pCopyBuf[1] = pTmp;
+
+                offset += ready;
+                srcoffset += tocopy;
+                size -= tocopy;
+                ready = tocopy;
+            }
+
+            if (err != bbEOK)
+                break;
+        }
+
+        bbU64 const written = (pCtx->mWritten += pJob->mSize);
+
+        // only the calling thread reports progress, others check for cancellation
+        if (report ? (pCtx->mpBuf->SaveProgress(written) != bbEOK) : pCtx->mpBuf->IsSaveCancelled())
+        {
+            err = dtECANCELLED;
+            break;
+        }
+    }
+
+    if (err != bbEOK)
+    {
+        int expected = bbEOK;
+        pCtx->mErr.compare_exchange_strong(expected, err);
+    }
+
+    bbMemFree(pCopyMem);
 }
 
-bbERR dtBufferStream::Delete(bbU64 const offset, bbU64 size, void* const user)
+bbERR dtBufferStream::SaveParallel(const bbCHAR* const pPath)
 {
-    if ((offset + size) >= mBufSize)
+    dtStreamFile    out;
+    dtSaveContext   ctx;
+    std::thread     threads[dtBUFFERSTREAM_MAXSAVETHREADS];
+    bbUINT          threadcount = 0;
+    bbU64           offset = 0;
+    bbU32           count = 0;
+    bbU32           idx;
+    bbUINT          i;
+
+    //
+    // Positional I/O is required for concurrent access to the files
+    //
+    if (out.Open(pPath, bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC, 0) == NULL)
+        return bbELAST;
+
+    if ((out.mFd < 0) || (mFile.mhFile && (mFile.mFd < 0)) || (mTempFile.mhFile && (mTempFile.mFd < 0)))
     {
-        if (((offset + size) > mBufSize) || (offset == mBufSize))
-            return bbErrSet(bbEBADPARAM);
+        out.Close();
+        return SaveSerial(pPath);
     }
 
-    if (!size)
-        return bbEOK;
+    //
+    // Precompute output offsets, Null and Temp segments are split into chunks of
+    // dtBUFFERSTREAM_SAVECHUNK bytes to spread them over the workers
+    //
+    idx = mSegmentUsedFirst;
+    do
+    {
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU64 const size = pSegment->GetSize();
 
-    #ifdef bbDEBUG
-    SaveTree(DEL, offset, size);
-    #endif
+        count += (pSegment->mType == dtSEGMENTTYPE_MAP) ? 1 : (bbU32)((size + dtBUFFERSTREAM_SAVECHUNK - 1) / dtBUFFERSTREAM_SAVECHUNK);
+        idx = pSegment->mNext;
 
-    bbU64 const size_org = size;
+    } while (idx != mSegmentUsedFirst);
 
-    bbU8* pUndo = NULL;
-    if (!mUndoActive)
+    if (!count)
+        return bbEOK;
+
+    if ((ctx.mpJobs = (dtSaveJob*)bbMemAlloc(count * sizeof(dtSaveJob))) == NULL)
+        return bbELAST;
+
+    count = 0;
+    idx = mSegmentUsedFirst;
+    do
     {
-        if ((pUndo = mHistory.Push(dtCHANGE_DELETE, offset, size, mUndoPoint!=0)) == NULL)
-            return bbELAST;
-        mUndoPoint = 0;
-        UpdateCanUndoState();
-    }
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU64 size = pSegment->GetSize();
+        bbU64 srcoffset = pSegment->mFileOffset;
 
-    mSegmentLastMapped = (bbU32)-1;
+        while (size)
+        {
+            dtSaveJob* const pJob = &ctx.mpJobs[count++];
+            bbU32 const chunk = ((pSegment->mType == dtSEGMENTTYPE_MAP) || (size <= dtBUFFERSTREAM_SAVECHUNK)) ? (bbU32)size : dtBUFFERSTREAM_SAVECHUNK;
+
+            pJob->mOffset    = offset;
+            pJob->mSrcOffset = srcoffset;
+            pJob->mpData     = pSegment->mpData;
+            pJob->mSize      = chunk;
+            pJob->mType      = pSegment->mType;
+
+            offset += chunk;
+            srcoffset += chunk;
+            size -= chunk;
+        }
 
-    bbU64 segmentstart, segmentoffset;
-    bbU32 del = (bbU32)-1;
-    bbU32 idx = FindSegment(offset, &segmentstart, 0);
-    dtSegment* pSegment = mSegments.GetPtr(idx);
+        idx = pSegment->mNext;
+
+    } while (idx != mSegmentUsedFirst);
+
+    bbASSERT(offset == mBufSize);
 
     //
-    // Align pSegment start to delete offset
+    // Run workers, the calling thread is one of them
     //
-    if ((segmentoffset = offset - segmentstart) != 0)
+    ctx.mpBuf     = this;
+    ctx.mpPath    = pPath;
+    ctx.mpSrc[0]  = &mFile;
+    ctx.mpSrc[1]  = &mTempFile;
+    ctx.mJobCount = count;
+    ctx.mNextJob  = 0;
+    ctx.mErr      = bbEOK;
+    ctx.mKernelCopy = 1;
+    ctx.mWritten  = 0;
+
+    for (i = 1; (i < mSaveThreads) && (i < count); i++)
     {
-        bbASSERT(segmentoffset < pSegment->GetSize());
+        try
+        {
+            threads[threadcount] = std::thread(&dtBufferStream::SaveWorker, &ctx, 0);
+            threadcount++;
+        }
+        catch (...)
+        {
+            break; // continue with fewer workers
+        }
+    }
 
-        if (pSegment->mType == dtSEGMENTTYPE_NULL)
+    SaveWorker(&ctx, 1);
+
+    for (i = 0; i < threadcount; i++)
+        threads[i].join();
+
+    bbMemFree(ctx.mpJobs);
+
+    if (ctx.mErr.load() != bbEOK)
+        return bbErrSet(ctx.mErr.load());
+
+    if (SavePatches(out) != bbEOK)
+        return bbELAST;
+
+    SaveProgress(ctx.mWritten); // other workers may have finished last, all data is written
+    return bbEOK;
+}
+
+int dtBufferStream::IsOverwriteOnly()
+{
+    if (mBufSize != mFileSize)
+        return 0;
+
+    bbU64 offset = 0;
+    bbU32 idx = mSegmentUsedFirst;
+    do
+    {
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+
+        // data read from the original file must stay where it is
+        if (((pSegment->mType == dtSEGMENTTYPE_NULL) ||
+             ((pSegment->mType == dtSEGMENTTYPE_MAP) && !pSegment->mChanged)) &&
+            (pSegment->mFileOffset != offset))
         {
-            //
-            //        |-Del--... ->           |-Del--...
-            // |-Null-------...       |-Null--|-Null--...
-            //
+            return 0;
+        }
 
-            // Insert a new Null segment
+        offset += pSegment->GetSize();
+        idx = pSegment->mNext;
 
-            idx = SplitNullSegment(idx, segmentoffset); // invalidates any dtSegment*
-            if (idx == (bbU32)-1)
+    } while (idx != mSegmentUsedFirst);
+
+    return 1;
+}
+
+bbERR dtBufferStream::SavePatch(const bbCHAR* const pPath)
+{
+    dtStreamFile patch;
+    bbU8*  pCopyBuf = NULL;
+    bbU64  offset = 0;
+    bbU32  idx;
+
+    if (patch.Open(pPath, bbFILEOPEN_READWRITE, mDirectIO) == NULL)
+        return bbELAST;
+
+    idx = mSegmentUsedFirst;
+    do
+    {
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+
+        if ((pSegment->mType == dtSEGMENTTYPE_MAP) && pSegment->mChanged)
+        {
+            if (patch.WriteAt(offset, pSegment->mpData, pSegment->mSize) != bbEOK)
+                goto err;
+        }
+        else if (pSegment->mType == dtSEGMENTTYPE_TEMP)
+        {
+            if (!pCopyBuf && ((pCopyBuf = (bbU8*)bbMemAlloc(dtBUFFERSTREAM_SEGMENTSIZE)) == NULL))
+                goto err;
+
+            for (bbU32 pos = 0; pos < pSegment->mSize; )
             {
-                if (pUndo)
-                    mHistory.PushRevert();
-                return bbELAST;
+                bbU32 const tocopy = (pSegment->mSize - pos) > dtBUFFERSTREAM_SEGMENTSIZE ? dtBUFFERSTREAM_SEGMENTSIZE : (pSegment->mSize - pos);
+
+                if ((mTempFile.ReadAt(pSegment->mFileOffset + pos, pCopyBuf, tocopy) != bbEOK) ||
+                    (patch.WriteAt(offset + pos, pCopyBuf, tocopy) != bbEOK))
+                {
+                    goto err;
+                }
+                pos += tocopy;
             }
         }
-        else
+
+        offset += pSegment->GetSize();
+        idx = pSegment->mNext;
+
+        SaveProgress(offset); // a partially patched file is worse than finishing, ignore cancellation
+
+    } while (idx != mSegmentUsedFirst);
+
+    if (SavePatches(patch) != bbEOK)
+        goto err;
+
+    bbMemFreeNull((void**)&pCopyBuf);
+    patch.Close();
+
+    RebaseSegments();
+    CloseFile();
+    if (!mTempUndo)
+        CloseTempFile();
+
+    if ((bbEOK != OpenFile(pPath)) || (mFileSize != mBufSize))
+    {
+        OnClose();
+        return bbELAST;
+    }
+
+    return bbEOK;
+
+    err:
+    bbLog(bbErr, bbT("Save error, %s may be partially patched"), pPath);
+    bbMemFree(pCopyBuf);
+    return bbELAST;
+}
+
+void dtBufferStream::ClearSegments(int const freedata)
+{
+    mSegmentLastMapped = (bbU32)-1;
+    mGapSegment = (bbU32)-1;
+    mLRUFirst = (bbU32)-1;
+    mCacheSize = 0;
+    mDirtyFirst = (bbU32)-1;
+    mDirtySize = 0;
+
+    if (freedata && mSegments.GetSize())
+    {
+        bbU32 walk = mSegmentUsedLast;
+        do
         {
-            bbASSERT(segmentoffset <= 0xFFFFFFFFUL);
+            dtSegment* const pWalk = mSegments.GetPtr(walk);
 
-            if (size <= (pSegment->mSize - (bbU32)segmentoffset))
-            {
-                // Shortcut: if segment is Map, and delete area is within the segment,
-                //           just reduce its size and return
-                //
-                //       |-Del-|                    |-Del-|
-                //       |     |          ->        |/
-                // |-Map----------|-X--...    |-Map-|--|-X--...
-                //
+            if ((pWalk->mType == dtSEGMENTTYPE_MAP) && !IsFileMapped(pWalk->mpData))
+                mpAlloc->Free(pWalk->mpData);
 
-                bbU32 const delend = (bbU32)segmentoffset + (bbU32)size;
-                bbASSERT(delend <= pSegment->mSize);
-                if (pUndo)
-                    bbMemMove(pUndo, pSegment->mpData + (bbU32)segmentoffset, (bbU32)size);
-                bbMemMove(pSegment->mpData + (bbU32)segmentoffset,
-                          pSegment->mpData + delend,
-                          pSegment->mSize - delend);
-                bbMemRealloc(pSegment->mSize -= (bbU32)size, (void**)&pSegment->mpData);
+            walk = pWalk->mPrev;
 
-                NodeSubstractOffset(idx, segmentstart, size); // adjust relative offsets in index tree
-                #ifdef bbDEBUG
-                CheckTree();
-                #endif
+        } while (walk != mSegmentUsedLast);
+    }
 
-                pSegment->mChanged = 1;
+    PatchClear();
+    dtSegmentTree::ClearSegments();
+}
 
-                bbASSERT(size <= mBufSize);
-                mBufSize -= (bbU32)size;
+/** Writer for the history payload of a deletion, see dtBufferStream::Delete(). */
+struct dtDeleteUndo
+{
+    bbU8*         mpStart;  //!< Start of payload, or NULL if no history is recorded
+    bbU8*         mpPos;    //!< Write position
+    dtHistoryRun* mpRun;    //!< Last written run, or NULL
+    int           mRuns;    //!< !=0 if payload is a dtHistoryRun list, 0 if it is a plain copy
 
-                NotifyChange(dtCHANGE_DELETE, offset, size, user);
-                return bbEOK;
-            }
+    dtHistoryRun* NewRun(bbU64 const fileoffset)
+    {
+        mpPos = mpStart + dtHISTORYRUN_PAD((bbUPTR)(mpPos - mpStart));
+        mpRun = (dtHistoryRun*)mpPos;
+        mpRun->mFileOffset = fileoffset;
+        mpRun->mSize = 0;
+        mpPos += sizeof(dtHistoryRun);
+        return mpRun;
+    }
 
-            //      ->|ovl|<-               ->|ovl|<-        ovl is overlapping area in bytes
-            //        |-Del--...  ->          |   |-Del--... size -= ovl
-            // |-Map------|-X--...     |-Map--|   |-X--...   Map->mSize -= ovl
-            //
+    /** Append data bytes.
+        @param size Number of bytes
+        @return Pointer to receive \a size bytes
+    */
+    bbU8* Data(bbU64 const size)
+    {
+        if (mRuns && size && (!mpRun || (mpRun->mFileOffset != dtHISTORYRUN_DATA)))
+            NewRun(dtHISTORYRUN_DATA);
+
+        bbU8* const pData = mpPos;
+        if (mRuns && size)
+            mpRun->mSize += size;
+        mpPos += (bbUPTR)size;
+        return pData;
+    }
 
-            if ((del = NewSegment()) == (bbU32)-1) // allocate empty segment header, beyound this point the buffer
-            {
-                if (pUndo)
-                    mHistory.PushRevert();
-                return bbELAST;                    // gets modified, so this will be the last call that may fail
-            }
-            pSegment = mSegments.GetPtr(idx); // memory may have moved
+    /** Append reference to underlying file, merged with a contiguous preceding reference.
+        @param fileoffset Offset in underlying file
+        @param size Number of bytes
+    */
+    void File(bbU64 const fileoffset, bbU64 const size)
+    {
+        bbASSERT(mRuns);
 
-            bbASSERT(segmentoffset < pSegment->mSize);
-            bbU32 const ovl = pSegment->mSize - (bbU32)segmentoffset;
+        if (!size)
+            return;
 
-            if (pUndo)
-            {
-                bbMemMove(pUndo, pSegment->mpData + (bbU32)segmentoffset, ovl);
-                pUndo += ovl;
-            }
+        if (!mpRun || (mpRun->mFileOffset == dtHISTORYRUN_DATA) ||
+            ((mpRun->mFileOffset + mpRun->mSize) != fileoffset))
+        {
+            NewRun(fileoffset);
+        }
 
-            bbMemRealloc(pSegment->mSize = (bbU32)segmentoffset, (void**)&pSegment->mpData);
+        mpRun->mSize += size;
+    }
+};
 
-            NodeSubstractOffset(idx, segmentstart, ovl); // adjust relative offsets in index tree
-            #ifdef bbDEBUG
-            CheckTree();
-            #endif
+bbU64 dtBufferStream::GetDeleteRunsSize(bbU64 const offset, bbU64 const size)
+{
+    bbU64 const end = offset + size;
+    bbU64 runssize = 0;
+    bbU64 segmentstart;
+    int refs = 0;
+    bbU32 idx = FindSegment(offset, &segmentstart, 0);
 
-            pSegment->mChanged = 1;
+    for(;;)
+    {
+        const dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU64 const segmentend = segmentstart + pSegment->GetSize();
+        bbU64 const piece = ((segmentend < end) ? segmentend : end) - ((segmentstart > offset) ? segmentstart : offset);
 
-            bbASSERT(ovl < size);
-            size -= ovl;
-            mBufSize -= ovl;
+        if (piece)
+        {
+            runssize += sizeof(dtHistoryRun);
 
-            idx = pSegment->mNext;
+            if (pSegment->mType == dtSEGMENTTYPE_NULL)
+                refs = 1;
+            else if ((pSegment->mType != dtSEGMENTTYPE_MAP) || pSegment->mChanged || (piece != pSegment->mSize))
+                runssize += dtHISTORYRUN_PAD(piece);
         }
+
+        if (segmentend >= end)
+            break;
+
+        segmentstart = segmentend;
+        idx = pSegment->mNext;
     }
 
-    if (del == (bbU32)-1)
+    return refs ? runssize : 0;
+}
+
+bbERR dtBufferStream::RecordDelete(dtDeleteUndo* const pUndo, bbU64 const offset, bbU64 const size)
+{
+    bbU64 const end = offset + size;
+    bbU64 segmentstart;
+    bbU32 idx = FindSegment(offset, &segmentstart, 0);
+
+    for(;;)
+    {
+        const dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU64 const segmentend = segmentstart + pSegment->GetSize();
+        bbU64 const start = (segmentstart > offset) ? segmentstart - offset : 0; // piece start relative to offset
+        bbU64 const skip = (segmentstart < offset) ? offset - segmentstart : 0;  // piece start relative to segment
+        bbU64 const piece = ((segmentend < end) ? segmentend : end) - offset - start;
+
+        if (piece)
+        {
+            if (pSegment->mType == dtSEGMENTTYPE_MAP)
+            {
+                if (pUndo->mRuns && !pSegment->mChanged && (piece == pSegment->mSize))
+                    pUndo->File(pSegment->mFileOffset, piece);
+                else
+                    bbMemMove(pUndo->Data(piece), pSegment->mpData + (bbU32)skip, (bbU32)piece);
+            }
+            else if (pSegment->mType == dtSEGMENTTYPE_TEMP)
+            {
+                bbASSERT(piece == pSegment->mSize); // partially deleted Temp segment was loaded
+                if (mTempFile.ReadAt(pSegment->mFileOffset, pUndo->Data(piece), (bbU32)piece) != bbEOK)
+                    return bbELAST;
+            }
+            else if (pUndo->mRuns)
+            {
+                pUndo->File(pSegment->mFileOffset + skip, piece);
+            }
+            else if (ReadPatched(pSegment->mFileOffset + skip, pUndo->Data(piece), (bbU32)piece) != bbEOK)
+            {
+                return bbELAST;
+            }
+        }
+
+        if (segmentend >= end)
+            break;
+
+        segmentstart = segmentend;
+        idx = pSegment->mNext;
+    }
+
+    return bbEOK;
+}
+
+bbERR dtBufferStream::Delete(bbU64 const offset, bbU64 size, void* const user)
+{
+    if ((offset + size) >= mBufSize)
+    {
+        if (((offset + size) > mBufSize) || (offset == mBufSize))
+            return bbErrSet(bbEBADPARAM);
+    }
+
+    if (!size)
+        return bbEOK;
+
+    #ifdef bbDEBUG
+    SaveTree(DEL, offset, size);
+    #endif
+
+    bbU64 const size_org = size;
+
+    //
+    // Deletions covering unloaded file data record the file ranges instead of a copy
+    //
+    dtDeleteUndo undo;
+    undo.mpStart = NULL;
+    undo.mpRun = NULL;
+    undo.mRuns = 0;
+    bbU64 runssize = 0;
+    if (!mUndoActive)
+    {
+        runssize = GetDeleteRunsSize(offset, size);
+
+        if (runssize)
+            undo.mpStart = (bbU8*)mHistory.PushRuns(dtCHANGE_DELETE, offset, size, runssize, mUndoPoint!=0);
+        else
+            undo.mpStart = mHistory.Push(dtCHANGE_DELETE, offset, size, mUndoPoint!=0);
+
+        if (!undo.mpStart)
+            return bbELAST;
+
+        undo.mRuns = (runssize != 0);
+        mUndoPoint = 0;
+        UpdateCanUndoState();
+    }
+    undo.mpPos = undo.mpStart;
+
+    mSegmentLastMapped = (bbU32)-1;
+
+    //
+    // Shortcut: delete adjacent to open gap, within its segment
+    //
+    if (mGapSegment != (bbU32)-1)
+    {
+        dtSegment* const pGap = mSegments.GetPtr(mGapSegment);
+        bbU64 const gapstart = mGapSegmentStart + mGapOffset;
+
+        if (((offset == gapstart) || ((offset + size) == gapstart)) &&
+            (offset >= mGapSegmentStart) &&
+            ((offset + size) <= (mGapSegmentStart + pGap->mSize)) &&
+            (size < pGap->mSize)) // keep segment non-empty
+        {
+            LRURemove(mGapSegment);
+
+            if (offset != gapstart)
+                mGapOffset -= (bbU32)size; // delete before gap
+
+            if (undo.mpStart)
+                bbMemMove(undo.Data(size), pGap->mpData + mGapOffset + ((offset == gapstart) ? mGapSize : 0), (bbU32)size);
+
+            mGapSize += (bbU32)size;
+            pGap->mSize -= (bbU32)size;
+
+            NodeSubstractOffset(mGapSegment, mGapSegmentStart, size); // adjust relative offsets in index tree
+            #ifdef bbDEBUG
+            CheckTree();
+            #endif
+
+            LRUAdd(mGapSegment);
+
+            mBufSize -= size;
+
+            NotifyChange(dtCHANGE_DELETE, offset, size, user);
+            CompactNote(offset);
+            return bbEOK;
+        }
+
+        CloseGap();
+    }
+
+    bbU64 segmentstart, segmentoffset;
+    bbU32 del = (bbU32)-1;
+    bbU32 idx = FindSegment(offset, &segmentstart, 0);
+
+    //
+    // Prepare segments, which are deleted only partially, at start and end of delete area
+    //
+    bbU64 tailstart;
+    bbU32 const tail = FindSegment(offset + size, &tailstart, 0);
+
+    if (((segmentstart < offset) && (MakeSegmentWritable(idx, NULL) != bbEOK)) ||
+        (((offset + size) < (tailstart + mSegments[tail].GetSize())) &&
+         (MakeSegmentWritable(tail, NULL) != bbEOK)) ||
+        (undo.mpStart && (RecordDelete(&undo, offset, size) != bbEOK)))
+    {
+        if (undo.mpStart)
+            mHistory.PushRevert();
+        return bbELAST;
+    }
+
+    dtSegment* pSegment = mSegments.GetPtr(idx);
+
+    //
+    // Align pSegment start to delete offset
+    //
+    if ((segmentoffset = offset - segmentstart) != 0)
+    {
+        bbASSERT(segmentoffset < pSegment->GetSize());
+
+        if (pSegment->mType == dtSEGMENTTYPE_NULL)
+        {
+            //
+            //        |-Del--... ->           |-Del--...
+            // |-Null-------...       |-Null--|-Null--...
+            //
+
+            // Insert a new Null segment
+
+            idx = SplitNullSegment(idx, segmentstart, segmentoffset); // invalidates any dtSegment*
+            if (idx == (bbU32)-1)
+            {
+                if (undo.mpStart)
+                    mHistory.PushRevert();
+                return bbELAST;
+            }
+        }
+        else
+        {
+            bbASSERT(segmentoffset <= 0xFFFFFFFFUL);
+
+            if (size <= (pSegment->mSize - (bbU32)segmentoffset))
+            {
+                // Shortcut: if segment is Map, and delete area is within the segment,
+                //           just reduce its size and return
+                //
+                //       |-Del-|                    |-Del-|
+                //       |     |          ->        |/
+                // |-Map----------|-X--...    |-Map-|--|-X--...
+                //
+
+                bbU32 const delend = (bbU32)segmentoffset + (bbU32)size;
+                bbASSERT(delend <= pSegment->mSize);
+                LRURemove(idx);
+
+                if (mGapReserve && (size <= mGapReserve))
+                {
+                    // leave deleted area as gap, following inserts and deletes at this position move no data
+                    pSegment->mSize -= (bbU32)size;
+                    mGapSegment      = idx;
+                    mGapSegmentStart = segmentstart;
+                    mGapOffset       = (bbU32)segmentoffset;
+                    mGapSize         = (bbU32)size;
+                }
+                else
+                {
+                    bbMemMove(pSegment->mpData + (bbU32)segmentoffset,
+                              pSegment->mpData + delend,
+                              pSegment->mSize - delend);
+                    pSegment->mSize -= (bbU32)size;
+                    ReserveSegmentData(pSegment, pSegment->mSize);
+                }
+
+                NodeSubstractOffset(idx, segmentstart, size); // adjust relative offsets in index tree
+                #ifdef bbDEBUG
+                CheckTree();
+                #endif
+
+                pSegment->mChanged = 1;
+                LRUAdd(idx);
+
+                bbASSERT(size <= mBufSize);
+                mBufSize -= (bbU32)size;
+
+                NotifyChange(dtCHANGE_DELETE, offset, size, user);
+                CompactNote(offset);
+                return bbEOK;
+            }
+
+            //      ->|ovl|<-               ->|ovl|<-        ovl is overlapping area in bytes
+            //        |-Del--...  ->          |   |-Del--... size -= ovl
+            // |-Map------|-X--...     |-Map--|   |-X--...   Map->mSize -= ovl
+            //
+
+            if ((del = NewSegment()) == (bbU32)-1) // allocate empty segment header, beyound this point the buffer
+            {
+                if (undo.mpStart)
+                    mHistory.PushRevert();
+                return bbELAST;                    // gets modified, so this will be the last call that may fail
+            }
+            pSegment = mSegments.GetPtr(idx); // memory may have moved
+
+            bbASSERT(segmentoffset < pSegment->mSize);
+            bbU32 const ovl = pSegment->mSize - (bbU32)segmentoffset;
+
+            LRURemove(idx);
+
+            ReserveSegmentData(pSegment, pSegment->mSize = (bbU32)segmentoffset);
+
+            NodeSubstractOffset(idx, segmentstart, ovl); // adjust relative offsets in index tree
+            #ifdef bbDEBUG
+            CheckTree();
+            #endif
+
+            pSegment->mChanged = 1;
+            LRUAdd(idx);
+
+            bbASSERT(ovl < size);
+            size -= ovl;
+            mBufSize -= ovl;
+
+            idx = pSegment->mNext;
+        }
+    }
+
+    if (del == (bbU32)-1)
+    {
+        // delete segment header hasn't been alloced yet
+        if ((del = NewSegment()) == (bbU32)-1)
+        {
+            if (undo.mpStart)
+                mHistory.PushRevert();
+            return bbELAST;
+        }
+    }
+
+    #ifdef bbDEBUG
+    CheckTree();
+    gCheckTreeDisable = 1;
+    #endif
+
+    // - at this point the delete offset lies on a segment boundary
+
+    pSegment = mSegments.GetPtr(idx);
+    bbU32 const prev = pSegment->mPrev;
+
+    //
+    // prev |del           |
+    //      |idx|idx|idx|tail|
+    //
+
+    bbASSERT(mBufSize >= size);
+    mBufSize -= size;
+
+    //
+    // Eat all segments which are fully covered by the delete area
+    //
+    bbU64 delfilesize = 0;
+    for(;;)
+    {
+        bbU64 segmentsize = pSegment->GetSize();
+
+        if (size < segmentsize)
+            break;
+
+        size -= segmentsize;
+        delfilesize += pSegment->mFileSize;
+
+        if (pSegment->mType == dtSEGMENTTYPE_MAP)
+        {
+            LRURemove(idx);
+            if (!IsFileMapped(pSegment->mpData))
+                mpAlloc->Free(pSegment->mpData);
+        }
+        else if (pSegment->mType == dtSEGMENTTYPE_NULL)
+        {
+            mMappedSize += (bbU32)segmentsize;
+        }
+
+        // unlink node from tree
+        NodeDelete(idx, offset);
+
+        bbU32 const tmp = idx;
+        idx = pSegment->mNext;
+
+        // return segment to free pool
+        pSegment->mNext = mSegmentFree;
+        mSegmentFree = tmp;
+
+        pSegment = mSegments.GetPtr(idx);
+    }
+
+    if ((pSegment->mType == dtSEGMENTTYPE_NULL) || ((idx == mSegmentUsedFirst) && (size==0)))
+    {
+        //
+        // If delete eat loop ended on a Null segment, or at buffer end,
+        // we need to insert a new 0-size Map segment
+        //
+        bbASSERT(pSegment->GetSize() >= size);
+
+        if (size)
+        {
+            //
+            //       |-D-------|
+            // |-----|---|---|-N-| -> |-----|M|N-|
+            //
+            bbASSERT((idx != mSegmentUsedFirst) || (mSegmentUsedFirst == mSegmentUsedLast));
+
+            pSegment->mFileOffset += size;
+            pSegment->mFileSize -= size;
+            NodeSubstractOffset(idx, offset, size);
+            mMappedSize += size;
+        }
+        // else
+        //
+        //       |-D-----|
+        // |-----|---|---|-N-| -> |-----|M|-N-|
+        //
+        //       |-D-----|
+        // |-N---|---|---| -> |-N---|M|
+        //
+        //       |-D-----|
+        // |-M---|---|---| -> |-M---|M|
+        //
+
+        dtSegment* const pSegmentDel = mSegments.GetPtr(del);
+        pSegmentDel->mType = dtSEGMENTTYPE_MAP;
+        pSegmentDel->mChanged = 1;
+        pSegmentDel->mpData = NULL;
+        pSegmentDel->mSize = 0;
+        pSegmentDel->mCapacity = 0;
+        pSegmentDel->mFileSize = delfilesize + size;
+        LRUAdd(del);
+
+        if (mSegmentUsedLast == prev) // special case: del is at buffer start
+        {
+            // did delete eat loop end with buffer wrap? If it ate nothing, idx is still the first
+            // segment, but then a Null segment is left partially deleted
+            if ((idx == mSegmentUsedFirst) && (size == 0))
+            {
+                mSegmentUsedLast = del;
+            }
+            else
+            {
+                pSegmentDel->mNext = idx;
+                pSegment->mPrev = del;
+            }
+
+            mSegmentUsedFirst = del;
+
+            pSegmentDel->mPrev = mSegmentUsedLast;
+            mSegments[mSegmentUsedLast].mNext = del;
+
+            // link as leftmost tree node
+            NodeLinkFirst(del);
+        }
+        else
+        {
+            if (idx == mSegmentUsedFirst) // did delete eat loop end with buffer wrap?
+                mSegmentUsedLast = del;
+
+            pSegmentDel->mNext = idx;
+            pSegment->mPrev = del;
+
+            pSegmentDel->mPrev = prev;
+            mSegments[prev].mNext = del;
+
+            NodeLinkRight(del, prev, offset - mSegments[prev].GetSize());
+        }
+    }
+    else
+    {
+        bbASSERT(pSegment->mSize >= size);
+        bbASSERT((pSegment->mType == dtSEGMENTTYPE_MAP) || (size == 0)); // partially deleted Temp segment was loaded
+
+        if (pSegment->mType == dtSEGMENTTYPE_MAP)
+            LRURemove(idx);
+
+        //
+        //       |-D-------|
+        // |-----|---|---|-M-| -> |-----|M-|
+        //
+        //
+        //       |-D-----|
+        // |-----|---|---|-M-| -> |-----|-M-|
+        //
+
+        if (size)
+        {
+            bbMemMove(pSegment->mpData, pSegment->mpData + size, pSegment->mSize -= (bbU32)size);
+            ReserveSegmentData(pSegment, pSegment->mSize);
+        }
+
+        pSegment->mFileSize += delfilesize;
+        pSegment->mChanged = 1;
+
+        if (pSegment->mType == dtSEGMENTTYPE_MAP)
+            LRUAdd(idx);
+
+        pSegment->mPrev = prev;
+        mSegments[prev].mNext = idx;
+
+        if (mSegmentUsedLast == prev) // deleting from buffer start
+            mSegmentUsedFirst = idx;
+
+        if (size)
+            NodeSubstractOffset(idx, offset, size); // adjust relative offsets in index tree
+
+        // return del segment to free pool
+        mSegments[del].mNext = mSegmentFree;
+        mSegmentFree = del;
+    }
+
+    #ifdef bbDEBUG
+    gCheckTreeDisable = 0;
+    CheckTree();
+    DebugCheckMappedSize();
+    #endif
+
+    bbASSERT(!undo.mRuns || ((bbU64)(undo.mpPos - undo.mpStart) <= runssize));
+
+    NotifyChange(dtCHANGE_DELETE, offset, size_org, user);
+
+    CompactNote(offset);
+
+    return bbEOK;
+}
+
+dtSection* dtBufferStream::Insert(bbU64 const offset, bbU32 const size)
+{
+    if ((offset > mBufSize) || (size == 0))
+    {
+        bbErrSet(bbEBADPARAM);
+        return NULL;
+    }
+
+    mSegmentLastMapped = (bbU32)-1;
+
+    dtSection* const pSection = SectionAlloc();
+    if (!pSection)
+        return NULL;
+
+    pSection->mType   = dtSECTIONTYPE_INSERT;
+    pSection->mOffset = offset;
+    pSection->mSize   = size;
+
+    //
+    // Shortcut: insert at open gap
+    //
+    if (mGapSegment != (bbU32)-1)
+    {
+        if ((offset == (mGapSegmentStart + mGapOffset)) &&
+            (((bbU64)mSegments[mGapSegment].mSize + size + mGapReserve) <= dtBUFFERSTREAM_SEGMENTSIZE_MAX))
+        {
+            if ((mGapSize < size) && (GrowGap(size) != bbEOK))
+            {
+                SectionFree(pSection);
+                return NULL;
+            }
+            return InsertAtGap(pSection);
+        }
+
+        CloseGap();
+    }
+
+    bbU64 segmentstart;
+    bbU32 insert, prev, idx = FindSegment(offset, &segmentstart, 0);
+    bbU64 const segmentoffset = offset - segmentstart;
+    dtSegment* pSegment;
+
+    if (segmentoffset) // insert into middle of a segment -> split into two
+    {
+        if (mSegments[idx].mType == dtSEGMENTTYPE_NULL)
+        {
+            if ((idx = SplitNullSegment(idx, segmentstart, segmentoffset)) == (bbU32)-1)
+                goto dtBufferStream_Insert_err;
+        }
+        else
+        {
+            bbASSERT(segmentoffset <= 0xFFFFFFFFUL);
+
+            if (MakeSegmentWritable(idx, NULL) != bbEOK)
+                goto dtBufferStream_Insert_err;
+
+            // open a gap instead of splitting, if the segment does not grow too large
+            if (mGapReserve && (segmentoffset < mSegments[idx].mSize) &&
+                (((bbU64)mSegments[idx].mSize + size + mGapReserve) <= dtBUFFERSTREAM_SEGMENTSIZE_MAX))
+            {
+                if (OpenGap(idx, segmentstart, (bbU32)segmentoffset, size + mGapReserve) != bbEOK)
+                    goto dtBufferStream_Insert_err;
+                return InsertAtGap(pSection);
+            }
+
+            // split segment inherits mChanged, relink both parts into LRU chain
+            bbU32 const left = idx;
+            int const split = (segmentoffset < mSegments[left].mSize);
+            if (split)
+                LRURemove(left);
+
+            idx = SplitMapSegment(left, segmentstart, (bbU32)segmentoffset);
+
+            if (split)
+            {
+                LRUAdd(left);
+                if (idx != (bbU32)-1)
+                    LRUAdd(idx);
+            }
+
+            if (idx == (bbU32)-1)
+                goto dtBufferStream_Insert_err;
+        }
+    }
+
+    //
+    // At this point, we insert at a segment boundary
+    // idx points to the right segment (first for insert at buffer start or end)
+    //
+
+    prev = mSegments[idx].mPrev;
+    pSegment = mSegments.GetPtr(prev);
+
+    //
+    // 'Replace' case: right segment is size 0 -> replace it
+    // This case exists to eliminate 0-size segments whenever possible
+    // - also covers the empty buffer case (right is same as left segment)
+    // - if left segment is 0 and type Map, it will be covered by the 'Enlarge' case
+    // - if left segment is 0 and type Null, we have a bug
+    //
+    if ((mSegments[idx].GetSize() == 0) && ((idx != mSegmentUsedFirst) || (idx == prev)))
+    {
+        bbASSERT((idx != prev) || (offset == 0)); // if left=right, we should be inserting at buffer start
+        bbASSERT((mSegments[idx].mType == dtSEGMENTTYPE_NULL) || (mSegments[idx].mpData == NULL)); // if Map, then pData should be NULL
+
+        if ((pSection->mpData = (bbU8*)mpAlloc->Alloc(size)) == NULL)
+            goto dtBufferStream_Insert_err;
+
+        pSection->mSegment = idx;
+        pSection->mOpt     = dtSECTIONOPT_INSERT_REPLACE;
+        return pSection;
+    }
+
+    bbASSERT((pSegment->mType!=dtSEGMENTTYPE_NULL) || (pSegment->mFileSize != 0)); // at this point we must not meet 0-sized Null segments
+
+    //
+    // 'Enlarge' case: If previous section is mapped and smaller dtBUFFERSTREAM_SEGMENTSIZE,
+    // append insert at previous segment.
+    //
+
+    if ((pSegment->mType == dtSEGMENTTYPE_MAP) &&
+        (pSegment->mSize < dtBUFFERSTREAM_SEGMENTSIZE) &&
+        !IsFileMapped(pSegment->mpData) &&
+        (offset || !mBufSize)) // prevent shortcut at buffer start, unless buffersize is 0
+    {
+        if (bbEOK != ReserveSegmentData(pSegment, pSegment->mSize + size))
+            goto dtBufferStream_Insert_err;
+
+        pSection->mpData   = pSegment->mpData + pSegment->mSize;
+        pSection->mSegment = prev;
+        pSection->mOpt     = dtSECTIONOPT_INSERT_ENLARGE; // mark that no new node was created in mSegments[]
+        return pSection;
+    }
+
+    //
+    // 'Create' case: new segment and link in between the two existing segments
+    //
+
+    if ((insert = NewSegment()) == (bbU32)-1)
+        goto dtBufferStream_Insert_err;
+
+    pSegment = mSegments.GetPtr(insert);
+
+    if ((pSegment->mpData = (bbU8*)mpAlloc->Alloc(size)) == NULL)
+    {
+        UndoSegment(insert);
+        goto dtBufferStream_Insert_err;
+    }
+
+    pSegment->mType     = dtSEGMENTTYPE_MAP;
+    pSegment->mFileSize = 0;
+    pSegment->mSize     = 0; // set later in Commit, but set to 0 so ReserveSegmentData() in Discard() will free
+    pSegment->mCapacity = size;
+    pSegment->mChanged  = 1;
+
+    pSection->mpData    = pSegment->mpData;
+    pSection->mSegment  = insert;
+    pSection->mOpt      = dtSECTIONOPT_INSERT_CREATE; // mark that new node was created in mSegments[]
+
+    // The new segment will finally be linked in Commit(), or discarded in Discard()
+    pSegment->mNext = idx;
+    pSegment->mPrev = prev;
+
+    return pSection;
+
+    dtBufferStream_Insert_err:
+    SectionFree(pSection);
+    return NULL;
+}
+
+bbERR dtBufferStream::InsertRef(bbU64 const offset, dtSEGMENTTYPE const type, bbU64 const fileoffset, bbU64 const size, void* const user)
+{
+    bbASSERT((offset <= mBufSize) && size);
+    bbASSERT((type == dtSEGMENTTYPE_NULL) ? ((fileoffset + size) <= mFileSize)
+                                          : ((size <= dtBUFFERSTREAM_SEGMENTSIZE) && ((fileoffset + size) <= mTempFileSize)));
+
+    mSegmentLastMapped = (bbU32)-1;
+
+    CloseGap();
+
+    bbU64 segmentstart;
+    bbU32 insert, prev, idx = FindSegment(offset, &segmentstart, 0);
+    bbU64 const segmentoffset = offset - segmentstart;
+    dtSegment* pSegment;
+
+    if (segmentoffset) // insert into middle of a segment -> split into two
+    {
+        if (mSegments[idx].mType == dtSEGMENTTYPE_NULL)
+        {
+            if ((idx = SplitNullSegment(idx, segmentstart, segmentoffset)) == (bbU32)-1)
+                return bbELAST;
+        }
+        else
+        {
+            bbASSERT(segmentoffset <= 0xFFFFFFFFUL);
+
+            if (MakeSegmentWritable(idx, NULL) != bbEOK)
+                return bbELAST;
+
+            // split segment inherits mChanged, relink both parts into LRU chain
+            bbU32 const left = idx;
+            int const split = (segmentoffset < mSegments[left].mSize);
+            if (split)
+                LRURemove(left);
+
+            idx = SplitMapSegment(left, segmentstart, (bbU32)segmentoffset);
+
+            if (split)
+            {
+                LRUAdd(left);
+                if (idx != (bbU32)-1)
+                    LRUAdd(idx);
+            }
+
+            if (idx == (bbU32)-1)
+                return bbELAST;
+        }
+    }
+
+    //
+    // At this point, we insert at a segment boundary
+    // idx points to the right segment (first for insert at buffer start or end)
+    //
+
+    prev = mSegments[idx].mPrev;
+
+    if ((mSegments[idx].GetSize() == 0) && ((idx != mSegmentUsedFirst) || (idx == prev)))
+    {
+        // 'Replace' case: right segment is size 0 -> turn it into the new segment, see Insert()
+        pSegment = mSegments.GetPtr(idx);
+        bbASSERT((pSegment->mType == dtSEGMENTTYPE_NULL) || (pSegment->mpData == NULL));
+
+        if (pSegment->mType == dtSEGMENTTYPE_MAP)
+            LRURemove(idx);
+
+        if (pSegment->mType == dtSEGMENTTYPE_NULL)
+            pSegment->mFileSize = 0;
+
+        insert = idx;
+    }
+    else
+    {
+        // 'Create' case: new segment and link in between the two existing segments
+        if ((insert = NewSegment()) == (bbU32)-1)
+            return bbELAST;
+
+        pSegment = mSegments.GetPtr(insert);
+        pSegment->mFileSize   = 0;
+        pSegment->mNext       = idx;
+        pSegment->mPrev       = prev;
+    }
+
+    pSegment->mType       = (bbU8)type;
+    pSegment->mFileOffset = fileoffset;
+
+    if (type == dtSEGMENTTYPE_NULL)
+    {
+        pSegment->mChanged  = 0;
+        pSegment->mFileSize = size;
+    }
+    else
+    {
+        // Temp segment holding inserted data, replaces no file bytes
+        pSegment->mChanged  = 1;
+        pSegment->mpData    = NULL;
+        pSegment->mSize     = (bbU32)size;
+    }
+
+    if (insert == idx)
+        NodeSubstractOffset(idx, offset, -(bbS64)size);
+    else
+        LinkSegment(insert, offset);
+
+    mBufSize += size;
+
+    if (type == dtSEGMENTTYPE_NULL)
+    {
+        bbASSERT(mMappedSize >= size);
+        mMappedSize -= size;
+
+        //
+        // Merge with contiguous Null neighbours
+        //
+        MergeNullSegment(insert, offset);
+
+        if (insert != mSegmentUsedFirst)
+        {
+            prev = mSegments[insert].mPrev;
+            if (mSegments[prev].mType == dtSEGMENTTYPE_NULL)
+                MergeNullSegment(prev, offset - mSegments[prev].mFileSize);
+        }
+    }
+
+    #ifdef bbDEBUG
+    CheckTree();
+    DebugCheckMappedSize();
+    #endif
+
+    NotifyChange(dtCHANGE_INSERT, offset, size, user);
+    CompactNote(offset);
+    return bbEOK;
+}
+
+bbERR dtBufferStream::InsertRuns(bbU64 offset, const dtHistoryRun* pRuns, bbU64 const length, void* const user)
+{
+    bbU8 const undopoint = mUndoPointRec;
+    bbERR err = bbEOK;
+    bbU64 done = 0;
+
+    while (done < length)
+    {
+        bbU64 const size = pRuns->mSize;
+        bbASSERT(size && ((done + size) <= length));
+
+        // report undo point with last change only
+        mUndoPointRec = ((done + size) == length) ? undopoint : 0;
+
+        if (pRuns->mFileOffset == dtHISTORYRUN_DATA)
+        {
+            dtSection* const pSection = Insert(offset, (bbU32)size);
+            if (!pSection)
+            {
+                err = bbELAST;
+                break;
+            }
+
+            bbMemMove(pSection->mpData, pRuns + 1, (bbU32)size);
+
+            if ((err = Commit(pSection, user)) != bbEOK)
+                break;
+
+            pRuns = (const dtHistoryRun*)((const bbU8*)(pRuns + 1) + dtHISTORYRUN_PAD(size));
+        }
+        else if (pRuns->mFileOffset & dtHISTORYRUN_TEMP)
+        {
+            // Temp segments are loaded as a whole, keep them at most one segment in size
+            bbU64 const tempoffset = pRuns->mFileOffset &~ dtHISTORYRUN_TEMP;
+            bbU64 pos = 0;
+
+            while (pos < size)
+            {
+                bbU64 const piece = (size - pos) > dtBUFFERSTREAM_SEGMENTSIZE ? dtBUFFERSTREAM_SEGMENTSIZE : (size - pos);
+
+                mUndoPointRec = ((done + pos + piece) == length) ? undopoint : 0;
+
+                if ((err = InsertRef(offset + pos, dtSEGMENTTYPE_TEMP, tempoffset + pos, piece, user)) != bbEOK)
+                    break;
+
+                pos += piece;
+            }
+
+            if (err != bbEOK)
+                break;
+
+            pRuns++;
+        }
+        else
+        {
+            if ((err = InsertRef(offset, dtSEGMENTTYPE_NULL, pRuns->mFileOffset, size, user)) != bbEOK)
+                break;
+
+            pRuns++;
+        }
+
+        offset += size;
+        done += size;
+    }
+
+    mUndoPointRec = undopoint;
+    return err;
+}
+
+dtPage* dtBufferStream::PageAlloc(bbU32 const size)
+{
+    dtPage** ppFit = NULL;      // smallest free page of at least size bytes
+    dtPage** ppLargest = NULL;  // largest free page smaller than size
+
+    for (dtPage** ppWalk = &mpPageFree; *ppWalk; ppWalk = &(*ppWalk)->mpNextFree)
+    {
+        bbU32 const pagesize = (*ppWalk)->mSize;
+
+        if (pagesize >= size)
+        {
+            if (!ppFit || (pagesize < (*ppFit)->mSize))
+                ppFit = ppWalk;
+        }
+        else if (!ppLargest || (pagesize > (*ppLargest)->mSize))
+        {
+            ppLargest = ppWalk;
+        }
+    }
+
+    if (!ppFit)
+        ppFit = ppLargest;
+
+    if (!ppFit)
+    {
+        //
+        // Pool exhausted, add a block of pages
+        //
+        dtPageBlock* const pBlock = (dtPageBlock*)bbMemAlloc(sizeof(dtPageBlock));
+        if (!pBlock)
+            return NULL;
+
+        bbMemClear(pBlock, sizeof(dtPageBlock));
+        for (bbUINT i = dtBUFFERSTREAM_PAGEBLOCK; i > 0; i--)
+            PageFree(pBlock->mPages + i - 1);
+
+        pBlock->mpNext = mpPageBlocks;
+        mpPageBlocks = pBlock;
+        ppFit = &mpPageFree;
+    }
+
+    dtPage* const pPage = *ppFit;
+
+    if (size > pPage->mSize)
+    {
+        if (bbEOK != bbMemRealloc(size, (void**)&pPage->mpData))
+            return NULL;
+        pPage->mSize = size;
+    }
+
+    *ppFit = pPage->mpNextFree;
+
+    return pPage;
+}
+
+dtSection* dtBufferStream::Map(bbU64 offset, bbU32 size, dtMAP const accesshint)
+{
+    if ((offset + size) >= mBufSize)
+    {
+        if (((offset + size) > mBufSize) || (offset == mBufSize))
+        {
+            bbErrSet(bbEBADPARAM);
+            return NULL;
+        }
+    }
+
+    //
+    // Small writes into unloaded file data go to the patch overlay
+    //
+    if ((accesshint != dtMAP_READONLY) && size && (size <= dtBUFFERSTREAM_PATCHSIZE) &&
+        ((mPatchSize + size + sizeof(dtPatch)) <= mPatchLimit))
+    {
+        bbU64 segmentstart;
+        const dtSegment* const pSegment = mSegments.GetPtr(FindSegment(offset, &segmentstart, 0));
+
+        if ((pSegment->mType == dtSEGMENTTYPE_NULL) && ((offset + size) <= (segmentstart + pSegment->mFileSize)))
+        {
+            bbU64 const fileoffset = pSegment->mFileOffset + (offset - segmentstart);
+
+            if (PatchMergeSize(fileoffset, size) <= dtBUFFERSTREAM_PATCHSIZE)
+                return MapPatch(offset, fileoffset, size, accesshint);
+        }
+    }
+
+    //
+    // Shortcut: Check if complete map lies within a segment
+    //
+    dtSection* pMap = MapSeq(offset, 0, dtMAP_READONLY);
+    if (!pMap)
+    {
+        bbASSERT(bbErrGet() != bbEEOF);
+        return NULL;
+    }
+
+    if (pMap && (size <= pMap->mSize))
+    {
+        pMap->mSize = size;
+        pMap->mType = dtSECTIONTYPE_MAP;
+        pMap->mOpt  = (accesshint == dtMAP_WRITEDIFF) ? (dtSECTIONOPT_MAP_SEQ|dtSECTIONOPT_MAP_DIFF) : dtSECTIONOPT_MAP_SEQ;
+
+        if (accesshint != dtMAP_READONLY)
+            pMap->mOpt |= dtSECTIONOPT_MAP_WRITE;
+
+        if ((accesshint != dtMAP_READONLY) && (MakeSegmentWritable(pMap->mSegment, pMap) != bbEOK))
+        {
+            SectionFree(pMap);
+            return NULL;
+        }
+
+        //
+        // Undo
+        //
+        if ((accesshint == dtMAP_WRITEDIFF) && (!mUndoActive))
+        {
+            if (SnapshotSection(pMap) != bbEOK)
+            {
+                SectionFree(pMap);
+                return NULL;
+            }
+        }
+        else if ((accesshint != dtMAP_READONLY) && (!mUndoActive))
+        {
+            bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, size, mUndoPoint!=0);
+            if (!pUndo)
+            {
+                SectionFree(pMap);
+                return NULL;
+            }
+            bbMemMove(pUndo, pMap->mpData, size);
+            mUndoPoint = 0;
+            UpdateCanUndoState();
+        }
+
+        return pMap;
+    }
+
+    bbU8* pDst;
+
+    //
+    // Map area is split accross multiple segments, collect them into one dtPage
+    //
+    dtSection* const pSection = SectionAlloc();
+    dtPage* const pPage = PageAlloc(size);
+
+    if (!pSection || !pPage)
+        goto dtBufferStream_Map_err;
+
+    pSection->mType  = dtSECTIONTYPE_MAP;
+    pSection->mOpt   = (accesshint == dtMAP_WRITEDIFF) ? (dtSECTIONOPT_MAP_PAGE|dtSECTIONOPT_MAP_DIFF) : dtSECTIONOPT_MAP_PAGE;
+    pSection->mpData = pPage->mpData;
+    pSection->mOffset = offset;
+    pSection->mSize  = size;
+    pSection->mpPage = pPage;
+
+    pDst = pPage->mpData;
+    for(;;)
+    {
+        bbU32 tocopy = pMap->mSize;
+        if (tocopy > size)
+            tocopy = size;
+
+        bbMemMove(pDst, pMap->mpData, tocopy);
+        Discard(pMap);
+        pDst += tocopy;
+        size -= tocopy;
+        offset += tocopy;
+
+        if (size == 0)
+            break;
+
+        if ((pMap = MapSeq(offset, 0, dtMAP_READONLY)) == NULL)
+        {
+            bbASSERT(bbErrGet() != bbEEOF);
+            goto dtBufferStream_Map_err;
+        }
+    }
+
+    if (accesshint != dtMAP_READONLY)
+        pSection->mOpt |= dtSECTIONOPT_MAP_WRITE;
+    return pSection;
+
+    dtBufferStream_Map_err:
+    PageFree(pPage);
+    SectionFree(pSection);
+    Discard(pMap);
+    return NULL;
+}
+
+dtSection* dtBufferStream::MapSeq(bbU64 const offset, bbUINT minsize, dtMAP const accesshint)
+{
+    if ((offset + minsize) >= mBufSize)
+    {
+        if (offset >= mBufSize)
+        {
+            bbErrSet(bbEEOF);
+            return NULL;
+        }
+        minsize = (bbUINT)mBufSize - (bbUINT)offset;
+    }
+
+    bbU64 segmentstart;
+    bbU32 idx;
+    bbU32 segmentOffset;
+    dtSegment* pSegment;
+    int loaded = 0;
+    int patched = 0;
+
+    dtSection* const pSection = SectionAlloc();
+    if (!pSection)
+        return NULL;
+
+    //
+    // - Shortcut: caches repeated access to the same segment
+    //
+    idx = mSegmentLastMapped;
+    if (idx != (bbU32)-1)
+    {
+        segmentstart = mSegmentLastOffset;
+        pSegment = mSegments.GetPtr(idx);
+        if ((offset - segmentstart) < pSegment->mSize)
+        {
+            goto dtBufferStream_MapSeq_usecached;
+        }
+
+        mSegmentLastMapped = (bbU32)-1;
+    }
+
+    idx = FindSegment(offset, &segmentstart, 0);
+    pSegment = mSegments.GetPtr(idx);
+
+    if (pSegment->mType == dtSEGMENTTYPE_NULL)
+    {
+        int backward;
+        bbU32 const loadsize = GetLoadSize(pSegment, offset - segmentstart, &backward);
+
+        if (pSegment->mFileSize > loadsize)
+        {
+            bbU64 splitoffset;
+
+            if (backward && ((segmentstart + pSegment->mFileSize - offset) <= loadsize))
+                splitoffset = pSegment->mFileSize - loadsize; // load segment end
+            else
+                splitoffset = (offset - segmentstart) &~ (bbU64)(loadsize-1);
+
+            if (splitoffset) // don't split at segment start
+            {
+                bbU32 right = SplitNullSegment(idx, segmentstart, splitoffset);
+                if (right == (bbU32)-1)
+                    goto dtBufferStream_MapSeq_err;
+
+                segmentstart += splitoffset;
+
+                idx = right;
+                pSegment = mSegments.GetPtr(idx);
+            }
+
+            if (pSegment->mFileSize > loadsize)
+            {
+                if (SplitNullSegment(idx, segmentstart, loadsize) == (bbU32)-1)
+                    goto dtBufferStream_MapSeq_err;
+                pSegment = mSegments.GetPtr(idx);
+            }
+        }
+
+        bbU8* pData;
+
+        if (mpFileMap)
+        {
+            // point into file mapping, copied to heap before segment is modified
+            pData = mpFileMap + pSegment->mFileOffset;
+        }
+        else if (!mpPrefetch || ((pData = mpPrefetch->Take(pSegment->mFileOffset, (bbU32)pSegment->mFileSize)) == NULL))
+        {
+            if ((pData = (bbU8*)mpAlloc->Alloc((bbU32)pSegment->mFileSize)) == NULL)
+                goto dtBufferStream_MapSeq_err;
+
+            if (mFile.ReadAt(pSegment->mFileOffset, pData, (bbU32)pSegment->mFileSize) != bbEOK)
+            {
+                mpAlloc->Free(pData);
+                goto dtBufferStream_MapSeq_err;
+            }
+        }
+
+        // bytes from the patch overlay turn the loaded data into a changed segment
+        if (mPatchCount && PatchTest(pSegment->mFileOffset, pSegment->mFileSize))
+        {
+            if (IsFileMapped(pData))
+            {
+                bbU8* const pCopy = (bbU8*)mpAlloc->Alloc((bbU32)pSegment->mFileSize);
+                if (!pCopy)
+                    goto dtBufferStream_MapSeq_err;
+                bbMemMove(pCopy, pData, (bbU32)pSegment->mFileSize);
+                pData = pCopy;
+            }
+
+            PatchApply(pSegment->mFileOffset, pData, pSegment->mFileSize);
+            PatchDrop(pSegment->mFileOffset, pSegment->mFileSize);
+            patched = 1;
+        }
+
+        pSegment->mType     = dtSEGMENTTYPE_MAP;
+        pSegment->mSize     = (bbU32)pSegment->mFileSize;
+        pSegment->mCapacity = IsFileMapped(pData) ? 0 : pSegment->mSize;
+        pSegment->mpData    = pData;
+        pSegment->mChanged  = (bbU8)patched;
+
+        mMappedSize += (bbU32)pSegment->mFileSize;
+        LRUAdd(idx);
+        loaded = 1;
+
+        mLoadStart = pSegment->mFileOffset;
+        mLoadEnd   = pSegment->mFileOffset + pSegment->mFileSize;
+
+        if (mpPrefetch)
+            mpPrefetch->OnLoad(pSegment->mFileOffset, (bbU32)pSegment->mFileSize);
+
+        #ifdef bbDEBUG
+        DebugCheckMappedSize();
+        #endif
+    }
+    else if (pSegment->mType == dtSEGMENTTYPE_TEMP)
+    {
+        if (SwapInSegment(idx) != bbEOK)
+            goto dtBufferStream_MapSeq_err;
+        loaded = 1;
+    }
+    else if (idx != (pSegment->mChanged ? mDirtyFirst : mLRUFirst))
+    {
+        LRURemove(idx);
+        LRUAdd(idx);
+    }
+
+    if (loaded && ((mCacheSize > mCacheLimit) || (mDirtySize > mDirtyLimit)))
+    {
+        // reference idx from pSection to protect it from eviction
+        pSection->mSegment = idx;
+        pSection->mType    = dtSECTIONTYPE_MAPSEQ;
+
+        if (mCacheSize > mCacheLimit)
+            EvictSegments();
+        if (mDirtySize > mDirtyLimit)
+            SwapOutSegments();
+
+        pSegment = mSegments.GetPtr(idx);
+    }
+
+    mSegmentLastMapped = idx; // cache
+    mSegmentLastOffset = segmentstart;
+    dtBufferStream_MapSeq_usecached:
+
+    //
+    // Check if segment size satisfies minsize requirement
+    //
+    segmentOffset = (bbU32)offset - (bbU32)segmentstart;
+    bbASSERT(pSegment->mSize > segmentOffset);
+
+    //
+    // Data before and after an open gap is mapped separately
+    //
+    bbU32 gapsize, mapsize;
+    gapsize = 0;
+    mapsize = pSegment->mSize - segmentOffset;
+
+    if (idx == mGapSegment)
+    {
+        if (segmentOffset < mGapOffset)
+            mapsize = mGapOffset - segmentOffset;
+        else
+            gapsize = mGapSize;
+    }
+
+    if (mapsize < minsize)
+    {
+        SectionFree(pSection); // could catch this condition earlier to avoid pSection alloc
+        return Map(offset, minsize, accesshint);
+    }
+
+    if ((accesshint != dtMAP_READONLY) && (MakeSegmentWritable(idx, NULL) != bbEOK))
+        goto dtBufferStream_MapSeq_err;
+
+    pSection->mSegment = idx;
+    pSection->mpData   = pSegment->mpData + segmentOffset + gapsize;
+    pSection->mOffset  = offset;
+    pSection->mSize    = mapsize;
+    pSection->mType    = dtSECTIONTYPE_MAPSEQ;
+    pSection->mOpt     = (accesshint == dtMAP_WRITEDIFF) ? dtSECTIONOPT_MAP_DIFF : 0;
+    if (accesshint != dtMAP_READONLY)
+        pSection->mOpt |= dtSECTIONOPT_MAP_WRITE;
+
+    //
+    // Undo
+    //
+    if ((accesshint == dtMAP_WRITEDIFF) && (!mUndoActive))
+    {
+        if (SnapshotSection(pSection) != bbEOK)
+            goto dtBufferStream_MapSeq_err;
+    }
+    else if ((accesshint != dtMAP_READONLY) && (!mUndoActive))
+    {
+        bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, pSection->mSize, mUndoPoint!=0);
+        if (!pUndo)
+            goto dtBufferStream_MapSeq_err;
+        bbMemMove(pUndo, pSection->mpData, pSection->mSize);
+        mUndoPoint = 0;
+        UpdateCanUndoState();
+    }
+
+    return pSection;
+
+    dtBufferStream_MapSeq_err:
+    SectionFree(pSection);
+    return NULL;
+}
+
+bbERR dtBufferStream::Commit(dtSection* const pSection, void* const user)
+{
+    bbERR      err;
+    dtSegment* pSegment;
+    bbU8*      pUndo;
+
+    switch (pSection->mType)
+    {
+    case dtSECTIONTYPE_INSERT:
+        if (!mUndoActive)
+        {
+            pUndo = mHistory.Push(dtCHANGE_INSERT, pSection->mOffset, pSection->mSize, mUndoPoint!=0);
+            if (!pUndo)
+            {
+                err = bbELAST;
+                goto dtBufferStream_Commit_err;
+            }
+            mUndoPoint = 0;
+            UpdateCanUndoState();
+        }
+
+        pSegment = mSegments.GetPtr(pSection->mSegment);
+
+        bbASSERT(mSegmentLastMapped == (bbU32)-1);
+
+        switch (pSection->mOpt)
+        {
+        case dtSECTIONOPT_INSERT_ENLARGE:
+        {
+            bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+            LRURemove(pSection->mSegment);
+
+            // adjust relative offsets in tree
+            bbU64 const segmentstart = pSection->mOffset - pSegment->mSize;
+            pSegment->mSize += pSection->mSize;
+            NodeSubstractOffset(pSection->mSegment, segmentstart, -(bbS64)pSection->mSize);
+            break;
+        }
+
+        case dtSECTIONOPT_INSERT_CREATE:
+            bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+            // complete linking into mSegments[] list and tree
+            pSegment->mSize = pSection->mSize;
+            LinkSegment(pSection->mSegment, pSection->mOffset);
+            break;
+
+        case dtSECTIONOPT_INSERT_GAP:
+            bbASSERT((pSection->mSegment == mGapSegment) && (pSection->mSize <= mGapSize));
+
+            LRURemove(pSection->mSegment);
+
+            pSegment->mSize += pSection->mSize;
+            mGapOffset += pSection->mSize;
+            mGapSize -= pSection->mSize;
+            NodeSubstractOffset(pSection->mSegment, mGapSegmentStart, -(bbS64)pSection->mSize);
+            break;
+
+        case dtSECTIONOPT_INSERT_REPLACE:
+            bbASSERT((pSegment->mType != dtSEGMENTTYPE_NULL) || (pSegment->mFileSize == 0));
+            bbASSERT((pSegment->mType != dtSEGMENTTYPE_MAP)  || (pSegment->mpData == NULL));
+
+            if (pSegment->mType == dtSEGMENTTYPE_MAP)
+                LRURemove(pSection->mSegment);
+
+            pSegment->mType     = dtSEGMENTTYPE_MAP;
+            pSegment->mpData    = pSection->mpData;
+            pSegment->mSize     = pSection->mSize;
+            pSegment->mCapacity = pSection->mSize;
+
+            NodeSubstractOffset(pSection->mSegment, pSection->mOffset, -(bbS64)pSection->mSize);
+            break;
+        }
+
+        #ifdef bbDEBUG
+        CheckTree();
+        #endif
+
+        mBufSize += pSection->mSize;
+        pSegment->mChanged = 1;
+        LRUAdd(pSection->mSegment);
+        NotifyChange(dtCHANGE_INSERT, pSection->mOffset, pSection->mSize, user);
+        break;
+
+    case dtSECTIONTYPE_MAP:
+        bbASSERT(pSection->mOpt & dtSECTIONOPT_MAP_WRITE); // assert dtMAP_WRITE usage
+
+        if ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) == dtSECTIONOPT_MAP_PATCH)
+        {
+            bbU64 segmentstart;
+            pSegment = mSegments.GetPtr(FindSegment(pSection->mOffset, &segmentstart, 0));
+
+            if ((pSegment->mType == dtSEGMENTTYPE_NULL) &&
+                ((pSection->mOffset + pSection->mSize) <= (segmentstart + pSegment->mFileSize)))
+            {
+                err = CommitPatch(pSection, pSegment->mFileOffset + (pSection->mOffset - segmentstart), user);
+                PageFree(pSection->mpPage);
+
+                if (err != bbEOK)
+                    goto dtBufferStream_Commit_err;
+                break;
+            }
+
+            // range was loaded since Map(), write it via segments
+            pSection->mOpt = (bbU8)((pSection->mOpt & ~dtSECTIONOPT_MAP_TYPEMASK) | dtSECTIONOPT_MAP_PAGE);
+        }
+
+        if ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) != dtSECTIONOPT_MAP_SEQ)
+        {
+            bbU8*         pTmp   = pSection->mpData;
+            bbU32         size   = pSection->mSize;
+            bbU64         offset = pSection->mOffset;
+            int const     diff   = (pSection->mOpt & dtSECTIONOPT_MAP_DIFF) && !mUndoActive;
+
+            pUndo = NULL;
+            if (!mUndoActive && !diff)
+            {
+                pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, size, mUndoPoint!=0);
+                if (!pUndo)
+                {
+                    err = bbELAST;
+                    goto dtBufferStream_Commit_err;
+                }
+                mUndoPoint = 0;
+                UpdateCanUndoState();
+            }
+
+            while (size > 0)
+            {
+                dtSection* pMapSeq = MapSeq(offset, 0, dtMAP_READONLY);
+                bbASSERT(!pMapSeq || (pMapSeq->mOpt |= dtSECTIONOPT_MAP_WRITE));
+
+                if (!pMapSeq || (MakeSegmentWritable(pMapSeq->mSegment, pMapSeq) != bbEOK))
+                {
+                    bbASSERT(bbErrGet() != bbEEOF);
+                    if (pMapSeq)
+                        SectionFree(pMapSeq);
+                    if (pUndo)
+                        mHistory.PushRevert();
+                    PageFree(pSection->mpPage);
+                    err = bbELAST;
+                    goto dtBufferStream_Commit_err; //xxx not atomic
+                }
+
+                bbU32 tocopy = pMapSeq->mSize;
+                if (size < tocopy)
+                    tocopy = size;
+
+                if (diff)
+                {
+                    // buffer receives new data, page keeps the original for comparison
+                    bbMemSwap(pMapSeq->mpData, pTmp, tocopy);
+                    err = CommitDiff(pMapSeq->mSegment, offset, pMapSeq->mpData, pTmp, tocopy, user);
+                    SectionFree(pMapSeq);
+
+                    if (err != bbEOK)
+                    {
+                        PageFree(pSection->mpPage);
+                        goto dtBufferStream_Commit_err; //xxx not atomic
+                    }
+
+                    pTmp += tocopy;
+                    offset += tocopy;
+                    size -= tocopy;
+                    continue;
+                }
+
+                if (pUndo)
+                {
+                    bbMemMove(pUndo, pMapSeq->mpData, tocopy);
+                    pUndo += tocopy;
+                }
+                bbMemMove(pMapSeq->mpData, pTmp, tocopy);
+
+                if ((err = Commit(pMapSeq, user)) != bbEOK)
+                {
+                    if (pUndo)
+                        mHistory.PushRevert();
+                    PageFree(pSection->mpPage);
+                    goto dtBufferStream_Commit_err; //xxx not atomic
+                }
+
+                pTmp += tocopy;
+                offset += tocopy;
+                size -= tocopy;
+            }
+
+            PageFree(pSection->mpPage);
+            break;
+        }
+        //fall through
+
+    case dtSECTIONTYPE_MAPSEQ:
+        bbASSERT(pSection->mOpt & dtSECTIONOPT_MAP_WRITE);
+        pSegment = mSegments.GetPtr(pSection->mSegment);
+        bbASSERT(!IsFileMapped(pSegment->mpData));
+
+        if ((pSection->mOpt & dtSECTIONOPT_MAP_DIFF) && !mUndoActive)
+        {
+            // original data is in the snapshot page, or for unchanged segments in the file mapping
+            const bbU8* const pOrg = pSection->mpOrgPage ? pSection->mpOrgPage->mpData :
+                mpFileMap + pSegment->mFileOffset + (bbU32)(pSection->mpData - pSegment->mpData);
+
+            err = CommitDiff(pSection->mSegment, pSection->mOffset, pSection->mpData, pOrg, pSection->mSize, user);
+            PageFree(pSection->mpOrgPage);
+
+            if (err != bbEOK)
+                goto dtBufferStream_Commit_err;
+            break;
+        }
+
+        if (!pSegment->mChanged)
+        {
+            LRURemove(pSection->mSegment);
+            pSegment->mChanged = 1;
+            LRUAdd(pSection->mSegment);
+        }
+        NotifyChange(dtCHANGE_OVERWRITE, pSection->mOffset, pSection->mSize, user);
+        break;
+
+    default:
+        bbASSERT(0);
+    }
+
+    err = bbEOK;
+    dtBufferStream_Commit_err:
+
+    #ifdef bbDEBUG
+    CheckTree();
+    #endif
+
+    bbU64 const offset = pSection->mOffset;
+    SectionFree(pSection);
+
+    if (mDirtySize > mDirtyLimit)
+        SwapOutSegments();
+
+    if (err == bbEOK)
+        CompactNote(offset);
+
+    return err;
+}
+
+void dtBufferStream::Discard(dtSection* const pSection)
+{
+    if (!pSection)
+        return;
+
+    dtSegment* pSegment;
+
+    switch (pSection->mType)
+    {
+    case dtSECTIONTYPE_INSERT:
+        pSegment = mSegments.GetPtr(pSection->mSegment);
+        bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+        if (pSection->mOpt == dtSECTIONOPT_INSERT_REPLACE)
+        {
+            mpAlloc->Free(pSection->mpData);
+        }
+        else if (pSection->mOpt == dtSECTIONOPT_INSERT_GAP)
+        {
+            // gap stays open
+        }
+        else
+        {
+            ReserveSegmentData(pSegment, pSegment->mSize); // shrink or free heap block
+
+            if (pSection->mOpt == dtSECTIONOPT_INSERT_CREATE)
+            {
+                bbASSERT(pSegment->mpData == NULL); // ensure it was really freed
+
+                // return segment to free pool
+                pSegment->mNext = mSegmentFree;
+                mSegmentFree = pSection->mSegment;
+            }
+        }
+
+        break;
+
+    case dtSECTIONTYPE_MAP:
+        if ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) != dtSECTIONOPT_MAP_SEQ)
+        {
+            PageFree(pSection->mpPage); // undo of a page or patch is recorded on commit
+            break;
+        }
+        // fall through
+
+    case dtSECTIONTYPE_MAPSEQ:
+        bbASSERT(mSegments[pSection->mSegment].mType == dtSEGMENTTYPE_MAP);
+
+        if ((pSection->mOpt & dtSECTIONOPT_MAP_WRITE) && !mUndoActive)
+        {
+            if (pSection->mOpt & dtSECTIONOPT_MAP_DIFF)
+                PageFree(pSection->mpOrgPage);
+            else
+                DropMapUndo(pSection);
+        }
+        break;
+
+    default:
+        bbASSERT(0);
+    }
+
+    SectionFree(pSection);
+}
+
+void dtBufferStream::DropMapUndo(const dtSection* const pSection)
+{
+    dtBufferChange change;
+
+    if (mHistory.CanRedo() || !mHistory.GetEnd())
+        return;
+
+    mHistory.Peek(mHistory.GetEnd(), &change, NULL);
+
+    // if other changes were recorded since, the record stays as a no-op
+    if ((change.type == dtCHANGE_OVERWRITE) && (change.offset == pSection->mOffset) && (change.length >= pSection->mSize))
+    {
+        mHistory.PushRevert();
+        if (change.undopoint)
+            mUndoPoint = 1;
+        UpdateCanUndoState();
+    }
+}
+
+bbERR dtBufferStream::OpenGap(bbU32 const idx, bbU64 const segmentstart, bbU32 const segmentoffset, bbU32 const gapsize)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbASSERT((mGapSegment == (bbU32)-1) && (pSegment->mType == dtSEGMENTTYPE_MAP) && !IsFileMapped(pSegment->mpData));
+    bbASSERT(segmentoffset <= pSegment->mSize);
+
+    if (bbEOK != ReserveSegmentData(pSegment, pSegment->mSize + gapsize))
+        return bbELAST;
+
+    // use all slack of the heap block as gap
+    bbU32 const slack = pSegment->mCapacity - pSegment->mSize;
+
+    bbMemMove(pSegment->mpData + segmentoffset + slack,
+              pSegment->mpData + segmentoffset,
+              pSegment->mSize - segmentoffset);
+
+    // segment must not be evicted while the gap is open
+    if (!pSegment->mChanged)
+    {
+        LRURemove(idx);
+        pSegment->mChanged = 1;
+        LRUAdd(idx);
+    }
+
+    mGapSegment      = idx;
+    mGapSegmentStart = segmentstart;
+    mGapOffset       = segmentoffset;
+    mGapSize         = slack;
+
+    return bbEOK;
+}
+
+bbERR dtBufferStream::GrowGap(bbU32 const size)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(mGapSegment);
+    bbU32 const gapsize = size + mGapReserve;
+
+    bbASSERT(gapsize > mGapSize);
+
+    if (bbEOK != ReserveSegmentData(pSegment, pSegment->mSize + gapsize))
+        return bbELAST;
+
+    bbU32 const slack = pSegment->mCapacity - pSegment->mSize;
+
+    bbMemMove(pSegment->mpData + mGapOffset + slack,
+              pSegment->mpData + mGapOffset + mGapSize,
+              pSegment->mSize - mGapOffset);
+
+    mGapSize = slack;
+
+    return bbEOK;
+}
+
+void dtBufferStream::CloseGap()
+{
+    if (mGapSegment == (bbU32)-1)
+        return;
+
+    dtSegment* const pSegment = mSegments.GetPtr(mGapSegment);
+
+    bbMemMove(pSegment->mpData + mGapOffset,
+              pSegment->mpData + mGapOffset + mGapSize,
+              pSegment->mSize - mGapOffset);
+    ReserveSegmentData(pSegment, pSegment->mSize);
+
+    mGapSegment = (bbU32)-1;
+}
+
+dtSection* dtBufferStream::InsertAtGap(dtSection* const pSection)
+{
+    pSection->mpData   = mSegments[mGapSegment].mpData + mGapOffset;
+    pSection->mSegment = mGapSegment;
+    pSection->mOpt     = dtSECTIONOPT_INSERT_GAP;
+    return pSection;
+}
+
+void dtBufferStream::LRUAdd(bbU32 const idx)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+    bbU32* const pFirst = pSegment->mChanged ? &mDirtyFirst : &mLRUFirst;
+
+    if (*pFirst == (bbU32)-1)
+    {
+        pSegment->mLRUPrev =
+        pSegment->mLRUNext = idx;
+    }
+    else
+    {
+        dtSegment* const pFirstSegment = mSegments.GetPtr(*pFirst);
+        bbU32 const last = pFirstSegment->mLRUPrev;
+        pSegment->mLRUNext = *pFirst;
+        pSegment->mLRUPrev = last;
+        pFirstSegment->mLRUPrev = idx;
+        mSegments[last].mLRUNext = idx;
+    }
+
+    *pFirst = idx;
+    *(pSegment->mChanged ? &mDirtySize : &mCacheSize) += pSegment->mSize;
+}
+
+void dtBufferStream::LRURemove(bbU32 const idx)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+    bbU32* const pFirst = pSegment->mChanged ? &mDirtyFirst : &mLRUFirst;
+    bbU64* const pSize  = pSegment->mChanged ? &mDirtySize : &mCacheSize;
+    bbU32 const next = pSegment->mLRUNext;
+
+    if (next == idx)
+    {
+        bbASSERT(*pFirst == idx);
+        *pFirst = (bbU32)-1;
+    }
+    else
+    {
+        bbU32 const prev = pSegment->mLRUPrev;
+        mSegments[prev].mLRUNext = next;
+        mSegments[next].mLRUPrev = prev;
+
+        if (*pFirst == idx)
+            *pFirst = next;
+    }
+
+    bbASSERT(*pSize >= pSegment->mSize);
+    *pSize -= pSegment->mSize;
+}
+
+bbUINT dtBufferStream::GetLockedSegments(bbU32** const ppLocked)
+{
+    bbUINT count = 0;
+
+    if (mLockedSize < mSectionCount)
+    {
+        if (bbEOK != bbMemRealloc(mSectionCount * sizeof(bbU32), (void**)&mpLocked))
+            return (bbUINT)-1;
+        mLockedSize = mSectionCount;
+    }
+
+    *ppLocked = mpLocked;
+
+    //
+    // Scan embedded descriptors, then descriptor blocks, unused entries have type dtSECTIONTYPE_NONE
+    //
+    const dtSection* pSection = mSections;
+    const dtSection* pEnd = mSections + dtBUFFER_MAXSECTIONS;
+    const dtSectionBlock* pBlock = mpSectionBlocks;
+
+    for (;;)
     {
-        // delete segment header hasn't been alloced yet
-        if ((del = NewSegment()) == (bbU32)-1)
+        for (; pSection < pEnd; pSection++)
         {
-            if (pUndo)
-                mHistory.PushRevert();
-            return bbELAST;
+            if (pSection->mType == dtSECTIONTYPE_INSERT)
+                return (bbUINT)-1;
+
+            if ((pSection->mType == dtSECTIONTYPE_MAPSEQ) ||
+                ((pSection->mType == dtSECTIONTYPE_MAP) && ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) == dtSECTIONOPT_MAP_SEQ)))
+            {
+                bbASSERT(count < mLockedSize);
+                mpLocked[count++] = pSection->mSegment;
+            }
         }
+
+        if (!pBlock)
+            break;
+
+        pSection = pBlock->mSections;
+        pEnd = pBlock->mSections + dtBUFFER_SECTIONBLOCK;
+        pBlock = pBlock->mpNext;
     }
 
-    #ifdef bbDEBUG
-    CheckTree();
-    gCheckTreeDisable = 1;
-    #endif
+    return count;
+}
 
-    // - at this point the delete offset lies on a segment boundary
+void dtBufferStream::EvictSegment(bbU32 const idx)
+{
+    dtSegment* pSegment = mSegments.GetPtr(idx);
+    bbASSERT(!pSegment->mChanged && (pSegment->mSize == pSegment->mFileSize));
 
-    pSegment = mSegments.GetPtr(idx);
-    bbU32 const prev = pSegment->mPrev;
+    LRURemove(idx);
 
-    //
-    // prev |del           |
-    //      |idx|idx|idx|tail|
-    //
+    if (!IsFileMapped(pSegment->mpData))
+        mpAlloc->Free(pSegment->mpData);
+    pSegment->mType = dtSEGMENTTYPE_NULL;
+    mMappedSize -= pSegment->mFileSize;
 
-    bbASSERT(mBufSize >= size);
-    mBufSize -= size;
+    if (mSegmentLastMapped == idx)
+        mSegmentLastMapped = (bbU32)-1;
 
     //
-    // Eat all segments which are fully covered by the delete area
+    // Merge with contiguous Null neighbours, right neighbour first, since idx may get freed
     //
-    bbU64 delfilesize = 0;
-    for(;;)
+    bbU64 const segmentstart = NodeStart(idx);
+
+    MergeNullSegment(idx, segmentstart);
+
+    if (idx != mSegmentUsedFirst)
     {
-        bbU64 segmentsize = pSegment->GetSize();
+        bbU32 const prev = pSegment->mPrev;
+        dtSegment* const pPrev = mSegments.GetPtr(prev);
 
-        if (size < segmentsize)
-            break;
+        if (pPrev->mType == dtSEGMENTTYPE_NULL)
+            MergeNullSegment(prev, segmentstart - pPrev->mFileSize);
+    }
+}
 
-        size -= segmentsize;
-        delfilesize += pSegment->mFileSize;
+void dtBufferStream::EvictSegments()
+{
+    bbU32* locked;
+    bbUINT const lockedcount = GetLockedSegments(&locked);
+    bbUINT i;
 
-        if (pSegment->mType == dtSEGMENTTYPE_MAP)
-        {
-            if (pUndo)
-            {
-                bbMemMove(pUndo, pSegment->mpData, (bbU32)segmentsize);
-                pUndo += (bbU32)segmentsize;
-            }
-            bbMemFree(pSegment->mpData);
-        }
-        else
-        {
-            if (pUndo)
-            {
-                bbFileSeek(mhFile, pSegment->mFileOffset, bbFILESEEK_SET);//xxx
-                bbFileRead(mhFile, pUndo, (bbU32)segmentsize);//xxx
-                pUndo += (bbU32)segmentsize;
-            }
+    // while an insert is pending, segments must not be merged
+    if ((lockedcount == (bbUINT)-1) || (mLRUFirst == (bbU32)-1))
+        return;
 
-            mMappedSize += (bbU32)segmentsize;
-        }
+    //
+    // Walk LRU chain from least recently used segment
+    //
 
-        // unlink node from tree
-        NodeDelete(idx, offset);
+    bbU32 walk = mSegments[mLRUFirst].mLRUPrev;
 
-        bbU32 const tmp = idx;
-        idx = pSegment->mNext;
+    while (mCacheSize > mCacheLimit)
+    {
+        bbU32 const prev = mSegments[walk].mLRUPrev;
+        int const last = (walk == mLRUFirst);
 
-        // return segment to free pool
-        pSegment->mNext = mSegmentFree;
-        mSegmentFree = tmp;
+        for (i = 0; i < lockedcount; i++)
+            if (locked[i] == walk)
+                break;
 
-        pSegment = mSegments.GetPtr(idx);
-    }
+        if (i == lockedcount)
+            EvictSegment(walk);
 
-    if ((pSegment->mType == dtSEGMENTTYPE_NULL) || ((idx == mSegmentUsedFirst) && (size==0)))
-    {
-        //
-        // If delete eat loop ended on a Null segment, or at buffer end,
-        // we need to insert a new 0-size Map segment
-        //
-        bbASSERT(pSegment->GetSize() >= size);
+        if (last)
+            break;
 
-        if (size)
-        {
-            //
-            //       |-D-------|
-            // |-----|---|---|-N-| -> |-----|M|N-|
-            //
-            bbASSERT((idx != mSegmentUsedFirst) || (mSegmentUsedFirst == mSegmentUsedLast));
+        walk = prev;
+    }
 
-            if (pUndo)
-            {
-                bbFileSeek(mhFile, pSegment->mFileOffset, bbFILESEEK_SET);//xxx
-                bbFileRead(mhFile, pUndo, (bbU32)size);//xxx
-                pUndo += (bbU32)size;
-            }
+    #ifdef bbDEBUG
+    DebugCheckCache();
+    #endif
+}
 
-            pSegment->mFileOffset += size;
-            pSegment->mFileSize -= size;
-            NodeSubstractOffset(idx, offset, size);
-            mMappedSize += size;
-        }
-        // else
-        //
-        //       |-D-----|
-        // |-----|---|---|-N-| -> |-----|M|-N-|
-        //
-        //       |-D-----|
-        // |-N---|---|---| -> |-N---|M|
-        //
-        //       |-D-----|
-        // |-M---|---|---| -> |-M---|M|
-        //
+bbU32 dtBufferStream::GetSegmentCount() const
+{
+    bbU32 count = 0;
 
-        dtSegment* const pSegmentDel = mSegments.GetPtr(del);
-        pSegmentDel->mType = dtSEGMENTTYPE_MAP;
-        pSegmentDel->mChanged = 1;
-        pSegmentDel->mpData = NULL;
-        pSegmentDel->mSize = 0;
-        pSegmentDel->mFileSize = delfilesize + size;
+    if (!mSegments.GetSize())
+        return 0;
 
-        if (mSegmentUsedLast == prev) // special case: del is at buffer start
-        {
-            if (idx == mSegmentUsedFirst) // did delete eat loop end with buffer wrap?
-            {
-                bbASSERT(size == 0);
-                mSegmentUsedLast = del;
-            }
-            else
-            {
-                pSegmentDel->mNext = idx;
-                pSegment->mPrev = del;
-            }
+    bbU32 idx = mSegmentUsedFirst;
+    do
+    {
+        count++;
+        idx = mSegments[idx].mNext;
 
-            mSegmentUsedFirst = del;
+    } while (idx != mSegmentUsedFirst);
 
-            pSegmentDel->mPrev = mSegmentUsedLast;
-            mSegments[mSegmentUsedLast].mNext = del;
+    return count;
+}
 
-            // set new tree root
-            pSegmentDel->mLT = (bbU32)-1;
-            pSegmentDel->mGE = mSegmentUsedRoot;
-            pSegmentDel->mOffset = 0;
-            mSegmentUsedRoot = del;
-        }
-        else
-        {
-            if (idx == mSegmentUsedFirst) // did delete eat loop end with buffer wrap?
-                mSegmentUsedLast = del;
+bbU32 dtBufferStream::Compact(bbU32 count)
+{
+    bbU32* locked;
+    bbUINT const lockedcount = GetLockedSegments(&locked);
+    bbU32 merged = 0;
+    bbUINT i;
 
-            pSegmentDel->mNext = idx;
-            pSegment->mPrev = del;
+    mCompactDebt = 0;
 
-            pSegmentDel->mPrev = prev;
-            mSegments[prev].mNext = del;
+    // while an insert is pending, segments must not be merged
+    if ((lockedcount == (bbUINT)-1) || !mSegments.GetSize())
+        return 0;
 
-            NodeLinkRight(del, mSegments.GetPtr(prev), mSegments[prev].GetSize());
-        }
+    //
+    // Start at left neighbour of segment at cursor, so it can be merged with it
+    //
+    bbU64 segmentstart;
+    bbU32 idx = FindSegment((mCompactOffset < mBufSize) ? mCompactOffset : 0, &segmentstart, 0);
+
+    if (idx != mSegmentUsedFirst)
+    {
+        idx = mSegments[idx].mPrev;
+        segmentstart -= mSegments[idx].GetSize();
     }
-    else
+
+    while (count--)
     {
-        bbASSERT(pSegment->mSize >= size);
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU32 const right = pSegment->mNext;
 
-        //
-        //       |-D-------|
-        // |-----|---|---|-M-| -> |-----|M-|
-        //
-        //
-        //       |-D-----|
-        // |-----|---|---|-M-| -> |-----|-M-|
-        //
+        if (right == mSegmentUsedFirst) // wrap at buffer end
+        {
+            idx = right;
+            segmentstart = 0;
+            continue;
+        }
 
-        if (size)
+        dtSegment* const pRight = mSegments.GetPtr(right);
+
+        if (pSegment->mType == dtSEGMENTTYPE_NULL)
         {
-            if (pUndo)
+            if (MergeNullSegment(idx, segmentstart))
             {
-                bbMemMove(pUndo, pSegment->mpData, (bbU32)size);
-                pUndo += (bbU32)size;
+                merged++;
+                continue; // try again with next right neighbour
             }
-
-            bbMemMove(pSegment->mpData, pSegment->mpData + size, pSegment->mSize -= (bbU32)size);
-            bbMemRealloc(pSegment->mSize, (void**)&pSegment->mpData);
         }
+        else if ((pSegment->mType == dtSEGMENTTYPE_MAP) &&
+                 (pRight->mType == dtSEGMENTTYPE_MAP) &&
+                 ((pSegment->mSize + pRight->mSize) <= dtBUFFERSTREAM_SEGMENTSIZE) &&
+                 (pSegment->mChanged || pRight->mChanged || ((pSegment->mFileOffset + pSegment->mFileSize) == pRight->mFileOffset)) &&
+                 !IsFileMapped(pSegment->mpData) && !IsFileMapped(pRight->mpData) &&
+                 (idx != mGapSegment) && (right != mGapSegment))
+        {
+            for (i = 0; i < lockedcount; i++)
+                if ((locked[i] == idx) || (locked[i] == right))
+                    break;
 
-        pSegment->mFileSize += delfilesize;
-        pSegment->mChanged = 1;
+            if (i == lockedcount)
+            {
+                bbU32 const rightsize = pRight->mSize;
+                int const relink = !pSegment->mChanged && pRight->mChanged; // moves to dirty chain
 
-        pSegment->mPrev = prev;
-        mSegments[prev].mNext = idx;
+                LRURemove(right);
+                if (relink)
+                    LRURemove(idx);
 
-        if (mSegmentUsedLast == prev) // deleting from buffer start
-            mSegmentUsedFirst = idx;
+                if (MergeMapSegment(idx, segmentstart) == bbEOK)
+                {
+                    // otherwise merged data keeps the LRU position of the left segment
+                    if (relink)
+                        LRUAdd(idx);
+                    else
+                        *(pSegment->mChanged ? &mDirtySize : &mCacheSize) += rightsize;
+
+                    mSegmentLastMapped = (bbU32)-1;
+                    merged++;
+                    continue;
+                }
 
-        if (size)
-            NodeSubstractOffset(idx, offset, size); // adjust relative offsets in index tree
+                if (relink)
+                    LRUAdd(idx);
+                LRUAdd(right);
+            }
+        }
 
-        // return del segment to free pool
-        mSegments[del].mNext = mSegmentFree;
-        mSegmentFree = del;
+        segmentstart += pSegment->GetSize();
+        idx = right;
     }
 
+    mCompactOffset = segmentstart;
+
     #ifdef bbDEBUG
-    gCheckTreeDisable = 0;
-    CheckTree();
     DebugCheckMappedSize();
+    DebugCheckCache();
     #endif
 
-    NotifyChange(dtCHANGE_DELETE, offset, size_org, user);
-
-    return bbEOK;
+    return merged;
 }
 
-dtSection* dtBufferStream::Insert(bbU64 const offset, bbU32 const size)
+void dtBufferStream::SetCacheLimit(bbU64 const limit)
 {
-    if ((offset > mBufSize) || (size == 0))
-    {
-        bbErrSet(bbEBADPARAM);
-        return NULL;
-    }
+    mCacheLimit = limit;
 
-    mSegmentLastMapped = (bbU32)-1;
+    if (mCacheSize > mCacheLimit)
+        EvictSegments();
+}
 
-    dtSection* const pSection = SectionAlloc();
-    if (!pSection)
-        return NULL;
+bbERR dtBufferStream::SwapOutSegment(bbU32 const idx)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbASSERT((pSegment->mType == dtSEGMENTTYPE_MAP) && pSegment->mChanged);
 
-    pSection->mType   = dtSECTIONTYPE_INSERT;
-    pSection->mOffset = offset;
-    pSection->mSize   = size;
+    if (idx == mGapSegment)
+        CloseGap();
 
-    bbU64 segmentstart;
-    bbU32 insert, prev, idx = FindSegment(offset, &segmentstart, 0);
-    bbU64 const segmentoffset = offset - segmentstart;
-    dtSegment* pSegment;
+    if (OpenTempFile() != bbEOK)
+        return bbELAST;
 
-    if (segmentoffset) // insert into middle of a segment -> split into two
+    if (mTempFile.WriteAt(mTempFileSize, pSegment->mpData, pSegment->mSize) != bbEOK)
     {
-        if (mSegments[idx].mType == dtSEGMENTTYPE_NULL)
-        {
-            if ((idx = SplitNullSegment(idx, segmentoffset)) == (bbU32)-1)
-                goto dtBufferStream_Insert_err;
-        }
-        else
-        {
-            bbASSERT(segmentoffset <= 0xFFFFFFFFUL);
-
-            // xxx Idea for another shortcut: To prevent split fragmentation here, realloc
-            // the existing Map segment, and temporary write data to end of block. In Commit
-            // move the data to the right spot. Alternatively introduce gap buffers on each
-            // segment as in !Zap
-
-            if ((idx = SplitMapSegment(idx, (bbU32)segmentoffset)) == (bbU32)-1)
-                goto dtBufferStream_Insert_err;
-        }
+        return bbELAST;
     }
 
-    //
-    // At this point, we insert at a segment boundary
-    // idx points to the right segment (first for insert at buffer start or end)
-    //
+    LRURemove(idx);
 
-    prev = mSegments[idx].mPrev;
-    pSegment = mSegments.GetPtr(prev);
+    mpAlloc->Free(pSegment->mpData);
+    pSegment->mType       = dtSEGMENTTYPE_TEMP;
+    pSegment->mFileOffset = mTempFileSize;
+    mTempFileSize += pSegment->mSize;
 
-    //
-    // 'Replace' case: right segment is size 0 -> replace it
-    // This case exists to eliminate 0-size segments whenever possible
-    // - also covers the empty buffer case (right is same as left segment)
-    // - if left segment is 0 and type Map, it will be covered by the 'Enlarge' case
-    // - if left segment is 0 and type Null, we have a bug
-    //
-    if ((mSegments[idx].GetSize() == 0) && ((idx != mSegmentUsedFirst) || (idx == prev)))
-    {
-        bbASSERT((idx != prev) || (offset == 0)); // if left=right, we should be inserting at buffer start
-        bbASSERT((mSegments[idx].mType == dtSEGMENTTYPE_NULL) || (mSegments[idx].mpData == NULL)); // if Map, then pData should be NULL
+    if (mSegmentLastMapped == idx)
+        mSegmentLastMapped = (bbU32)-1;
 
-        if ((pSection->mpData = (bbU8*)bbMemAlloc(size)) == NULL)
-            goto dtBufferStream_Insert_err;
+    return bbEOK;
+}
 
-        pSection->mSegment = idx;
-        pSection->mOpt     = dtSECTIONOPT_INSERT_REPLACE;
-        return pSection;
-    }
+void dtBufferStream::SwapOutSegments()
+{
+    bbU32* locked;
+    bbUINT const lockedcount = GetLockedSegments(&locked);
+    bbUINT i;
 
-    bbASSERT((pSegment->mType==dtSEGMENTTYPE_MAP) || (pSegment->mFileSize != 0)); // at this point we must not meet 0-sized Null segments
+    if ((lockedcount == (bbUINT)-1) || (mDirtyFirst == (bbU32)-1))
+        return;
 
     //
-    // 'Enlarge' case: If previous section is mapped and smaller dtBUFFERSTREAM_SEGMENTSIZE,
-    // append insert at previous segment.
+    // Walk LRU chain from least recently used segment
     //
+    bbU32 walk = mSegments[mDirtyFirst].mLRUPrev;
 
-    if ((pSegment->mType == dtSEGMENTTYPE_MAP) &&
-        (pSegment->mSize < dtBUFFERSTREAM_SEGMENTSIZE) &&
-        (offset || !mBufSize)) // prevent shortcut at buffer start, unless buffersize is 0
+    while (mDirtySize > mDirtyLimit)
     {
-        if (bbEOK != bbMemRealloc(pSegment->mSize + size, (void**)&pSegment->mpData))
-            goto dtBufferStream_Insert_err;
+        bbU32 const prev = mSegments[walk].mLRUPrev;
+        int const last = (walk == mDirtyFirst);
+
+        for (i = 0; i < lockedcount; i++)
+            if (locked[i] == walk)
+                break;
+
+        if ((i == lockedcount) && mSegments[walk].mSize)
+        {
+            if (SwapOutSegment(walk) != bbEOK)
+                break; // keep segments in memory
+        }
 
-        pSection->mpData   = pSegment->mpData + pSegment->mSize;
-        pSection->mSegment = prev;
-        pSection->mOpt     = dtSECTIONOPT_INSERT_ENLARGE; // mark that no new node was created in mSegments[]
-        return pSection;
+        if (last)
+            break;
+
+        walk = prev;
     }
 
-    //
-    // 'Create' case: new segment and link in between the two existing segments
-    //
+    #ifdef bbDEBUG
+    DebugCheckCache();
+    #endif
+}
 
-    if ((insert = NewSegment()) == (bbU32)-1)
-        goto dtBufferStream_Insert_err;
+bbERR dtBufferStream::SwapInSegment(bbU32 const idx)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbASSERT((pSegment->mType == dtSEGMENTTYPE_TEMP) && pSegment->mChanged && pSegment->mSize);
 
-    pSegment = mSegments.GetPtr(insert);
+    bbU8* const pData = (bbU8*)mpAlloc->Alloc(pSegment->mSize);
+    if (pData == NULL)
+        return bbELAST;
 
-    if ((pSegment->mpData = (bbU8*)bbMemAlloc(size)) == NULL)
+    if (mTempFile.ReadAt(pSegment->mFileOffset, pData, pSegment->mSize) != bbEOK)
     {
-        UndoSegment(insert);
-        goto dtBufferStream_Insert_err;
+        mpAlloc->Free(pData);
+        return bbELAST;
     }
 
     pSegment->mType     = dtSEGMENTTYPE_MAP;
-    pSegment->mFileSize = 0;
-    pSegment->mSize     = 0; // set later in Commit, but set to 0 so bbMemRealloc() in Discard() will free
-    pSegment->mChanged  = 1;
-
-    pSection->mpData    = pSegment->mpData;
-    pSection->mSegment  = insert;
-    pSection->mOpt      = dtSECTIONOPT_INSERT_CREATE; // mark that new node was created in mSegments[]
+    pSegment->mpData    = pData;
+    pSegment->mCapacity = pSegment->mSize;
+    LRUAdd(idx);
 
-    // The new segment will finally be linked in Commit(), or discarded in Discard()
-    pSegment->mNext = idx;
-    pSegment->mPrev = prev;
+    return bbEOK;
+}
 
-    return pSection;
+void dtBufferStream::SetDirtyLimit(bbU64 const limit)
+{
+    mDirtyLimit = limit;
 
-    dtBufferStream_Insert_err:
-    SectionFree(pSection);
-    return NULL;
+    if (mDirtySize > mDirtyLimit)
+        SwapOutSegments();
 }
 
-dtPage* dtBufferStream::PageAlloc(bbU32 const size)
+bbERR dtBufferStream::SetAllocator(dtAlloc* const pAlloc)
 {
-    bbUINT const i = mPageFree;
+    if (mSegments.GetSize())
+        return bbErrSet(bbEBADPARAM); // buffer is open
 
-    if (i >= dtBUFFERSTREAM_MAXPAGES)
-    {
-        bbErrSet(bbEFULL);
-        return NULL;
-    }
+    mpAlloc = pAlloc ? pAlloc : &dtAllocHeap::mDefault;
+    return bbEOK;
+}
+
+void dtBufferStream::SetSaveThreads(bbUINT count)
+{
+    if (count == 0)
+        count = 1;
+    if (count > dtBUFFERSTREAM_MAXSAVETHREADS)
+        count = dtBUFFERSTREAM_MAXSAVETHREADS;
 
-    dtPage* const pPage = mPagePool + i;
+    mSaveThreads = count;
+}
 
-    if (size > pPage->mSize)
+void dtBufferStream::SetSegmentSize(bbU32 size)
+{
+    if (size)
     {
-        if (bbEOK != bbMemRealloc(size, (void**)&pPage->mpData))
-            return NULL;
-        pPage->mSize = size;
-    }
+        if (size > dtBUFFERSTREAM_SEGMENTSIZE_MAX)
+            size = dtBUFFERSTREAM_SEGMENTSIZE_MAX;
+        else if (size < dtBUFFERSTREAM_SEGMENTSIZE_MIN)
+            size = dtBUFFERSTREAM_SEGMENTSIZE_MIN;
 
-    mPageFree = mPagePool->mNextFree;
+        while (size & (size - 1)) // round down to power of 2
+            size &= size - 1;
+    }
 
-    return pPage;
+    mSegmentSize = size;
 }
 
-dtSection* dtBufferStream::Map(bbU64 offset, bbU32 size, dtMAP const accesshint)
+bbU32 dtBufferStream::GetLoadSize(const dtSegment* const pSegment, bbU64 const segmentoffset, int* const pBackward)
 {
-    if ((offset + size) >= mBufSize)
-    {
-        if (((offset + size) > mBufSize) || (offset == mBufSize))
-        {
-            bbErrSet(bbEBADPARAM);
-            return NULL;
-        }
-    }
+    *pBackward = 0;
+
+    if (mSegmentSize)
+        return mSegmentSize;
 
     //
-    // Shortcut: Check if complete map lies within a segment
+    // Adaptive mode: double load size while accesses continue next to the previous
+    // load's file range, restart with the minimum size on random access
     //
-    dtSection* pMap = MapSeq(offset, 0, dtMAP_READONLY);
-    if (!pMap)
+    if ((pSegment->mFileOffset == mLoadEnd) && (segmentoffset < mLoadSize))
     {
-        bbASSERT(bbErrGet() != bbEEOF);
-        return NULL;
+        if (mLoadSize < dtBUFFERSTREAM_SEGMENTSIZE_MAX)
+            mLoadSize <<= 1;
     }
-
-    if (pMap && (size <= pMap->mSize))
+    else if (((pSegment->mFileOffset + pSegment->mFileSize) == mLoadStart) &&
+             ((pSegment->mFileSize - segmentoffset) <= mLoadSize))
     {
-        pMap->mSize = size;
-        pMap->mType = dtSECTIONTYPE_MAP;
-        pMap->mOpt  = dtSECTIONOPT_MAP_SEQ;
+        if (mLoadSize < dtBUFFERSTREAM_SEGMENTSIZE_MAX)
+            mLoadSize <<= 1;
+        *pBackward = 1;
+    }
+    else
+    {
+        mLoadSize = dtBUFFERSTREAM_SEGMENTSIZE_MIN;
+    }
 
-        bbASSERT((accesshint == dtMAP_READONLY) || (pMap->mOpt |= dtSECTIONOPT_MAP_WRITE));
+    return mLoadSize;
+}
 
-        //
-        // Undo
-        //
-        if ((accesshint != dtMAP_READONLY) && (!mUndoActive))
-        {
-            bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, size, mUndoPoint!=0);
-            if (!pUndo)
-            {
-                Discard(pMap);
-                return NULL;
-            }
-            bbMemMove(pUndo, pMap->mpData, size);
-            mUndoPoint = 0;
-            UpdateCanUndoState();
-        }
+void dtBufferStream::OpenFileMap()
+{
+    bbASSERT(!mpFileMap);
 
-        return pMap;
-    }
+#ifndef _WIN32
+    // size_t must hold the file size, and 0-sized mappings are not allowed
+    if (!mFileSize || (mFileSize != (bbU64)(size_t)mFileSize))
+        return;
 
-    bbU8* pDst;
+    if (mFile.mFd < 0)
+        return;
 
-    //
-    // Map area is split accross multiple segments, collect them into one dtPage
-    //
-    dtSection* const pSection = SectionAlloc();
-    dtPage* const pPage = PageAlloc(size);
+    void* const pMap = mmap(NULL, (size_t)mFileSize, PROT_READ, MAP_PRIVATE, mFile.mFd, 0);
 
-    if (!pSection || !pPage)
-        goto dtBufferStream_Map_err;
+    if (pMap == MAP_FAILED)
+        return;
 
-    pSection->mType  = dtSECTIONTYPE_MAP;
-    pSection->mOpt   = dtSECTIONOPT_MAP_PAGE;
-    pSection->mpData = pPage->mpData;
-    pSection->mOffset = offset;
-    pSection->mSize  = size;
-    pSection->mpPage = pPage;
+    mpFileMap = (bbU8*)pMap;
+    mFileMapSize = mFileSize;
+#endif
+}
 
-    pDst = pPage->mpData;
-    for(;;)
-    {
-        bbU32 tocopy = pMap->mSize;
-        if (tocopy > size)
-            tocopy = size;
+void dtBufferStream::CloseFileMap()
+{
+#ifndef _WIN32
+    if (mpFileMap)
+        munmap(mpFileMap, (size_t)mFileMapSize);
+#endif
+    mpFileMap = NULL;
+    mFileMapSize = 0;
+}
 
-        bbMemMove(pDst, pMap->mpData, tocopy);
-        Discard(pMap);
-        pDst += tocopy;
-        size -= tocopy;
-        offset += tocopy;
+bbERR dtBufferStream::MakeSegmentWritable(bbU32 const idx, dtSection* const pSection)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
 
-        if (size == 0)
-            break;
+    if (pSegment->mType == dtSEGMENTTYPE_TEMP)
+        return SwapInSegment(idx);
 
-        if ((pMap = MapSeq(offset, 0, dtMAP_READONLY)) == NULL)
-        {
-            bbASSERT(bbErrGet() != bbEEOF);
-            goto dtBufferStream_Map_err;
-        }
-    }
+    if ((pSegment->mType != dtSEGMENTTYPE_MAP) || !IsFileMapped(pSegment->mpData))
+        return bbEOK;
 
-    bbASSERT((accesshint == dtMAP_READONLY) || (pSection->mOpt |= dtSECTIONOPT_MAP_WRITE));
-    return pSection;
+    bbASSERT(!pSegment->mChanged && (pSegment->mSize == pSegment->mFileSize));
 
-    dtBufferStream_Map_err:
-    PageFree(pPage);
-    SectionFree(pSection);
-    Discard(pMap);
-    return NULL;
+    bbU8* const pData = (bbU8*)mpAlloc->Alloc(pSegment->mSize);
+    if (pData == NULL)
+        return bbELAST;
+
+    bbMemMove(pData, pSegment->mpData, pSegment->mSize);
+
+    if (pSection)
+        pSection->mpData = pData + (pSection->mpData - pSegment->mpData);
+
+    pSegment->mpData    = pData;
+    pSegment->mCapacity = pSegment->mSize;
+
+    return bbEOK;
 }
 
-dtSection* dtBufferStream::MapSeq(bbU64 const offset, bbUINT minsize, dtMAP const accesshint)
+bbERR dtBufferStream::SnapshotSection(dtSection* const pSection)
 {
-    if ((offset + minsize) >= mBufSize)
+    const dtSegment* const pSegment = mSegments.GetPtr(pSection->mSegment);
+    bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+
+    pSection->mpOrgPage = NULL;
+
+    if (pSegment->mChanged || !mpFileMap || (pSection->mSegment == mGapSegment))
     {
-        if (offset >= mBufSize)
-        {
-            bbErrSet(bbEEOF);
-            return NULL;
-        }
-        minsize = (bbUINT)mBufSize - (bbUINT)offset;
+        dtPage* const pPage = PageAlloc(pSection->mSize);
+        if (!pPage)
+            return bbELAST;
+
+        bbMemMove(pPage->mpData, pSection->mpData, pSection->mSize);
+        pSection->mpOrgPage = pPage;
     }
 
-    bbU64 segmentstart;
-    bbU32 idx;
-    bbU32 segmentOffset;
-    dtSegment* pSegment;
+    return bbEOK;
+}
 
-    dtSection* const pSection = SectionAlloc();
-    if (!pSection)
-        return NULL;
+/** Find next range of differing bytes.
+    Ranges separated by up to dtBUFFERSTREAM_DIFFGAP equal bytes are joined.
+    @param pData New data
+    @param pOrg Original data
+    @param size Number of bytes to compare
+    @param pPos In: offset to start search at, out: start offset of range
+    @return Size of range in bytes, or 0 if no more bytes differ
+*/
+static bbU32 dtDiffRange(const bbU8* const pData, const bbU8* const pOrg, bbU32 const size, bbU32* const pPos)
+{
+    bbU32 pos = *pPos;
 
-    //
-    // - Shortcut: caches repeated access to the same segment
-    //
-    idx = mSegmentLastMapped;
-    if (idx != (bbU32)-1)
-    {
-        segmentstart = mSegmentLastOffset;
-        pSegment = mSegments.GetPtr(idx);
-        if ((offset - segmentstart) < pSegment->mSize)
-        {
-            goto dtBufferStream_MapSeq_usecached;
-        }
+    // skip equal blocks, then bytes
+    while (((size - pos) >= 64) && (bbMemCmp(pData + pos, pOrg + pos, 64) == 0))
+        pos += 64;
 
-        mSegmentLastMapped = (bbU32)-1;
-    }
+    while ((pos < size) && (pData[pos] == pOrg[pos]))
+        pos++;
 
-    idx = FindSegment(offset, &segmentstart, 0);
-    pSegment = mSegments.GetPtr(idx);
+    if (pos >= size)
+        return 0;
 
-    if (pSegment->mType == dtSEGMENTTYPE_NULL)
-    {
-        if (pSegment->mFileSize > dtBUFFERSTREAM_SEGMENTSIZE)
-        {
-            bbU64 splitoffset = (offset - segmentstart) &~ (bbU64)(dtBUFFERSTREAM_SEGMENTSIZE-1);
+    *pPos = pos;
 
-            if (splitoffset) // don't split at segment start
-            {
-                segmentstart += splitoffset;
+    bbU32 end = pos + 1;
+    for (bbU32 i = end; (i < size) && ((i - end) < dtBUFFERSTREAM_DIFFGAP); i++)
+    {
+        if (pData[i] != pOrg[i])
+            end = i + 1;
+    }
 
-                bbU32 right = SplitNullSegment(idx, splitoffset);
-                if (right == (bbU32)-1)
-                    goto dtBufferStream_MapSeq_err;
+    return end - pos;
+}
 
-                idx = right;
-                pSegment = mSegments.GetPtr(idx);
-            }
+bbERR dtBufferStream::CommitDiff(bbU32 const idx, bbU64 const offset, bbU8* const pData, const bbU8* const pOrg, bbU32 const size, void* const user)
+{
+    bbU32 pos = 0, len;
 
-            if (pSegment->mFileSize > dtBUFFERSTREAM_SEGMENTSIZE)
-            {
-                if (SplitNullSegment(idx, dtBUFFERSTREAM_SEGMENTSIZE) == (bbU32)-1)
-                    goto dtBufferStream_MapSeq_err;
-                pSegment = mSegments.GetPtr(idx);
-            }
+    while ((len = dtDiffRange(pData, pOrg, size, &pos)) != 0)
+    {
+        bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset + pos, len, mUndoPoint!=0);
+        if (!pUndo)
+        {
+            // keep buffer in sync with history
+            bbMemMove(pData + pos, pOrg + pos, size - pos);
+            UpdateCanUndoState();
+            return bbELAST;
         }
 
-        bbU8* const pData = (bbU8*)bbMemAlloc((bbU32)pSegment->mFileSize);
-        if (pData == NULL)
-            goto dtBufferStream_MapSeq_err;
+        bbMemMove(pUndo, pOrg + pos, len);
+        mUndoPoint = 0;
 
-        if ((bbFileSeek(mhFile, pSegment->mFileOffset, bbFILESEEK_SET) != bbEOK) ||
-            (bbFileRead(mhFile, pData, (bbU32)pSegment->mFileSize) != bbEOK))
+        dtSegment* const pSegment = mSegments.GetPtr(idx);
+        if (!pSegment->mChanged)
         {
-            bbMemFree(pData);
-            goto dtBufferStream_MapSeq_err;
+            LRURemove(idx);
+            pSegment->mChanged = 1;
+            LRUAdd(idx);
         }
 
-        pSegment->mType    = dtSEGMENTTYPE_MAP;
-        pSegment->mSize    = (bbU32)pSegment->mFileSize;
-        pSegment->mpData   = pData;
-        pSegment->mChanged = 0;
+        NotifyChange(dtCHANGE_OVERWRITE, offset + pos, len, user);
+        pos += len;
+    }
 
-        mMappedSize += (bbU32)pSegment->mFileSize;
-        #ifdef bbDEBUG
-        DebugCheckMappedSize();
-        #endif
+    UpdateCanUndoState();
+    return bbEOK;
+}
+bbU32 dtBufferStream::PatchFind(bbU64 const fileoffset) const
+{
+    bbU32 lo = 0, hi = mPatchCount;
+
+    while (lo < hi)
+    {
+        bbU32 const mid = (lo + hi) >> 1;
+
+        if ((mpPatches[mid].mFileOffset + mpPatches[mid].mSize) > fileoffset)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
 
-    mSegmentLastMapped = idx; // cache
-    mSegmentLastOffset = segmentstart;
-    dtBufferStream_MapSeq_usecached:
+    return lo;
+}
 
-    //
-    // Check if segment size satisfies minsize requirement
-    //
-    segmentOffset = (bbU32)offset - (bbU32)segmentstart;
-    bbASSERT(pSegment->mSize > segmentOffset);
+bbU64 dtBufferStream::PatchMergeSize(bbU64 const fileoffset, bbU32 const size) const
+{
+    bbU64 start = fileoffset, end = fileoffset + size;
 
-    if ((pSegment->mSize-segmentOffset) < minsize)
+    // start with first patch ending at or after fileoffset, i.e. include adjacent ones
+    for (bbU32 i = fileoffset ? PatchFind(fileoffset - 1) : 0; (i < mPatchCount) && (mpPatches[i].mFileOffset <= end); i++)
     {
-        SectionFree(pSection); // could catch this condition earlier to avoid pSection alloc
-        return Map(offset, minsize, accesshint);
+        const dtPatch* const pPatch = mpPatches + i;
+
+        if (pPatch->mFileOffset < start)
+            start = pPatch->mFileOffset;
+        if ((pPatch->mFileOffset + pPatch->mSize) > end)
+            end = pPatch->mFileOffset + pPatch->mSize;
     }
 
-    pSection->mSegment = idx;
-    pSection->mpData   = pSegment->mpData + segmentOffset;
-    pSection->mOffset  = offset;
-    pSection->mSize    = pSegment->mSize - segmentOffset;
-    pSection->mType    = dtSECTIONTYPE_MAPSEQ;
-    #ifdef bbDEBUG
-    pSection->mOpt     = (bbU8)accesshint;
-    #endif
+    return end - start;
+}
+
+bbERR dtBufferStream::PatchWrite(bbU64 const fileoffset, const bbU8* const pData, bbU32 const size)
+{
+    bbU32 const first = fileoffset ? PatchFind(fileoffset - 1) : 0;
+    bbU32 last = first;
+    bbU64 start = fileoffset, end = fileoffset + size;
+    dtPatch* pPatch;
+    bbU8* pMerged;
 
     //
-    // Undo
+    // Get patches overlapping or adjacent to the range, they are merged into one
     //
-    if ((accesshint != dtMAP_READONLY) && (!mUndoActive))
+    while ((last < mPatchCount) && (mpPatches[last].mFileOffset <= end))
     {
-        bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, pSection->mSize, mUndoPoint!=0);
-        if (!pUndo)
-            goto dtBufferStream_MapSeq_err;
-        bbMemMove(pUndo, pSection->mpData, pSection->mSize);
-        mUndoPoint = 0;
-        UpdateCanUndoState();
+        pPatch = mpPatches + last;
+
+        if (pPatch->mFileOffset < start)
+            start = pPatch->mFileOffset;
+        if ((pPatch->mFileOffset + pPatch->mSize) > end)
+            end = pPatch->mFileOffset + pPatch->mSize;
+        last++;
     }
 
-    return pSection;
+    //
+    // Shortcut: range lies within a patch
+    //
+    pPatch = mpPatches + first;
 
-    dtBufferStream_MapSeq_err:
-    SectionFree(pSection);
-    return NULL;
-}
+    if ((last == (first + 1)) && (start == pPatch->mFileOffset) && (end == (start + pPatch->mSize)))
+    {
+        bbMemMove(pPatch->mpData + (bbU32)(fileoffset - start), pData, size);
+        return bbEOK;
+    }
 
-bbERR dtBufferStream::Commit(dtSection* const pSection, void* const user)
-{
-    bbERR      err;
-    dtSegment* pSegment;
-    bbU8*      pUndo;
+    if ((pMerged = (bbU8*)bbMemAlloc((bbU32)(end - start))) == NULL)
+        return bbELAST;
 
-    switch (pSection->mType)
+    if (first == last)
     {
-    case dtSECTIONTYPE_INSERT:
-        if (!mUndoActive)
+        // insert new patch
+        if (mPatchCount == mPatchCapacity)
         {
-            pUndo = mHistory.Push(dtCHANGE_INSERT, pSection->mOffset, pSection->mSize, mUndoPoint!=0);
-            if (!pUndo)
+            bbU32 const capacity = mPatchCapacity ? (mPatchCapacity << 1) : 16;
+
+            if (bbEOK != bbMemRealloc(capacity * sizeof(dtPatch), (void**)&mpPatches))
             {
-                err = bbELAST;
-                goto dtBufferStream_Commit_err;
+                bbMemFree(pMerged);
+                return bbELAST;
             }
-            mUndoPoint = 0;
-            UpdateCanUndoState();
+            mPatchCapacity = capacity;
         }
 
-        pSegment = mSegments.GetPtr(pSection->mSegment);
+        pPatch = mpPatches + first;
+        bbMemMove(pPatch + 1, pPatch, (mPatchCount - first) * sizeof(dtPatch));
+        mPatchCount++;
+        mPatchSize += sizeof(dtPatch);
+    }
+    else
+    {
+        // copy merged patches, the first descriptor is reused
+        for (bbU32 i = first; i < last; i++)
+        {
+            bbMemMove(pMerged + (bbU32)(mpPatches[i].mFileOffset - start), mpPatches[i].mpData, mpPatches[i].mSize);
+            mPatchSize -= mpPatches[i].mSize;
+            bbMemFree(mpPatches[i].mpData);
+        }
 
-        bbASSERT(mSegmentLastMapped == (bbU32)-1);
+        bbMemMove(mpPatches + first + 1, mpPatches + last, (mPatchCount - last) * sizeof(dtPatch));
+        mPatchCount -= last - first - 1;
+        mPatchSize -= (last - first - 1) * sizeof(dtPatch);
+    }
 
-        switch (pSection->mOpt)
-        {
-        case dtSECTIONOPT_INSERT_ENLARGE:
-        {
-            bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+    bbMemMove(pMerged + (bbU32)(fileoffset - start), pData, size);
 
-            // adjust relative offsets in tree
-            bbU64 const segmentstart = pSection->mOffset - pSegment->mSize;
-            pSegment->mSize += pSection->mSize;
-            NodeSubstractOffset(pSection->mSegment, segmentstart, -(bbS64)pSection->mSize);
-            break;
-        }
+    pPatch->mFileOffset = start;
+    pPatch->mpData      = pMerged;
+    pPatch->mSize       = (bbU32)(end - start);
+    mPatchSize += pPatch->mSize;
 
-        case dtSECTIONOPT_INSERT_CREATE:
-        {
-            bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+    return bbEOK;
+}
 
-            //
-            // Complete linking into mSegments[] list
-            //
-            bbU32 const insert = pSection->mSegment;
-            bbU32 const next = pSegment->mNext;
-            bbU32 const prev = pSegment->mPrev;
-            mSegments[prev].mNext = insert;
-            mSegments[next].mPrev = insert;
+void dtBufferStream::PatchApply(bbU64 const fileoffset, bbU8* const pData, bbU64 const size) const
+{
+    bbU64 const end = fileoffset + size;
 
-            //
-            // update first/last pointers for linked list
-            //
-            if (next == mSegmentUsedFirst) // new segment created at buffer start or end?
-            {
-                bbASSERT(mSegmentUsedLast == prev);
+    for (bbU32 i = PatchFind(fileoffset); (i < mPatchCount) && (mpPatches[i].mFileOffset < end); i++)
+    {
+        const dtPatch* const pPatch = mpPatches + i;
+        bbU64 const from = (pPatch->mFileOffset > fileoffset) ? pPatch->mFileOffset : fileoffset;
+        bbU64 to = pPatch->mFileOffset + pPatch->mSize;
+        if (to > end)
+            to = end;
 
-                if (pSection->mOffset == 0) // insert at buffer start?
-                {
-                    mSegmentUsedFirst = insert;
-
-                    // set new tree root (alternatively we could create a new child at the bottom left of the tree)
-                    mSegments[mSegmentUsedRoot].mOffset += pSection->mSize;
-                    pSegment->mSize = pSection->mSize;
-                    pSegment->mOffset = 0;
-                    pSegment->mLT = (bbU32)-1;
-                    pSegment->mGE = mSegmentUsedRoot;
-                    mSegmentUsedRoot = insert;
-                    goto dtBufferStream_Commit_insert_noleftneighbour;
-                }
-                else
-                {
-                    mSegmentUsedLast = insert;
-                }
-            }
+        bbMemMove(pData + (bbUPTR)(from - fileoffset), pPatch->mpData + (bbU32)(from - pPatch->mFileOffset), (bbU32)(to - from));
+    }
+}
 
-            //
-            // Link and adjust offsets in tree
-            //
-            bbASSERT((next == mSegmentUsedFirst) || (mSegmentUsedLast != prev));
+void dtBufferStream::PatchDrop(bbU64 const fileoffset, bbU64 const size)
+{
+    bbU64 const end = fileoffset + size;
+    bbU32 first = PatchFind(fileoffset), last;
 
-            // link inserted segment to left neighbour
-            pSegment->mSize = pSection->mSize;
-            NodeInsert(insert, pSection->mOffset);
+    // patches straddling the range boundaries are kept
+    if ((first < mPatchCount) && (mpPatches[first].mFileOffset < fileoffset))
+        first++;
 
-            dtBufferStream_Commit_insert_noleftneighbour:
+    for (last = first; (last < mPatchCount) && ((mpPatches[last].mFileOffset + mpPatches[last].mSize) <= end); last++)
+    {
+        mPatchSize -= mpPatches[last].mSize + sizeof(dtPatch);
+        bbMemFree(mpPatches[last].mpData);
+    }
 
-            // xxx rebalance tree here
-            break;
-        }
+    if (last > first)
+    {
+        bbMemMove(mpPatches + first, mpPatches + last, (mPatchCount - last) * sizeof(dtPatch));
+        mPatchCount -= last - first;
+    }
+}
 
-        case dtSECTIONOPT_INSERT_REPLACE:
-            bbASSERT((pSegment->mType != dtSEGMENTTYPE_NULL) || (pSegment->mFileSize == 0));
-            bbASSERT((pSegment->mType != dtSEGMENTTYPE_MAP)  || (pSegment->mpData == NULL));
+void dtBufferStream::PatchClear()
+{
+    for (bbU32 i = 0; i < mPatchCount; i++)
+        bbMemFree(mpPatches[i].mpData);
 
-            pSegment->mType  = dtSEGMENTTYPE_MAP;
-            pSegment->mpData = pSection->mpData;
-            pSegment->mSize  = pSection->mSize;
+    bbMemFreeNull((void**)&mpPatches);
+    mPatchCount = mPatchCapacity = 0;
+    mPatchSize = 0;
+}
 
-            NodeSubstractOffset(pSection->mSegment, pSection->mOffset, -(bbS64)pSection->mSize);
-            break;
-        }
+bbERR dtBufferStream::ReadPatched(bbU64 const fileoffset, bbU8* const pData, bbU32 const size)
+{
+    if (mpFileMap)
+        bbMemMove(pData, mpFileMap + fileoffset, size);
+    else if (mFile.ReadAt(fileoffset, pData, size) != bbEOK)
+        return bbELAST;
 
-        #ifdef bbDEBUG
-        CheckTree();
-        #endif
+    PatchApply(fileoffset, pData, size);
+    return bbEOK;
+}
 
-        mBufSize += pSection->mSize;
-        pSegment->mChanged = 1;
-        NotifyChange(dtCHANGE_INSERT, pSection->mOffset, pSection->mSize, user);
-        break;
+dtSection* dtBufferStream::MapPatch(bbU64 const offset, bbU64 const fileoffset, bbU32 const size, dtMAP const accesshint)
+{
+    dtSection* const pSection = SectionAlloc();
+    dtPage* const pPage = PageAlloc(size);
 
-    case dtSECTIONTYPE_MAP:
-        bbASSERT(pSection->mOpt & dtSECTIONOPT_MAP_WRITE); // assert dtMAP_WRITE usage
+    if (!pSection || !pPage || (ReadPatched(fileoffset, pPage->mpData, size) != bbEOK))
+    {
+        PageFree(pPage);
+        SectionFree(pSection);
+        return NULL;
+    }
 
-        if ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) != dtSECTIONOPT_MAP_SEQ)
-        {
-            bbU8*         pTmp   = pSection->mpData;
-            bbU32         size   = pSection->mSize;
-            bbU64         offset = pSection->mOffset;
+    pSection->mType   = dtSECTIONTYPE_MAP;
+    pSection->mOpt    = (accesshint == dtMAP_WRITEDIFF) ? (dtSECTIONOPT_MAP_PATCH|dtSECTIONOPT_MAP_DIFF) : dtSECTIONOPT_MAP_PATCH;
+    pSection->mpData  = pPage->mpData;
+    pSection->mOffset = offset;
+    pSection->mSize   = size;
+    pSection->mpPage  = pPage;
 
-            pUndo = NULL;
-            if (!mUndoActive)
-            {
-                pUndo = mHistory.Push(dtCHANGE_OVERWRITE, offset, size, mUndoPoint!=0);
-                if (!pUndo)
-                {
-                    err = bbELAST;
-                    goto dtBufferStream_Commit_err;
-                }
-                mUndoPoint = 0;
-                UpdateCanUndoState();
-            }
+    pSection->mOpt |= dtSECTIONOPT_MAP_WRITE;
+    return pSection;
+}
 
-            while (size > 0)
-            {
-                dtSection* pMapSeq = MapSeq(offset, 0, dtMAP_READONLY);
-                bbASSERT(!pMapSeq || (pMapSeq->mOpt = dtMAP_WRITE));
+bbERR dtBufferStream::CommitPatch(dtSection* const pSection, bbU64 const fileoffset, void* const user)
+{
+    bbU8* const pData = pSection->mpData;
+    bbU32 const size = pSection->mSize;
+    bbU32 pos = 0, len = size;
+    dtPage* pOrg = NULL;
 
-                if (!pMapSeq)
-                {
-                    bbASSERT(bbErrGet() != bbEEOF);
-                    if (pUndo)
-                        mHistory.PushRevert();
-                    goto dtBufferStream_Commit_err; //xxx not atomic
-                }
+    if (mUndoActive)
+    {
+        if (PatchWrite(fileoffset, pData, size) != bbEOK)
+            return bbELAST;
 
-                bbU32 tocopy = pMapSeq->mSize;
-                if (size < tocopy)
-                    tocopy = size;
-                if (pUndo)
-                {
-                    bbMemMove(pUndo, pMapSeq->mpData, tocopy);
-                    pUndo += tocopy;
-                }
-                bbMemMove(pMapSeq->mpData, pTmp, tocopy);
+        NotifyChange(dtCHANGE_OVERWRITE, pSection->mOffset, size, user);
+        return bbEOK;
+    }
 
-                if ((err = Commit(pMapSeq, user)) != bbEOK)
-                {
-                    if (pUndo)
-                        mHistory.PushRevert();
-                    goto dtBufferStream_Commit_err; //xxx not atomic
-                }
+    //
+    // With dtMAP_WRITEDIFF only ranges differing from the original are recorded
+    //
+    if (pSection->mOpt & dtSECTIONOPT_MAP_DIFF)
+    {
+        if (((pOrg = PageAlloc(size)) == NULL) || (ReadPatched(fileoffset, pOrg->mpData, size) != bbEOK))
+            goto dtBufferStream_CommitPatch_err;
 
-                pTmp += tocopy;
-                offset += tocopy;
-                size -= tocopy;
-            }
-            break;
+        len = dtDiffRange(pData, pOrg->mpData, size, &pos);
+    }
+
+    while (len)
+    {
+        bbU8* const pUndo = mHistory.Push(dtCHANGE_OVERWRITE, pSection->mOffset + pos, len, mUndoPoint!=0);
+        if (!pUndo)
+            goto dtBufferStream_CommitPatch_err;
+
+        if (pOrg)
+            bbMemMove(pUndo, pOrg->mpData + pos, len);
+
+        if ((!pOrg && (ReadPatched(fileoffset + pos, pUndo, len) != bbEOK)) ||
+            (PatchWrite(fileoffset + pos, pData + pos, len) != bbEOK))
+        {
+            mHistory.PushRevert();
+            goto dtBufferStream_CommitPatch_err;
         }
-        //fall through
 
-    case dtSECTIONTYPE_MAPSEQ:
-        bbASSERT((pSection->mOpt == dtMAP_WRITE) || (pSection->mType==dtSECTIONTYPE_MAP));
-        pSegment = mSegments.GetPtr(pSection->mSegment);
-        pSegment->mChanged = 1;
-        NotifyChange(dtCHANGE_OVERWRITE, pSection->mOffset, pSection->mSize, user);
-        break;
+        mUndoPoint = 0;
+        NotifyChange(dtCHANGE_OVERWRITE, pSection->mOffset + pos, len, user);
 
-    default:
-        bbASSERT(0);
+        pos += len;
+        len = pOrg ? dtDiffRange(pData, pOrg->mpData, size, &pos) : 0;
     }
 
-    err = bbEOK;
-    dtBufferStream_Commit_err:
-
-    #ifdef bbDEBUG
-    CheckTree();
-    #endif
+    PageFree(pOrg);
+    UpdateCanUndoState();
+    return bbEOK;
 
-    SectionFree(pSection);
-    return err;
+    dtBufferStream_CommitPatch_err:
+    PageFree(pOrg);
+    UpdateCanUndoState();
+    return bbELAST;
 }
 
-void dtBufferStream::Discard(dtSection* const pSection)
+bbERR dtBufferStream::SavePatches(dtStreamFile& out)
 {
-    if (!pSection)
-        return;
-
-    dtSegment* pSegment;
+    if (!mPatchCount)
+        return bbEOK;
 
-    switch (pSection->mType)
+    bbU64 offset = 0;
+    bbU32 idx = mSegmentUsedFirst;
+    do
     {
-    case dtSECTIONTYPE_INSERT:
-        pSegment = mSegments.GetPtr(pSection->mSegment);
-        bbASSERT(pSegment->mType == dtSEGMENTTYPE_MAP);
+        const dtSegment* const pSegment = mSegments.GetPtr(idx);
+        bbU64 const size = pSegment->GetSize();
 
-        if (pSection->mOpt == dtSECTIONOPT_INSERT_REPLACE)
+        if ((pSegment->mType == dtSEGMENTTYPE_NULL) && size)
         {
-            bbMemFree(pSection->mpData);
-        }
-        else
-        {
-            bbMemRealloc(pSegment->mSize, (void**)&pSegment->mpData); // restore or free heap block size
+            bbU64 const end = pSegment->mFileOffset + size;
 
-            if (pSection->mOpt == dtSECTIONOPT_INSERT_CREATE)
+            for (bbU32 i = PatchFind(pSegment->mFileOffset); (i < mPatchCount) && (mpPatches[i].mFileOffset < end); i++)
             {
-                bbASSERT(pSegment->mpData == NULL); // ensure it was really freed
-
-                // return segment to free pool
-                pSegment->mNext = mSegmentFree;
-                mSegmentFree = pSection->mSegment;
+                const dtPatch* const pPatch = mpPatches + i;
+                bbU64 const from = (pPatch->mFileOffset > pSegment->mFileOffset) ? pPatch->mFileOffset : pSegment->mFileOffset;
+                bbU64 to = pPatch->mFileOffset + pPatch->mSize;
+                if (to > end)
+                    to = end;
+
+                if (out.WriteAt(offset + (from - pSegment->mFileOffset),
+                                pPatch->mpData + (bbU32)(from - pPatch->mFileOffset),
+                                (bbU32)(to - from)) != bbEOK)
+                {
+                    return bbELAST;
+                }
             }
         }
 
-        break;
-
-    case dtSECTIONTYPE_MAP:
-        bbASSERT((pSection->mOpt & dtSECTIONOPT_MAP_WRITE) == 0); // assert dtMAP_READONLY usage
-        if ((pSection->mOpt & dtSECTIONOPT_MAP_TYPEMASK) != dtSECTIONOPT_MAP_SEQ)
-        {
-            PageFree(pSection->mpPage);
-            break;
-        }
-        // fall through
-
-    case dtSECTIONTYPE_MAPSEQ:
-        bbASSERT(pSection->mOpt == dtMAP_READONLY);
-        bbASSERT(mSegments[pSection->mSegment].mType == dtSEGMENTTYPE_MAP);
-        break;
+        offset += size;
+        idx = pSegment->mNext;
 
-    default:
-        bbASSERT(0);
-    }
+    } while (idx != mSegmentUsedFirst);
 
-    SectionFree(pSection);
+    return bbEOK;
 }
+
 #ifdef bbDEBUG
 
 void dtBufferStream::DumpSavedTree()
@@ -1314,7 +3756,7 @@ void dtBufferStream::LoadSavedTree(const bbCHAR* const pFileName, int const exec
         bbFileRead(fh, &gSavedClass, sizeof(gSavedClass));
         bbFileRead(fh, gpSavedSegments, gSavedSegmentSize * sizeof(dtSegment));
 
-        ClearSegments();
+        ClearSegments(1);
         mSegments.SetSize(gSavedSegmentSize);
         bbMemMove(mSegments.GetPtr(), gpSavedSegments, gSavedSegmentSize * sizeof(dtSegment));
         mSegmentFree        = gSavedClass.mSegmentFree;
@@ -1323,6 +3765,10 @@ void dtBufferStream::LoadSavedTree(const bbCHAR* const pFileName, int const exec
         mSegmentUsedRoot    = gSavedClass.mSegmentUsedRoot;
         mSegmentLastMapped  = -1;
         mBufSize            = gSavedClass.mBufSize;
+        mLRUFirst           = -1;
+        mCacheSize          = 0;
+        mDirtyFirst         = -1;
+        mDirtySize          = 0;
 
         bbU32 walk = mSegmentUsedFirst;
         do
@@ -1331,8 +3777,10 @@ void dtBufferStream::LoadSavedTree(const bbCHAR* const pFileName, int const exec
 
             if (pSegment->mType == dtSEGMENTTYPE_MAP)
             {
-                pSegment->mpData = (bbU8*)bbMemAlloc(pSegment->mSize);
+                pSegment->mpData = (bbU8*)mpAlloc->Alloc(pSegment->mSize);
+                pSegment->mCapacity = pSegment->mSize;
                 bbMemClear(pSegment->mpData, pSegment->mSize);
+                LRUAdd(walk);
             }
 
             walk = pSegment->mNext;
@@ -1390,6 +3838,7 @@ void dtBufferStream::CheckTree()
         gOffsetSize = mSegments.GetSize();
         bbMemRealloc(8*gOffsetSize, (void**)&gpOffsets);
         bbMemRealloc(8*gOffsetSize, (void**)&gpOffsetStack);
+        bbMemRealloc(4*gOffsetSize, (void**)&gpNodeStack);
     }
 
     if ((gCheckTreeDisable == 0) && (mSegmentUsedRoot != (bbU32)-1))
@@ -1399,8 +3848,7 @@ void dtBufferStream::CheckTree()
         {
             bbASSERT(walk < mSegments.GetSize());
             gpOffsets[walk] = offset;
-            if ((mSegments[walk].mType != dtSEGMENTTYPE_MAP) || (mSegments[walk].mChanged != 255))
-                offset += mSegments[walk].GetSize();
+            offset += mSegments[walk].GetSize();
             walk = mSegments[walk].mNext;
         } while (walk != mSegmentUsedFirst);
 
@@ -1416,18 +3864,27 @@ void dtBufferStream::CheckTree()
                 bbASSERT(offset == gpOffsets[walk]);
             }
 
+            bbASSERT((pSegment->mLT == (bbU32)-1) || (mSegments[pSegment->mLT].mParent == walk));
+            bbASSERT((pSegment->mGE == (bbU32)-1) || (mSegments[pSegment->mGE].mParent == walk));
+
+            // AA-tree invariants
+            bbASSERT(pSegment->mLevel == (NodeLevel(pSegment->mLT) + 1));
+            bbASSERT((pSegment->mLevel == NodeLevel(pSegment->mGE)) || (pSegment->mLevel == (NodeLevel(pSegment->mGE) + 1)));
+            bbASSERT((pSegment->mGE == (bbU32)-1) || (pSegment->mLevel > NodeLevel(mSegments[pSegment->mGE].mGE)));
+            bbASSERT((pSegment->mLevel == 1) || ((pSegment->mLT != (bbU32)-1) && (pSegment->mGE != (bbU32)-1)));
+
             if (pSegment->mLT != (bbU32)-1)
             {
                 bbASSERT(i < mSegments.GetSize());
                 gpOffsetStack[i] = offset;
-                mSegments[i++].mCapacity = pSegment->mLT;
+                gpNodeStack[i++] = pSegment->mLT;
             }
 
             walk = pSegment->mGE;
 
             if ((walk == (bbU32)-1) && i)
             {
-                walk = mSegments[--i].mCapacity;
+                walk = gpNodeStack[--i];
                 offset = gpOffsetStack[i];
             }
 
@@ -1450,6 +3907,52 @@ void dtBufferStream::DebugCheckMappedSize()
     bbASSERT((mFileSize - unmappedSize) == mMappedSize);
 }
 
+void dtBufferStream::DebugCheckCache()
+{
+    // Check if LRU chains contain all Map segments, and match mCacheSize and mDirtySize
+    bbU32 walk = mSegmentUsedFirst;
+    bbU32 count[2] = { 0, 0 };
+    bbU64 size[2] = { 0, 0 };
+    do
+    {
+        if (mSegments[walk].mType == dtSEGMENTTYPE_MAP)
+        {
+            int const changed = mSegments[walk].mChanged != 0;
+            size[changed] += mSegments[walk].mSize;
+            count[changed]++;
+        }
+        else if (mSegments[walk].mType == dtSEGMENTTYPE_TEMP)
+        {
+            bbASSERT(mSegments[walk].mChanged && mTempFile.mhFile);
+            bbASSERT((mSegments[walk].mFileOffset + mSegments[walk].mSize) <= mTempFileSize);
+        }
+        walk = mSegments[walk].mNext;
+    } while (walk != mSegmentUsedFirst);
+
+    bbASSERT(size[0] == mCacheSize);
+    bbASSERT(size[1] == mDirtySize);
+
+    for (int changed = 0; changed < 2; changed++)
+    {
+        bbU32 const first = changed ? mDirtyFirst : mLRUFirst;
+
+        if ((walk = first) != (bbU32)-1)
+        {
+            do
+            {
+                dtSegment* const pSegment = mSegments.GetPtr(walk);
+                bbASSERT((pSegment->mType == dtSEGMENTTYPE_MAP) && ((pSegment->mChanged != 0) == changed));
+                bbASSERT(mSegments[pSegment->mLRUNext].mLRUPrev == walk);
+                bbASSERT(count[changed]);
+                count[changed]--;
+                walk = pSegment->mLRUNext;
+            } while (walk != first);
+        }
+
+        bbASSERT(count[changed] == 0);
+    }
+}
+
 bbU32 dtBufferStream::DebugCheck()
 {
     bbASSERT(mSegmentUsedFirst < mSegments.GetSize());
@@ -1499,10 +4002,20 @@ bbU32 dtBufferStream::DebugCheck()
 
         if (p->mType == dtSEGMENTTYPE_MAP)
         {
-            bbU8* pData = p->mpData;
-            bbU8* const pDataEnd = pData + p->mSize;
-            while (pData < pDataEnd)
-                crc += (bbU32)*(pData++);
+            bbU32 const gap = (idx == mGapSegment) ? mGapOffset : p->mSize;
+            bbASSERT(IsFileMapped(p->mpData) || (p->mCapacity >= (p->mSize + ((idx == mGapSegment) ? mGapSize : 0))));
+            bbASSERT(p->mChanged || !PatchTest(p->mFileOffset, p->mSize)); // unchanged data equals file
+            for (bbU32 i = 0; i < p->mSize; i++)
+                crc += (bbU32)p->mpData[(i < gap) ? i : (i + mGapSize)];
+        }
+        else if (p->mType == dtSEGMENTTYPE_TEMP)
+        {
+            bbU8* const pTmp = (bbU8*)bbMemAlloc(p->mSize);
+            bbASSERT(pTmp);
+            mTempFile.ReadAt(p->mFileOffset, pTmp, p->mSize);
+            for (bbU32 i = 0; i < p->mSize; i++)
+                crc += (bbU32)pTmp[i];
+            bbMemFree(pTmp);
         }
 
         prev = idx;
@@ -1513,7 +4026,17 @@ bbU32 dtBufferStream::DebugCheck()
     bbASSERT((freecount + usedcount) == mSegments.GetSize()); // orphans?
     bbASSERT(bufsize == mBufSize);
 
+    // patch overlay is sorted, patches neither overlap nor touch
+    bbU64 patchsize = 0;
+    for (bbU32 i = 0; i < mPatchCount; i++)
+    {
+        bbASSERT(mpPatches[i].mSize && (!i || ((mpPatches[i-1].mFileOffset + mpPatches[i-1].mSize) < mpPatches[i].mFileOffset)));
+        patchsize += mpPatches[i].mSize + sizeof(dtPatch);
+    }
+    bbASSERT(patchsize == mPatchSize);
+
     DebugCheckMappedSize();
+    DebugCheckCache();
 
     return crc;
 }
@@ -0,0 +1,295 @@
+#include "dtFileIO.h"
+#include <babel/mem.h>
+
+#if defined(__linux__) && !defined(dtFILEIO_NOURING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define dtFILEIO_URING
+#endif
+#endif
+
+#ifdef dtFILEIO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/** Minimal io_uring instance, see io_uring_setup(2). */
+struct dtIORing
+{
+    int             mFd;        //!< Ring file descriptor
+    void*           mpSQ;       //!< Mapped submission queue ring
+    size_t          mSQSize;
+    void*           mpCQ;       //!< Mapped completion queue ring, may be same as mpSQ
+    size_t          mCQSize;
+    io_uring_sqe*   mpSQEs;     //!< Mapped submission queue entries
+    size_t          mSQESize;
+    unsigned*       mpSQTail;
+    unsigned*       mpSQMask;
+    unsigned*       mpSQArray;
+    unsigned*       mpCQHead;
+    unsigned*       mpCQTail;
+    unsigned*       mpCQMask;
+    io_uring_cqe*   mpCQEs;
+};
+
+static void dtIORingDestroy(dtIORing* const pRing)
+{
+    if (pRing->mpSQEs)
+        munmap(pRing->mpSQEs, pRing->mSQESize);
+    if (pRing->mpCQ && (pRing->mpCQ != pRing->mpSQ))
+        munmap(pRing->mpCQ, pRing->mCQSize);
+    if (pRing->mpSQ)
+        munmap(pRing->mpSQ, pRing->mSQSize);
+    close(pRing->mFd);
+    bbMemFree(pRing);
+}
+
+static dtIORing* dtIORingCreate(unsigned const entries)
+{
+    io_uring_params params;
+    bbMemClear(&params, sizeof(params));
+
+    int const fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return NULL; // e.g. kernel too old, or blocked by seccomp
+
+    dtIORing* const pRing = (dtIORing*)bbMemAlloc(sizeof(dtIORing));
+    if (!pRing)
+    {
+        close(fd);
+        return NULL;
+    }
+    bbMemClear(pRing, sizeof(dtIORing));
+    pRing->mFd = fd;
+
+    pRing->mSQSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pRing->mCQSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (pRing->mCQSize > pRing->mSQSize)
+            pRing->mSQSize = pRing->mCQSize;
+        pRing->mCQSize = pRing->mSQSize;
+    }
+
+    void* p = mmap(NULL, pRing->mSQSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (p == MAP_FAILED)
+        goto err;
+    pRing->mpSQ = p;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        pRing->mpCQ = pRing->mpSQ;
+    }
+    else
+    {
+        p = mmap(NULL, pRing->mCQSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (p == MAP_FAILED)
+            goto err;
+        pRing->mpCQ = p;
+    }
+
+    pRing->mSQESize = params.sq_entries * sizeof(io_uring_sqe);
+    p = mmap(NULL, pRing->mSQESize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (p == MAP_FAILED)
+        goto err;
+    pRing->mpSQEs = (io_uring_sqe*)p;
+
+    pRing->mpSQTail  = (unsigned*)((bbU8*)pRing->mpSQ + params.sq_off.tail);
+    pRing->mpSQMask  = (unsigned*)((bbU8*)pRing->mpSQ + params.sq_off.ring_mask);
+    pRing->mpSQArray = (unsigned*)((bbU8*)pRing->mpSQ + params.sq_off.array);
+    pRing->mpCQHead  = (unsigned*)((bbU8*)pRing->mpCQ + params.cq_off.head);
+    pRing->mpCQTail  = (unsigned*)((bbU8*)pRing->mpCQ + params.cq_off.tail);
+    pRing->mpCQMask  = (unsigned*)((bbU8*)pRing->mpCQ + params.cq_off.ring_mask);
+    pRing->mpCQEs    = (io_uring_cqe*)((bbU8*)pRing->mpCQ + params.cq_off.cqes);
+
+    return pRing;
+
+    err:
+    dtIORingDestroy(pRing);
+    return NULL;
+}
+#endif
+
+dtFileIO::dtFileIO()
+{
+    mpRing = NULL;
+    mCount = 0;
+}
+
+dtFileIO::~dtFileIO()
+{
+    Close();
+}
+
+bbERR dtFileIO::Open(const bbCHAR* const pPath, bbUINT const flags, bbUINT const opt)
+{
+    bbASSERT(!IsOpen());
+
+    mCount = 0;
+
+    if (mFile.Open(pPath, flags, opt & dtFILEIOOPT_DIRECT) == NULL)
+        return bbELAST;
+
+#ifdef dtFILEIO_URING
+    if ((opt & dtFILEIOOPT_ASYNC) && (mFile.mFd >= 0) && !mFile.IsDirect())
+        mpRing = dtIORingCreate(dtFILEIO_MAXBATCH);
+#endif
+
+    return bbEOK;
+}
+
+void dtFileIO::Close()
+{
+#ifdef dtFILEIO_URING
+    if (mpRing)
+    {
+        dtIORingDestroy(mpRing);
+        mpRing = NULL;
+    }
+#endif
+
+    mFile.Close();
+    mCount = 0;
+}
+
+bbERR dtFileIO::Queue(dtStreamFile* const pFile, bbU64 const offset, bbU8* const pBuf, bbU32 const size, bbU8 const write)
+{
+    if (!size)
+        return bbEOK;
+
+    if ((mCount == dtFILEIO_MAXBATCH) && (Flush() != bbEOK))
+        return bbELAST;
+
+    dtFileIOReq* const pReq = &mReq[mCount++];
+    pReq->mpFile  = pFile;
+    pReq->mOffset = offset;
+    pReq->mpBuf   = pBuf;
+    pReq->mSize   = size;
+    pReq->mWrite  = write;
+
+    return bbEOK;
+}
+
+bbERR dtFileIO::Flush()
+{
+    if (!mCount)
+        return bbEOK;
+
+    bbERR const err = mpRing ? FlushRing() : FlushSync(0);
+    mCount = 0;
+    return err;
+}
+
+bbERR dtFileIO::FlushSync(bbUINT const first)
+{
+    for (bbUINT i = first; i < mCount; i++)
+    {
+        dtFileIOReq* const pReq = &mReq[i];
+
+        if ((pReq->mWrite ? pReq->mpFile->WriteAt(pReq->mOffset, pReq->mpBuf, pReq->mSize)
+                          : pReq->mpFile->ReadAt(pReq->mOffset, pReq->mpBuf, pReq->mSize)) != bbEOK)
+            return bbELAST;
+    }
+
+    return bbEOK;
+}
+
+bbERR dtFileIO::FlushRing()
+{
+#ifdef dtFILEIO_URING
+    dtIORing* const pRing = mpRing;
+    bbUINT i;
+    bbERR err = bbEOK;
+
+    //
+    // Fill submission queue, we are the only producer
+    //
+    unsigned tail = *pRing->mpSQTail;
+    unsigned const sqmask = *pRing->mpSQMask;
+
+    for (i = 0; i < mCount; i++)
+    {
+        dtFileIOReq* const pReq = &mReq[i];
+        unsigned const idx = tail & sqmask;
+        io_uring_sqe* const pSQE = &pRing->mpSQEs[idx];
+
+        bbMemClear(pSQE, sizeof(io_uring_sqe));
+        pSQE->opcode    = pReq->mWrite ? IORING_OP_WRITE : IORING_OP_READ;
+        pSQE->fd        = pReq->mpFile->mFd;
+        pSQE->off       = pReq->mOffset;
+        pSQE->addr      = (bbU64)(bbUPTR)pReq->mpBuf;
+        pSQE->len       = pReq->mSize;
+        pSQE->user_data = i;
+
+        pRing->mpSQArray[idx] = idx;
+        tail++;
+    }
+
+    __atomic_store_n(pRing->mpSQTail, tail, __ATOMIC_RELEASE);
+
+    //
+    // Submit and reap completions
+    //
+    bbUINT tosubmit = mCount;
+    bbUINT pending = mCount;    // requests not reaped yet, excluding those that failed to submit
+    bbUINT unsubmitted = 0;
+
+    while (pending)
+    {
+        int const ret = (int)syscall(__NR_io_uring_enter, pRing->mFd, tosubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0)
+        {
+            tosubmit -= (bbUINT)ret;
+        }
+        else if (tosubmit && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+        {
+            // Submission failed, requests in flight still reference caller buffers,
+            // keep reaping until they completed. The rest is run synchronously below.
+            unsubmitted = tosubmit;
+            pending -= tosubmit;
+            tosubmit = 0;
+        }
+
+        unsigned head = *pRing->mpCQHead;
+        unsigned const cqmask = *pRing->mpCQMask;
+
+        while (head != __atomic_load_n(pRing->mpCQTail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe* const pCQE = &pRing->mpCQEs[head & cqmask];
+            dtFileIOReq* const pReq = &mReq[pCQE->user_data];
+            bbS32 res = pCQE->res;
+            head++;
+            pending--;
+
+            // finish short transfers and unsupported opcodes synchronously
+            if ((res >= 0) ? ((bbU32)res < pReq->mSize) : ((res == -EINVAL) || (res == -EOPNOTSUPP)))
+            {
+                bbU32 const done = (res > 0) ? (bbU32)res : 0;
+                res = (pReq->mWrite ? pReq->mpFile->WriteAt(pReq->mOffset + done, pReq->mpBuf + done, pReq->mSize - done)
+                                    : pReq->mpFile->ReadAt(pReq->mOffset + done, pReq->mpBuf + done, pReq->mSize - done)) == bbEOK ? 0 : -1;
+            }
+
+            if ((res < 0) && (err == bbEOK))
+                err = bbErrSet(pReq->mWrite ? bbEFILEWRITE : bbEFILEREAD);
+        }
+
+        __atomic_store_n(pRing->mpCQHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (unsubmitted)
+    {
+        // unsubmitted entries are left in the submission queue, don't use this ring again
+        dtIORingDestroy(pRing);
+        mpRing = NULL;
+
+        if ((FlushSync(mCount - unsubmitted) != bbEOK) && (err == bbEOK))
+            err = bbELAST;
+    }
+
+    return err;
+#else
+    return FlushSync(0);
+#endif
+}
@@ -24,9 +24,10 @@ void dtHistory::Trunc()
 
     while (pos > mHistPos)
     {
-        len = Peek(pos, &change);
+        int runs;
+        len = Peek(pos, &change, &runs);
 
-        if (change.length > 8)
+        if (runs || (change.length > 8))
             bbMemFree(change.user);
 
         pos -= len;
@@ -42,7 +43,7 @@ void dtHistory::Trunc()
     }
 }
 
-bbUINT dtHistory::Peek(bbU32 const pos, dtBufferChange* const pChange) const
+bbUINT dtHistory::Peek(bbU32 const pos, dtBufferChange* const pChange, int* const pRuns) const
 {
     bbASSERT(mHistSize);
     bbASSERT((pos <= mHistSize) || (pos == dtHistory::PEEKNEXT));
@@ -67,6 +68,9 @@ bbUINT dtHistory::Peek(bbU32 const pos, dtBufferChange* const pChange) const
     pChange->type      = header & 3;
     pChange->user      = NULL;
 
+    if (pRuns)
+        *pRuns = header & 8;
+
     switch ((header >> 4) & 3)
     {
     case 0: pChange->offset = bbLD32(pTmp); pTmp+=4; break;
@@ -77,7 +81,7 @@ bbUINT dtHistory::Peek(bbU32 const pos, dtBufferChange* const pChange) const
     switch ((header >> 6) & 3)
     {
     case 0:
-        if ((pChange->length = *(pTmp++)) <= 8)
+        if (((pChange->length = *(pTmp++)) <= 8) && !(header & 8))
         {
             pChange->user = const_cast<bbU8*>(pTmp);
             pTmp += (bbUINT)pChange->length + 1;
@@ -104,14 +108,32 @@ bbUINT dtHistory::Peek(bbU32 const pos, dtBufferChange* const pChange) const
 }
 
 
+void dtHistory::SetPayload(bbU32 const pos, void* const pPayload)
+{
+    bbASSERT(pos && (pos <= mHistSize));
+
+    // pointer is stored in front of the trailing length byte
+    bbU8* pTmp = mHist.GetPtr(pos - 1);
+
+    #if bbSIZEOF_UPTR > 4
+    pTmp -= 8;
+    bbST32(pTmp, (bbU32)(bbUPTR)pPayload);
+    bbST32(pTmp+4, (bbU32)(bbUPTR)((bbU64)pPayload>>32));
+    #else
+    pTmp -= 4;
+    bbST32(pTmp, (bbU32)(bbUPTR)pPayload);
+    #endif
+}
+
 void dtHistory::PushRevert()
 {
     dtBufferChange change;
+    int runs;
     bbASSERT(mHistSize && (mHistSize == mHistPos));
 
-    bbUINT len = Peek(mHistSize, &change);
+    bbUINT len = Peek(mHistSize, &change, &runs);
 
-    if (change.length > 8)
+    if (runs || (change.length > 8))
         bbMemFree(change.user);
 
     mHistSize = mHistPos = mHistSize - len;
@@ -119,10 +141,21 @@ void dtHistory::PushRevert()
 
 bbU8* dtHistory::Push(dtCHANGE const type, bbU64 const offset, bbU64 const length, bool isUndoPoint)
 {
-    if (length > (1UL<<26)) // 256 MB
+    return PushPayload(type, offset, length, length, 0, isUndoPoint);
+}
+
+dtHistoryRun* dtHistory::PushRuns(dtCHANGE const type, bbU64 const offset, bbU64 const length, bbU64 const payloadsize, bool isUndoPoint)
+{
+    bbASSERT(payloadsize);
+    return (dtHistoryRun*)PushPayload(type, offset, length, payloadsize, 1, isUndoPoint);
+}
+
+bbU8* dtHistory::PushPayload(dtCHANGE const type, bbU64 const offset, bbU64 const length, bbU64 const payloadsize, int const runs, bool isUndoPoint)
+{
+    if (payloadsize > dtHISTORY_MAXPAYLOAD)
     {
         bbErrSet(bbENOMEM);
-        return NULL;//xxx
+        return NULL;
     }
 
     if (mHistPos < mHistSize)
@@ -149,6 +182,8 @@ bbU8* dtHistory::Push(dtCHANGE const type, bbU64 const offset, bbU64 const lengt
     header = type;
     if (isUndoPoint)
         header |= 4;
+    if (runs)
+        header |= 8;
 
     pTmp = mHist.GetPtr(pos + 1);
 
@@ -180,7 +215,7 @@ bbU8* dtHistory::Push(dtCHANGE const type, bbU64 const offset, bbU64 const lengt
         {
             *(pTmp++) = (bbU8)length;
 
-            if (length <= 8)
+            if ((length <= 8) && !runs)
             {
                 pData = pTmp;
                 pTmp += length;
@@ -202,7 +237,7 @@ bbU8* dtHistory::Push(dtCHANGE const type, bbU64 const offset, bbU64 const lengt
         pTmp += 8;
     }
 
-    if ((pData = (bbU8*)bbMemAlloc((bbU32)length)) == NULL)
+    if ((pData = (bbU8*)bbMemAlloc((bbU32)payloadsize)) == NULL)
         goto dtBuffer_HistPush_exit;
 
     bbST32(pTmp, (bbU32)(bbUPTR)pData); pTmp+=4;
@@ -0,0 +1,311 @@
+#include "dtPrefetch.h"
+#include <babel/mem.h>
+#include <babel/str.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+dtPrefetch::dtPrefetch()
+{
+    mRunning  = 0;
+    mQuit     = 0;
+    mpPath    = NULL;
+    mFileSize = 0;
+    mpFileMap = NULL;
+    mLast     = (bbU64)-1;
+    mStride   = 0;
+    mDepth    = 0;
+    mIOOpt    = 0;
+    mpAlloc   = &dtAllocHeap::mDefault;
+}
+
+dtPrefetch::~dtPrefetch()
+{
+    Close();
+}
+
+bbERR dtPrefetch::Open(const bbCHAR* const pPath, bbU64 const filesize, bbUINT const depth, bbUINT const ioopt, const bbU8* const pFileMap, dtAlloc* const pAlloc)
+{
+    bbASSERT(!mRunning && !mpPath);
+
+    if ((mpPath = bbStrDup(pPath)) == NULL)
+        return bbELAST;
+
+    mFileSize  = filesize;
+    mDepth     = depth;
+    mIOOpt     = ioopt;
+    mpFileMap  = pFileMap;
+    mpAlloc    = pAlloc;
+    mLast      = (bbU64)-1;
+    mStride    = 0;
+
+    return bbEOK;
+}
+
+void dtPrefetch::Close()
+{
+    if (mRunning)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mQuit = 1;
+        }
+        mWake.notify_one();
+        mThread.join();
+        mRunning = 0;
+        mQuit = 0;
+    }
+
+    for (std::list<dtPrefetchBlock>::iterator it = mBlocks.begin(); it != mBlocks.end(); ++it)
+        mpAlloc->Free(it->mpData);
+    mBlocks.clear();
+
+    bbMemFreeNull((void**)&mpPath);
+    mpFileMap = NULL;
+}
+
+void dtPrefetch::OnLoad(bbU64 const fileoffset, bbU32 const blocksize)
+{
+    if (!mDepth || !mpPath)
+        return;
+
+    bbS64 const stride = (bbS64)(fileoffset - mLast);
+    int const sequential = (mLast != (bbU64)-1) && stride && (stride == mStride);
+
+    if (!sequential && mStride)
+        Cancel(); // access pattern changed, drop outstanding read-ahead
+
+    mLast = fileoffset;
+    mStride = stride;
+
+    if (!sequential)
+        return;
+
+    Prune(fileoffset);
+
+    bbU64 next = fileoffset;
+    for (bbUINT i = 0; i < mDepth; i++)
+    {
+        next += stride;
+        if (next >= mFileSize) // also catches wrap below 0
+            break;
+
+        bbU64 const size = mFileSize - next;
+        Request(next, size < blocksize ? (bbU32)size : blocksize);
+    }
+}
+
+void dtPrefetch::Advise(bbU64 const fileoffset, bbU32 const size)
+{
+#ifndef _WIN32
+    // madvise needs a page aligned start address
+    bbU64 const pagemask = (bbU64)sysconf(_SC_PAGESIZE) - 1;
+    bbU64 const start = fileoffset &~ pagemask;
+    madvise((void*)(mpFileMap + start), (size_t)(fileoffset + size - start), MADV_WILLNEED);
+#endif
+}
+
+void dtPrefetch::Request(bbU64 const fileoffset, bbU32 const size)
+{
+    if (mpFileMap)
+    {
+        Advise(fileoffset, size);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        for (std::list<dtPrefetchBlock>::iterator it = mBlocks.begin(); it != mBlocks.end(); ++it)
+            if ((it->mFileOffset == fileoffset) && !it->mCancel)
+                return; // already requested
+
+        if (mBlocks.size() >= mDepth)
+            return;
+
+        dtPrefetchBlock block;
+        block.mFileOffset = fileoffset;
+        block.mSize       = size;
+        block.mState      = dtPREFETCHSTATE_QUEUED;
+        block.mCancel     = 0;
+        block.mpData      = NULL;
+        mBlocks.push_back(block);
+    }
+
+    if (!mRunning)
+    {
+        try
+        {
+            mThread = std::thread(&dtPrefetch::Worker, this);
+            mRunning = 1;
+        }
+        catch (...)
+        {
+            // no worker, blocks are read synchronously by caller
+            std::lock_guard<std::mutex> lock(mLock);
+            mBlocks.clear();
+            mDepth = 0;
+            return;
+        }
+    }
+
+    mWake.notify_one();
+}
+
+void dtPrefetch::Cancel()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    std::list<dtPrefetchBlock>::iterator it = mBlocks.begin();
+    while (it != mBlocks.end())
+    {
+        if (it->mState == dtPREFETCHSTATE_READING)
+        {
+            it->mCancel = 1; // freed by worker
+            ++it;
+        }
+        else
+        {
+            mpAlloc->Free(it->mpData);
+            it = mBlocks.erase(it);
+        }
+    }
+}
+
+void dtPrefetch::Prune(bbU64 const fileoffset)
+{
+    if (mpFileMap)
+        return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    // drop blocks, which were passed without being taken
+    std::list<dtPrefetchBlock>::iterator it = mBlocks.begin();
+    while (it != mBlocks.end())
+    {
+        int const behind = (mStride > 0) ? (it->mFileOffset <= fileoffset) : (it->mFileOffset >= fileoffset);
+
+        if (behind && (it->mState != dtPREFETCHSTATE_READING))
+        {
+            mpAlloc->Free(it->mpData);
+            it = mBlocks.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bbU8* dtPrefetch::Take(bbU64 const fileoffset, bbU32 const size)
+{
+    if (!mRunning)
+        return NULL;
+
+    std::unique_lock<std::mutex> lock(mLock);
+
+    for (std::list<dtPrefetchBlock>::iterator it = mBlocks.begin(); it != mBlocks.end(); ++it)
+    {
+        if ((it->mFileOffset != fileoffset) || it->mCancel)
+            continue;
+
+        while (it->mState == dtPREFETCHSTATE_READING)
+            mDone.wait(lock);
+
+        bbU8* pData = NULL;
+
+        if ((it->mState == dtPREFETCHSTATE_DONE) && (it->mSize >= size))
+        {
+            pData = it->mpData;
+            it->mpData = NULL;
+
+            if ((it->mSize > size) && (mpAlloc->Realloc(size, (void**)&pData) != bbEOK))
+            {
+                mpAlloc->Free(pData);
+                pData = NULL;
+            }
+        }
+
+        mpAlloc->Free(it->mpData);
+        mBlocks.erase(it);
+        return pData;
+    }
+
+    return NULL;
+}
+
+void dtPrefetch::Worker()
+{
+    dtFileIO io;
+    int const opened = (io.Open(mpPath, bbFILEOPEN_READ, mIOOpt) == bbEOK);
+
+    std::list<dtPrefetchBlock>::iterator batch[dtFILEIO_MAXBATCH];
+    bbUINT count, i;
+
+    std::unique_lock<std::mutex> lock(mLock);
+
+    for(;;)
+    {
+        //
+        // Collect all queued blocks into one batch
+        //
+        count = 0;
+        for (std::list<dtPrefetchBlock>::iterator it = mBlocks.begin(); (it != mBlocks.end()) && (count < dtFILEIO_MAXBATCH); ++it)
+        {
+            if (it->mState == dtPREFETCHSTATE_QUEUED)
+            {
+                it->mState = dtPREFETCHSTATE_READING;
+                batch[count++] = it;
+            }
+        }
+
+        if (mQuit)
+            break;
+
+        if (!count)
+        {
+            mWake.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+
+        int ok = opened;
+        for (i = 0; i < count; i++)
+        {
+            // blocks in READING state are only modified by this thread
+            bbU8* const pData = ok ? (bbU8*)mpAlloc->Alloc(batch[i]->mSize) : NULL;
+            batch[i]->mpData = pData;
+            if (!pData || (io.Read(batch[i]->mFileOffset, pData, batch[i]->mSize) != bbEOK))
+                ok = 0;
+        }
+        if (io.Flush() != bbEOK)
+            ok = 0;
+
+        lock.lock();
+
+        // list iterators stay valid, blocks in READING state are not erased by other threads
+        for (i = 0; i < count; i++)
+        {
+            std::list<dtPrefetchBlock>::iterator const it = batch[i];
+
+            if (it->mCancel || !ok)
+            {
+                mpAlloc->Free(it->mpData);
+                it->mpData = NULL;
+            }
+
+            if (it->mCancel)
+                mBlocks.erase(it);
+            else
+                it->mState = ok ? dtPREFETCHSTATE_DONE : dtPREFETCHSTATE_FAILED;
+        }
+
+        mDone.notify_all();
+    }
+
+    // blocks collected after quit are freed by Close()
+    lock.unlock();
+}
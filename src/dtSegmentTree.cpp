@@ -6,6 +6,7 @@ dtSegmentTree::dtSegmentTree()
     mSegmentUsedFirst =
     mSegmentUsedLast =
     mSegmentUsedRoot = 0;
+    mpAlloc = &dtAllocHeap::mDefault;
 
     ClearSegments();
 }
@@ -85,15 +86,207 @@ bbU32 dtSegmentTree::FindSegment(bbU64 const offset, bbU64* const pSegmentStart,
     }
 }
 
-void dtSegmentTree::NodeLinkRight(bbU32 const idx, dtSegment* pSubTree, bbS64 offset)
+int dtSegmentTree::NodeIsBefore(bbU32 const idx, bbU32 walk) const
 {
-    bbASSERT(pSubTree->GetSize() == (bbU64)offset);
+    // 0-sized segments are always left of a sized segment at the same offset
+    if (mSegments[walk].GetSize())
+        return 1;
 
-    bbU32 walk;
+    // walk over the run of 0-sized segments left of walk
+    while (walk != mSegmentUsedFirst)
+    {
+        walk = mSegments[walk].mPrev;
+
+        if (walk == idx)
+            return 1;
+
+        if (mSegments[walk].GetSize())
+            break;
+    }
+
+    return 0;
+}
+
+bbUINT dtSegmentTree::NodePath(bbU32 const idx, bbU64 const segmentstart, bbU32* const pPath) const
+{
+    bbU32  walk = mSegmentUsedRoot;
+    bbU64  offset = 0;
+    bbUINT depth = 0;
+
+    for(;;)
+    {
+        bbASSERT(walk != (bbU32)-1); // must hit idx
+        bbASSERT(depth < dtSEGMENTTREE_MAXDEPTH);
+
+        pPath[depth++] = walk;
+
+        if (walk == idx)
+            return depth;
+
+        const dtSegment* const pWalk = mSegments.GetPtr(walk);
+        offset += pWalk->mOffset;
+
+        if ((segmentstart < offset) || ((segmentstart == offset) && NodeIsBefore(idx, walk)))
+            walk = pWalk->mLT;
+        else
+            walk = pWalk->mGE;
+    }
+}
+
+bbU64 dtSegmentTree::NodeStart(bbU32 idx) const
+{
+    bbU64 offset = 0;
+
+    do
+    {
+        offset += mSegments[idx].mOffset;
+        idx = mSegments[idx].mParent;
+    } while (idx != (bbU32)-1);
+
+    return offset;
+}
+
+bbU32 dtSegmentTree::NodeSkew(bbU32 const idx)
+{
+    /*
+         (idx)           (left)
+         /   \    ->     /    \
+     (left)   c         a    (idx)
+      /  \                   /   \
+     a    b                 b     c
+    */
+    if (idx == (bbU32)-1)
+        return idx;
+
+    dtSegment* const pNode = mSegments.GetPtr(idx);
+    bbU32 const left = pNode->mLT;
+
+    if ((left == (bbU32)-1) || (mSegments[left].mLevel != pNode->mLevel))
+        return idx;
+
+    dtSegment* const pLeft = mSegments.GetPtr(left);
+    bbU64 const leftoffset = pLeft->mOffset;
+
+    if ((pNode->mLT = pLeft->mGE) != (bbU32)-1)
+    {
+        mSegments[pLeft->mGE].mOffset += leftoffset;
+        mSegments[pLeft->mGE].mParent = idx;
+    }
+
+    pLeft->mGE     = idx;
+    pLeft->mParent = pNode->mParent;
+    pNode->mParent = left;
+    pLeft->mOffset = pNode->mOffset + leftoffset;
+    pNode->mOffset = (bbU64)0 - leftoffset;
+
+    return left;
+}
+
+bbU32 dtSegmentTree::NodeSplit(bbU32 const idx)
+{
+    /*
+      (idx)                   (right)
+      /   \                   /     \
+     a  (right)     ->     (idx)     c
+         /   \             /   \
+        b     c           a     b
+    */
+    if (idx == (bbU32)-1)
+        return idx;
+
+    dtSegment* const pNode = mSegments.GetPtr(idx);
+    bbU32 const right = pNode->mGE;
+
+    if ((right == (bbU32)-1) || (NodeLevel(mSegments[right].mGE) != pNode->mLevel))
+        return idx;
+
+    dtSegment* const pRight = mSegments.GetPtr(right);
+    bbU64 const rightoffset = pRight->mOffset;
+
+    if ((pNode->mGE = pRight->mLT) != (bbU32)-1)
+    {
+        mSegments[pRight->mLT].mOffset += rightoffset;
+        mSegments[pRight->mLT].mParent = idx;
+    }
+
+    pRight->mLT     = idx;
+    pRight->mParent = pNode->mParent;
+    pNode->mParent  = right;
+    pRight->mOffset = pNode->mOffset + rightoffset;
+    pRight->mLevel++;
+    pNode->mOffset  = (bbU64)0 - rightoffset;
+
+    return right;
+}
+
+void dtSegmentTree::NodeRebalanceInsert(const bbU32* const pPath, bbUINT depth)
+{
+    while (depth)
+    {
+        bbU32 const node = pPath[--depth];
+        bbU32 const walk = NodeSplit(NodeSkew(node));
+
+        if (walk != node)
+            NodeRelink(depth ? pPath[depth-1] : (bbU32)-1, node, walk);
+    }
+}
+
+void dtSegmentTree::NodeRebalanceDelete(const bbU32* const pPath, bbUINT depth)
+{
+    while (depth)
+    {
+        bbU32 const node = pPath[--depth];
+        bbU32 walk = node;
+        dtSegment* pNode = mSegments.GetPtr(walk);
+
+        // decrease level, if a child is more than one level lower
+        bbUINT level = NodeLevel(pNode->mLT);
+        bbUINT const levelGE = NodeLevel(pNode->mGE);
+        if (levelGE < level)
+            level = levelGE;
+        level++;
+
+        if (level < pNode->mLevel)
+        {
+            pNode->mLevel = (bbU8)level;
+
+            if (levelGE > level)
+                mSegments[pNode->mGE].mLevel = (bbU8)level;
+        }
+
+        walk  = NodeSkew(walk);
+        pNode = mSegments.GetPtr(walk);
+        if ((pNode->mGE = NodeSkew(pNode->mGE)) != (bbU32)-1)
+        {
+            dtSegment* const pRight = mSegments.GetPtr(pNode->mGE);
+            pRight->mGE = NodeSkew(pRight->mGE);
+        }
+
+        walk  = NodeSplit(walk);
+        pNode = mSegments.GetPtr(walk);
+        pNode->mGE = NodeSplit(pNode->mGE);
+
+        if (walk != node)
+            NodeRelink(depth ? pPath[depth-1] : (bbU32)-1, node, walk);
+    }
+}
+
+void dtSegmentTree::NodeLinkRight(bbU32 const idx, bbU32 const left, bbU64 const leftstart)
+{
+    bbU32  path[dtSEGMENTTREE_MAXDEPTH];
+    bbUINT depth = NodePath(left, leftstart, path);
+
+    dtSegment* pSubTree = mSegments.GetPtr(left);
+    bbS64 offset = pSubTree->GetSize(); // offset of idx relative to pSubTree
+
+    bbU32 walk, parent = left;
     if ((walk = pSubTree->mGE) != (bbU32)-1)
     {
         for(;;)
         {
+            bbASSERT(depth < dtSEGMENTTREE_MAXDEPTH);
+            path[depth++] = walk;
+
             pSubTree = mSegments.GetPtr(walk);
 
             offset -= pSubTree->mOffset;
@@ -104,6 +297,7 @@ void dtSegmentTree::NodeLinkRight(bbU32 const idx, dtSegment* pSubTree, bbS64 of
             walk = pSubTree->mLT;
         }
         pSubTree->mLT = idx;
+        parent = walk;
     }
     else
     {
@@ -113,227 +307,245 @@ void dtSegmentTree::NodeLinkRight(bbU32 const idx, dtSegment* pSubTree, bbS64 of
     dtSegment* const pSegment = mSegments.GetPtr(idx);
 
     pSegment->mOffset = offset;
+    pSegment->mParent = parent;
+    pSegment->mLevel  = 1;
     pSegment->mLT =
     pSegment->mGE = (bbU32)-1;
+
+    NodeRebalanceInsert(path, depth);
 }
 
-void dtSegmentTree::NodeInsert(bbU32 const idx, bbU64 const segmentstart)
+void dtSegmentTree::NodeLinkFirst(bbU32 const idx)
 {
-    bbASSERT(segmentstart);
+    bbU32  path[dtSEGMENTTREE_MAXDEPTH];
+    bbUINT depth = 0;
+    bbU64  offset = 0;
+    bbU32  walk = mSegmentUsedRoot;
 
     dtSegment* const pSegment = mSegments.GetPtr(idx);
-    dtSegment*       pLeft    = mSegments.GetPtr(pSegment->mPrev);
-    bbU64 const size = pSegment->GetSize();
-    bbU64 offset = pLeft->GetSize();
-
-    // adjust offsets of all crossing anchestor nodes
-    NodeSubstractOffset(pSegment->mPrev, segmentstart - offset, -(bbS64)size);
+    pSegment->mLevel = 1;
+    pSegment->mLT =
+    pSegment->mGE = (bbU32)-1;
 
-    if (pLeft->mGE != (bbU32)-1)
+    if (walk == (bbU32)-1)
     {
-        pLeft = mSegments.GetPtr(pLeft->mGE);
-        for(;;)
-        {
-            offset -= pLeft->mOffset;
-    
-            if (pLeft->mLT == (bbU32)-1)
-                break;
-    
-            pLeft = mSegments.GetPtr(pLeft->mLT);
-        }
-        pLeft->mLT = idx;
+        pSegment->mOffset = 0;
+        pSegment->mParent = (bbU32)-1;
+        mSegmentUsedRoot = idx;
+        return;
     }
-    else
+
+    for(;;)
     {
-        pLeft->mGE = idx;
+        bbASSERT(depth < dtSEGMENTTREE_MAXDEPTH);
+        path[depth++] = walk;
+
+        offset += mSegments[walk].mOffset;
+
+        if (mSegments[walk].mLT == (bbU32)-1)
+            break;
+
+        walk = mSegments[walk].mLT;
     }
 
-    pSegment->mOffset = offset;
-    pSegment->mLT =
-    pSegment->mGE = (bbU32)-1;
+    mSegments[walk].mLT = idx;
+    pSegment->mParent = walk;
+    pSegment->mOffset = (bbU64)0 - offset;
+
+    NodeRebalanceInsert(path, depth);
 }
 
-void dtSegmentTree::NodeSubstractOffset(bbU32 const idx, bbU64 const segmentstart, bbS64 const diff)
+void dtSegmentTree::NodeInsert(bbU32 const idx, bbU64 const segmentstart)
 {
+    bbASSERT(segmentstart);
+
     dtSegment* const pSegment = mSegments.GetPtr(idx);
-    
-    bbASSERT(diff); // not required, but should not happen either
+    bbU32 const left = pSegment->mPrev;
+    bbU64 const leftstart = segmentstart - mSegments[left].GetSize();
 
-    if ((bbS64)pSegment->mOffset < 0)               // +size on self offset if self is left child
-    {
-        pSegment->mOffset += diff;
-        bbASSERT(((bbS64)pSegment->mOffset < 0) || (pSegment->mChanged==255));
-    }
+    // adjust offsets of all crossing anchestor nodes
+    NodeSubstractOffset(left, leftstart, -(bbS64)pSegment->GetSize());
 
-    if (pSegment->mGE != (bbU32)-1)                 // -size on right child
-    {
-        mSegments[pSegment->mGE].mOffset -= diff;
-        bbASSERT((bbS64)mSegments[pSegment->mGE].mOffset >= 0);
-    }
-    
-    bbU32 walk = mSegmentUsedRoot;                  // -size on all anchestors crossing idx
-    bbU64 offset = 0;
-    int dir = 1;
-    for(;;)
+    NodeLinkRight(idx, left, leftstart);
+}
+
+void dtSegmentTree::LinkSegment(bbU32 const idx, bbU64 const segmentstart)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbU32 const next = pSegment->mNext;
+    bbU32 const prev = pSegment->mPrev;
+    mSegments[prev].mNext = idx;
+    mSegments[next].mPrev = idx;
+
+    //
+    // update first/last pointers for linked list
+    //
+    if (next == mSegmentUsedFirst) // new segment created at buffer start or end?
     {
-        if (walk == idx)
-            break;
-        
-        offset += mSegments[walk].mOffset;
+        bbASSERT(mSegmentUsedLast == prev);
 
-        if (dir)
+        if (segmentstart == 0) // insert at buffer start?
         {
-            if (offset > segmentstart) // jumped across resized segment?
-            {
-                bbASSERT((bbS64)(mSegments[walk].mOffset - diff) >= 0);
-                mSegments[walk].mOffset -= diff;
-                dir = 0;
-                walk = mSegments[walk].mLT;
-                bbASSERT(walk != (bbU32)-1); // must hit self
-            }
-            else
-            {
-                walk = mSegments[walk].mGE;
-                bbASSERT(walk != (bbU32)-1); // must hit self
-            }
+            mSegmentUsedFirst = idx;
+
+            // move all segments right and link as leftmost tree node
+            mSegments[mSegmentUsedRoot].mOffset += pSegment->GetSize();
+            NodeLinkFirst(idx);
+            return;
         }
         else
         {
-            if (offset <= segmentstart)
-            {
-                bbASSERT((bbS64)(mSegments[walk].mOffset + diff) < 0);
-                mSegments[walk].mOffset += diff;
-                dir = 1;
-                walk = mSegments[walk].mGE;
-                bbASSERT(walk != (bbU32)-1); // must hit self
-            }
-            else
-            {
-                walk = mSegments[walk].mLT;
-                bbASSERT(walk != (bbU32)-1); // must hit self
-            }
+            mSegmentUsedLast = idx;
         }
     }
+
+    //
+    // Link and adjust offsets in tree
+    //
+    bbASSERT((next == mSegmentUsedFirst) || (mSegmentUsedLast != prev));
+
+    // link inserted segment to left neighbour
+    NodeInsert(idx, segmentstart);
 }
 
-void dtSegmentTree::NodeDelete(bbU32 const idx, bbU64 const segmentstart)
+void dtSegmentTree::NodePathSubstractOffset(const bbU32* const pPath, bbUINT const depth, bbS64 const diff)
 {
-    bbU32* pParentLink = &mSegmentUsedRoot;
-    bbU32  walk = mSegmentUsedRoot;
-    bbU64  offset = 0;
-    dtSegment* pSegment;
+    bbASSERT(diff); // not required, but should not happen either
 
     //
-    // Find pParentLink
+    // All nodes right of the resized node are moved by -diff. A relative offset
+    // changes, if a node and its parent are on different sides of the resized node.
+    // Nodes on the path are right of it, if the path continues into their LT subtree.
     //
-    for(;;)
-    {
-        pSegment = mSegments.GetPtr(walk);
-        offset += pSegment->mOffset;
+    int parentright = 0; // root offset is relative to buffer start
 
-        if (walk == idx)
-            break;
+    for (bbUINT i=0; i<depth; i++)
+    {
+        dtSegment* const pWalk = mSegments.GetPtr(pPath[i]);
+        int const right = ((i+1) < depth) && (pWalk->mLT == pPath[i+1]);
 
-        if (segmentstart < offset)
+        if (right != parentright)
         {
-            pParentLink = &pSegment->mLT;
-            walk = pSegment->mLT;
-        }
-        else
-        {
-            pParentLink = &pSegment->mGE;
-            walk = pSegment->mGE;
+            if (right)
+                pWalk->mOffset -= diff;
+            else
+                pWalk->mOffset += diff;
+
+            parentright = right;
         }
-        bbASSERT(walk != (bbU32)-1);
     }
-    bbASSERT(offset == segmentstart);
+
+    dtSegment* const pSegment = mSegments.GetPtr(pPath[depth-1]);
+
+    if (pSegment->mGE != (bbU32)-1)                 // -size on right child
+        mSegments[pSegment->mGE].mOffset -= diff;
+}
+
+void dtSegmentTree::NodeSubstractOffset(bbU32 const idx, bbU64 const segmentstart, bbS64 const diff)
+{
+    bbU32 path[dtSEGMENTTREE_MAXDEPTH];
+
+    NodePathSubstractOffset(path, NodePath(idx, segmentstart, path), diff);
+}
+
+void dtSegmentTree::NodeDelete(bbU32 const idx, bbU64 const segmentstart)
+{
+    bbU32  path[dtSEGMENTTREE_MAXDEPTH];
+    bbUINT depth = NodePath(idx, segmentstart, path);
+    bbUINT const pos = depth - 1; // position of idx in path[]
+    bbU32  const parent = pos ? path[pos-1] : (bbU32)-1;
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbU32 walk;
 
     //
-    // Update relative offsets
+    // Update relative offsets, after this idx has the same start offset as its successor
     //
-    bbASSERT((pSegment->mChanged != 255) && (pSegment->mChanged = 255)); // for assert in NodeSubstractOffset: mark segment as to be deleted
-    #ifdef bbDEBUG
-    bbS64 dbg_savedoffset = pSegment->mOffset;
-    #endif
-
+    bbU64 offset;
     if ((offset = pSegment->GetSize()) != 0)
     {
-        NodeSubstractOffset(idx, segmentstart, offset);
+        NodePathSubstractOffset(path, depth, offset);
     }
 
     //
-    // Delete node by replacing it with appropriate subtree
+    // Delete node by replacing it with appropriate subtree or its successor
     //
-    if ((walk = pSegment->mGE) == (bbU32)-1)
+    if ((pSegment->mLT == (bbU32)-1) || (pSegment->mGE == (bbU32)-1))
     {
-        // Case A) no GE subtree -> move up LT subtree (or -1)
+        // Case A) at most one subtree -> move up subtree (or -1)
         //      (parent)
-        //         . . <- pParentLink
+        //         . . <- link
         //        /   \ 
         //           (del)
         //           /   x
         //          o
         //         / \ 
         //
-        if ((*pParentLink = pSegment->mLT) != (bbU32)-1)
-        {
-            bbASSERT((bbS64)mSegments[pSegment->mLT].mOffset < 0);
-            mSegments[pSegment->mLT].mOffset += pSegment->mOffset;
-            bbASSERT((bbS64)(mSegments[pSegment->mLT].mOffset ^ dbg_savedoffset) >= 0); // sign must not change
-        }        
+        if ((walk = pSegment->mLT) == (bbU32)-1)
+            walk = pSegment->mGE;
+
+        if (walk != (bbU32)-1)
+            mSegments[walk].mOffset += pSegment->mOffset;
+
+        NodeRelink(parent, idx, walk);
+        depth = pos;
     }
     else
     {
-        // find smallest node in GE subtree
+        // Case B) find smallest node in GE subtree, and replace del with it
 
+        walk = pSegment->mGE;
         offset = mSegments[walk].mOffset;
+        path[depth++] = walk;
 
-        if (mSegments[walk].mLT != (bbU32)-1)
+        while (mSegments[walk].mLT != (bbU32)-1)
         {
-            bbU32 walk_parent;
-            do
-            {
-                walk_parent = walk;
-                walk = mSegments[walk].mLT;
-                offset += mSegments[walk].mOffset;
+            walk = mSegments[walk].mLT;
+            offset += mSegments[walk].mOffset;
+            bbASSERT(depth < dtSEGMENTTREE_MAXDEPTH);
+            path[depth++] = walk;
+        }
 
-            } while (mSegments[walk].mLT != (bbU32)-1);
+        bbASSERT(offset == 0); // successor starts at same offset as del, after del was reduced to size 0
+        bbASSERT(walk == pSegment->mNext);
 
-            bbASSERT(offset == 0); //xxx
-            bbASSERT(walk == pSegment->mNext);
+        // walk is now smallest node in subtree
+        // if it has a GE subtree, we need to move that up, to isolate walk
 
-            // walk is now smallest node in subtree
-            // if it has a GE subtree, we need to move that up, to isolate walk
+        dtSegment* const pSuccessor = mSegments.GetPtr(walk);
 
-            if (mSegments[walk].mGE != (bbU32)-1)
-            {
-                mSegments[mSegments[walk].mGE].mOffset += mSegments[walk].mOffset;
-                bbASSERT((bbS64)mSegments[mSegments[walk].mGE].mOffset < 0);
-            }
-            mSegments[walk_parent].mLT = mSegments[walk].mGE;
+        if (pSuccessor->mGE != (bbU32)-1)
+            mSegments[pSuccessor->mGE].mOffset += pSuccessor->mOffset;
 
-            bbASSERT(pSegment->mGE != (bbU32)-1);
-            mSegments[pSegment->mGE].mOffset += offset;
-            bbASSERT((bbS64)mSegments[pSegment->mGE].mOffset >= 0);
-            mSegments[walk].mGE = pSegment->mGE;
-        }
-        bbASSERT((bbS64)offset >= 0);
+        NodeRelink(path[depth-2], walk, pSuccessor->mGE);
+
+        // move successor into place of del
+
+        pSuccessor->mLT     = pSegment->mLT;
+        pSuccessor->mGE     = pSegment->mGE;
+        pSuccessor->mLevel  = pSegment->mLevel;
+        pSuccessor->mOffset = pSegment->mOffset + offset;
 
-        if (pSegment->mLT != (bbU32)-1)
+        if (pSuccessor->mLT != (bbU32)-1)
         {
-            mSegments[pSegment->mLT].mOffset -= offset;
-            bbASSERT((bbS64)mSegments[pSegment->mLT].mOffset < 0);
+            mSegments[pSuccessor->mLT].mOffset -= offset;
+            mSegments[pSuccessor->mLT].mParent = walk;
         }
-        mSegments[walk].mLT = pSegment->mLT;
-        mSegments[walk].mOffset = pSegment->mOffset;
-        
-        bbASSERT((bbS64)(mSegments[walk].mOffset ^ dbg_savedoffset) >= 0); // sign must not change
+        if (pSuccessor->mGE != (bbU32)-1)
+        {
+            mSegments[pSuccessor->mGE].mOffset -= offset;
+            mSegments[pSuccessor->mGE].mParent = walk;
+        }
+
+        NodeRelink(parent, idx, walk);
 
-        *pParentLink = walk;
+        path[pos] = walk;
+        depth--; // rebalance starts at successor's old parent
     }
+
+    NodeRebalanceDelete(path, depth);
 }
 
-bbU32 dtSegmentTree::SplitNullSegment(bbU32 const idx, bbU64 segmentoffset)
+bbU32 dtSegmentTree::SplitNullSegment(bbU32 const idx, bbU64 const segmentstart, bbU64 segmentoffset)
 {
     dtSegment* pSegmentLeft = mSegments.GetPtr(idx);
     bbU32 right;
@@ -371,17 +583,16 @@ bbU32 dtSegmentTree::SplitNullSegment(bbU32 const idx, bbU64 segmentoffset)
         pSegmentLeft->mNext   = right;
         mSegments[next].mPrev = right;
 
-        NodeLinkRight(right, pSegmentLeft, segmentoffset);
+        NodeLinkRight(right, idx, segmentstart);
         #ifdef bbDEBUG
         CheckTree();
         #endif
-        // xxx rebalance tree here
     }
 
     return right;
 }
 
-bbU32 dtSegmentTree::SplitMapSegment(bbU32 const idx, bbU32 const segmentoffset)
+bbU32 dtSegmentTree::SplitMapSegment(bbU32 const idx, bbU64 const segmentstart, bbU32 const segmentoffset)
 {
     bbU32 right;
 
@@ -405,13 +616,14 @@ bbU32 dtSegmentTree::SplitMapSegment(bbU32 const idx, bbU32 const segmentoffset)
     dtSegment* pSegmentRight = mSegments.GetPtr(right);
 
     bbU32 rightsize = pSegmentLeft->mSize - segmentoffset;
-    if ((pSegmentRight->mpData = (bbU8*) bbMemAlloc(rightsize)) == NULL)
+    if ((pSegmentRight->mpData = (bbU8*) mpAlloc->Alloc(rightsize)) == NULL)
     {
         UndoSegment(right);
         return (bbU32)-1;
     }
+    pSegmentRight->mCapacity = rightsize;
     bbMemMove(pSegmentRight->mpData, pSegmentLeft->mpData + segmentoffset, rightsize);
-    bbMemRealloc(segmentoffset, (void**)&pSegmentLeft->mpData);
+    ReserveSegmentData(pSegmentLeft, segmentoffset);
 
     if (idx == mSegmentUsedLast)
         mSegmentUsedLast = right;
@@ -425,6 +637,7 @@ bbU32 dtSegmentTree::SplitMapSegment(bbU32 const idx, bbU32 const segmentoffset)
         bbASSERT(pSegmentLeft->mFileSize == (pSegmentLeft->mSize + rightsize));
         pSegmentLeft->mFileSize = segmentoffset;
         pSegmentRight->mFileSize = rightsize;
+        pSegmentRight->mFileOffset = pSegmentLeft->mFileOffset + segmentoffset;
     }
     else
     {
@@ -437,12 +650,137 @@ bbU32 dtSegmentTree::SplitMapSegment(bbU32 const idx, bbU32 const segmentoffset)
     pSegmentLeft->mNext   = right;
     mSegments[next].mPrev = right;
 
-    NodeLinkRight(right, pSegmentLeft, segmentoffset);
+    NodeLinkRight(right, idx, segmentstart);
     #ifdef bbDEBUG
     CheckTree();
     #endif
-    // xxx rebalance tree here
 
     return right;
 }
 
+bbERR dtSegmentTree::ReserveSegmentData(dtSegment* const pSegment, bbU32 const size)
+{
+    bbU32 capacity = pSegment->mCapacity;
+
+    if (!size)
+    {
+        capacity = 0;
+    }
+    else if ((size > capacity) || (size < (capacity >> 2)))
+    {
+        capacity = size + (size >> 1);
+        if (capacity < size)
+            capacity = size; // overflow
+    }
+    else
+    {
+        return bbEOK;
+    }
+
+    if (bbEOK != mpAlloc->Realloc(capacity, (void**)&pSegment->mpData))
+    {
+        if (size <= pSegment->mCapacity)
+            return bbEOK; // failed to shrink, keep block
+        return bbELAST;
+    }
+
+    pSegment->mCapacity = capacity;
+    return bbEOK;
+}
+
+void dtSegmentTree::UnlinkRightSegment(bbU32 const idx, bbU64 const segmentstart)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbU32 const right = pSegment->mNext;
+    dtSegment* const pSegmentRight = mSegments.GetPtr(right);
+
+    bbASSERT(right != mSegmentUsedFirst);
+
+    // unlink right segment from tree, this moves all following segments left
+    NodeDelete(right, segmentstart + pSegment->GetSize());
+
+    // unlink right segment from list and return it to free pool
+    bbU32 const next      = pSegmentRight->mNext;
+    pSegment->mNext       = next;
+    mSegments[next].mPrev = idx;
+
+    if (right == mSegmentUsedLast)
+        mSegmentUsedLast = idx;
+
+    pSegmentRight->mNext = mSegmentFree;
+    mSegmentFree = right;
+}
+
+int dtSegmentTree::MergeNullSegment(bbU32 const idx, bbU64 const segmentstart)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbU32 const right = pSegment->mNext;
+
+    bbASSERT(pSegment->mType == dtSEGMENTTYPE_NULL);
+
+    if (right == mSegmentUsedFirst) // idx is last segment
+        return 0;
+
+    dtSegment* const pSegmentRight = mSegments.GetPtr(right);
+
+    if ((pSegmentRight->mType != dtSEGMENTTYPE_NULL) ||
+        ((pSegment->mFileOffset + pSegment->mFileSize) != pSegmentRight->mFileOffset))
+    {
+        return 0;
+    }
+
+    bbU64 const rightsize = pSegmentRight->mFileSize;
+
+    UnlinkRightSegment(idx, segmentstart);
+
+    // enlarge idx, this moves all following segments right again
+    if (rightsize)
+    {
+        pSegment->mFileSize += rightsize;
+        NodeSubstractOffset(idx, segmentstart, -(bbS64)rightsize);
+    }
+    #ifdef bbDEBUG
+    CheckTree();
+    #endif
+
+    return 1;
+}
+
+bbERR dtSegmentTree::MergeMapSegment(bbU32 const idx, bbU64 const segmentstart)
+{
+    dtSegment* const pSegment = mSegments.GetPtr(idx);
+    bbU32 const right = pSegment->mNext;
+    dtSegment* const pSegmentRight = mSegments.GetPtr(right);
+
+    bbASSERT(right != mSegmentUsedFirst);
+    bbASSERT((pSegment->mType == dtSEGMENTTYPE_MAP) && (pSegmentRight->mType == dtSEGMENTTYPE_MAP));
+    bbASSERT(pSegment->mChanged || pSegmentRight->mChanged || ((pSegment->mFileOffset + pSegment->mFileSize) == pSegmentRight->mFileOffset));
+
+    bbU32 const leftsize  = pSegment->mSize;
+    bbU32 const rightsize = pSegmentRight->mSize;
+
+    if (rightsize)
+    {
+        if (bbEOK != ReserveSegmentData(pSegment, leftsize + rightsize))
+            return bbELAST;
+        bbMemMove(pSegment->mpData + leftsize, pSegmentRight->mpData, rightsize);
+    }
+    mpAlloc->Free(pSegmentRight->mpData);
+
+    pSegment->mFileSize += pSegmentRight->mFileSize;
+    pSegment->mChanged  |= pSegmentRight->mChanged;
+
+    UnlinkRightSegment(idx, segmentstart);
+
+    // enlarge idx, this moves all following segments right again
+    if (rightsize)
+    {
+        pSegment->mSize = leftsize + rightsize;
+        NodeSubstractOffset(idx, segmentstart, -(bbS64)rightsize);
+    }
+    #ifdef bbDEBUG
+    CheckTree();
+    #endif
+
+    return bbEOK;
+}
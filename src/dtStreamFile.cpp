@@ -1,5 +1,108 @@
 #include "dtStreamFile.h"
 #include "babel/file.h"
+#include "babel/mem.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/** Positional read or write loop.
+    @return 0 on success, -1 on unexpected end of file, or errno on failure
+*/
+static int dtStreamFileTransfer(int const fd, bbU64 offset, bbU8* pBuf, bbU32 size, int const write)
+{
+    while (size)
+    {
+        ssize_t const n = write ? pwrite(fd, pBuf, size, (off_t)offset)
+                                : pread(fd, pBuf, size, (off_t)offset);
+        if (n <= 0)
+        {
+            if (n == 0)
+                return write ? EIO : -1;
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        pBuf += n;
+        offset += n;
+        size -= (bbU32)n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/** copy_file_range() loop.
+    @return Number of bytes copied, less than size if the kernel refused to copy
+*/
+static bbU64 dtStreamFileCopyRange(int const fdin, bbU64 const srcoffset, int const fdout, bbU64 const offset, bbU64 const size)
+{
+    bbU64 done = 0;
+
+    while (done < size)
+    {
+        loff_t in = (loff_t)(srcoffset + done);
+        loff_t out = (loff_t)(offset + done);
+        size_t const chunk = (size - done) > 0x40000000 ? 0x40000000 : (size_t)(size - done);
+
+        ssize_t const n = copy_file_range(fdin, &in, fdout, &out, chunk, 0);
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            break; // e.g. EXDEV, ENOSYS, EOPNOTSUPP
+        }
+        done += (bbU64)n;
+    }
+
+    return done;
+}
+#endif
+#endif
+
+bbFILEH dtStreamFile::Open(const bbCHAR* pFilename, const bbUINT flags, const int direct)
+{
+    bbASSERT(!mhFile);
+
+    if ((mhFile = bbFileOpen(pFilename, flags)) == NULL)
+        return NULL;
+
+#ifndef _WIN32
+    // file was created or truncated by bbFileOpen(), if requested
+    int const mode = ((flags & (bbFILEOPEN_READWRITE|bbFILEOPEN_TRUNC)) ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+    mFd = open(pFilename, mode);
+
+    #ifdef O_DIRECT
+    if (direct && (mFd >= 0))
+        mFdDirect = open(pFilename, mode | O_DIRECT); // fails e.g. on tmpfs
+    #endif
+#endif
+
+    return mhFile;
+}
+
+void dtStreamFile::Close()
+{
+    if (mhFile)
+    {
+#ifndef _WIN32
+        if (mFd >= 0)
+            close(mFd);
+        if (mFdDirect >= 0)
+            close(mFdDirect);
+#endif
+        bbFileClose(mhFile);
+    }
+    mhFile = NULL;
+    mFd = mFdDirect = -1;
+    bbMemFreeNull((void**)&mpBounce);
+}
 
 bbU64 dtStreamFile::GetSize()
 {
@@ -30,3 +133,167 @@ bbERR dtStreamFile::Write(bbU8* pBuf, bbU32 size)
     return bbFileWrite(mhFile, pBuf, size);
 }
 
+bbERR dtStreamFile::ReadAt(bbU64 offset, bbU8* pBuf, bbU32 size)
+{
+#ifndef _WIN32
+    if (mFd >= 0)
+    {
+        int const err = (mFdDirect >= 0) ? TransferDirect(offset, pBuf, size, 0)
+                                         : dtStreamFileTransfer(mFd, offset, pBuf, size, 0);
+        if (err)
+            return bbErrSet((err < 0) ? bbEEOF : bbEFILEREAD);
+        return bbEOK;
+    }
+#endif
+
+    return dtStream::ReadAt(offset, pBuf, size);
+}
+
+bbERR dtStreamFile::WriteAt(bbU64 offset, bbU8* pBuf, bbU32 size)
+{
+#ifndef _WIN32
+    if (mFd >= 0)
+    {
+        int const err = (mFdDirect >= 0) ? TransferDirect(offset, pBuf, size, 1)
+                                         : dtStreamFileTransfer(mFd, offset, pBuf, size, 1);
+        if (err)
+            return bbErrSet(bbEFILEWRITE);
+        return bbEOK;
+    }
+#endif
+
+    return dtStream::WriteAt(offset, pBuf, size);
+}
+
+int dtStreamFile::TransferDirect(bbU64 offset, bbU8* pBuf, bbU32 size, int const write)
+{
+#ifndef _WIN32
+    bbU64 const mask = dtSTREAMFILE_DIRECTALIGN - 1;
+    bbU64 const start = (offset + mask) &~ mask;
+    bbU64 const end = (offset + size) &~ mask;
+    int err;
+
+    if (start >= end)
+        return dtStreamFileTransfer(mFd, offset, pBuf, size, write);
+
+    //
+    // Unaligned head and tail go through the page cache
+    //
+    bbU32 const head = (bbU32)(start - offset);
+    bbU32 const tail = (bbU32)(offset + size - end);
+
+    if (head && ((err = dtStreamFileTransfer(mFd, offset, pBuf, head, write)) != 0))
+        return err;
+    if (tail && ((err = dtStreamFileTransfer(mFd, end, pBuf + (end - offset), tail, write)) != 0))
+        return err;
+
+    pBuf += head;
+    offset = start;
+    size = (bbU32)(end - start);
+
+    //
+    // Aligned middle part bypasses it, via bounce buffer if memory is unaligned
+    //
+    if (((bbUPTR)pBuf & mask) == 0)
+    {
+        err = dtStreamFileTransfer(mFdDirect, offset, pBuf, size, write);
+    }
+    else
+    {
+        if (!mpBounce)
+            mpBounce = (bbU8*)bbMemAlloc(dtSTREAMFILE_DIRECTBUFSIZE + dtSTREAMFILE_DIRECTALIGN);
+        if (!mpBounce)
+            return dtStreamFileTransfer(mFd, offset, pBuf, size, write);
+
+        bbU8* const pBounce = (bbU8*)(((bbUPTR)mpBounce + mask) &~ (bbUPTR)mask);
+        err = 0;
+
+        while (size && !err)
+        {
+            bbU32 const chunk = size > dtSTREAMFILE_DIRECTBUFSIZE ? dtSTREAMFILE_DIRECTBUFSIZE : size;
+
+            if (write)
+                bbMemMove(pBounce, pBuf, chunk);
+            if ((err = dtStreamFileTransfer(mFdDirect, offset, pBounce, chunk, write)) == 0)
+            {
+                if (!write)
+                    bbMemMove(pBuf, pBounce, chunk);
+                pBuf += chunk;
+                offset += chunk;
+                size -= chunk;
+            }
+        }
+    }
+
+    if (err == EINVAL)
+    {
+        // alignment not sufficient for this device, stay buffered from now on
+        close(mFdDirect);
+        mFdDirect = -1;
+        err = dtStreamFileTransfer(mFd, offset, pBuf, size, write);
+    }
+
+    return err;
+#else
+    return -1;
+#endif
+}
+
+bbU64 dtStreamFile::CopyFrom(dtStreamFile& src, bbU64 const srcoffset, bbU64 const offset, bbU64 const size)
+{
+#ifdef __linux__
+    if ((mFd < 0) || (src.mFd < 0) || !size)
+        return 0;
+
+    bbU64 head = size, clone = 0;
+
+    #ifdef FICLONERANGE
+    //
+    // Reflink the block-aligned middle part, if source and destination have the same alignment
+    //
+    struct stat st;
+    if ((fstat(mFd, &st) == 0) && (st.st_blksize > 0))
+    {
+        bbU64 const blk = (bbU64)st.st_blksize;
+
+        if ((srcoffset % blk) == (offset % blk))
+        {
+            head = (blk - (offset % blk)) % blk;
+            if (head < size)
+                clone = ((size - head) / blk) * blk;
+
+            if (clone)
+            {
+                struct file_clone_range range;
+                range.src_fd      = src.mFd;
+                range.src_offset  = srcoffset + head;
+                range.src_length  = clone;
+                range.dest_offset = offset + head;
+
+                if (ioctl(mFd, FICLONERANGE, &range) != 0)
+                    clone = 0; // e.g. ext4, or different file systems
+            }
+
+            if (!clone)
+                head = size;
+        }
+    }
+    #endif
+
+    //
+    // Copy the rest in the kernel. For direct I/O only the unaligned head and tail of a
+    // clone are copied, since copy_file_range() passes all data through the page cache.
+    //
+    if (!clone && (IsDirect() || src.IsDirect()))
+        return 0;
+
+    bbU64 done = dtStreamFileCopyRange(src.mFd, srcoffset, mFd, offset, head);
+    if ((done < head) || !clone)
+        return done;
+
+    done += clone;
+    return done + dtStreamFileCopyRange(src.mFd, srcoffset + done, mFd, offset + done, size - done);
+#else
+    return 0;
+#endif
+}